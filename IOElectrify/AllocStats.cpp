@@ -0,0 +1,222 @@
+/*
+ *  Released under "The GNU General Public License (GPL-2.0)"
+ *
+ *  This program is free software; you can redistribute it and/or modify it
+ *  under the terms of the GNU General Public License as published by the
+ *  Free Software Foundation; either version 2 of the License, or (at your
+ *  option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful, but
+ *  WITHOUT ANY WARRANTY; without even the implied warranty of MERCHANTABILITY
+ *  or FITNESS FOR A PARTICULAR PURPOSE. See the GNU General Public License
+ *  for more details.
+ *
+ *  You should have received a copy of the GNU General Public License along
+ *  with this program; if not, write to the Free Software Foundation, Inc.,
+ *  59 Temple Place, Suite 330, Boston, MA 02111-1307 USA
+ *
+ */
+
+#include <IOKit/IOLib.h>
+#include "common.h"
+#include "AllocStats.h"
+
+static volatile SInt32 sAllocs[kAllocSiteCount];
+static volatile SInt32 sFrees[kAllocSiteCount];
+
+static const char* sSiteNames[kAllocSiteCount] =
+{
+    "force-power-args",
+    "wdg-buffer",
+    "wdg-entry",
+    "wmi-flags",
+    "wmi-iterator"
+};
+
+void AllocStats::alloc(UInt32 site, UInt32 count)
+{
+    if (site < kAllocSiteCount)
+        OSAddAtomic(count, &sAllocs[site]);
+}
+
+void AllocStats::free(UInt32 site, UInt32 count)
+{
+    if (site < kAllocSiteCount)
+        OSAddAtomic(count, &sFrees[site]);
+}
+
+SInt32 AllocStats::live(UInt32 site)
+{
+    return site < kAllocSiteCount ? atomicLoad(sAllocs[site]) - atomicLoad(sFrees[site]) : 0;
+}
+
+void AllocStats::publish(IOService* service)
+{
+    OSDictionary* dict = OSDictionary::withCapacity(kAllocSiteCount);
+    OSNumber* osNum;
+
+    if (dict == NULL)
+        return;
+
+    for (int i = 0; i < kAllocSiteCount; i++) {
+        OSDictionary* site = OSDictionary::withCapacity(3);
+        SInt32 allocs = atomicLoad(sAllocs[i]);
+        SInt32 frees = atomicLoad(sFrees[i]);
+
+        if (site == NULL)
+            continue;
+
+        osNum = OSNumber::withNumber((UInt32)allocs, 32);
+        site->setObject("alloc", osNum);
+        osNum->release();
+
+        osNum = OSNumber::withNumber((UInt32)frees, 32);
+        site->setObject("free", osNum);
+        osNum->release();
+
+        osNum = OSNumber::withNumber((UInt32)(allocs - frees), 32);
+        site->setObject("live", osNum);
+        osNum->release();
+
+        dict->setObject(sSiteNames[i], site);
+        site->release();
+    }
+
+    service->setProperty(kAllocStatsKey, dict);
+    dict->release();
+}
+
+// The factories only count objects that initialized, a failed one is freed
+// with mSite still out of range
+
+OSDefineMetaClassAndStructors(AllocStatsNumber, OSNumber)
+
+AllocStatsNumber* AllocStatsNumber::withNumber(UInt32 site, unsigned long long value, unsigned int numberOfBits)
+{
+    AllocStatsNumber* object = new AllocStatsNumber;
+
+    if (object != NULL && !object->init(value, numberOfBits))
+        OSSafeReleaseNULL(object);
+
+    if (object != NULL) {
+        object->mSite = site;
+        AllocStats::alloc(site);
+    }
+    return object;
+}
+
+void AllocStatsNumber::free()
+{
+    AllocStats::free(mSite);
+    OSNumber::free();
+}
+
+OSDefineMetaClassAndStructors(AllocStatsString, OSString)
+
+AllocStatsString* AllocStatsString::withCString(UInt32 site, const char* string)
+{
+    AllocStatsString* object = new AllocStatsString;
+
+    if (object != NULL && !object->initWithCString(string))
+        OSSafeReleaseNULL(object);
+
+    if (object != NULL) {
+        object->mSite = site;
+        AllocStats::alloc(site);
+    }
+    return object;
+}
+
+void AllocStatsString::free()
+{
+    AllocStats::free(mSite);
+    OSString::free();
+}
+
+OSDefineMetaClassAndStructors(AllocStatsData, OSData)
+
+AllocStatsData* AllocStatsData::withBytes(UInt32 site, const void* bytes, unsigned int length)
+{
+    AllocStatsData* object = new AllocStatsData;
+
+    if (object != NULL && !object->initWithBytes(bytes, length))
+        OSSafeReleaseNULL(object);
+
+    if (object != NULL) {
+        object->mSite = site;
+        AllocStats::alloc(site);
+    }
+    return object;
+}
+
+void AllocStatsData::free()
+{
+    AllocStats::free(mSite);
+    OSData::free();
+}
+
+OSDefineMetaClassAndStructors(AllocStatsArray, OSArray)
+
+AllocStatsArray* AllocStatsArray::withCapacity(UInt32 site, unsigned int capacity)
+{
+    AllocStatsArray* object = new AllocStatsArray;
+
+    if (object != NULL && !object->initWithCapacity(capacity))
+        OSSafeReleaseNULL(object);
+
+    if (object != NULL) {
+        object->mSite = site;
+        AllocStats::alloc(site);
+    }
+    return object;
+}
+
+void AllocStatsArray::free()
+{
+    AllocStats::free(mSite);
+    OSArray::free();
+}
+
+OSDefineMetaClassAndStructors(AllocStatsDictionary, OSDictionary)
+
+AllocStatsDictionary* AllocStatsDictionary::withCapacity(UInt32 site, unsigned int capacity)
+{
+    AllocStatsDictionary* object = new AllocStatsDictionary;
+
+    if (object != NULL && !object->initWithCapacity(capacity))
+        OSSafeReleaseNULL(object);
+
+    if (object != NULL) {
+        object->mSite = site;
+        AllocStats::alloc(site);
+    }
+    return object;
+}
+
+void AllocStatsDictionary::free()
+{
+    AllocStats::free(mSite);
+    OSDictionary::free();
+}
+
+OSDefineMetaClassAndStructors(AllocStatsIterator, OSCollectionIterator)
+
+AllocStatsIterator* AllocStatsIterator::withCollection(UInt32 site, const OSCollection* collection)
+{
+    AllocStatsIterator* object = new AllocStatsIterator;
+
+    if (object != NULL && !object->initWithCollection(collection))
+        OSSafeReleaseNULL(object);
+
+    if (object != NULL) {
+        object->mSite = site;
+        AllocStats::alloc(site);
+    }
+    return object;
+}
+
+void AllocStatsIterator::free()
+{
+    AllocStats::free(mSite);
+    OSCollectionIterator::free();
+}
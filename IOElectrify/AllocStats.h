@@ -0,0 +1,119 @@
+/*
+ *  Released under "The GNU General Public License (GPL-2.0)"
+ *
+ *  This program is free software; you can redistribute it and/or modify it
+ *  under the terms of the GNU General Public License as published by the
+ *  Free Software Foundation; either version 2 of the License, or (at your
+ *  option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful, but
+ *  WITHOUT ANY WARRANTY; without even the implied warranty of MERCHANTABILITY
+ *  or FITNESS FOR A PARTICULAR PURPOSE. See the GNU General Public License
+ *  for more details.
+ *
+ *  You should have received a copy of the GNU General Public License along
+ *  with this program; if not, write to the Free Software Foundation, Inc.,
+ *  59 Temple Place, Suite 330, Boston, MA 02111-1307 USA
+ *
+ */
+
+#ifndef AllocStats_h
+#define AllocStats_h
+
+#include <IOKit/IOService.h>
+
+#define kAllocStatsKey "AllocStats"
+
+// Call sites creating OSObjects on recurring paths
+enum
+{
+    kAllocSiteForcePowerArgs = 0,   // OSNumber arguments of every force-power call
+    kAllocSiteWDGBuffer,            // copy of the _WDG result kept by WMI
+    kAllocSiteWDGEntry,             // per-block dictionary and values in parseWDGEntry
+    kAllocSiteWMIFlags,             // parseWMIFlags string
+    kAllocSiteWMIIterator,          // iterator in getMethod
+    kAllocSiteCount
+};
+
+// Kext-wide counters of the objects created and freed per call site. The
+// objects are the AllocStats classes below: their factory counts the
+// creation and their free() counts the free, whoever drops the last
+// reference, so objects someone else still holds stay live. A site whose
+// live count keeps growing across sleep cycles leaks.
+class AllocStats
+{
+public:
+    static void alloc(UInt32 site, UInt32 count = 1);
+    static void free(UInt32 site, UInt32 count = 1);
+
+    static SInt32 live(UInt32 site);
+    static void publish(IOService* service);
+};
+
+class AllocStatsNumber : public OSNumber
+{
+    OSDeclareDefaultStructors(AllocStatsNumber)
+public:
+    static AllocStatsNumber* withNumber(UInt32 site, unsigned long long value, unsigned int numberOfBits);
+protected:
+    virtual void free() override;
+private:
+    UInt32 mSite = kAllocSiteCount;     // not counted until the factory succeeded
+};
+
+class AllocStatsString : public OSString
+{
+    OSDeclareDefaultStructors(AllocStatsString)
+public:
+    static AllocStatsString* withCString(UInt32 site, const char* string);
+protected:
+    virtual void free() override;
+private:
+    UInt32 mSite = kAllocSiteCount;
+};
+
+class AllocStatsData : public OSData
+{
+    OSDeclareDefaultStructors(AllocStatsData)
+public:
+    static AllocStatsData* withBytes(UInt32 site, const void* bytes, unsigned int length);
+protected:
+    virtual void free() override;
+private:
+    UInt32 mSite = kAllocSiteCount;
+};
+
+class AllocStatsArray : public OSArray
+{
+    OSDeclareDefaultStructors(AllocStatsArray)
+public:
+    static AllocStatsArray* withCapacity(UInt32 site, unsigned int capacity);
+protected:
+    virtual void free() override;
+private:
+    UInt32 mSite = kAllocSiteCount;
+};
+
+class AllocStatsDictionary : public OSDictionary
+{
+    OSDeclareDefaultStructors(AllocStatsDictionary)
+public:
+    static AllocStatsDictionary* withCapacity(UInt32 site, unsigned int capacity);
+protected:
+    virtual void free() override;
+private:
+    UInt32 mSite = kAllocSiteCount;
+};
+
+class AllocStatsIterator : public OSCollectionIterator
+{
+    OSDeclareDefaultStructors(AllocStatsIterator)
+public:
+    static AllocStatsIterator* withCollection(UInt32 site, const OSCollection* collection);
+protected:
+    virtual void free() override;
+private:
+    UInt32 mSite = kAllocSiteCount;
+};
+
+#endif /* AllocStats_h */
@@ -0,0 +1,203 @@
+/*
+ *  Released under "The GNU General Public License (GPL-2.0)"
+ *
+ *  This program is free software; you can redistribute it and/or modify it
+ *  under the terms of the GNU General Public License as published by the
+ *  Free Software Foundation; either version 2 of the License, or (at your
+ *  option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful, but
+ *  WITHOUT ANY WARRANTY; without even the implied warranty of MERCHANTABILITY
+ *  or FITNESS FOR A PARTICULAR PURPOSE. See the GNU General Public License
+ *  for more details.
+ *
+ *  You should have received a copy of the GNU General Public License along
+ *  with this program; if not, write to the Free Software Foundation, Inc.,
+ *  59 Temple Place, Suite 330, Boston, MA 02111-1307 USA
+ *
+ */
+
+#include <IOKit/IOLib.h>
+#include "common.h"
+#include "CommandQueue.h"
+
+#define kCommandQueueMask (kCommandQueueEntries - 1)
+
+// One command of a batch taken off the queue, run outside the lock
+struct DrainSlot
+{
+    CommandEntry command;
+    CompletionEntry completion;
+};
+
+bool CommandRing::init()
+{
+    mLock = IOLockAlloc();
+    return mLock != NULL;
+}
+
+void CommandRing::free()
+{
+    OSSafeReleaseNULL(mMemory);
+    mQueue = NULL;
+
+    if (mLock != NULL) {
+        IOLockFree(mLock);
+        mLock = NULL;
+    }
+}
+
+IOReturn CommandRing::copyMemory(IOMemoryDescriptor** memory)
+{
+    IOReturn ret = kIOReturnSuccess;
+
+    if (mLock == NULL)
+        return kIOReturnNotReady;
+
+    IOLockLock(mLock);
+
+    if (mMemory == NULL) {
+        mMemory = IOBufferMemoryDescriptor::withOptions(kIODirectionInOut | kIOMemoryKernelUserShared,
+                                                        sizeof(CommandQueue), PAGE_SIZE);
+        if (mMemory != NULL) {
+            mQueue = (CommandQueue*)mMemory->getBytesNoCopy();
+            bzero(mQueue, sizeof(CommandQueue));
+            mSubmitHead = 0;
+            mCompleteTail = 0;
+            mCompleteReserved = 0;
+        }
+    }
+
+    // the caller consumes a reference
+    if (mMemory != NULL) {
+        mMemory->retain();
+        *memory = mMemory;
+    }
+    else {
+        ret = kIOReturnNoMemory;
+    }
+
+    IOLockUnlock(mLock);
+
+    return ret;
+}
+
+IOReturn CommandRing::drain(OSObject* target, Handler handler, UInt32* processed)
+{
+    *processed = 0;
+
+    if (mLock == NULL)
+        return kIOReturnNotReady;
+
+    IOLockLock(mLock);
+
+    if (mQueue == NULL) {
+        IOLockUnlock(mLock);
+        return kIOReturnNotReady;
+    }
+
+    // the commands are read after the tail that published them, completion
+    // slots are reused after userspace moved its head past them
+    UInt32 submitTail = commandQueueLoad(mQueue->submitTail);
+    UInt32 completeHead = commandQueueLoad(mQueue->completeHead);
+
+    // userspace indices can be anything, never trust more than a full ring
+    if (submitTail - mSubmitHead > kCommandQueueEntries || mCompleteReserved - completeHead > kCommandQueueEntries) {
+        IOLockUnlock(mLock);
+        return kIOReturnBadArgument;
+    }
+
+    UInt32 count = submitTail - mSubmitHead;
+    UInt32 room = kCommandQueueEntries - (mCompleteReserved - completeHead);
+
+    if (count > room) {
+        count = room;
+        mOverflows++;
+    }
+
+    DrainSlot* slots = count ? (DrainSlot*)IOMalloc(count * sizeof(DrainSlot)) : NULL;
+
+    if (count && slots == NULL) {
+        IOLockUnlock(mLock);
+        return kIOReturnNoMemory;
+    }
+
+    // copied, userspace may rewrite the slots while the commands run
+    for (UInt32 i = 0; i < count; i++)
+        slots[i].command = mQueue->submit[(mSubmitHead + i) & kCommandQueueMask];
+
+    // the batch owns its completion slots from here on
+    UInt32 first = mCompleteReserved;
+
+    mSubmitHead += count;
+    mCompleteReserved += count;
+    commandQueueStore(mQueue->submitHead, mSubmitHead);
+    mDoorbells++;
+
+    IOLockUnlock(mLock);
+
+    if (count == 0)
+        return kIOReturnSuccess;
+
+    // a force-power command can take seconds, the lock is not held meanwhile
+    for (UInt32 i = 0; i < count; i++) {
+        UInt64 result = 0;
+
+        slots[i].completion.status = handler(target, slots[i].command.opcode, slots[i].command.arg, &result);
+        slots[i].completion.tag = slots[i].command.tag;
+        slots[i].completion.result = result;
+    }
+
+    IOLockLock(mLock);
+
+    // batches complete in the order they were taken
+    while (mCompleteTail != first)
+        IOLockSleep(mLock, &mCompleteTail, THREAD_UNINT);
+
+    for (UInt32 i = 0; i < count; i++)
+        mQueue->complete[(first + i) & kCommandQueueMask] = slots[i].completion;
+
+    // completions are visible before the tail that publishes them
+    mCompleteTail = first + count;
+    commandQueueStore(mQueue->completeTail, mCompleteTail);
+    IOLockWakeup(mLock, &mCompleteTail, false);
+
+    mCommands += count;
+    if (count > mMaxBatch)
+        mMaxBatch = count;
+
+    IOLockUnlock(mLock);
+
+    IOFree(slots, count * sizeof(DrainSlot));
+
+    *processed = count;
+    return kIOReturnSuccess;
+}
+
+void CommandRing::publish(IOService* service, const char* key)
+{
+    OSDictionary* dict = OSDictionary::withCapacity(4);
+    OSNumber* osNum;
+
+    if (dict == NULL)
+        return;
+
+    osNum = OSNumber::withNumber(mCommands, 32);
+    dict->setObject("commands", osNum);
+    osNum->release();
+
+    osNum = OSNumber::withNumber(mDoorbells, 32);
+    dict->setObject("doorbells", osNum);
+    osNum->release();
+
+    osNum = OSNumber::withNumber(mMaxBatch, 32);
+    dict->setObject("max-batch", osNum);
+    osNum->release();
+
+    osNum = OSNumber::withNumber(mOverflows, 32);
+    dict->setObject("overflows", osNum);
+    osNum->release();
+
+    service->setProperty(key, dict);
+    dict->release();
+}
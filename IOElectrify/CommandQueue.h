@@ -0,0 +1,120 @@
+/*
+ *  Released under "The GNU General Public License (GPL-2.0)"
+ *
+ *  This program is free software; you can redistribute it and/or modify it
+ *  under the terms of the GNU General Public License as published by the
+ *  Free Software Foundation; either version 2 of the License, or (at your
+ *  option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful, but
+ *  WITHOUT ANY WARRANTY; without even the implied warranty of MERCHANTABILITY
+ *  or FITNESS FOR A PARTICULAR PURPOSE. See the GNU General Public License
+ *  for more details.
+ *
+ *  You should have received a copy of the GNU General Public License along
+ *  with this program; if not, write to the Free Software Foundation, Inc.,
+ *  59 Temple Place, Suite 330, Boston, MA 02111-1307 USA
+ *
+ */
+
+#ifndef CommandQueue_h
+#define CommandQueue_h
+
+#include "OSTypesCompat.h"
+
+// Shared memory submission/completion queue pair of the user clients.
+//
+// Userspace maps it with clientMemoryForType(kCommandQueueMemoryType), writes
+// commands at submitTail and rings the doorbell selector once for the batch.
+// The driver consumes them from submitHead and posts one completion per
+// command at completeTail, userspace consumes completions from completeHead.
+// Indices run freely and are masked with kCommandQueueEntries - 1, each one
+// is only written by one side. A side writes its entries before it publishes
+// the index covering them with commandQueueStore, and reads the other side's
+// index with commandQueueLoad before it touches the entries.
+
+#define kCommandQueueMemoryType     0
+#define kCommandQueueEntries        64      // power of two
+
+enum
+{
+    kCommandForcePower = 1,     // controller, arg = on
+    kCommandPowerHook,          // controller, arg = IOElectrifyPowerHook mask
+    kCommandProbe               // bridge, arg = probe options
+};
+
+struct __attribute__((packed)) CommandEntry
+{
+    UInt32 opcode;
+    UInt32 tag;                 // returned as-is in the completion
+    UInt64 arg;
+};
+
+struct __attribute__((packed)) CompletionEntry
+{
+    UInt32 tag;
+    UInt32 status;              // IOReturn, kIOReturnUnsupported for an unknown opcode
+    UInt64 result;              // what the scalar selector returns in out[0]
+};
+
+// Not packed, the indices are accessed atomically and stay naturally aligned,
+// the layout is the same
+struct CommandQueue
+{
+    volatile UInt32 submitHead;     // driver
+    volatile UInt32 submitTail;     // userspace
+    volatile UInt32 completeHead;   // userspace
+    volatile UInt32 completeTail;   // driver
+    CommandEntry submit[kCommandQueueEntries];
+    CompletionEntry complete[kCommandQueueEntries];
+};
+
+static_assert(sizeof(CommandEntry) == 16 && sizeof(CompletionEntry) == 16, "queue entries changed size");
+static_assert(sizeof(CommandQueue) == 16 + kCommandQueueEntries * 32, "queue layout changed");
+
+// Index handoff, the acquire and release order the entries around the index
+#define commandQueueLoad(index)         __atomic_load_n(&(index), __ATOMIC_ACQUIRE)
+#define commandQueueStore(index, value) __atomic_store_n(&(index), (value), __ATOMIC_RELEASE)
+
+#ifdef KERNEL
+
+#include <IOKit/IOBufferMemoryDescriptor.h>
+#include <IOKit/IOLocks.h>
+
+// Kernel side of one queue pair, owned by a user client
+class CommandRing
+{
+public:
+    // Runs one command for target, result goes into the completion
+    typedef IOReturn (*Handler)(OSObject* target, UInt32 opcode, UInt64 arg, UInt64* result);
+
+    bool init();
+    void free();
+
+    // clientMemoryForType backend, the queue is created on first use
+    IOReturn copyMemory(IOMemoryDescriptor** memory);
+
+    // Doorbell, drains what was submitted as long as there is room for the
+    // completions, *processed is the number of commands completed. Commands
+    // run without the ring locked, completions are posted in submission order.
+    IOReturn drain(OSObject* target, Handler handler, UInt32* processed);
+
+    // Publish commands, doorbells and the largest batch under key
+    void publish(IOService* service, const char* key);
+
+private:
+    IOLock* mLock = NULL;
+    IOBufferMemoryDescriptor* mMemory = NULL;
+    CommandQueue* mQueue = NULL;
+    UInt32 mSubmitHead = 0;     // driver owned indices, the copies in the queue are only published
+    UInt32 mCompleteTail = 0;
+    UInt32 mCompleteReserved = 0;   // completion slots handed out to batches still running
+    UInt32 mCommands = 0;
+    UInt32 mDoorbells = 0;
+    UInt32 mMaxBatch = 0;
+    UInt32 mOverflows = 0;      // doorbells that left commands behind for lack of completion room
+};
+
+#endif /* KERNEL */
+
+#endif /* CommandQueue_h */
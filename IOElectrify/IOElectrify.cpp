@@ -18,12 +18,24 @@
  */
 
 #define kIOElectrifyPowerHookKey "IOElectrifyPowerHook"
+#define kIOElectrifyIdleTimeoutKey "IOElectrifyIdleTimeout"
+#define kIOElectrifyACPIBudgetKey "IOElectrifyACPIBudget"
+#define kIOElectrifyIdleGatingKey "IdleGating"
+#define kIOElectrifyPowerTimingKey "ForcePowerTiming"
+#define kIOElectrifyProfileKey "Profile"
+#define kIOElectrifyClientStatsKey "UserClientStats"
+#define kIOElectrifyCommandQueueKey "CommandQueueStats"
 
 
 #include <IOKit/IOLib.h>
 #include <IOKit/IOUserClient.h>
 #include "IOElectrify.h"
 #include "WMI.h"
+#include "WakeTrace.h"
+#include "Policy.h"
+#include "Recorder.h"
+#include "AllocStats.h"
+#include <IOKit/acpi/IOACPIPlatformDevice.h>
 
 #include <libkern/version.h>
 extern kmod_info_t kmod_info;
@@ -51,9 +63,19 @@ bool IOElectrify::init(OSDictionary *propTable)
 {
     DebugLog("IOElectrify::init() %p\n", this);
 
-	OSNumber *osNum;
-	osNum = OSDynamicCast(OSNumber, propTable->getObject(kIOElectrifyPowerHookKey));
-	mPowerHook = osNum->unsigned32BitValue();
+    mStartup.begin(kStartupPhaseInit);
+    mStartup.begin(kStartupPhasePlist);
+
+	// missing or malformed keys keep their defaults
+	Config config = { mPowerHook, mIdleTimeout, mACPIBudget };
+	readConfig(propTable, &config, false);
+	mPowerHook = config.powerHook;
+	mIdleTimeout = config.idleTimeout;
+	mACPIBudget = config.acpiBudget;
+	Policy::setPresenceAware(mPowerHook & kPowerHookPresenceAware);
+	Policy::setDarkWakeAware(mPowerHook & kPowerHookDarkWake);
+
+    mStartup.end(kStartupPhasePlist);
 	
     // announce version
     IOLog("IOElectrify: Version %s starting on OS X Darwin %d.%d.\n", kmod_info.version, version_major, version_minor);
@@ -66,6 +88,7 @@ bool IOElectrify::init(OSDictionary *propTable)
     }
 	
     // place version/build info in ioreg properties DV,Build and DV,Version
+    mStartup.begin(kStartupPhaseVersion);
     char buf[128];
     snprintf(buf, sizeof(buf), "%s %s", kmod_info.name, kmod_info.version);
     setProperty("DV,Version", buf);
@@ -74,22 +97,141 @@ bool IOElectrify::init(OSDictionary *propTable)
 #else
     setProperty("DV,Build", "Release-darkvoid");// LOGNAME);
 #endif
+    mStartup.end(kStartupPhaseVersion);
 
     mProvider = NULL;
+
+    mStartup.end(kStartupPhaseInit);
     
     return true;
 }
 
+// Strict parsing rejects unknown keys, wrong types and out of range values,
+// otherwise those are skipped and the config keeps what it had
+IOReturn IOElectrify::readConfig(OSDictionary* dict, Config* config, bool strict)
+{
+    Config parsed = *config;
+    unsigned int known = 0;
+    OSObject* osObj;
+    OSNumber* osNum;
+
+    if (dict == NULL)
+        return kIOReturnBadArgument;
+
+    if ((osObj = dict->getObject(kIOElectrifyPowerHookKey)) != NULL) {
+        known++;
+        osNum = OSDynamicCast(OSNumber, osObj);
+        if (osNum && !(osNum->unsigned32BitValue() & ~kPowerHookMask))
+            parsed.powerHook = osNum->unsigned32BitValue();
+        else if (strict)
+            return kIOReturnBadArgument;
+    }
+
+    if ((osObj = dict->getObject(kIOElectrifyIdleTimeoutKey)) != NULL) {
+        known++;
+        osNum = OSDynamicCast(OSNumber, osObj);
+        if (osNum && osNum->unsigned64BitValue() <= kMaxIdleTimeoutS)
+            parsed.idleTimeout = osNum->unsigned32BitValue();
+        else if (strict)
+            return kIOReturnBadArgument;
+    }
+
+    if ((osObj = dict->getObject(kIOElectrifyACPIBudgetKey)) != NULL) {
+        known++;
+        osNum = OSDynamicCast(OSNumber, osObj);
+        if (osNum && osNum->unsigned64BitValue() && osNum->unsigned64BitValue() <= kMaxACPIBudgetMS)
+            parsed.acpiBudget = osNum->unsigned32BitValue();
+        else if (strict)
+            return kIOReturnBadArgument;
+    }
+
+    if (strict && known != dict->getCount())
+        return kIOReturnUnsupported;
+
+    *config = parsed;
+    return kIOReturnSuccess;
+}
+
+bool IOElectrify::serializeProperties(OSSerialize* serialize) const
+{
+    IOElectrifyUserClient::publishCounters(const_cast<IOElectrify*>(this));
+    // closes a trace that settled since the last event
+    WakeTrace::publish(const_cast<IOElectrify*>(this));
+
+    return super::serializeProperties(serialize);
+}
+
+// Live reconfiguration, e.g. through IORegistryEntrySetCFProperties. Every key
+// is validated before anything changes, then all are applied at once on the work loop
+IOReturn IOElectrify::setProperties(OSObject* properties)
+{
+    OSDictionary* dict = OSDynamicCast(OSDictionary, properties);
+
+    if (dict == NULL)
+        return kIOReturnBadArgument;
+
+    IOReturn ret = IOUserClient::clientHasPrivilege(current_task(), kIOClientPrivilegeAdministrator);
+    if (ret != kIOReturnSuccess)
+        return ret;
+
+    if (mCommandGate == NULL)
+        return kIOReturnNotReady;
+
+    Config config = { mPowerHook, mIdleTimeout, mACPIBudget };
+    ret = readConfig(dict, &config, true);
+    if (ret != kIOReturnSuccess)
+        return ret;
+
+    return mCommandGate->runAction(OSMemberFunctionCast(IOCommandGate::Action, this, &IOElectrify::applyConfigGated),
+                                   &config);
+}
+
+IOReturn IOElectrify::applyConfigGated(Config* config)
+{
+    OSNumber* osNum;
+
+    DebugLog("config hook 0x%x idle %u s budget %u ms\n", config->powerHook, config->idleTimeout, config->acpiBudget);
+
+    mIdleTimeout = config->idleTimeout;
+    mACPIBudget = config->acpiBudget;
+    setPowerHookGated(config->powerHook);
+
+    // restart the idle countdown with the new timeout
+    if (mAwake && !mIdleGated && mIdleTimeout)
+        mIdleTimer->setTimeoutMS(mIdleTimeout * 1000);
+    else if (!mIdleTimeout)
+        mIdleTimer->cancelTimeout();
+
+    osNum = OSNumber::withNumber(mIdleTimeout, 32);
+    setProperty(kIOElectrifyIdleTimeoutKey, osNum);
+    osNum->release();
+
+    osNum = OSNumber::withNumber(mACPIBudget, 32);
+    setProperty(kIOElectrifyACPIBudgetKey, osNum);
+    osNum->release();
+
+    publishIdleStats();
+    publishPowerTiming();
+
+    return kIOReturnSuccess;
+}
+
 bool IOElectrify::attach(IOService* provider)
 {
     DebugLog("IOElectrify::attach() %s\n", provider->getName());
 
-    return super::attach(provider);
+    mStartup.begin(kStartupPhaseAttach);
+    bool ret = super::attach(provider);
+    mStartup.end(kStartupPhaseAttach);
+
+    return ret;
 }
 
 bool IOElectrify::start(IOService *provider)
 {
     DebugLog("IOElectrify::start() %s\n", provider->getName());
+
+    mStartup.begin(kStartupPhaseStart);
     
     if (!super::start(provider))
     {
@@ -99,20 +241,57 @@ bool IOElectrify::start(IOService *provider)
     
     bool result = false;
     
+    mStartup.begin(kStartupPhaseWMI);
     mWMI = new WMI(provider);
 
     if (mWMI->initialize()) {
 
-        if (mWMI->hasMethod(INTEL_WMI_THUNDERBOLT_GUID)) {
-            result = true;
+        for (unsigned int i = 0; i < kForcePowerProfileCount; i++) {
+            if (mWMI->hasMethod(kForcePowerProfiles[i].guid)) {
+                mProfile = &kForcePowerProfiles[i];
+                setProperty(kIOElectrifyProfileKey, mProfile->name);
+                result = true;
+                break;
+            }
+        }
+    }
+    mStartup.end(kStartupPhaseWMI);
+
+    if (result) {
+        mStartup.begin(kStartupPhaseWorkLoop);
+        mWorkLoop = IOWorkLoop::workLoop();
+        mCommandGate = IOCommandGate::commandGate(this);
+        mIdleTimer = IOTimerEventSource::timerEventSource(this, &IOElectrify::idleTimerFired);
+
+        mPowerCall = thread_call_allocate(&IOElectrify::powerCallMain, this);
+
+        if (!mWorkLoop || !mCommandGate || !mIdleTimer || !mPowerCall ||
+            mWorkLoop->addEventSource(mCommandGate) != kIOReturnSuccess ||
+            mWorkLoop->addEventSource(mIdleTimer) != kIOReturnSuccess) {
+            AlwaysLog("failed to set up work loop\n");
+            result = false;
         }
+        mStartup.end(kStartupPhaseWorkLoop);
     }
 
     if (result) {
+        Policy::registerController(this);
+        publishIdleStats();
+
+        if (!mResidency.init(this))
+            AlwaysLog("failed to create residency reporters\n");
+
         // init power state management & set state as PowerOn
+        mStartup.begin(kStartupPhasePM);
         PMinit();
+        mPowerState = kPowerStateNormal;
         registerPowerDriver(this, powerStateArray, kPowerStateCount);
         provider->joinPMtree(this);
+        mStartup.end(kStartupPhasePM);
+
+        mStartup.end(kStartupPhaseStart);
+        mStartup.publish(this);
+        AllocStats::publish(this);
     }
     
     return result;
@@ -123,19 +302,51 @@ void IOElectrify::stop(IOService *provider)
     DebugLog("IOElectrify::stop() %p\n", this);
     
     PMstop();
+
+    releaseWorkLoop();
     
     if (mWMI != NULL) {
         delete mWMI;
         mWMI = NULL;
     }
 
+    Policy::unregister(this);
+
     super::stop(provider);
 }
 
+void IOElectrify::releaseWorkLoop()
+{
+    if (mPowerCall != NULL) {
+        // drop the reference taken for a transition that never ran
+        if (thread_call_cancel_wait(mPowerCall))
+            release();
+        thread_call_free(mPowerCall);
+        mPowerCall = NULL;
+    }
+
+    if (mIdleTimer != NULL) {
+        mIdleTimer->cancelTimeout();
+        if (mWorkLoop != NULL)
+            mWorkLoop->removeEventSource(mIdleTimer);
+        OSSafeReleaseNULL(mIdleTimer);
+    }
+
+    if (mCommandGate != NULL) {
+        if (mWorkLoop != NULL)
+            mWorkLoop->removeEventSource(mCommandGate);
+        OSSafeReleaseNULL(mCommandGate);
+    }
+
+    OSSafeReleaseNULL(mWorkLoop);
+}
+
 void IOElectrify::free()
 {
     DebugLog("IOElectrify::free() %p\n", this);
 
+    mResidency.free();
+
     super::free();
 }
 
@@ -148,47 +359,543 @@ void IOElectrify::detach(IOService *provider)
 }
 #endif
 
-UInt32 IOElectrify::TBFP(UInt32 ON)
-{
-    if (mWMI->hasMethod(INTEL_WMI_THUNDERBOLT_GUID)) {
-        
-        OSObject* params[3] = {
-            OSNumber::withNumber(0ULL, 32),
-            OSNumber::withNumber(0ULL, 32),
-            OSNumber::withNumber((unsigned long long)ON, 32)
-        };
-        
-        if (mWMI->executeMethod(INTEL_WMI_THUNDERBOLT_GUID, NULL, params, 3)) {
-					if (ON)
-                    	AlwaysLog("Thunderbolt force-power: ON.\n");
-					else
-						AlwaysLog("Thunderbolt force-power: OFF.\n");
+// Force-power and the state around it are only touched with the command gate held,
+// user clients, PM and the idle timer all funnel through here
+IOReturn IOElectrify::TBFP(UInt32 ON, UInt32 source)
+{
+    if (mCommandGate != NULL && !mWorkLoop->inGate())
+        return mCommandGate->runAction(OSMemberFunctionCast(IOCommandGate::Action, this, &IOElectrify::forcePowerGated),
+                                       (void*)(uintptr_t)ON, (void*)(uintptr_t)source);
+
+    return forcePowerGated(ON, source);
+}
+
+// Call the force-power method within mACPIBudget ms, retrying failures with
+// exponential backoff, and verify the result where the firmware allows it
+IOReturn IOElectrify::forcePowerGated(UInt32 ON, UInt32 source)
+{
+    if (mProfile == NULL)
+        return kIOReturnUnsupported;
+
+    UInt64 start = getUptimeNanoseconds();
+    UInt64 deadline = start + (UInt64)mACPIBudget * 1000000ULL;
+    UInt32 backoff = kACPIRetryBackoffMS;
+    IOReturn ret;
+    
+    // one call at a time, a retry backoff opens the gate to other requests
+    if (mCommandGate != NULL) {
+        while (mForcePowerBusy)
+            mCommandGate->commandSleep(&mForcePowerBusy, THREAD_UNINT);
+    }
+    mForcePowerBusy = true;
+
+    OSObject* params[kProfileMaxArgs];
+    for (unsigned int i = 0; i < mProfile->argCount; i++) {
+        params[i] = AllocStatsNumber::withNumber(kAllocSiteForcePowerArgs, i == mProfile->powerArg ? (unsigned long long)ON : mProfile->args[i], 32);
+    }
+
+    for (;;) {
+        ret = mWMI->executeMethod(mProfile->guid, NULL, params, mProfile->argCount);
+        if (ret == kIOReturnSuccess)
+            ret = verifyForcePower(ON);
+        if (ret == kIOReturnSuccess || ret == kIOReturnNotFound)
+            break;
+
+        // only retry when the backoff still fits in the budget, the last
+        // error is what the caller gets
+        UInt64 now = getUptimeNanoseconds();
+        if (now + (UInt64)backoff * 1000000ULL >= deadline) {
+            DebugLog("force-power %u out of budget, giving up\n", ON);
+            break;
         }
+
+        DebugLog("force-power %u failed (0x%x), retrying in %u ms\n", ON, ret, backoff);
+        mTBFPRetries++;
+        sleepGateOpen(backoff);
+        backoff *= 2;
+    }
+
+    for (unsigned int i = 0; i < mProfile->argCount; i++) {
+        OSSafeReleaseNULL(params[i]);
+    }
+
+    UInt64 end = getUptimeNanoseconds();
+    UInt64 elapsed = end - start;
+    mLastTBFPTime[ON ? 1 : 0] = elapsed;
+    if (elapsed > mMaxTBFPTime[ON ? 1 : 0])
+        mMaxTBFPTime[ON ? 1 : 0] = elapsed;
+
+    // a single slow AML method can't be interrupted, but it is accounted for
+    if (end > deadline)
+        mTBFPOverruns++;
+
+    mResidency.record(source, ON, ret == kIOReturnSuccess, elapsed);
+
+    mForcePowerBusy = false;
+    if (mCommandGate != NULL)
+        mCommandGate->commandWakeup(&mForcePowerBusy);
+
+    // done or failed, either way bridges waiting for power can go ahead
+    if (ON)
+        Policy::settleForcePower(this);
+
+    mLastTBFPStatus = ret;
+    if (ret == kIOReturnSuccess) {
+        mForcePowered = ON;
+        // powered up during a dark wake, whoever asked, the next sleep has to power off again
+        if (ON)
+            mDarkWake = false;
+        if (ON)
+            AlwaysLog("Thunderbolt force-power: ON.\n");
+        else
+            AlwaysLog("Thunderbolt force-power: OFF.\n");
+    }
+    else {
+        mTBFPFailures++;
+        AlwaysLog("Thunderbolt force-power %s failed (0x%x)\n", ON ? "ON" : "OFF", ret);
+    }
+
+    return ret;
+}
+
+// Sleep without holding the command gate, so that a force-power backoff
+// doesn't stall every other request to this driver
+void IOElectrify::sleepGateOpen(UInt32 ms)
+{
+    AbsoluteTime deadline;
+
+    if (mCommandGate == NULL || !mWorkLoop->inGate()) {
+        IOSleep(ms);
+        return;
+    }
+
+    // nothing wakes this event, the sleep only ends at the deadline
+    clock_interval_to_deadline(ms, kMillisecondScale, &deadline);
+    mCommandGate->commandSleep(&deadline, deadline, THREAD_UNINT);
+}
+
+IOReturn IOElectrify::verifyForcePower(UInt32 ON)
+{
+    UInt32 state;
+
+    if (mProfile->verifyMethod == NULL)
+        return kIOReturnSuccess;
+
+    IOReturn ret = mWMI->evaluateInteger(mProfile->verifyMethod, &state);
+    if (ret != kIOReturnSuccess) {
+        // firmware can't tell us, trust the call
+        return kIOReturnSuccess;
     }
+
+    return (!state == !ON) ? kIOReturnSuccess : kIOReturnNotReady;
+}
+
+void IOElectrify::setPowerHook(UInt32 hook)
+{
+    if (mCommandGate != NULL)
+        mCommandGate->runAction(OSMemberFunctionCast(IOCommandGate::Action, this, &IOElectrify::setPowerHookGated),
+                                (void*)(uintptr_t)hook);
+    else
+        setPowerHookGated(hook);
+}
+
+IOReturn IOElectrify::setPowerHookGated(UInt32 hook)
+{
+    mPowerHook = hook;
+
+    OSNumber *osNum;
+    osNum = OSNumber::withNumber (mPowerHook, sizeof (UInt32) * 8);
+    setProperty(kIOElectrifyPowerHookKey, osNum);
+    osNum->release();
+
+    Policy::setPresenceAware(mPowerHook & kPowerHookPresenceAware);
+    Policy::setDarkWakeAware(mPowerHook & kPowerHookDarkWake);
+
+    return kIOReturnSuccess;
+}
+
+IOReturn IOElectrify::forcePowerAsync(UInt32 ON)
+{
+    retain();
+    if (thread_call_enter1(mPowerCall, (thread_call_param_t)(uintptr_t)ON)) {
+        // already queued, the pending call acknowledges for us
+        release();
+    }
+
+    return kPowerAckTimeoutUS;
+}
+
+void IOElectrify::powerCallMain(thread_call_param_t param0, thread_call_param_t param1)
+{
+    IOElectrify* self = (IOElectrify*)param0;
+    UInt32 ON = (UInt32)(uintptr_t)param1;
+
+    self->TBFP(ON, kResidencySourcePM);
+    if (ON)
+        WakeTrace::mark(kWakeStageACPIDone);
+    WakeTrace::publish(self);
+    self->publishPowerTiming();
+
+    self->acknowledgeSetPowerState();
+    self->release();
+}
+
+void IOElectrify::publishPowerTiming()
+{
+    if (mCommandGate != NULL)
+        mCommandGate->runAction(OSMemberFunctionCast(IOCommandGate::Action, this, &IOElectrify::publishPowerTimingGated));
+    else
+        publishPowerTimingGated();
+}
+
+// the counters change under the gate, a snapshot without it could tear
+IOReturn IOElectrify::publishPowerTimingGated()
+{
+    OSDictionary* dict = OSDictionary::withCapacity(11);
+    OSNumber* osNum;
+
+    if (dict == NULL)
+        return kIOReturnNoMemory;
+
+    osNum = OSNumber::withNumber(mLastTBFPTime[1], 64);
+    dict->setObject("on-ns", osNum);
+    osNum->release();
+
+    osNum = OSNumber::withNumber(mMaxTBFPTime[1], 64);
+    dict->setObject("max-on-ns", osNum);
+    osNum->release();
+
+    osNum = OSNumber::withNumber(mLastTBFPTime[0], 64);
+    dict->setObject("off-ns", osNum);
+    osNum->release();
+
+    osNum = OSNumber::withNumber(mMaxTBFPTime[0], 64);
+    dict->setObject("max-off-ns", osNum);
+    osNum->release();
+
+    osNum = OSNumber::withNumber(mACPIBudget, 32);
+    dict->setObject("budget-ms", osNum);
+    osNum->release();
+
+    osNum = OSNumber::withNumber(mTBFPRetries, 32);
+    dict->setObject("retries", osNum);
+    osNum->release();
+
+    osNum = OSNumber::withNumber(mTBFPFailures, 32);
+    dict->setObject("failures", osNum);
+    osNum->release();
+
+    osNum = OSNumber::withNumber(mTBFPOverruns, 32);
+    dict->setObject("overruns", osNum);
+    osNum->release();
+
+    osNum = OSNumber::withNumber((UInt32)mLastTBFPStatus, 32);
+    dict->setObject("last-status", osNum);
+    osNum->release();
+
+    osNum = OSNumber::withNumber(mDarkWakes, 32);
+    dict->setObject("dark-wakes", osNum);
+    osNum->release();
+
+    osNum = OSNumber::withNumber(mDarkWakePromotions, 32);
+    dict->setObject("dark-wake-promotions", osNum);
+    osNum->release();
+
+    setProperty(kIOElectrifyPowerTimingKey, dict);
+    dict->release();
+
+    PowerResidencyRecord record;
+    copyResidency(&record);
+    PowerResidency::publish(this, &record);
+
+    AllocStats::publish(this);
+
+    return kIOReturnSuccess;
+}
+
+void IOElectrify::copyResidency(PowerResidencyRecord* record)
+{
+    if (mCommandGate != NULL)
+        mCommandGate->runAction(OSMemberFunctionCast(IOCommandGate::Action, this, &IOElectrify::copyResidencyGated),
+                                record);
+    else
+        copyResidencyGated(record);
+}
+
+IOReturn IOElectrify::copyResidencyGated(PowerResidencyRecord* record)
+{
+    mResidency.copy(record);
+    return kIOReturnSuccess;
+}
+
+void IOElectrify::resetResidency()
+{
+    if (mCommandGate != NULL)
+        mCommandGate->runAction(OSMemberFunctionCast(IOCommandGate::Action, this, &IOElectrify::resetResidencyGated));
+    else
+        resetResidencyGated();
+}
+
+IOReturn IOElectrify::resetResidencyGated()
+{
+    PowerResidencyRecord record;
+
+    mResidency.reset();
+    mResidency.copy(&record);
+    PowerResidency::publish(this, &record);
+
+    return kIOReturnSuccess;
+}
+
+IOReturn IOElectrify::configureReport(IOReportChannelList* channels, IOReportConfigureAction action, void* result,
+                                      void* destination)
+{
+    IOReturn ret = mResidency.configureReport(channels, action, result, destination);
+
+    if (ret != kIOReturnSuccess)
+        return ret;
+
+    return super::configureReport(channels, action, result, destination);
+}
+
+IOReturn IOElectrify::updateReport(IOReportChannelList* channels, IOReportUpdateAction action, void* result,
+                                   void* destination)
+{
+    IOReturn ret = mResidency.updateReport(channels, action, result, destination);
+
+    if (ret != kIOReturnSuccess)
+        return ret;
+
+    return super::updateReport(channels, action, result, destination);
+}
+
+//
+// Runtime idle gating: force-power goes off after mIdleTimeout seconds without
+// activity, any user client call or hotplug brings it back.
+//
+
+void IOElectrify::noteActivity()
+{
+    UInt64 start = getUptimeNanoseconds();
+    bool resumed = false;
+
+    if (mCommandGate == NULL)
+        return;
+
+    mCommandGate->runAction(OSMemberFunctionCast(IOCommandGate::Action, this, &IOElectrify::noteActivityGated), &resumed);
+
+    // the bridges rescan outside the gate, devices they publish message us back
+    if (resumed) {
+        UInt64 elapsed;
+
+        Policy::rescanBridges();
+        elapsed = getUptimeNanoseconds() - start;
+        mCommandGate->runAction(OSMemberFunctionCast(IOCommandGate::Action, this, &IOElectrify::noteResumeGated), &elapsed);
+    }
+}
+
+IOReturn IOElectrify::noteActivityGated(bool* resumed)
+{
+    if (mIdleGated) {
+        TBFP(1ULL, kResidencySourcePolicy);
+        mIdleGated = false;
+        *resumed = true;
+    }
+
+    if (mIdleTimeout && mAwake)
+        mIdleTimer->setTimeoutMS(mIdleTimeout * 1000);
+
+    return kIOReturnSuccess;
+}
+
+IOReturn IOElectrify::noteResumeGated(UInt64* elapsed)
+{
+    mLastResumeTime = *elapsed;
+    if (mLastResumeTime > mMaxResumeTime)
+        mMaxResumeTime = mLastResumeTime;
+    mIdleResumeCount++;
+
+    DebugLog("idle resume took %llu ns\n", mLastResumeTime);
+    publishIdleStats();
+
+    return kIOReturnSuccess;
+}
+
+IOReturn IOElectrify::setAwakeGated(bool awake)
+{
+    mAwake = awake;
+    mIdleGated = false;
+
+    if (awake && mIdleTimeout)
+        mIdleTimer->setTimeoutMS(mIdleTimeout * 1000);
+    else
+        mIdleTimer->cancelTimeout();
+
+    return kIOReturnSuccess;
+}
+
+void IOElectrify::idleTimerFired(OSObject* owner, IOTimerEventSource* sender)
+{
+    IOElectrify* self = OSDynamicCast(IOElectrify, owner);
+
+    if (self == NULL || !self->mAwake || self->mIdleGated || !self->mForcePowered)
+        return;
+
+    // a force-power call is backing off, look again later rather than block the work loop
+    if (self->mForcePowerBusy) {
+        sender->setTimeoutMS(self->mIdleTimeout * 1000);
+        return;
+    }
+
+    // never pull power from under attached devices
+    if (Policy::bridgesHaveDevices()) {
+        sender->setTimeoutMS(self->mIdleTimeout * 1000);
+        return;
+    }
+
+    DebugLog("controller idle for %u s, gating force-power\n", self->mIdleTimeout);
+    self->TBFP(0ULL, kResidencySourcePolicy);
+    self->mIdleGated = true;
+    self->mIdleGateCount++;
+    self->publishIdleStats();
+}
+
+void IOElectrify::publishIdleStats()
+{
+    OSDictionary* dict = OSDictionary::withCapacity(6);
+    OSNumber* osNum;
+
+    if (dict == NULL)
+        return;
+
+    osNum = OSNumber::withNumber(mIdleTimeout, 32);
+    dict->setObject("timeout", osNum);
+    osNum->release();
+
+    dict->setObject("gated", mIdleGated ? kOSBooleanTrue : kOSBooleanFalse);
+
+    osNum = OSNumber::withNumber(mIdleGateCount, 32);
+    dict->setObject("gate-count", osNum);
+    osNum->release();
+
+    osNum = OSNumber::withNumber(mIdleResumeCount, 32);
+    dict->setObject("resume-count", osNum);
+    osNum->release();
+
+    osNum = OSNumber::withNumber(mLastResumeTime, 64);
+    dict->setObject("last-resume-ns", osNum);
+    osNum->release();
+
+    osNum = OSNumber::withNumber(mMaxResumeTime, 64);
+    dict->setObject("max-resume-ns", osNum);
+    osNum->release();
+
+    setProperty(kIOElectrifyIdleGatingKey, dict);
+    dict->release();
 }
 
 IOReturn IOElectrify::setPowerState(unsigned long powerState, IOService *service)
 {
+    IOReturn result = IOPMAckImplied;
+    UInt32 state = (UInt32)powerState;
+    UInt32 previous = mPowerState;
+
     DebugLog("setPowerState %ld\n", powerState);
+    Recorder::record(kEventPMCallback, kEventSourceController, NULL, &state, 1, 0, getUptimeNanoseconds(), 0);
+    mPowerState = state;
 	//if (mEnablePowerHook) 
 	//{
 	    switch (powerState)
 	    {
 	        case kPowerStateSleep:
 	            DebugLog("--> sleep(%d)\n", (int)powerState);
-                if (mPowerHook & 0x1)
-				    TBFP(0ULL);
+	            WakeTrace::end();
+	            Policy::clearDeferred(kDeferForcePower);
+	            mCommandGate->runAction(OSMemberFunctionCast(IOCommandGate::Action, this, &IOElectrify::powerChangeGated),
+	                                    (void*)(uintptr_t)state, (void*)(uintptr_t)previous, &result);
 	            break;
 	        case kPowerStateDoze:
 	        case kPowerStateNormal:
 	            DebugLog("--> awake(%d)\n", (int)powerState);
-                if (mPowerHook & 0x2)
-	                TBFP(1ULL);
+	            WakeTrace::begin();
+	            mCommandGate->runAction(OSMemberFunctionCast(IOCommandGate::Action, this, &IOElectrify::powerChangeGated),
+	                                    (void*)(uintptr_t)state, (void*)(uintptr_t)previous, &result);
+	            if (result == IOPMAckImplied)
+	                WakeTrace::publish(this);
 	            break;
 	    }
     //}
     
-    return IOPMAckImplied;
+    return result;
+}
+
+// PM's side of setPowerState. The hook mask and the dark wake state are only
+// touched with the command gate held, like the user client and policy paths.
+IOReturn IOElectrify::powerChangeGated(UInt32 state, UInt32 previous, IOReturn* result)
+{
+    setAwakeGated(state != kPowerStateSleep);
+
+    if (state == kPowerStateSleep) {
+        if (mDarkWake) {
+            // still off since the last sleep, nothing to undo
+            DebugLog("leaving dark wake, force-power already off\n");
+            mDarkWake = false;
+        }
+        else if (mPowerHook & kPowerHookSleep)
+            *result = forcePowerAsync(0);
+        // bridges hold their wake rescan until we force-powered
+        if ((mPowerHook & kPowerHookWake) && mProfile != NULL)
+            Policy::expectForcePower(this);
+        return kIOReturnSuccess;
+    }
+
+    if (state == kPowerStateNormal && mDarkWake) {
+        // full wake after a dark one, do the wake work now
+        DebugLog("promoting dark wake\n");
+        mDarkWake = false;
+        mDarkWakePromotions++;
+        Policy::clearDeferred(kDeferForcePower);
+    }
+    if (mPowerHook & kPowerHookWake) {
+        if (state == kPowerStateDoze && previous == kPowerStateSleep && Policy::shouldDeferDarkWake()) {
+            DebugLog("dark wake, leaving force-power off\n");
+            mDarkWake = true;
+            mDarkWakes++;
+            Policy::defer(kDeferForcePower);
+            publishPowerTiming();
+        } else if (Policy::shouldDeferWake()) {
+            DebugLog("nothing attached at sleep, deferring force-power\n");
+            Policy::defer(kDeferForcePower);
+        } else {
+            *result = forcePowerAsync(1);
+        }
+    } else {
+        Policy::settleForcePower(this);
+    }
+
+    return kIOReturnSuccess;
+}
+
+IOReturn IOElectrify::message(UInt32 type, IOService *provider, void *argument)
+{
+    switch (type)
+    {
+        case kIOACPIMessageDeviceNotification:
+            // firmware notified a Thunderbolt hotplug
+            DebugLog("ACPI notification\n");
+            Policy::resumeDeferred("hotplug");
+            noteActivity();
+            return kIOReturnSuccess;
+        case kIOElectrifyMessageForcePowerOn:
+            TBFP(1ULL, kResidencySourcePolicy);
+            WakeTrace::mark(kWakeStageACPIDone);
+            return kIOReturnSuccess;
+        case kIOElectrifyMessageActivity:
+            noteActivity();
+            return kIOReturnSuccess;
+    }
+
+    return super::message(type, provider, argument);
 }
 
 
@@ -197,22 +904,16 @@ IOReturn IOElectrify::setPowerState(unsigned long powerState, IOService *service
 // Userspace Client:
 //*********************************************************************
 
-const IOExternalMethodDispatch IOElectrifyUserClient::sMethods[kClientNumMethods] =
-{
-    { // kClientExecuteTBFP
-        (IOExternalMethodAction)&IOElectrifyUserClient::executeTBFP,
-        1, // One scalar input value
-        0, // No struct inputs
-        1, // One scalar output value
-        0  // No struct outputs
-    },
-    { //kClientTogglePowerHook
-        (IOExternalMethodAction)&IOElectrifyUserClient::togglePowerHook,
-        1, // One scalar input value
-        0, // No struct inputs
-        1, // One scalar output value
-        0  // No struct outputs
-    }
+const DispatchMethod IOElectrifyUserClient::sMethods[kClientNumMethods] =
+{
+    kDispatchMethod(IOElectrifyUserClient::executeTBFP, true),              // kClientExecuteTBFP
+    kDispatchMethod(IOElectrifyUserClient::togglePowerHook, true),          // kClientTogglePowerHook
+    kDispatchRawMethod(IOElectrifyUserClient::copyEventLog,                 // kClientCopyEventLog
+                       0, 0, 1, kIOUCVariableStructureSize, false),
+    kDispatchMethod(IOElectrifyUserClient::copyStartupProfile, true),       // kClientCopyStartupProfile
+    kDispatchClientMethod(IOElectrifyUserClient::ringDoorbell, true),       // kClientRingDoorbell
+    kDispatchMethod(IOElectrifyUserClient::copyResidency, false),           // kClientCopyResidency
+    kDispatchMethod(IOElectrifyUserClient::resetResidency, true)            // kClientResetResidency
 };
 
 // Structure of IOExternalMethodDispatch:
@@ -244,10 +945,24 @@ bool IOElectrifyUserClient::initWithTask(task_t owningTask, void* securityID, UI
     IOLog("Client::initWithTask(type %u)\n", (unsigned int)type);
     
     mTask = owningTask;
+
+    if (!mCommands.init())
+        return false;
     
     return IOUserClient::initWithTask(owningTask, securityID, type, properties);
 }
 
+//
+// IOUserClient teardown, the command queue goes away with the last mapping
+//
+
+void IOElectrifyUserClient::free()
+{
+    mCommands.free();
+
+    IOUserClient::free();
+}
+
 //
 // IOUserClient user-kernel boundary interface start
 //
@@ -275,8 +990,20 @@ bool IOElectrifyUserClient::start(IOService * provider)
 // IOUserClient user-kernel boundary interface client exit behavior
 //
 
+// Calls through the user clients, published on close and whenever the
+// provider's properties are read, long-lived clients may never close
+void IOElectrifyUserClient::publishCounters(IOElectrify* provider)
+{
+    publishDispatchCounters(provider, kIOElectrifyClientStatsKey, sMethods, provider->mClientCounters, kClientNumMethods);
+}
+
 IOReturn IOElectrifyUserClient::clientClose(void)
 {
+    if (providertarget != NULL) {
+        publishCounters(providertarget);
+        mCommands.publish(providertarget, kIOElectrifyCommandQueueKey);
+    }
+
     if (!isInactive())
         terminate();
     
@@ -294,6 +1021,19 @@ void IOElectrifyUserClient::stop(IOService * provider)
     IOUserClient::stop(provider);
 }
 
+//
+// IOUserClient shared memory, the command queue pair
+//
+
+IOReturn IOElectrifyUserClient::clientMemoryForType(UInt32 type, IOOptionBits* options, IOMemoryDescriptor** memory)
+{
+    if (type != kCommandQueueMemoryType)
+        return kIOReturnBadArgument;
+
+    *options = 0;
+    return mCommands.copyMemory(memory);
+}
+
 //
 // IOUserClient handle external method
 //
@@ -302,34 +1042,123 @@ IOReturn IOElectrifyUserClient::externalMethod(uint32_t selector, IOExternalMeth
                                               IOExternalMethodDispatch* dispatch, OSObject* target, void* reference)
 {
     DebugLog("%s[%p]::%s(%d, %p, %p, %p, %p)\n", getName(), this, __FUNCTION__, selector, arguments, dispatch, target, reference);
-    
-    if (selector < (uint32_t)kClientNumMethods)
-    {
-        dispatch = (IOExternalMethodDispatch *)&sMethods[selector];
-        
-        if (!target)
-        {
-            if (selector == kClientExecuteTBFP || selector == kClientTogglePowerHook)
-                target = providertarget;
-            else
-                target = this;
+
+    return dispatchExternalMethod(this, providertarget, sMethods, providertarget->mClientCounters, kClientNumMethods,
+                                  kEventSourceController, selector, arguments);
+}
+
+IOReturn IOElectrifyUserClient::togglePowerHook(IOElectrify* target, const uint64_t (&in)[1], uint64_t (&out)[1])
+{
+    target->noteActivity();
+    target->setPowerHook((UInt32)in[0]);
+    // what we just applied, mPowerHook may already hold another client's mask
+    out[0] = (UInt32)in[0];
+    return kIOReturnSuccess;
+}
+
+IOReturn IOElectrifyUserClient::executeTBFP(IOElectrify* target, const uint64_t (&in)[1], uint64_t (&out)[1])
+{
+    UInt32 on = (UInt32)in[0];
+
+    target->noteActivity();
+    if (on)
+        Policy::clearDeferred(kDeferForcePower);
+    IOReturn ret = target->TBFP(on, kResidencySourceClient);
+    out[0] = (UInt32)ret;
+    if (on && ret == kIOReturnSuccess)
+        Policy::resumeDeferred("user client");
+    return ret;
+}
+
+IOReturn IOElectrifyUserClient::copyEventLog(IOElectrify* target, IOExternalMethodArguments* arguments)
+{
+    IOMemoryDescriptor* desc = arguments->structureOutputDescriptor;
+    UInt32 size = desc ? arguments->structureOutputDescriptorSize : arguments->structureOutputSize;
+    UInt32 maxEvents = size / sizeof(RecorderEvent);
+
+    if (maxEvents > kRecorderCapacity)
+        maxEvents = kRecorderCapacity;
+
+    RecorderEvent* events = (RecorderEvent*)IOMalloc(kRecorderCapacity * sizeof(RecorderEvent));
+    if (events == NULL)
+        return kIOReturnNoMemory;
+
+    UInt32 count = Recorder::copyEvents(events, maxEvents);
+    IOReturn ret = kIOReturnSuccess;
+
+    if (desc != NULL) {
+        ret = desc->prepare();
+        if (ret == kIOReturnSuccess) {
+            desc->writeBytes(0, events, count * sizeof(RecorderEvent));
+            desc->complete();
+            arguments->structureOutputDescriptorSize = count * sizeof(RecorderEvent);
         }
     }
-    return IOUserClient::externalMethod(selector, arguments, dispatch, target, reference);
+    else {
+        memcpy(arguments->structureOutput, events, count * sizeof(RecorderEvent));
+        arguments->structureOutputSize = count * sizeof(RecorderEvent);
+    }
+
+    IOFree(events, kRecorderCapacity * sizeof(RecorderEvent));
+
+    arguments->scalarOutput[0] = count;
+    return ret;
 }
 
-IOReturn IOElectrifyUserClient::togglePowerHook(IOElectrify* target, void* reference, IOExternalMethodArguments* arguments)
+IOReturn IOElectrifyUserClient::copyStartupProfile(IOElectrify* target, StartupProfileRecord* out)
 {
-    target->mPowerHook = (UInt32)arguments->scalarInput[0];
-    OSNumber *osNum;
-    osNum = OSNumber::withNumber (target->mPowerHook, sizeof (UInt32) * 8);
-    target->setProperty(kIOElectrifyPowerHookKey, osNum);
-    osNum->release();
+    target->copyStartupProfile(out);
+    return kIOReturnSuccess;
+}
+
+IOReturn IOElectrifyUserClient::copyResidency(IOElectrify* target, PowerResidencyRecord* out)
+{
+    target->copyResidency(out);
     return kIOReturnSuccess;
 }
 
-IOReturn IOElectrifyUserClient::executeTBFP(IOElectrify* target, void* reference, IOExternalMethodArguments* arguments)
+IOReturn IOElectrifyUserClient::resetResidency(IOElectrify* target)
 {
-    arguments->scalarOutput[0] = target->TBFP((UInt32)arguments->scalarInput[0]);
+    target->resetResidency();
     return kIOReturnSuccess;
 }
+
+IOReturn IOElectrifyUserClient::runCommand(OSObject* target, UInt32 opcode, UInt64 arg, UInt64* result)
+{
+    IOElectrify* provider = (IOElectrify*)target;
+    const uint64_t in[1] = { arg };
+    uint64_t out[1] = { 0 };
+    UInt64 start = getUptimeNanoseconds();
+    UInt32 selector;
+    IOReturn ret;
+
+    // same paths as the scalar selectors
+    switch (opcode) {
+        case kCommandForcePower:
+            selector = kClientExecuteTBFP;
+            ret = executeTBFP(provider, in, out);
+            break;
+        case kCommandPowerHook:
+            selector = kClientTogglePowerHook;
+            ret = togglePowerHook(provider, in, out);
+            break;
+        default:
+            return kIOReturnUnsupported;
+    }
+
+    // counted and recorded as a call to the selector it stands for
+    accountDispatch(sMethods, provider->mClientCounters, kClientNumMethods, kEventSourceController, kRecorderQueueName,
+                    selector, in, 1, ret, start, getUptimeNanoseconds() - start);
+
+    *result = out[0];
+    return ret;
+}
+
+IOReturn IOElectrifyUserClient::ringDoorbell(IOElectrifyUserClient* client, uint64_t (&out)[1])
+{
+    UInt32 processed;
+    IOReturn ret = client->mCommands.drain(client->providertarget, runCommand, &processed);
+
+    out[0] = processed;
+    return ret;
+}
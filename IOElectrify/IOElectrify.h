@@ -22,17 +22,47 @@
 
 #include <IOKit/IOService.h>
 #include <IOKit/pci/IOPCIDevice.h>
+#include <IOKit/IOWorkLoop.h>
+#include <IOKit/IOCommandGate.h>
+#include <IOKit/IOTimerEventSource.h>
+#include <kern/thread_call.h>
 
 #include "common.h"
 #include "WMI.h"
+#include "Profiles.h"
+#include "StartupProfile.h"
+#include "UserClientDispatch.h"
+#include "CommandQueue.h"
+#include "PowerResidency.h"
 
-#define INTEL_WMI_THUNDERBOLT_GUID "86ccfd48-205e-4a77-9c48-2021cbede341"
+// IOElectrifyPowerHook bits
+#define kPowerHookSleep         0x1     // force-power off on sleep
+#define kPowerHookWake          0x2     // force-power on on wake
+#define kPowerHookPresenceAware 0x4     // defer wake work when nothing was attached at sleep
+#define kPowerHookDarkWake      0x8     // defer wake work during dark (Doze) wakes
+#define kPowerHookMask          0xf
+
+// Upper bound we give PM for an asynchronous force-power transition
+#define kPowerAckTimeoutUS      (10 * 1000 * 1000)
+
+// Time budget for one force-power request, failed ACPI calls are retried with backoff within it
+#define kDefaultACPIBudgetMS    2000
+#define kMaxACPIBudgetMS        (kPowerAckTimeoutUS / 1000)     // PM stops waiting after that
+#define kACPIRetryBackoffMS     10
+
+// Longest idle timeout, in seconds, the timer takes it in ms as a UInt32
+#define kMaxIdleTimeoutS        (24 * 60 * 60)
 
 // External client methods
 enum
 {
     kClientExecuteTBFP = 0,
     kClientTogglePowerHook,
+    kClientCopyEventLog,
+    kClientCopyStartupProfile,
+    kClientRingDoorbell,
+    kClientCopyResidency,
+    kClientResetResidency,
     kClientNumMethods
 };
 
@@ -44,19 +74,101 @@ class IOElectrify : public IOService
 protected:
     IOPCIDevice* mProvider;
     WMI* mWMI;
+    const ForcePowerProfile* mProfile = NULL;
+
+    // Runtime idle gating
+    IOWorkLoop* mWorkLoop = NULL;
+    IOCommandGate* mCommandGate = NULL;
+    IOTimerEventSource* mIdleTimer = NULL;
+    UInt32 mIdleTimeout = 0;        // seconds, 0 disables idle gating
+    bool mForcePowered = false;
+    bool mAwake = false;
+    bool mIdleGated = false;
+    UInt32 mIdleGateCount = 0;
+    UInt32 mIdleResumeCount = 0;
+    UInt64 mLastResumeTime = 0;
+    UInt64 mMaxResumeTime = 0;
+
+    static void idleTimerFired(OSObject* owner, IOTimerEventSource* sender);
+    IOReturn noteActivityGated(bool* resumed);
+    IOReturn noteResumeGated(UInt64* elapsed);
+    IOReturn setAwakeGated(bool awake);
+    void publishIdleStats();
+    void releaseWorkLoop();
+
+    // Force-power on PM transitions runs on its own thread so that several
+    // controllers are powered concurrently, PM is acknowledged when done
+    thread_call_t mPowerCall = NULL;
+    UInt64 mLastTBFPTime[2] = { 0, 0 };     // indexed by ON
+    UInt64 mMaxTBFPTime[2] = { 0, 0 };
+
+    IOReturn forcePowerAsync(UInt32 ON);
+    IOReturn forcePowerGated(UInt32 ON, UInt32 source);
+    IOReturn verifyForcePower(UInt32 ON);
+    IOReturn setPowerHookGated(UInt32 hook);
+    static void powerCallMain(thread_call_param_t param0, thread_call_param_t param1);
+    void publishPowerTiming();
+    IOReturn publishPowerTimingGated();
+
+    // Deadline-bounded ACPI execution
+    UInt32 mACPIBudget = kDefaultACPIBudgetMS;     // ms
+    UInt32 mTBFPRetries = 0;
+    UInt32 mTBFPFailures = 0;
+    UInt32 mTBFPOverruns = 0;
+    IOReturn mLastTBFPStatus = kIOReturnSuccess;
+    bool mForcePowerBusy = false;   // a call is in progress, possibly backing off with the gate open
+
+    void sleepGateOpen(UInt32 ms);
+
+    // Dark wakes leave force-power off, a full wake promotes them
+    UInt32 mPowerState = 0;
+    bool mDarkWake = false;         // force-power was left off for the current dark wake
+    UInt32 mDarkWakes = 0;
+    UInt32 mDarkWakePromotions = 0;
+
+    IOReturn powerChangeGated(UInt32 state, UInt32 previous, IOReturn* result);
+
+    // Settings read from the personality and changed live through setProperties
+    struct Config
+    {
+        UInt32 powerHook;
+        UInt32 idleTimeout;
+        UInt32 acpiBudget;
+    };
+
+    static IOReturn readConfig(OSDictionary* dict, Config* config, bool strict);
+    IOReturn applyConfigGated(Config* config);
+
+    StartupProfile mStartup;
+
+    // Force-power residency and transition cost, only touched with the command gate held
+    PowerResidency mResidency;
+    IOReturn copyResidencyGated(PowerResidencyRecord* record);
+    IOReturn resetResidencyGated();
 public:
     virtual bool init(OSDictionary *propTable);
     virtual bool attach(IOService *provider);
     virtual bool start(IOService *provider);
     virtual void stop(IOService *provider);
     virtual void free();
-	UInt32 TBFP(UInt32 ON);
+	IOReturn TBFP(UInt32 ON, UInt32 source);
+    void setPowerHook(UInt32 hook);
+    void noteActivity();
+    void copyStartupProfile(StartupProfileRecord* record) const { mStartup.copy(record); }
+    void copyResidency(PowerResidencyRecord* record);
+    void resetResidency();
 	UInt32 mPowerHook = 0x0;
+    DispatchCounters mClientCounters[kClientNumMethods] = {};
 #ifdef DEBUG
     virtual void detach(IOService *provider);
 #endif
     
     virtual IOReturn setPowerState(unsigned long powerState, IOService *service);
+    virtual IOReturn message(UInt32 type, IOService *provider, void *argument = 0);
+    virtual IOReturn setProperties(OSObject* properties);
+    virtual bool serializeProperties(OSSerialize* serialize) const;
+    virtual IOReturn configureReport(IOReportChannelList* channels, IOReportConfigureAction action, void* result, void* destination);
+    virtual IOReturn updateReport(IOReportChannelList* channels, IOReportUpdateAction action, void* result, void* destination);
 };
 
 class IOElectrifyUserClient : public IOUserClient
@@ -66,16 +178,26 @@ private:
     IOElectrify* providertarget;
     task_t mTask;
     SInt32 mOpenCount;
-    static const IOExternalMethodDispatch sMethods[kClientNumMethods];
+    CommandRing mCommands;
+    static const DispatchMethod sMethods[kClientNumMethods];
+    static IOReturn runCommand(OSObject* target, UInt32 opcode, UInt64 arg, UInt64* result);
 public:
     virtual bool start(IOService* provider);
     virtual void stop(IOService* provider);
     virtual bool initWithTask(task_t owningTask, void * securityID, UInt32 type, OSDictionary* properties);
+    virtual void free();
     virtual IOReturn clientClose(void);
+    static void publishCounters(IOElectrify* provider);
+    virtual IOReturn clientMemoryForType(UInt32 type, IOOptionBits* options, IOMemoryDescriptor** memory);
     virtual IOReturn externalMethod(uint32_t selector, IOExternalMethodArguments *arguments, IOExternalMethodDispatch* dispatch = 0,
                                     OSObject* target = 0, void* reference = 0);
-    static IOReturn togglePowerHook(IOElectrify* target, void* reference, IOExternalMethodArguments* arguments);
-    static IOReturn executeTBFP(IOElectrify* target, void* reference, IOExternalMethodArguments* arguments);
+    static IOReturn togglePowerHook(IOElectrify* target, const uint64_t (&in)[1], uint64_t (&out)[1]);
+    static IOReturn executeTBFP(IOElectrify* target, const uint64_t (&in)[1], uint64_t (&out)[1]);
+    static IOReturn copyEventLog(IOElectrify* target, IOExternalMethodArguments* arguments);
+    static IOReturn copyStartupProfile(IOElectrify* target, StartupProfileRecord* out);
+    static IOReturn copyResidency(IOElectrify* target, PowerResidencyRecord* out);
+    static IOReturn resetResidency(IOElectrify* target);
+    static IOReturn ringDoorbell(IOElectrifyUserClient* client, uint64_t (&out)[1]);
 };
 
 #endif
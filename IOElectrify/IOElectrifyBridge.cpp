@@ -20,12 +20,53 @@
 #include <IOKit/IOLib.h>
 #include <IOKit/IOUserClient.h>
 #include "IOElectrifyBridge.h"
+#include "WakeTrace.h"
+#include "Policy.h"
+#include "Recorder.h"
 
 #include <libkern/version.h>
 extern kmod_info_t kmod_info;
 
 #define kIOElectrifyBridgePowerHookKey "IOElectrifyBridgePowerHook"
 #define kMatchParentNameKey "MatchParentName"
+#define kIOElectrifyBridgeProbeTimingKey "RescanTiming"
+#define kIOElectrifyBridgeProfileKey "Profile"
+#define kIOElectrifyBridgeClientStatsKey "UserClientStats"
+#define kIOElectrifyBridgeCommandQueueKey "CommandQueueStats"
+#define kIOElectrifyBridgeQuiesceTimeoutKey "IOElectrifyBridgeQuiesceTimeout"
+#define kIOElectrifyBridgeSleepTimingKey "SleepTiming"
+#define kIOElectrifyBridgeRescanWindowKey "IOElectrifyBridgeRescanWindow"
+
+// Upper bound we give PM for an asynchronous rescan
+#define kProbeAckTimeoutUS (10 * 1000 * 1000)
+
+// Longest a wake rescan waits for the controllers to force-power
+#define kForcePowerWaitMS 5000
+
+// Header type of a PCI-to-PCI bridge, without the multi-function bit
+#define kPCIHeaderTypeBridge 0x01
+
+// One pending requestProbe, lives on the stack of the request that opened it
+struct IOElectrifyBridge::RescanBatch
+{
+    UInt32 seq;
+    UInt32 options;             // merged option bits
+    bool eject;
+    bool closed;                // no longer takes requests
+    bool done;                  // issued, result is valid
+    UInt32 waiters;             // merged requests still to pick up the result
+    UInt32 result;
+};
+
+// Devices terminated before an eject, their termination notifications tick them off
+struct IOElectrifyBridge::QuiesceState
+{
+    IOLock* lock;
+    OSArray* children;
+    UInt64* done;               // ns after start, 0 while still terminating
+    UInt64 start;
+    UInt32 pending;
+};
 
 // define & enumerate power states
 enum
@@ -36,22 +77,32 @@ enum
     kPowerStateCount
 };
 
+// Define usable power states
+static IOPMPowerState powerStateArray[ kPowerStateCount ] =
+{
+    { 1,0,0,0,0,0,0,0,0,0,0,0 },
+    { 1,kIOPMDeviceUsable, kIOPMDoze, kIOPMDoze, 0,0,0,0,0,0,0,0 },
+    { 1,kIOPMDeviceUsable, IOPMPowerOn, IOPMPowerOn, 0,0,0,0,0,0,0,0 }
+};
+
 OSDefineMetaClassAndStructors(IOElectrifyBridge, IOService);
 
 bool IOElectrifyBridge::init(OSDictionary *propTable)
 {
     DebugLog("IOElectrifyBridge::init() %p\n", this);
 
-	OSBoolean *osBool;
-	osBool = OSDynamicCast(OSBoolean, propTable->getObject(kIOElectrifyBridgePowerHookKey));
-	if (osBool)
-		mEnablePowerHook = (bool)osBool->getValue();
-	else
-		mEnablePowerHook = false;
-	
-	OSString *osStr;
-	osStr = OSDynamicCast(OSString, propTable->getObject(kMatchParentNameKey));
-	strncpy(parentName, osStr->getCStringNoCopy(), osStr->getLength());
+    mStartup.begin(kStartupPhaseInit);
+    mStartup.begin(kStartupPhasePlist);
+
+	// missing or malformed keys keep their defaults
+	Config config = { false, mQuiesceTimeout, mRescanWindow, NULL };
+	readConfig(propTable, &config, false);
+	mEnablePowerHook = config.powerHook;
+	mQuiesceTimeout = config.quiesceTimeout;
+	mRescanWindow = config.rescanWindow;
+	mParentNames = config.parentNames;
+
+    mStartup.end(kStartupPhasePlist);
 	
     // announce version
     IOLog("IOElectrifyBridge: Version %s starting on OS X Darwin %d.%d.\n", kmod_info.version, version_major, version_minor);
@@ -64,6 +115,7 @@ bool IOElectrifyBridge::init(OSDictionary *propTable)
     }
 	
     // place version/build info in ioreg properties DV,Build and DV,Version
+    mStartup.begin(kStartupPhaseVersion);
     char buf[128];
     snprintf(buf, sizeof(buf), "%s %s", kmod_info.name, kmod_info.version);
     setProperty("DV,Version", buf);
@@ -72,47 +124,505 @@ bool IOElectrifyBridge::init(OSDictionary *propTable)
 #else
     setProperty("DV,Build", "Release-darkvoid");// LOGNAME);
 #endif
+    mStartup.end(kStartupPhaseVersion);
     
     mProvider = NULL;
+
+    mStartup.end(kStartupPhaseInit);
     
     return true;
 }
 
+// Strict parsing rejects unknown keys, wrong types and empty or non-string
+// names, otherwise those are skipped and the config keeps what it had
+IOReturn IOElectrifyBridge::readConfig(OSDictionary* dict, Config* config, bool strict)
+{
+    Config parsed = *config;
+    unsigned int known = 0;
+    OSObject* osObj;
+    OSNumber* osNum;
+
+    if (dict == NULL)
+        return kIOReturnBadArgument;
+
+    if ((osObj = dict->getObject(kIOElectrifyBridgePowerHookKey)) != NULL) {
+        known++;
+        OSBoolean* osBool = OSDynamicCast(OSBoolean, osObj);
+        if (osBool)
+            parsed.powerHook = osBool->getValue();
+        else if (strict)
+            return kIOReturnBadArgument;
+    }
+
+    if ((osObj = dict->getObject(kIOElectrifyBridgeQuiesceTimeoutKey)) != NULL) {
+        known++;
+        osNum = OSDynamicCast(OSNumber, osObj);
+        if (osNum)
+            parsed.quiesceTimeout = osNum->unsigned32BitValue();
+        else if (strict)
+            return kIOReturnBadArgument;
+    }
+
+    if ((osObj = dict->getObject(kIOElectrifyBridgeRescanWindowKey)) != NULL) {
+        known++;
+        osNum = OSDynamicCast(OSNumber, osObj);
+        if (osNum)
+            parsed.rescanWindow = osNum->unsigned32BitValue();
+        else if (strict)
+            return kIOReturnBadArgument;
+    }
+
+    // MatchParentName is either a single name or an array of names, one per controller
+    parsed.parentNames = NULL;
+    if ((osObj = dict->getObject(kMatchParentNameKey)) != NULL) {
+        known++;
+        if (OSArray *osArray = OSDynamicCast(OSArray, osObj)) {
+            bool valid = osArray->getCount() > 0;
+
+            for (unsigned int i = 0; valid && i < osArray->getCount(); i++)
+                valid = OSDynamicCast(OSString, osArray->getObject(i)) != NULL;
+
+            if (valid) {
+                parsed.parentNames = OSArray::withCapacity(osArray->getCount());
+                if (parsed.parentNames)
+                    parsed.parentNames->merge(osArray);
+            }
+        }
+        else if (OSString *osStr = OSDynamicCast(OSString, osObj)) {
+            parsed.parentNames = OSArray::withCapacity(1);
+            if (parsed.parentNames)
+                parsed.parentNames->setObject(osStr);
+        }
+
+        if (parsed.parentNames == NULL && strict)
+            return kIOReturnBadArgument;
+    }
+
+    if (strict && known != dict->getCount()) {
+        OSSafeReleaseNULL(parsed.parentNames);
+        return kIOReturnUnsupported;
+    }
+
+    // without a new list the current one is kept
+    if (parsed.parentNames == NULL && config->parentNames != NULL) {
+        parsed.parentNames = config->parentNames;
+        parsed.parentNames->retain();
+    }
+
+    *config = parsed;
+    return kIOReturnSuccess;
+}
+
+bool IOElectrifyBridge::serializeProperties(OSSerialize* serialize) const
+{
+    IOElectrifyBridgeUserClient::publishCounters(const_cast<IOElectrifyBridge*>(this));
+    WakeTrace::publish(const_cast<IOElectrifyBridge*>(this));
+
+    return super::serializeProperties(serialize);
+}
+
+// Live reconfiguration, e.g. through IORegistryEntrySetCFProperties. Every key
+// is validated before anything changes, then all are applied at once between probes
+IOReturn IOElectrifyBridge::setProperties(OSObject* properties)
+{
+    OSDictionary* dict = OSDynamicCast(OSDictionary, properties);
+
+    if (dict == NULL)
+        return kIOReturnBadArgument;
+
+    IOReturn ret = IOUserClient::clientHasPrivilege(current_task(), kIOClientPrivilegeAdministrator);
+    if (ret != kIOReturnSuccess)
+        return ret;
+
+    if (mProbeLock == NULL || mProvider == NULL)
+        return kIOReturnNotReady;
+
+    IOLockLock(mProbeLock);
+
+    Config config = { mEnablePowerHook, mQuiesceTimeout, mRescanWindow, mParentNames };
+    ret = readConfig(dict, &config, true);
+    if (ret != kIOReturnSuccess) {
+        IOLockUnlock(mProbeLock);
+        return ret;
+    }
+
+    DebugLog("config hook %d quiesce %u ms window %u ms\n", config.powerHook, config.quiesceTimeout, config.rescanWindow);
+
+    mEnablePowerHook = config.powerHook;
+    mQuiesceTimeout = config.quiesceTimeout;
+    OSSafeReleaseNULL(mParentNames);
+    mParentNames = config.parentNames;
+
+    setProperty(kIOElectrifyBridgePowerHookKey, mEnablePowerHook);
+    setProperty(kIOElectrifyBridgeQuiesceTimeoutKey, mQuiesceTimeout, 32);
+    setProperty(kIOElectrifyBridgeRescanWindowKey, config.rescanWindow, 32);
+
+    // probeDev reads the window under the rescan lock, an open batch keeps
+    // the deadline it was opened with
+    IOLockLock(mRescanLock);
+    mRescanWindow = config.rescanWindow;
+    IOLockUnlock(mRescanLock);
+    if (mParentNames != NULL)
+        setProperty(kMatchParentNameKey, mParentNames);
+
+    // an explicit list that no longer names our bridge hands it back
+    bool matches = mParentNames == NULL || matchParentName(mProvider->getProvider()->getName());
+
+    IOLockUnlock(mProbeLock);
+
+    if (!matches) {
+        AlwaysLog("%s no longer matches %s, stopping\n", mProvider->getProvider()->getName(), kMatchParentNameKey);
+        terminate();
+    }
+
+    return kIOReturnSuccess;
+}
+
 bool IOElectrifyBridge::attach(IOService* provider)
 {
     DebugLog("IOElectrifyBridge::attach() %s\n", provider->getName());
+
+    mStartup.begin(kStartupPhaseAttach);
     
     mProvider = OSDynamicCast(IOPCI2PCIBridge, provider);
     
     if (mProvider == NULL) {
+        mStartup.end(kStartupPhaseAttach);
         return false;
     }
 
     DebugLog("Provider -> Provider %s\n", mProvider->getProvider()->getName());
 
-    if (strcmp(mProvider->getProvider()->getName(), parentName)) {
-        DebugLog("Mismatch %s vs %s\n", mProvider->getProvider()->getName(), parentName);
+    // an explicit MatchParentName wins, otherwise look the bridge up in the profile table
+    if (mParentNames != NULL) {
+        if (!matchParentName(mProvider->getProvider()->getName())) {
+            DebugLog("Mismatch %s\n", mProvider->getProvider()->getName());
+            mProvider = NULL;
+            mStartup.end(kStartupPhaseAttach);
+            return false;
+        }
+    }
+    else {
+        const BridgeProfile* profile = matchProfile(mProvider->getProvider());
+
+        if (profile == NULL) {
+            DebugLog("No profile for %s\n", mProvider->getProvider()->getName());
+            mProvider = NULL;
+            mStartup.end(kStartupPhaseAttach);
+            return false;
+        }
+
+        setProperty(kIOElectrifyBridgeProfileKey, profile->name);
+    }
+
+    bool ret = super::attach(provider);
+    mStartup.end(kStartupPhaseAttach);
+
+    return ret;
+}
+
+const BridgeProfile* IOElectrifyBridge::matchProfile(IOService* device)
+{
+    IOPCIDevice* pciDevice = OSDynamicCast(IOPCIDevice, device);
+
+    if (pciDevice == NULL)
+        return NULL;
+
+    UInt16 vendor = pciDevice->configRead16(kIOPCIConfigVendorID);
+    UInt16 deviceId = pciDevice->configRead16(kIOPCIConfigDeviceID);
+    const char* name = pciDevice->getName();
+    const char* location = pciDevice->getLocation();
+
+    for (unsigned int i = 0; i < kBridgeProfileCount; i++) {
+        const BridgeProfile* profile = &kBridgeProfiles[i];
+
+        if (profile->vendor && profile->vendor != vendor)
+            continue;
+        if (profile->device && profile->device != deviceId)
+            continue;
+        if (profile->parentName && (name == NULL || strcmp(profile->parentName, name)))
+            continue;
+        if (profile->location && (location == NULL || strcmp(profile->location, location)))
+            continue;
+
+        return profile;
+    }
+
+    return NULL;
+}
+
+bool IOElectrifyBridge::matchParentName(const char* name)
+{
+    if (mParentNames == NULL || name == NULL)
         return false;
+
+    for (unsigned int i = 0; i < mParentNames->getCount(); i++) {
+        OSString* osStr = OSDynamicCast(OSString, mParentNames->getObject(i));
+
+        if (osStr && osStr->isEqualTo(name))
+            return true;
     }
 
-    return super::attach(provider);
+    return false;
 }
 
 bool IOElectrifyBridge::start(IOService *provider)
 {
     DebugLog("IOElectrifyBridge::start() %s\n", provider->getName());
+
+    mStartup.begin(kStartupPhaseStart);
     
     if (!super::start(provider))
     {
         AlwaysLog("super::start returned false\n");
         return false;
     }
+
+    mProbeCall = thread_call_allocate(&IOElectrifyBridge::probeCallMain, this);
+    mProbeLock = IOLockAlloc();
+    mRescanLock = IOLockAlloc();
+    if (mProbeCall == NULL || mProbeLock == NULL || mRescanLock == NULL) {
+        AlwaysLog("failed to allocate probe thread call\n");
+        if (mProbeCall != NULL) {
+            thread_call_free(mProbeCall);
+            mProbeCall = NULL;
+        }
+        super::stop(provider);
+        return false;
+    }
+
+    Policy::registerBridge(this);
+
+    // watch for devices appearing behind the bridge to timestamp wakes
+    OSDictionary* matching = serviceMatching("IOPCIDevice");
+    if (matching) {
+        mPublishNotifier = addMatchingNotification(gIOPublishNotification, matching, &IOElectrifyBridge::childPublished, this);
+        matching->release();
+    }
+
+    mStartup.begin(kStartupPhaseProbe);
     probeDev(0);
+    mStartup.end(kStartupPhaseProbe);
+
+    // init power state management so PM delivers sleep/wake to us
+    mStartup.begin(kStartupPhasePM);
+    PMinit();
+    mPowerState = kPowerStateNormal;
+    registerPowerDriver(this, powerStateArray, kPowerStateCount);
+    provider->joinPMtree(this);
+    mStartup.end(kStartupPhasePM);
+
+    mStartup.end(kStartupPhaseStart);
+    mStartup.publish(this);
     
     return true;
 }
 
+bool IOElectrifyBridge::isChildDevice(IOService* service)
+{
+    for (IOService* parent = service->getProvider(); parent != NULL; parent = parent->getProvider()) {
+        if (parent == mProvider)
+            return true;
+    }
+
+    return false;
+}
+
+// Appends the PCI devices one level below service, either its own IOPCIDevice
+// children or those of the PCI bridge driver attached to it
+static void appendPCIChildren(IOService* service, OSArray* devices)
+{
+    OSIterator* iterator = service->getChildIterator(gIOServicePlane);
+
+    if (iterator == NULL)
+        return;
+
+    while (OSObject* child = iterator->getNextObject()) {
+        if (OSDynamicCast(IOPCIDevice, child))
+            devices->setObject(child);
+        else if (IOPCIBridge* bridge = OSDynamicCast(IOPCIBridge, child))
+            appendPCIChildren(bridge, devices);
+    }
+    iterator->release();
+}
+
+static bool isPCIBridge(IOPCIDevice* device)
+{
+    return (device->configRead8(kIOPCIConfigHeaderType) & 0x7f) == kPCIHeaderTypeBridge;
+}
+
+// The Thunderbolt controller takes the first two levels below the root port,
+// its upstream port and the downstream ports behind it. Returns what sits
+// behind the downstream ports.
+OSArray* IOElectrifyBridge::copyDownstreamDevices()
+{
+    OSArray* level = OSArray::withCapacity(1);
+
+    if (level == NULL)
+        return NULL;
+
+    appendPCIChildren(mProvider, level);
+    for (int depth = 0; depth < 2 && level->getCount() > 0; depth++) {
+        OSArray* next = OSArray::withCapacity(4);
+
+        if (next == NULL) {
+            level->release();
+            return NULL;
+        }
+
+        for (unsigned int i = 0; i < level->getCount(); i++)
+            appendPCIChildren(OSDynamicCast(IOService, level->getObject(i)), next);
+
+        level->release();
+        level = next;
+    }
+
+    return level;
+}
+
+// Number of Thunderbolt devices attached to the controller. Behind a downstream
+// port sits either one of the controller's own functions (NHI, xHCI), which
+// are endpoints and show up whenever force-power is on, or the upstream port
+// of the attached device's own switch, which is a bridge.
+UInt32 IOElectrifyBridge::countAttachedDevices()
+{
+    UInt32 count = 0;
+    OSArray* devices = copyDownstreamDevices();
+
+    if (devices == NULL)
+        return 0;
+
+    for (unsigned int i = 0; i < devices->getCount(); i++) {
+        IOPCIDevice* device = OSDynamicCast(IOPCIDevice, devices->getObject(i));
+
+        if (device != NULL && isPCIBridge(device))
+            count++;
+    }
+    devices->release();
+
+    return count;
+}
+
+// Appends the endpoints in the PCI tree below device, or device itself when it is one
+static void appendEndpoints(IOPCIDevice* device, OSArray* endpoints)
+{
+    if (!isPCIBridge(device)) {
+        endpoints->setObject(device);
+        return;
+    }
+
+    OSArray* children = OSArray::withCapacity(4);
+
+    if (children == NULL)
+        return;
+
+    appendPCIChildren(device, children);
+    for (unsigned int i = 0; i < children->getCount(); i++) {
+        IOPCIDevice* child = OSDynamicCast(IOPCIDevice, children->getObject(i));
+
+        if (child != NULL)
+            appendEndpoints(child, endpoints);
+    }
+    children->release();
+}
+
+bool IOElectrifyBridge::childPublished(void* target, void* refCon, IOService* newService, IONotifier* notifier)
+{
+    IOElectrifyBridge* self = (IOElectrifyBridge*)target;
+
+    if (self->mProvider && self->isChildDevice(newService)) {
+        DebugLog("child published %s\n", newService->getName());
+        WakeTrace::childPublished();
+        WakeTrace::publish(self);
+        Policy::noteActivity();
+    }
+
+    return true;
+}
+
 UInt32 IOElectrifyBridge::probeDev(UInt32 options)
+{
+    if (mRescanLock == NULL)
+        return issueProbe(options);
+
+    bool eject = (options & kIOPCIProbeOptionEject) != 0;
+    UInt32 result;
+
+    // one snapshot, setProperties may change the window meanwhile
+    IOLockLock(mRescanLock);
+    UInt32 window = mRescanWindow;
+
+    if (window == 0) {
+        IOLockUnlock(mRescanLock);
+        return issueProbe(options);
+    }
+
+    mRescanRequests++;
+
+    RescanBatch* open = mOpenBatch;
+    if (open != NULL && open->eject == eject) {
+        // ride along, whoever opened the batch issues it for everyone
+        open->options |= options;
+        open->waiters++;
+        mRescanMerged++;
+
+        while (!open->done)
+            IOLockSleep(mRescanLock, open, THREAD_UNINT);
+
+        result = open->result;
+        if (--open->waiters == 0)
+            IOLockWakeup(mRescanLock, &open->waiters, false);
+
+        IOLockUnlock(mRescanLock);
+        return result;
+    }
+
+    // the other kind is pending, close it so it goes first
+    if (open != NULL) {
+        open->closed = true;
+        IOLockWakeup(mRescanLock, open, false);
+    }
+
+    RescanBatch batch = { ++mRescanSeq, options, eject, false, false, 0, 0 };
+    AbsoluteTime deadline;
+
+    mOpenBatch = &batch;
+    clock_interval_to_deadline(window, kMillisecondScale, &deadline);
+    while (!batch.closed) {
+        if (IOLockSleepDeadline(mRescanLock, &batch, deadline, THREAD_UNINT) == THREAD_TIMED_OUT)
+            break;
+    }
+
+    batch.closed = true;
+    if (mOpenBatch == &batch)
+        mOpenBatch = NULL;
+
+    while (mRescanDoneSeq + 1 != batch.seq)
+        IOLockSleep(mRescanLock, &mRescanDoneSeq, THREAD_UNINT);
+
+    // closed, nothing is merged into it anymore
+    options = batch.options;
+    IOLockUnlock(mRescanLock);
+
+    result = issueProbe(options);
+
+    IOLockLock(mRescanLock);
+    mRescanDoneSeq = batch.seq;
+    IOLockWakeup(mRescanLock, &mRescanDoneSeq, false);
+
+    batch.result = result;
+    batch.done = true;
+    IOLockWakeup(mRescanLock, &batch, false);
+    while (batch.waiters != 0)
+        IOLockSleep(mRescanLock, &batch.waiters, THREAD_UNINT);
+    IOLockUnlock(mRescanLock);
+
+    publishProbeTiming();
+
+    return result;
+}
+
+UInt32 IOElectrifyBridge::issueProbe(UInt32 options)
 {
     //SInt32 score = 0;
     //mProvider->probe(mProvider, &score);
@@ -120,12 +630,314 @@ UInt32 IOElectrifyBridge::probeDev(UInt32 options)
     
     //IOOptionBits options = 0;
 	DebugLog("probeDev options: 0x%lx\n", options);
-    return mProvider->requestProbe(options);
+
+    if (mProbeLock != NULL)
+        IOLockLock(mProbeLock);
+
+    UInt64 start = getUptimeNanoseconds();
+    UInt32 result = mProvider->requestProbe(options);
+    UInt64 elapsed = getUptimeNanoseconds() - start;
+
+    Recorder::record(kEventProbe, kEventSourceBridge, NULL, &options, 1, result, start, elapsed);
+    int kind = (options & kIOPCIProbeOptionEject) ? 0 : 1;
+
+    mLastProbeTime[kind] = elapsed;
+    if (elapsed > mMaxProbeTime[kind])
+        mMaxProbeTime[kind] = elapsed;
+
+    if (mProbeLock != NULL)
+        IOLockUnlock(mProbeLock);
+
+    return result;
+}
+
+IOReturn IOElectrifyBridge::probeDevAsync(UInt32 options)
+{
+    retain();
+    if (thread_call_enter1(mProbeCall, (thread_call_param_t)(uintptr_t)options)) {
+        // already queued, the pending call acknowledges for us
+        release();
+    }
+
+    return kProbeAckTimeoutUS;
+}
+
+void IOElectrifyBridge::probeCallMain(thread_call_param_t param0, thread_call_param_t param1)
+{
+    IOElectrifyBridge* self = (IOElectrifyBridge*)param0;
+    UInt32 options = (UInt32)(uintptr_t)param1;
+
+    if (options & kIOPCIProbeOptionEject) {
+        UInt64 start = getUptimeNanoseconds();
+
+        self->quiesceChildren();
+        self->probeDev(options);
+        self->mLastSleepTime = getUptimeNanoseconds() - start;
+        self->publishSleepTiming();
+    }
+    else {
+        // nothing to find behind the bridge until the controllers are powered
+        if (!Policy::waitForcePower(kForcePowerWaitMS))
+            AlwaysLog("force-power not done after %u ms, rescanning anyway\n", kForcePowerWaitMS);
+        WakeTrace::mark(kWakeStageProbeRequested);
+        self->probeDev(options);
+    }
+
+    WakeTrace::publish(self);
+    self->publishProbeTiming();
+
+    self->acknowledgeSetPowerState();
+    self->release();
+}
+
+// Terminate every device behind the bridge at once and wait for all of them
+// with a shared deadline, so the eject doesn't stop their drivers one by one
+bool IOElectrifyBridge::childTerminated(void* target, void* refCon, IOService* newService, IONotifier* notifier)
+{
+    QuiesceState* state = (QuiesceState*)refCon;
+    UInt64 now = getUptimeNanoseconds();
+
+    IOLockLock(state->lock);
+    for (unsigned int i = 0; i < state->children->getCount(); i++) {
+        if (state->children->getObject(i) == newService && state->done[i] == 0) {
+            state->done[i] = now > state->start ? now - state->start : 1;
+            if (--state->pending == 0)
+                IOLockWakeup(state->lock, state, false);
+            break;
+        }
+    }
+    IOLockUnlock(state->lock);
+
+    return true;
+}
+
+void IOElectrifyBridge::quiesceChildren()
+{
+    OSSafeReleaseNULL(mQuiesceResults);
+    mLastQuiesceTime = 0;
+
+    if (mQuiesceTimeout == 0)
+        return;
+
+    // only what hangs off an attached device's switch, the bridges that
+    // countAttachedDevices counts. The controller's own NHI and xHCI
+    // functions sit right behind its ports and go with the eject.
+    OSArray* children = OSArray::withCapacity(4);
+    OSArray* downstream = copyDownstreamDevices();
+
+    if (children == NULL || downstream == NULL) {
+        OSSafeReleaseNULL(children);
+        OSSafeReleaseNULL(downstream);
+        return;
+    }
+
+    for (unsigned int i = 0; i < downstream->getCount(); i++) {
+        IOPCIDevice* device = OSDynamicCast(IOPCIDevice, downstream->getObject(i));
+
+        if (device != NULL && !device->isInactive() && isPCIBridge(device))
+            appendEndpoints(device, children);
+    }
+    downstream->release();
+
+    QuiesceState state;
+    UInt32 count = children->getCount();
+    IONotifier* notifier = NULL;
+
+    // state lives on our stack, the notifier gets it as refCon. That is safe
+    // because notifier->remove() below returns only once no handler runs.
+    state.children = children;
+    state.pending = count;
+    state.lock = IOLockAlloc();
+    state.done = count ? (UInt64*)IOMalloc(count * sizeof(UInt64)) : NULL;
+
+    if (state.lock != NULL && state.done != NULL) {
+        OSDictionary* matching = serviceMatching("IOPCIDevice");
+
+        if (matching != NULL) {
+            notifier = addMatchingNotification(gIOTerminatedNotification, matching, &IOElectrifyBridge::childTerminated,
+                                               this, &state);
+            matching->release();
+        }
+    }
+
+    if (notifier == NULL) {
+        if (state.done != NULL)
+            IOFree(state.done, count * sizeof(UInt64));
+        if (state.lock != NULL)
+            IOLockFree(state.lock);
+        children->release();
+        return;
+    }
+
+    AbsoluteTime deadline;
+
+    bzero(state.done, count * sizeof(UInt64));
+    state.start = getUptimeNanoseconds();
+    clock_interval_to_deadline(mQuiesceTimeout, kMillisecondScale, &deadline);
+
+    for (UInt32 i = 0; i < count; i++)
+        ((IOService*)children->getObject(i))->terminate();
+
+    IOLockLock(state.lock);
+    while (state.pending > 0) {
+        if (IOLockSleepDeadline(state.lock, &state, deadline, THREAD_UNINT) == THREAD_TIMED_OUT)
+            break;
+    }
+    IOLockUnlock(state.lock);
+
+    // no notifications are delivered once remove returns
+    notifier->remove();
+    mLastQuiesceTime = getUptimeNanoseconds() - state.start;
+    mQuiesceResults = OSArray::withCapacity(count);
+
+    for (UInt32 i = 0; i < count && mQuiesceResults != NULL; i++) {
+        IOService* child = (IOService*)children->getObject(i);
+        OSDictionary* dict = OSDictionary::withCapacity(2);
+
+        if (dict == NULL)
+            continue;
+
+        OSString* name = OSString::withCString(child->getName());
+        if (name != NULL) {
+            dict->setObject("name", name);
+            name->release();
+        }
+
+        if (state.done[i] != 0) {
+            OSNumber* osNum = OSNumber::withNumber(state.done[i], 64);
+            dict->setObject("quiesce-ns", osNum);
+            osNum->release();
+        }
+        else {
+            mQuiesceTimeouts++;
+            dict->setObject("timed-out", kOSBooleanTrue);
+            AlwaysLog("%s did not quiesce within %u ms\n", child->getName(), mQuiesceTimeout);
+        }
+
+        mQuiesceResults->setObject(dict);
+        dict->release();
+    }
+
+    IOFree(state.done, count * sizeof(UInt64));
+    IOLockFree(state.lock);
+    children->release();
+}
+
+void IOElectrifyBridge::publishSleepTiming()
+{
+    OSDictionary* dict = OSDictionary::withCapacity(5);
+    OSNumber* osNum;
+
+    if (dict == NULL)
+        return;
+
+    osNum = OSNumber::withNumber(mLastSleepTime, 64);
+    dict->setObject("sleep-ns", osNum);
+    osNum->release();
+
+    osNum = OSNumber::withNumber(mLastQuiesceTime, 64);
+    dict->setObject("quiesce-ns", osNum);
+    osNum->release();
+
+    IOLockLock(mProbeLock);
+    UInt64 ejectTime = mLastProbeTime[0];
+    IOLockUnlock(mProbeLock);
+
+    osNum = OSNumber::withNumber(ejectTime, 64);
+    dict->setObject("eject-ns", osNum);
+    osNum->release();
+
+    osNum = OSNumber::withNumber(mQuiesceTimeouts, 32);
+    dict->setObject("timeouts", osNum);
+    osNum->release();
+
+    if (mQuiesceResults != NULL)
+        dict->setObject("children", mQuiesceResults);
+
+    setProperty(kIOElectrifyBridgeSleepTimingKey, dict);
+    dict->release();
+}
+
+void IOElectrifyBridge::publishProbeTiming()
+{
+    OSDictionary* dict = OSDictionary::withCapacity(8);
+    OSNumber* osNum;
+
+    UInt64 lastProbeTime[2], maxProbeTime[2];
+    UInt32 requests, merged, darkWakes, promotions;
+
+    if (dict == NULL)
+        return;
+
+    // probes, the rescan window and PM update these on their own threads
+    IOLockLock(mProbeLock);
+    memcpy(lastProbeTime, mLastProbeTime, sizeof(lastProbeTime));
+    memcpy(maxProbeTime, mMaxProbeTime, sizeof(maxProbeTime));
+    IOLockUnlock(mProbeLock);
+
+    IOLockLock(mRescanLock);
+    requests = mRescanRequests;
+    merged = mRescanMerged;
+    darkWakes = mDarkWakes;
+    promotions = mDarkWakePromotions;
+    IOLockUnlock(mRescanLock);
+
+    osNum = OSNumber::withNumber(lastProbeTime[1], 64);
+    dict->setObject("scan-ns", osNum);
+    osNum->release();
+
+    osNum = OSNumber::withNumber(maxProbeTime[1], 64);
+    dict->setObject("max-scan-ns", osNum);
+    osNum->release();
+
+    osNum = OSNumber::withNumber(lastProbeTime[0], 64);
+    dict->setObject("eject-ns", osNum);
+    osNum->release();
+
+    osNum = OSNumber::withNumber(maxProbeTime[0], 64);
+    dict->setObject("max-eject-ns", osNum);
+    osNum->release();
+
+    osNum = OSNumber::withNumber(requests, 32);
+    dict->setObject("requests", osNum);
+    osNum->release();
+
+    osNum = OSNumber::withNumber(merged, 32);
+    dict->setObject("merged", osNum);
+    osNum->release();
+
+    osNum = OSNumber::withNumber(darkWakes, 32);
+    dict->setObject("dark-wakes", osNum);
+    osNum->release();
+
+    osNum = OSNumber::withNumber(promotions, 32);
+    dict->setObject("dark-wake-promotions", osNum);
+    osNum->release();
+
+    setProperty(kIOElectrifyBridgeProbeTimingKey, dict);
+    dict->release();
 }
 
 void IOElectrifyBridge::stop(IOService *provider)
 {
     DebugLog("IOElectrifyBridge::stop() %p\n", this);
+
+    PMstop();
+
+    if (mProbeCall != NULL) {
+        // drop the reference taken for a transition that never ran
+        if (thread_call_cancel_wait(mProbeCall))
+            release();
+        thread_call_free(mProbeCall);
+        mProbeCall = NULL;
+    }
+
+    if (mPublishNotifier != NULL) {
+        mPublishNotifier->remove();
+        mPublishNotifier = NULL;
+    }
+
+    Policy::unregister(this);
     
     super::stop(provider);
 }
@@ -133,6 +945,19 @@ void IOElectrifyBridge::stop(IOService *provider)
 void IOElectrifyBridge::free()
 {
     DebugLog("IOElectrifyBridge::free() %p\n", this);
+
+    OSSafeReleaseNULL(mParentNames);
+    OSSafeReleaseNULL(mQuiesceResults);
+
+    if (mProbeLock != NULL) {
+        IOLockFree(mProbeLock);
+        mProbeLock = NULL;
+    }
+
+    if (mRescanLock != NULL) {
+        IOLockFree(mRescanLock);
+        mRescanLock = NULL;
+    }
     
     super::free();
 }
@@ -149,7 +974,14 @@ void IOElectrifyBridge::detach(IOService *provider)
 
 IOReturn IOElectrifyBridge::setPowerState(unsigned long powerState, IOService *service)
 {
+    IOReturn result = IOPMAckImplied;
+    UInt32 state = (UInt32)powerState;
+    UInt32 previous = mPowerState;
+    bool darkWake, promoted;
+
     DebugLog("setPowerState %ld\n", powerState);
+    Recorder::record(kEventPMCallback, kEventSourceBridge, NULL, &state, 1, 0, getUptimeNanoseconds(), 0);
+    mPowerState = state;
     
 	if (mEnablePowerHook)
 	{
@@ -157,19 +989,77 @@ IOReturn IOElectrifyBridge::setPowerState(unsigned long powerState, IOService *s
 	    {
 	        case kPowerStateSleep:
 	            DebugLog("--> sleep(%d)\n", (int)powerState);
-				probeDev(kIOPCIProbeOptionEject | kIOPCIProbeOptionDone);
+				WakeTrace::end();
+				Policy::clearDeferred(kDeferRescan);
+				IOLockLock(mRescanLock);
+				darkWake = mDarkWake;
+				mDarkWake = false;
+				IOLockUnlock(mRescanLock);
+				if (darkWake) {
+					// never rescanned since the last eject, and what was
+					// attached before the dark wake still stands
+					DebugLog("leaving dark wake, nothing to eject\n");
+					break;
+				}
+				Policy::recordSleepPresence(countAttachedDevices() > 0);
+				result = probeDevAsync(kIOPCIProbeOptionEject | kIOPCIProbeOptionDone);
 	            break;
 	        case kPowerStateDoze:
 	        case kPowerStateNormal:
 	            DebugLog("--> awake(%d)\n", (int)powerState);
-				probeDev(kIOPCIProbeOptionNeedsScan | kIOPCIProbeOptionDone);
+				WakeTrace::begin();
+				darkWake = powerState == kPowerStateDoze && previous == kPowerStateSleep && Policy::shouldDeferDarkWake();
+				IOLockLock(mRescanLock);
+				promoted = powerState == kPowerStateNormal && mDarkWake;
+				if (promoted) {
+					mDarkWake = false;
+					mDarkWakePromotions++;
+				}
+				if (darkWake) {
+					mDarkWake = true;
+					mDarkWakes++;
+				}
+				IOLockUnlock(mRescanLock);
+				if (promoted) {
+					// full wake after a dark one, rescan now
+					DebugLog("promoting dark wake\n");
+					Policy::clearDeferred(kDeferRescan);
+				}
+				if (darkWake) {
+					DebugLog("dark wake, leaving the bridge unscanned\n");
+					Policy::defer(kDeferRescan);
+					publishProbeTiming();
+				} else if (Policy::shouldDeferWake()) {
+					DebugLog("nothing attached at sleep, deferring rescan\n");
+					Policy::defer(kDeferRescan);
+				} else {
+					result = probeDevAsync(kIOPCIProbeOptionNeedsScan | kIOPCIProbeOptionDone);
+				}
+				if (result == IOPMAckImplied)
+					WakeTrace::publish(this);
 	            break;
 	    }
 	}
-	
-	
     
-    return IOPMAckImplied;
+    return result;
+}
+
+IOReturn IOElectrifyBridge::message(UInt32 type, IOService *provider, void *argument)
+{
+    switch (type)
+    {
+        case kIOElectrifyMessageRescan:
+            IOLockLock(mRescanLock);
+            mDarkWake = false;
+            IOLockUnlock(mRescanLock);
+            WakeTrace::mark(kWakeStageProbeRequested);
+            probeDev(kIOPCIProbeOptionNeedsScan | kIOPCIProbeOptionDone);
+            return kIOReturnSuccess;
+        case kIOElectrifyMessageHasDevices:
+            return countAttachedDevices() ? kIOReturnBusy : kIOReturnSuccess;
+    }
+
+    return super::message(type, provider, argument);
 }
 
 
@@ -177,15 +1067,11 @@ IOReturn IOElectrifyBridge::setPowerState(unsigned long powerState, IOService *s
 // Userspace Client:
 //*********************************************************************
 
-const IOExternalMethodDispatch IOElectrifyBridgeUserClient::sMethods[kClientNumMethods] =
+const DispatchMethod IOElectrifyBridgeUserClient::sMethods[kClientNumMethods] =
 {
-    { // kClientExecuteCMD
-        (IOExternalMethodAction)&IOElectrifyBridgeUserClient::executeCMD,
-        1, // One scalar input value
-        0, // No struct inputs
-        1, // One scalar output value
-        0  // No struct outputs
-    }
+    kDispatchMethod(IOElectrifyBridgeUserClient::executeCMD, true),                 // kClientExecuteCMD
+    kDispatchMethod(IOElectrifyBridgeUserClient::copyStartupProfile, true),         // kClientCopyStartupProfile
+    kDispatchClientMethod(IOElectrifyBridgeUserClient::ringDoorbell, true)          // kClientRingDoorbell
 };
 
 // Structure of IOExternalMethodDispatch:
@@ -217,10 +1103,24 @@ bool IOElectrifyBridgeUserClient::initWithTask(task_t owningTask, void* security
     IOLog("Client::initWithTask(type %u)\n", (unsigned int)type);
     
     mTask = owningTask;
+
+    if (!mCommands.init())
+        return false;
     
     return IOUserClient::initWithTask(owningTask, securityID, type, properties);
 }
 
+//
+// IOUserClient teardown, the command queue goes away with the last mapping
+//
+
+void IOElectrifyBridgeUserClient::free()
+{
+    mCommands.free();
+
+    IOUserClient::free();
+}
+
 //
 // IOUserClient user-kernel boundary interface start
 //
@@ -248,8 +1148,20 @@ bool IOElectrifyBridgeUserClient::start(IOService * provider)
 // IOUserClient user-kernel boundary interface client exit behavior
 //
 
+// Calls through the user clients, published on close and whenever the
+// provider's properties are read, long-lived clients may never close
+void IOElectrifyBridgeUserClient::publishCounters(IOElectrifyBridge* provider)
+{
+    publishDispatchCounters(provider, kIOElectrifyBridgeClientStatsKey, sMethods, provider->mClientCounters, kClientNumMethods);
+}
+
 IOReturn IOElectrifyBridgeUserClient::clientClose(void)
 {
+    if (providertarget != NULL) {
+        publishCounters(providertarget);
+        mCommands.publish(providertarget, kIOElectrifyBridgeCommandQueueKey);
+    }
+
     if (!isInactive())
         terminate();
     
@@ -267,6 +1179,19 @@ void IOElectrifyBridgeUserClient::stop(IOService * provider)
     IOUserClient::stop(provider);
 }
 
+//
+// IOUserClient shared memory, the command queue pair
+//
+
+IOReturn IOElectrifyBridgeUserClient::clientMemoryForType(UInt32 type, IOOptionBits* options, IOMemoryDescriptor** memory)
+{
+    if (type != kCommandQueueMemoryType)
+        return kIOReturnBadArgument;
+
+    *options = 0;
+    return mCommands.copyMemory(memory);
+}
+
 //
 // IOUserClient handle external method
 //
@@ -275,24 +1200,52 @@ IOReturn IOElectrifyBridgeUserClient::externalMethod(uint32_t selector, IOExtern
                                               IOExternalMethodDispatch* dispatch, OSObject* target, void* reference)
 {
     DebugLog("%s[%p]::%s(%d, %p, %p, %p, %p)\n", getName(), this, __FUNCTION__, selector, arguments, dispatch, target, reference);
-    
-    if (selector < (uint32_t)kClientNumMethods)
-    {
-        dispatch = (IOExternalMethodDispatch *)&sMethods[selector];
-        
-        if (!target)
-        {
-            if (selector == kClientExecuteCMD)
-                target = providertarget;
-            else
-                target = this;
-        }
-    }
-    return IOUserClient::externalMethod(selector, arguments, dispatch, target, reference);
+
+    return dispatchExternalMethod(this, providertarget, sMethods, providertarget->mClientCounters, kClientNumMethods,
+                                  kEventSourceBridge, selector, arguments);
 }
 
-IOReturn IOElectrifyBridgeUserClient::executeCMD(IOElectrifyBridge* target, void* reference, IOExternalMethodArguments* arguments)
+IOReturn IOElectrifyBridgeUserClient::executeCMD(IOElectrifyBridge* target, const uint64_t (&in)[1], uint64_t (&out)[1])
 {
-    arguments->scalarOutput[0] = target->probeDev((UInt32)arguments->scalarInput[0]);
+    // an explicit request powers up and rescans anything the wake policy deferred
+    Policy::resumeDeferred("user client");
+    Policy::noteActivity();
+    out[0] = target->probeDev((UInt32)in[0]);
     return kIOReturnSuccess;
 }
+
+IOReturn IOElectrifyBridgeUserClient::copyStartupProfile(IOElectrifyBridge* target, StartupProfileRecord* out)
+{
+    target->copyStartupProfile(out);
+    return kIOReturnSuccess;
+}
+
+IOReturn IOElectrifyBridgeUserClient::runCommand(OSObject* target, UInt32 opcode, UInt64 arg, UInt64* result)
+{
+    IOElectrifyBridge* provider = (IOElectrifyBridge*)target;
+    const uint64_t in[1] = { arg };
+    uint64_t out[1] = { 0 };
+    UInt64 start = getUptimeNanoseconds();
+
+    // same path as the scalar selector
+    if (opcode != kCommandProbe)
+        return kIOReturnUnsupported;
+
+    IOReturn ret = executeCMD(provider, in, out);
+
+    // counted and recorded as a call to the selector it stands for
+    accountDispatch(sMethods, provider->mClientCounters, kClientNumMethods, kEventSourceBridge, kRecorderQueueName,
+                    kClientExecuteCMD, in, 1, ret, start, getUptimeNanoseconds() - start);
+
+    *result = out[0];
+    return ret;
+}
+
+IOReturn IOElectrifyBridgeUserClient::ringDoorbell(IOElectrifyBridgeUserClient* client, uint64_t (&out)[1])
+{
+    UInt32 processed;
+    IOReturn ret = client->mCommands.drain(client->providertarget, runCommand, &processed);
+
+    out[0] = processed;
+    return ret;
+}
@@ -23,19 +23,33 @@
 #include <IOKit/IOService.h>
 #include <IOKit/pci/IOPCIDevice.h>
 #include <IOKit/pci/IOPCIBridge.h>
+#include <kern/thread_call.h>
+#include <IOKit/IOLocks.h>
 
+#ifndef DebugLog
 #ifdef DEBUG
 #define DebugLog(args...) do { IOLog("IOElectrifyBridge: " args); } while (0)
 #else
 #define DebugLog(args...) do { } while (0)
 #endif
+#endif
+#ifndef AlwaysLog
 #define AlwaysLog(args...) do { IOLog("IOElectrifyBridge: " args); } while (0)
+#endif
+
+#include "common.h"
+#include "Profiles.h"
+#include "StartupProfile.h"
+#include "UserClientDispatch.h"
+#include "CommandQueue.h"
 
 
 // External client methods
 enum
 {
     kClientExecuteCMD = 0,
+    kClientCopyStartupProfile,
+    kClientRingDoorbell,
     kClientNumMethods
 };
 
@@ -46,6 +60,71 @@ class IOElectrifyBridge : public IOService
     
 protected:
     IOPCI2PCIBridge* mProvider;
+    IONotifier* mPublishNotifier = NULL;
+
+    bool isChildDevice(IOService* service);
+    OSArray* copyDownstreamDevices();
+    UInt32 countAttachedDevices();
+    bool matchParentName(const char* name);
+    const BridgeProfile* matchProfile(IOService* device);
+
+    // Rescans on PM transitions run on their own thread so that several
+    // bridges rescan concurrently, PM is acknowledged when done
+    thread_call_t mProbeCall = NULL;
+    IOLock* mProbeLock = NULL;      // serializes probes from PM, user clients and the policy
+    UInt64 mLastProbeTime[2] = { 0, 0 };    // indexed by scan (1) / eject (0)
+    UInt64 mMaxProbeTime[2] = { 0, 0 };
+
+    UInt32 issueProbe(UInt32 options);
+    IOReturn probeDevAsync(UInt32 options);
+    static void probeCallMain(thread_call_param_t param0, thread_call_param_t param1);
+    void publishProbeTiming();
+
+    // Rescan coalescing, requests arriving within mRescanWindow of the first
+    // one are merged into a single requestProbe. Ejects and scans never share
+    // one, and batches are issued in the order they were opened. The window,
+    // batches and counters are guarded by mRescanLock.
+    struct RescanBatch;
+    IOLock* mRescanLock = NULL;
+    RescanBatch* mOpenBatch = NULL;
+    UInt32 mRescanWindow = 0;       // ms, 0 passes every request straight through
+    UInt32 mRescanSeq = 0;          // last batch opened
+    UInt32 mRescanDoneSeq = 0;      // last batch issued
+    UInt32 mRescanRequests = 0;
+    UInt32 mRescanMerged = 0;       // requests that rode along on another one's requestProbe
+
+    // Dark wakes leave the bridge unscanned, a full wake promotes them.
+    // The state and counters are guarded by mRescanLock.
+    UInt32 mPowerState = 0;
+    bool mDarkWake = false;         // the current dark wake skipped its rescan
+    UInt32 mDarkWakes = 0;
+    UInt32 mDarkWakePromotions = 0;
+
+    // Pre-eject quiesce of the devices behind the bridge on sleep
+    UInt32 mQuiesceTimeout = 0;     // ms, 0 leaves it all to the eject
+    UInt32 mQuiesceTimeouts = 0;
+    UInt64 mLastQuiesceTime = 0;
+    UInt64 mLastSleepTime = 0;      // quiesce and eject
+    OSArray* mQuiesceResults = NULL;
+
+    struct QuiesceState;
+    void quiesceChildren();
+    static bool childTerminated(void* target, void* refCon, IOService* newService, IONotifier* notifier);
+    void publishSleepTiming();
+    static bool childPublished(void* target, void* refCon, IOService* newService, IONotifier* notifier);
+
+    // Settings read from the personality and changed live through setProperties
+    struct Config
+    {
+        bool powerHook;
+        UInt32 quiesceTimeout;
+        UInt32 rescanWindow;
+        OSArray* parentNames;       // retained, NULL matches through the profile table
+    };
+
+    static IOReturn readConfig(OSDictionary* dict, Config* config, bool strict);
+
+    StartupProfile mStartup;
     
 public:
     virtual bool init(OSDictionary *propTable);
@@ -53,13 +132,18 @@ public:
     virtual bool start(IOService *provider);
     virtual void stop(IOService *provider);
     UInt32 probeDev(UInt32 options);
+    void copyStartupProfile(StartupProfileRecord* record) const { mStartup.copy(record); }
     virtual void free();
 	bool mEnablePowerHook = false;
-	char parentName[128];
+	OSArray* mParentNames = NULL;
+    DispatchCounters mClientCounters[kClientNumMethods] = {};
 #ifdef DEBUG
     virtual void detach(IOService *provider);
 #endif
 	virtual IOReturn setPowerState(unsigned long powerState, IOService *service);
+    virtual IOReturn message(UInt32 type, IOService *provider, void *argument = 0);
+    virtual IOReturn setProperties(OSObject* properties);
+    virtual bool serializeProperties(OSSerialize* serialize) const;
 };
 
 class IOElectrifyBridgeUserClient : public IOUserClient
@@ -69,15 +153,22 @@ private:
     IOElectrifyBridge* providertarget;
     task_t mTask;
     SInt32 mOpenCount;
-    static const IOExternalMethodDispatch sMethods[kClientNumMethods];
+    CommandRing mCommands;
+    static const DispatchMethod sMethods[kClientNumMethods];
+    static IOReturn runCommand(OSObject* target, UInt32 opcode, UInt64 arg, UInt64* result);
 public:
     virtual bool start(IOService* provider);
     virtual void stop(IOService* provider);
     virtual bool initWithTask(task_t owningTask, void * securityID, UInt32 type, OSDictionary* properties);
+    virtual void free();
     virtual IOReturn clientClose(void);
+    static void publishCounters(IOElectrifyBridge* provider);
+    virtual IOReturn clientMemoryForType(UInt32 type, IOOptionBits* options, IOMemoryDescriptor** memory);
     virtual IOReturn externalMethod(uint32_t selector, IOExternalMethodArguments *arguments, IOExternalMethodDispatch* dispatch = 0,
                                     OSObject* target = 0, void* reference = 0);
-    static IOReturn executeCMD(IOElectrifyBridge* target, void* reference, IOExternalMethodArguments* arguments);
+    static IOReturn executeCMD(IOElectrifyBridge* target, const uint64_t (&in)[1], uint64_t (&out)[1]);
+    static IOReturn copyStartupProfile(IOElectrifyBridge* target, StartupProfileRecord* out);
+    static IOReturn ringDoorbell(IOElectrifyBridgeUserClient* client, uint64_t (&out)[1]);
 };
 
 #endif
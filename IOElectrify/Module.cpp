@@ -0,0 +1,53 @@
+/*
+ *  Released under "The GNU General Public License (GPL-2.0)"
+ *
+ *  This program is free software; you can redistribute it and/or modify it
+ *  under the terms of the GNU General Public License as published by the
+ *  Free Software Foundation; either version 2 of the License, or (at your
+ *  option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful, but
+ *  WITHOUT ANY WARRANTY; without even the implied warranty of MERCHANTABILITY
+ *  or FITNESS FOR A PARTICULAR PURPOSE. See the GNU General Public License
+ *  for more details.
+ *
+ *  You should have received a copy of the GNU General Public License along
+ *  with this program; if not, write to the Free Software Foundation, Inc.,
+ *  59 Temple Place, Suite 330, Boston, MA 02111-1307 USA
+ *
+ */
+
+#include <mach/mach_types.h>
+#include <mach/kmod.h>
+#include <IOKit/IOLib.h>
+#include "common.h"
+#include "WakeTrace.h"
+#include "Recorder.h"
+#include "Policy.h"
+
+extern "C" kern_return_t IOElectrify_start(kmod_info_t* ki, void* data);
+extern "C" kern_return_t IOElectrify_stop(kmod_info_t* ki, void* data);
+
+// Kext-wide state shared by the drivers is set up once here, before any
+// instance starts, and torn down after the last one is gone.
+kern_return_t IOElectrify_start(kmod_info_t* ki, void* data)
+{
+    if (!WakeTrace::initialize() || !Recorder::initialize() || !Policy::initialize()) {
+        AlwaysLog("failed to set up kext-wide state\n");
+        Policy::finalize();
+        Recorder::finalize();
+        WakeTrace::finalize();
+        return KERN_FAILURE;
+    }
+
+    return KERN_SUCCESS;
+}
+
+kern_return_t IOElectrify_stop(kmod_info_t* ki, void* data)
+{
+    Policy::finalize();
+    Recorder::finalize();
+    WakeTrace::finalize();
+
+    return KERN_SUCCESS;
+}
@@ -0,0 +1,38 @@
+/*
+ *  Released under "The GNU General Public License (GPL-2.0)"
+ *
+ *  This program is free software; you can redistribute it and/or modify it
+ *  under the terms of the GNU General Public License as published by the
+ *  Free Software Foundation; either version 2 of the License, or (at your
+ *  option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful, but
+ *  WITHOUT ANY WARRANTY; without even the implied warranty of MERCHANTABILITY
+ *  or FITNESS FOR A PARTICULAR PURPOSE. See the GNU General Public License
+ *  for more details.
+ *
+ *  You should have received a copy of the GNU General Public License along
+ *  with this program; if not, write to the Free Software Foundation, Inc.,
+ *  59 Temple Place, Suite 330, Boston, MA 02111-1307 USA
+ *
+ */
+
+#ifndef OSTypesCompat_h
+#define OSTypesCompat_h
+
+// Headers shared with the host tools use the kernel type names
+#if defined(KERNEL) || defined(__APPLE__)
+#include <libkern/OSTypes.h>
+#else
+#include <stdint.h>
+typedef uint8_t  UInt8;
+typedef uint16_t UInt16;
+typedef uint32_t UInt32;
+typedef uint64_t UInt64;
+typedef int8_t   SInt8;
+typedef int16_t  SInt16;
+typedef int32_t  SInt32;
+typedef int64_t  SInt64;
+#endif
+
+#endif /* OSTypesCompat_h */
@@ -0,0 +1,279 @@
+/*
+ *  Released under "The GNU General Public License (GPL-2.0)"
+ *
+ *  This program is free software; you can redistribute it and/or modify it
+ *  under the terms of the GNU General Public License as published by the
+ *  Free Software Foundation; either version 2 of the License, or (at your
+ *  option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful, but
+ *  WITHOUT ANY WARRANTY; without even the implied warranty of MERCHANTABILITY
+ *  or FITNESS FOR A PARTICULAR PURPOSE. See the GNU General Public License
+ *  for more details.
+ *
+ *  You should have received a copy of the GNU General Public License along
+ *  with this program; if not, write to the Free Software Foundation, Inc.,
+ *  59 Temple Place, Suite 330, Boston, MA 02111-1307 USA
+ *
+ */
+
+#include <IOKit/IOLib.h>
+#include <IOKit/IOLocks.h>
+#include "common.h"
+#include "Policy.h"
+
+static IOLock* sLock = NULL;
+static OSArray* sControllers = NULL;
+static OSArray* sBridges = NULL;
+static OSArray* sPendingForcePower = NULL;  // controllers still to force-power on this wake
+
+static bool sPresenceAware = false;
+static bool sPresenceKnown = false;
+static bool sPresentAtSleep = false;
+static bool sDarkWakeAware = false;
+static UInt32 sDeferred = 0;
+
+static void addService(OSArray** array, IOService* service)
+{
+    IOLockLock(sLock);
+    if (*array == NULL)
+        *array = OSArray::withCapacity(2);
+    if (*array != NULL)
+        (*array)->setObject(service);
+    IOLockUnlock(sLock);
+}
+
+static void removeService(OSArray* array, IOService* service)
+{
+    if (array == NULL)
+        return;
+
+    for (unsigned int i = 0; i < array->getCount(); i++) {
+        if (array->getObject(i) == service) {
+            array->removeObject(i);
+            return;
+        }
+    }
+}
+
+// Must be called with the lock held
+static void settleService(IOService* service)
+{
+    removeService(sPendingForcePower, service);
+    if (sPendingForcePower == NULL || sPendingForcePower->getCount() == 0)
+        IOLockWakeup(sLock, &sPendingForcePower, false);
+}
+
+// Send a message to a snapshot of the registered services, outside the lock.
+// Returns the first non-success reply.
+static IOReturn messageAll(OSArray** array, UInt32 type)
+{
+    IOReturn result = kIOReturnSuccess;
+    OSArray* copy = NULL;
+
+    IOLockLock(sLock);
+    if (*array != NULL && (*array)->getCount() > 0) {
+        copy = OSArray::withCapacity((*array)->getCount());
+        if (copy != NULL)
+            copy->merge(*array);
+    }
+    IOLockUnlock(sLock);
+
+    if (copy == NULL)
+        return result;
+
+    for (unsigned int i = 0; i < copy->getCount(); i++) {
+        IOService* service = OSDynamicCast(IOService, copy->getObject(i));
+
+        if (service != NULL && !service->isInactive()) {
+            IOReturn ret = service->message(type, NULL, NULL);
+
+            if (result == kIOReturnSuccess)
+                result = ret;
+        }
+    }
+
+    copy->release();
+
+    return result;
+}
+
+bool Policy::initialize()
+{
+    sLock = IOLockAlloc();
+
+    return sLock != NULL;
+}
+
+void Policy::finalize()
+{
+    OSSafeReleaseNULL(sControllers);
+    OSSafeReleaseNULL(sBridges);
+    OSSafeReleaseNULL(sPendingForcePower);
+
+    if (sLock != NULL) {
+        IOLockFree(sLock);
+        sLock = NULL;
+    }
+}
+
+void Policy::registerController(IOService* service)
+{
+    addService(&sControllers, service);
+}
+
+void Policy::registerBridge(IOService* service)
+{
+    addService(&sBridges, service);
+}
+
+void Policy::unregister(IOService* service)
+{
+    IOLockLock(sLock);
+    removeService(sControllers, service);
+    removeService(sBridges, service);
+    settleService(service);
+    IOLockUnlock(sLock);
+}
+
+void Policy::setPresenceAware(bool enable)
+{
+    IOLockLock(sLock);
+    sPresenceAware = enable;
+    IOLockUnlock(sLock);
+}
+
+void Policy::recordSleepPresence(bool present)
+{
+    DebugLog("devices present at sleep: %s\n", present ? "yes" : "no");
+
+    IOLockLock(sLock);
+    sPresenceKnown = true;
+    sPresentAtSleep = present;
+    IOLockUnlock(sLock);
+}
+
+// Only defer when we know for certain nothing was attached before sleep
+bool Policy::shouldDeferWake()
+{
+    bool defer;
+
+    IOLockLock(sLock);
+    defer = sPresenceAware && sPresenceKnown && !sPresentAtSleep;
+    IOLockUnlock(sLock);
+
+    return defer;
+}
+
+void Policy::setDarkWakeAware(bool enable)
+{
+    IOLockLock(sLock);
+    sDarkWakeAware = enable;
+    IOLockUnlock(sLock);
+}
+
+// Dark wakes leave the Thunderbolt tree off unless a device or a client asks for it
+bool Policy::shouldDeferDarkWake()
+{
+    bool defer;
+
+    IOLockLock(sLock);
+    defer = sDarkWakeAware;
+    IOLockUnlock(sLock);
+
+    return defer;
+}
+
+void Policy::defer(UInt32 work)
+{
+    IOLockLock(sLock);
+    sDeferred |= work;
+    IOLockUnlock(sLock);
+}
+
+void Policy::clearDeferred(UInt32 work)
+{
+    IOLockLock(sLock);
+    sDeferred &= ~work;
+    IOLockUnlock(sLock);
+}
+
+void Policy::resumeDeferred(const char* reason)
+{
+    UInt32 deferred;
+
+    IOLockLock(sLock);
+    deferred = sDeferred;
+    sDeferred = 0;
+    // something showed up, the next wake has to do the full work again
+    sPresenceKnown = false;
+    IOLockUnlock(sLock);
+
+    if (deferred == 0)
+        return;
+
+    AlwaysLog("resuming deferred wake (%s)\n", reason);
+
+    if (deferred & kDeferForcePower)
+        messageAll(&sControllers, kIOElectrifyMessageForcePowerOn);
+
+    if (deferred & kDeferRescan)
+        messageAll(&sBridges, kIOElectrifyMessageRescan);
+}
+
+// Called by a controller at sleep when it is going to force-power on wake
+void Policy::expectForcePower(IOService* controller)
+{
+    IOLockLock(sLock);
+    removeService(sPendingForcePower, controller);
+    if (sPendingForcePower == NULL)
+        sPendingForcePower = OSArray::withCapacity(2);
+    if (sPendingForcePower != NULL)
+        sPendingForcePower->setObject(controller);
+    IOLockUnlock(sLock);
+}
+
+// Called once the controller's wake force-power is done, or won't happen
+void Policy::settleForcePower(IOService* controller)
+{
+    IOLockLock(sLock);
+    settleService(controller);
+    IOLockUnlock(sLock);
+}
+
+// Returns false when some controller did not settle within timeoutMS
+bool Policy::waitForcePower(UInt32 timeoutMS)
+{
+    AbsoluteTime deadline;
+    bool settled = true;
+
+    clock_interval_to_deadline(timeoutMS, kMillisecondScale, &deadline);
+
+    IOLockLock(sLock);
+    while (sPendingForcePower != NULL && sPendingForcePower->getCount() > 0) {
+        if (IOLockSleepDeadline(sLock, &sPendingForcePower, deadline, THREAD_UNINT) == THREAD_TIMED_OUT) {
+            settled = false;
+            break;
+        }
+    }
+    IOLockUnlock(sLock);
+
+    return settled;
+}
+
+// Activity behind a bridge keeps the controllers out of idle gating
+void Policy::noteActivity()
+{
+    messageAll(&sControllers, kIOElectrifyMessageActivity);
+}
+
+void Policy::rescanBridges()
+{
+    messageAll(&sBridges, kIOElectrifyMessageRescan);
+}
+
+// Bridges reply busy to kIOElectrifyMessageHasDevices when devices sit behind them
+bool Policy::bridgesHaveDevices()
+{
+    return messageAll(&sBridges, kIOElectrifyMessageHasDevices) == kIOReturnBusy;
+}
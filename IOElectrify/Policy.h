@@ -0,0 +1,77 @@
+/*
+ *  Released under "The GNU General Public License (GPL-2.0)"
+ *
+ *  This program is free software; you can redistribute it and/or modify it
+ *  under the terms of the GNU General Public License as published by the
+ *  Free Software Foundation; either version 2 of the License, or (at your
+ *  option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful, but
+ *  WITHOUT ANY WARRANTY; without even the implied warranty of MERCHANTABILITY
+ *  or FITNESS FOR A PARTICULAR PURPOSE. See the GNU General Public License
+ *  for more details.
+ *
+ *  You should have received a copy of the GNU General Public License along
+ *  with this program; if not, write to the Free Software Foundation, Inc.,
+ *  59 Temple Place, Suite 330, Boston, MA 02111-1307 USA
+ *
+ */
+
+#ifndef Policy_h
+#define Policy_h
+
+#include <IOKit/IOService.h>
+#include <IOKit/IOMessage.h>
+
+// Messages sent by the policy to registered drivers to resume deferred work
+#define kIOElectrifyMessageForcePowerOn     iokit_vendor_specific_msg(0x10)
+#define kIOElectrifyMessageRescan           iokit_vendor_specific_msg(0x11)
+#define kIOElectrifyMessageActivity         iokit_vendor_specific_msg(0x12)
+#define kIOElectrifyMessageHasDevices       iokit_vendor_specific_msg(0x13)
+
+// Wake work skipped by the presence-aware and dark wake policies
+enum
+{
+    kDeferForcePower    = 0x1,
+    kDeferRescan        = 0x2
+};
+
+// Kext-wide policy shared by IOElectrify and IOElectrifyBridge instances.
+// Drivers register on start; deferred work is resumed by messaging them,
+// force-power first, then the bridge rescans. With the rescan deferred nothing
+// gets published behind the bridges, so only the controller's ACPI hotplug
+// notification or a user client request resumes.
+class Policy
+{
+public:
+    // Called from module start/stop
+    static bool initialize();
+    static void finalize();
+
+    static void registerController(IOService* service);
+    static void registerBridge(IOService* service);
+    static void unregister(IOService* service);
+
+    static void setPresenceAware(bool enable);
+    static void recordSleepPresence(bool present);
+    static bool shouldDeferWake();
+
+    static void setDarkWakeAware(bool enable);
+    static bool shouldDeferDarkWake();
+
+    static void defer(UInt32 work);
+    static void clearDeferred(UInt32 work);
+    static void resumeDeferred(const char* reason);
+
+    // Bridges hold their wake rescan until the controllers expected to
+    // force-power on this wake are done
+    static void expectForcePower(IOService* controller);
+    static void settleForcePower(IOService* controller);
+    static bool waitForcePower(UInt32 timeoutMS);
+
+    static void noteActivity();
+    static void rescanBridges();
+    static bool bridgesHaveDevices();
+};
+
+#endif /* Policy_h */
@@ -0,0 +1,232 @@
+/*
+ *  Released under "The GNU General Public License (GPL-2.0)"
+ *
+ *  This program is free software; you can redistribute it and/or modify it
+ *  under the terms of the GNU General Public License as published by the
+ *  Free Software Foundation; either version 2 of the License, or (at your
+ *  option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful, but
+ *  WITHOUT ANY WARRANTY; without even the implied warranty of MERCHANTABILITY
+ *  or FITNESS FOR A PARTICULAR PURPOSE. See the GNU General Public License
+ *  for more details.
+ *
+ *  You should have received a copy of the GNU General Public License along
+ *  with this program; if not, write to the Free Software Foundation, Inc.,
+ *  59 Temple Place, Suite 330, Boston, MA 02111-1307 USA
+ *
+ */
+
+#include <IOKit/IOLib.h>
+#include "common.h"
+#include "PowerResidency.h"
+
+#define kResidencyGroup             "IOElectrify"
+#define kResidencySubGroup          "ForcePower"
+
+#define kStateChannel               IOREPORT_MAKEID('F','o','r','c','e','P','w','r')
+
+static const UInt64 sStateIDs[2] =
+{
+    IOREPORT_MAKEID('O','f','f',' ',' ',' ',' ',' '),
+    IOREPORT_MAKEID('O','n',' ',' ',' ',' ',' ',' ')
+};
+
+// Indexed by source, then state
+static const UInt64 sTransitionChannels[kResidencySourceCount][2] =
+{
+    { IOREPORT_MAKEID('P','M',' ',' ','O','f','f',' '), IOREPORT_MAKEID('P','M',' ',' ','O','n',' ',' ') },
+    { IOREPORT_MAKEID('C','l','n','t','O','f','f',' '), IOREPORT_MAKEID('C','l','n','t','O','n',' ',' ') },
+    { IOREPORT_MAKEID('P','l','c','y','O','f','f',' '), IOREPORT_MAKEID('P','l','c','y','O','n',' ',' ') }
+};
+
+static const char* sTransitionNames[kResidencySourceCount][2] =
+{
+    { "pm-off", "pm-on" },
+    { "client-off", "client-on" },
+    { "policy-off", "policy-on" }
+};
+
+static const UInt64 sTimeChannels[2] =
+{
+    IOREPORT_MAKEID('A','C','P','I','O','f','f',' '),
+    IOREPORT_MAKEID('A','C','P','I','O','n',' ',' ')
+};
+
+static const char* sTimeNames[2] = { "acpi-off", "acpi-on" };
+
+bool PowerResidency::init(IOService* service)
+{
+    mSessionStart = getUptimeNanoseconds();
+    mStateSince = mSessionStart;
+
+    mStateReporter = IOStateReporter::with(service, kIOReportCategoryPower, 2);
+    mCountReporter = IOSimpleReporter::with(service, kIOReportCategoryPower, kIOReportUnitNone);
+    mTimeReporter = IOSimpleReporter::with(service, kIOReportCategoryPower, kIOReportUnit_ns);
+
+    if (mStateReporter == NULL || mCountReporter == NULL || mTimeReporter == NULL) {
+        free();
+        return false;
+    }
+
+    mStateReporter->addChannel(kStateChannel, "force-power");
+    for (int state = 0; state < 2; state++)
+        mStateReporter->setStateID(kStateChannel, state, sStateIDs[state]);
+    mStateReporter->setChannelState(kStateChannel, sStateIDs[mState]);
+
+    for (int source = 0; source < kResidencySourceCount; source++)
+        for (int state = 0; state < 2; state++)
+            mCountReporter->addChannel(sTransitionChannels[source][state], sTransitionNames[source][state]);
+
+    for (int state = 0; state < 2; state++)
+        mTimeReporter->addChannel(sTimeChannels[state], sTimeNames[state]);
+
+    IOReportLegend::addReporterLegend(service, mStateReporter, kResidencyGroup, kResidencySubGroup);
+    IOReportLegend::addReporterLegend(service, mCountReporter, kResidencyGroup, kResidencySubGroup);
+    IOReportLegend::addReporterLegend(service, mTimeReporter, kResidencyGroup, kResidencySubGroup);
+
+    return true;
+}
+
+void PowerResidency::free()
+{
+    OSSafeReleaseNULL(mStateReporter);
+    OSSafeReleaseNULL(mCountReporter);
+    OSSafeReleaseNULL(mTimeReporter);
+}
+
+void PowerResidency::record(UInt32 source, UInt32 on, bool success, UInt64 elapsed)
+{
+    on = on ? 1 : 0;
+
+    mACPICalls[on]++;
+    mACPITime[on] += elapsed;
+    if (mTimeReporter != NULL)
+        mTimeReporter->incrementValue(sTimeChannels[on], elapsed);
+
+    if (!success || on == mState)
+        return;
+
+    UInt64 now = getUptimeNanoseconds();
+
+    mResidency[mState] += now - mStateSince;
+    mStateSince = now;
+    mState = on;
+
+    if (mStateReporter != NULL)
+        mStateReporter->setChannelState(kStateChannel, sStateIDs[on]);
+
+    if (source < kResidencySourceCount) {
+        mTransitions[source][on]++;
+        if (mCountReporter != NULL)
+            mCountReporter->incrementValue(sTransitionChannels[source][on], 1);
+    }
+}
+
+void PowerResidency::reset()
+{
+    mSessionStart = getUptimeNanoseconds();
+    mStateSince = mSessionStart;
+
+    bzero(mResidency, sizeof(mResidency));
+    bzero(mTransitions, sizeof(mTransitions));
+    bzero(mACPICalls, sizeof(mACPICalls));
+    bzero(mACPITime, sizeof(mACPITime));
+}
+
+void PowerResidency::copy(PowerResidencyRecord* record) const
+{
+    record->sessionStart = mSessionStart;
+    record->state = mState;
+
+    for (int state = 0; state < 2; state++) {
+        record->residency[state] = mResidency[state];
+        record->acpiCalls[state] = mACPICalls[state];
+        record->acpiTime[state] = mACPITime[state];
+        record->acpiMean[state] = mACPICalls[state] ? mACPITime[state] / mACPICalls[state] : 0;
+
+        for (int source = 0; source < kResidencySourceCount; source++)
+            record->transitions[source][state] = mTransitions[source][state];
+    }
+
+    // the current state counts up to now
+    record->residency[mState] += getUptimeNanoseconds() - mStateSince;
+}
+
+void PowerResidency::publish(IOService* service, const PowerResidencyRecord* record)
+{
+    OSDictionary* dict = OSDictionary::withCapacity(12);
+    OSNumber* osNum;
+
+    if (dict == NULL)
+        return;
+
+    osNum = OSNumber::withNumber(record->residency[0], 64);
+    dict->setObject("off-ns", osNum);
+    osNum->release();
+
+    osNum = OSNumber::withNumber(record->residency[1], 64);
+    dict->setObject("on-ns", osNum);
+    osNum->release();
+
+    for (int source = 0; source < kResidencySourceCount; source++) {
+        for (int state = 0; state < 2; state++) {
+            osNum = OSNumber::withNumber(record->transitions[source][state], 32);
+            dict->setObject(sTransitionNames[source][state], osNum);
+            osNum->release();
+        }
+    }
+
+    osNum = OSNumber::withNumber(record->acpiTime[0], 64);
+    dict->setObject("acpi-off-ns", osNum);
+    osNum->release();
+
+    osNum = OSNumber::withNumber(record->acpiMean[0], 64);
+    dict->setObject("acpi-off-mean-ns", osNum);
+    osNum->release();
+
+    osNum = OSNumber::withNumber(record->acpiTime[1], 64);
+    dict->setObject("acpi-on-ns", osNum);
+    osNum->release();
+
+    osNum = OSNumber::withNumber(record->acpiMean[1], 64);
+    dict->setObject("acpi-on-mean-ns", osNum);
+    osNum->release();
+
+    service->setProperty(kPowerResidencyKey, dict);
+    dict->release();
+}
+
+IOReturn PowerResidency::configureReport(IOReportChannelList* channels, IOReportConfigureAction action, void* result,
+                                         void* destination)
+{
+    IOReporter* reporters[] = { mStateReporter, mCountReporter, mTimeReporter };
+
+    for (unsigned int i = 0; i < sizeof(reporters) / sizeof(reporters[0]); i++) {
+        if (reporters[i] == NULL)
+            continue;
+
+        IOReturn ret = reporters[i]->configureReport(channels, action, result, destination);
+        if (ret != kIOReturnSuccess)
+            return ret;
+    }
+
+    return kIOReturnSuccess;
+}
+
+IOReturn PowerResidency::updateReport(IOReportChannelList* channels, IOReportUpdateAction action, void* result,
+                                      void* destination)
+{
+    IOReporter* reporters[] = { mStateReporter, mCountReporter, mTimeReporter };
+
+    for (unsigned int i = 0; i < sizeof(reporters) / sizeof(reporters[0]); i++) {
+        if (reporters[i] == NULL)
+            continue;
+
+        IOReturn ret = reporters[i]->updateReport(channels, action, result, destination);
+        if (ret != kIOReturnSuccess)
+            return ret;
+    }
+
+    return kIOReturnSuccess;
+}
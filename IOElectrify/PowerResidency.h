@@ -0,0 +1,89 @@
+/*
+ *  Released under "The GNU General Public License (GPL-2.0)"
+ *
+ *  This program is free software; you can redistribute it and/or modify it
+ *  under the terms of the GNU General Public License as published by the
+ *  Free Software Foundation; either version 2 of the License, or (at your
+ *  option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful, but
+ *  WITHOUT ANY WARRANTY; without even the implied warranty of MERCHANTABILITY
+ *  or FITNESS FOR A PARTICULAR PURPOSE. See the GNU General Public License
+ *  for more details.
+ *
+ *  You should have received a copy of the GNU General Public License along
+ *  with this program; if not, write to the Free Software Foundation, Inc.,
+ *  59 Temple Place, Suite 330, Boston, MA 02111-1307 USA
+ *
+ */
+
+#ifndef PowerResidency_h
+#define PowerResidency_h
+
+#include "OSTypesCompat.h"
+
+#define kPowerResidencyKey "ForcePowerResidency"
+
+// Who asked for a force-power transition
+enum
+{
+    kResidencySourcePM = 0,     // sleep/wake
+    kResidencySourceClient,     // user client selectors and command queue
+    kResidencySourcePolicy,     // idle gating and deferred wake work
+    kResidencySourceCount
+};
+
+// Copied out as-is through the user client, indexed by state (0 off, 1 on), times in ns
+struct __attribute__((packed)) PowerResidencyRecord
+{
+    UInt64 sessionStart;                            // uptime when the session was started or reset
+    UInt64 residency[2];                            // time in each state this session, up to now
+    UInt32 transitions[kResidencySourceCount][2];   // state changes into each state per source
+    UInt32 acpiCalls[2];                            // force-power requests per direction, failed ones too
+    UInt64 acpiTime[2];                             // total time inside the ACPI call, retries included
+    UInt64 acpiMean[2];
+    UInt32 state;
+};
+
+#ifdef KERNEL
+
+#include <IOKit/IOService.h>
+#include <IOKit/IOReporter.h>
+
+// Per-controller force-power residency and transition cost, also reported
+// through IOReporting. Not locked, callers hold the command gate.
+class PowerResidency
+{
+public:
+    bool init(IOService* service);
+    void free();
+
+    // Every force-power request, elapsed is the time spent in the ACPI call
+    void record(UInt32 source, UInt32 on, bool success, UInt64 elapsed);
+
+    // Start a new session, IOReporting keeps counting
+    void reset();
+
+    void copy(PowerResidencyRecord* record) const;
+    static void publish(IOService* service, const PowerResidencyRecord* record);
+
+    IOReturn configureReport(IOReportChannelList* channels, IOReportConfigureAction action, void* result, void* destination);
+    IOReturn updateReport(IOReportChannelList* channels, IOReportUpdateAction action, void* result, void* destination);
+
+private:
+    IOStateReporter* mStateReporter = NULL;     // off / on residency
+    IOSimpleReporter* mCountReporter = NULL;    // transitions per source and direction
+    IOSimpleReporter* mTimeReporter = NULL;     // ACPI time per direction
+
+    UInt64 mSessionStart = 0;
+    UInt64 mStateSince = 0;
+    UInt64 mResidency[2] = { 0, 0 };
+    UInt32 mTransitions[kResidencySourceCount][2] = {};
+    UInt32 mACPICalls[2] = { 0, 0 };
+    UInt64 mACPITime[2] = { 0, 0 };
+    UInt32 mState = 0;
+};
+
+#endif /* KERNEL */
+
+#endif /* PowerResidency_h */
@@ -0,0 +1,92 @@
+/*
+ *  Released under "The GNU General Public License (GPL-2.0)"
+ *
+ *  This program is free software; you can redistribute it and/or modify it
+ *  under the terms of the GNU General Public License as published by the
+ *  Free Software Foundation; either version 2 of the License, or (at your
+ *  option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful, but
+ *  WITHOUT ANY WARRANTY; without even the implied warranty of MERCHANTABILITY
+ *  or FITNESS FOR A PARTICULAR PURPOSE. See the GNU General Public License
+ *  for more details.
+ *
+ *  You should have received a copy of the GNU General Public License along
+ *  with this program; if not, write to the Free Software Foundation, Inc.,
+ *  59 Temple Place, Suite 330, Boston, MA 02111-1307 USA
+ *
+ */
+
+#ifndef Profiles_h
+#define Profiles_h
+
+#include "OSTypesCompat.h"
+
+// Most machines take three integer arguments and the on/off flag goes last
+#define kProfileMaxArgs 4
+
+// How to call force-power on a given firmware
+struct ForcePowerProfile
+{
+    const char* name;
+
+    // WMI method GUID, in the byte order it appears in _WDG
+    UInt8 guid[16];
+
+    // Argument layout, args[powerArg] is replaced by on/off
+    UInt8 argCount;
+    UInt8 powerArg;
+    UInt32 args[kProfileMaxArgs];
+
+    // ACPI object on the WMI device returning the current force-power
+    // state as an integer, NULL when the firmware offers none
+    const char* verifyMethod;
+};
+
+// Which PCI bridge sits in front of the Thunderbolt controller.
+// Zero / NULL keys match anything.
+struct BridgeProfile
+{
+    const char* name;
+    UInt16 vendor;
+    UInt16 device;
+    const char* parentName;
+    const char* location;
+};
+
+// 86ccfd48-205e-4a77-9c48-2021cbede341, Intel WMI Thunderbolt force-power
+#define INTEL_WMI_THUNDERBOLT_GUID_BYTES \
+    { 0x48, 0xfd, 0xcc, 0x86, 0x5e, 0x20, 0x77, 0x4a, 0x9c, 0x48, 0x20, 0x21, 0xcb, 0xed, 0xe3, 0x41 }
+
+// Known force-power methods, checked in order against _WDG
+constexpr ForcePowerProfile kForcePowerProfiles[] =
+{
+    {
+        "Intel WMI force-power",
+        INTEL_WMI_THUNDERBOLT_GUID_BYTES,
+        3, 2, { 0, 0, 0, 0 },
+        NULL
+    },
+};
+
+// Known bridges, most specific first. Add new laptops here.
+constexpr BridgeProfile kBridgeProfiles[] =
+{
+    { "Dell XPS 9360", 0x8086, 0x7615, "RP01", NULL },
+};
+
+constexpr unsigned int kForcePowerProfileCount = sizeof(kForcePowerProfiles) / sizeof(kForcePowerProfiles[0]);
+constexpr unsigned int kBridgeProfileCount = sizeof(kBridgeProfiles) / sizeof(kBridgeProfiles[0]);
+
+constexpr bool forcePowerProfilesValid(unsigned int i = 0)
+{
+    return i >= kForcePowerProfileCount ||
+        (kForcePowerProfiles[i].argCount <= kProfileMaxArgs &&
+         kForcePowerProfiles[i].powerArg < kForcePowerProfiles[i].argCount &&
+         forcePowerProfilesValid(i + 1));
+}
+
+static_assert(kForcePowerProfileCount > 0, "at least one force-power profile is required");
+static_assert(forcePowerProfilesValid(), "force-power profile argument layout out of range");
+
+#endif /* Profiles_h */
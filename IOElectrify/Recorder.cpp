@@ -0,0 +1,88 @@
+/*
+ *  Released under "The GNU General Public License (GPL-2.0)"
+ *
+ *  This program is free software; you can redistribute it and/or modify it
+ *  under the terms of the GNU General Public License as published by the
+ *  Free Software Foundation; either version 2 of the License, or (at your
+ *  option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful, but
+ *  WITHOUT ANY WARRANTY; without even the implied warranty of MERCHANTABILITY
+ *  or FITNESS FOR A PARTICULAR PURPOSE. See the GNU General Public License
+ *  for more details.
+ *
+ *  You should have received a copy of the GNU General Public License along
+ *  with this program; if not, write to the Free Software Foundation, Inc.,
+ *  59 Temple Place, Suite 330, Boston, MA 02111-1307 USA
+ *
+ */
+
+#include <IOKit/IOLib.h>
+#include <IOKit/IOLocks.h>
+#include "common.h"
+#include "Recorder.h"
+#include "WakeTrace.h"
+
+static IOLock* sLock = NULL;
+
+static RecorderEvent sEvents[kRecorderCapacity];
+static UInt32 sNext = 0;
+static UInt32 sCount = 0;
+
+bool Recorder::initialize()
+{
+    sLock = IOLockAlloc();
+
+    return sLock != NULL;
+}
+
+void Recorder::finalize()
+{
+    if (sLock != NULL) {
+        IOLockFree(sLock);
+        sLock = NULL;
+    }
+}
+
+void Recorder::record(UInt16 type, UInt16 source, const char* name, const UInt32* args, UInt32 argCount,
+                      UInt32 result, UInt64 start, UInt64 duration)
+{
+    RecorderEvent event;
+
+    bzero(&event, sizeof(event));
+    event.timestamp = start;
+    event.duration = duration;
+    event.wakeId = WakeTrace::currentId();
+    event.type = type;
+    event.source = source;
+    if (name != NULL)
+        strlcpy(event.name, name, sizeof(event.name));
+
+    if (argCount > kRecorderMaxArgs)
+        argCount = kRecorderMaxArgs;
+    event.argCount = argCount;
+    for (UInt32 i = 0; i < argCount; i++)
+        event.args[i] = args[i];
+    event.result = result;
+
+    IOLockLock(sLock);
+    sEvents[sNext] = event;
+    sNext = (sNext + 1) % kRecorderCapacity;
+    if (sCount < kRecorderCapacity)
+        sCount++;
+    IOLockUnlock(sLock);
+}
+
+// Copy out the most recent events, oldest first
+UInt32 Recorder::copyEvents(RecorderEvent* events, UInt32 maxEvents)
+{
+    UInt32 count;
+
+    IOLockLock(sLock);
+    count = sCount < maxEvents ? sCount : maxEvents;
+    for (UInt32 i = 0; i < count; i++)
+        events[i] = sEvents[(sNext + kRecorderCapacity - count + i) % kRecorderCapacity];
+    IOLockUnlock(sLock);
+
+    return count;
+}
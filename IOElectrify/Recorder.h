@@ -0,0 +1,79 @@
+/*
+ *  Released under "The GNU General Public License (GPL-2.0)"
+ *
+ *  This program is free software; you can redistribute it and/or modify it
+ *  under the terms of the GNU General Public License as published by the
+ *  Free Software Foundation; either version 2 of the License, or (at your
+ *  option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful, but
+ *  WITHOUT ANY WARRANTY; without even the implied warranty of MERCHANTABILITY
+ *  or FITNESS FOR A PARTICULAR PURPOSE. See the GNU General Public License
+ *  for more details.
+ *
+ *  You should have received a copy of the GNU General Public License along
+ *  with this program; if not, write to the Free Software Foundation, Inc.,
+ *  59 Temple Place, Suite 330, Boston, MA 02111-1307 USA
+ *
+ */
+
+#ifndef Recorder_h
+#define Recorder_h
+
+#include "OSTypesCompat.h"
+
+// Number of events kept, older events are overwritten
+#define kRecorderCapacity 256
+
+enum
+{
+    kEventPMCallback = 1,       // args[0] = power state
+    kEventACPIEvaluate,         // name = method, args = integer arguments, result = IOReturn
+    kEventProbe,                // args[0] = probe options, result = requestProbe() return
+    kEventUserClient            // args[0] = selector, args[1..] = scalar inputs, name = "queue" when
+                                // the call was drained from a command queue
+};
+
+#define kRecorderQueueName "queue"
+
+
+enum
+{
+    kEventSourceController = 0,
+    kEventSourceBridge
+};
+
+#define kRecorderMaxArgs 4
+
+// One recorded event, copied out as-is through the user client
+struct __attribute__((packed)) RecorderEvent
+{
+    UInt64 timestamp;           // ns of uptime when the event started
+    UInt64 duration;            // ns
+    UInt32 wakeId;              // WakeTrace id, 0 outside a wake
+    UInt16 type;
+    UInt16 source;
+    char name[8];
+    UInt32 argCount;
+    UInt32 args[kRecorderMaxArgs];
+    UInt32 result;
+};
+
+#ifdef KERNEL
+
+// Kext-wide ring buffer of PM callbacks, ACPI evaluations, probes and user client calls
+class Recorder
+{
+public:
+    // Called from module start/stop
+    static bool initialize();
+    static void finalize();
+
+    static void record(UInt16 type, UInt16 source, const char* name, const UInt32* args, UInt32 argCount,
+                       UInt32 result, UInt64 start, UInt64 duration);
+    static UInt32 copyEvents(RecorderEvent* events, UInt32 maxEvents);
+};
+
+#endif /* KERNEL */
+
+#endif /* Recorder_h */
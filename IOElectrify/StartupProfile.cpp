@@ -0,0 +1,102 @@
+/*
+ *  Released under "The GNU General Public License (GPL-2.0)"
+ *
+ *  This program is free software; you can redistribute it and/or modify it
+ *  under the terms of the GNU General Public License as published by the
+ *  Free Software Foundation; either version 2 of the License, or (at your
+ *  option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful, but
+ *  WITHOUT ANY WARRANTY; without even the implied warranty of MERCHANTABILITY
+ *  or FITNESS FOR A PARTICULAR PURPOSE. See the GNU General Public License
+ *  for more details.
+ *
+ *  You should have received a copy of the GNU General Public License along
+ *  with this program; if not, write to the Free Software Foundation, Inc.,
+ *  59 Temple Place, Suite 330, Boston, MA 02111-1307 USA
+ *
+ */
+
+#include <IOKit/IOLib.h>
+#include "common.h"
+#include "StartupProfile.h"
+
+static const char* sPhaseNames[kStartupPhaseCount] =
+{
+    "init",
+    "plist",
+    "version",
+    "attach",
+    "start",
+    "wmi",
+    "work-loop",
+    "pm",
+    "probe"
+};
+
+void StartupProfile::begin(UInt32 phase)
+{
+    if (phase < kStartupPhaseCount)
+        mBegin[phase] = getUptimeNanoseconds();
+}
+
+void StartupProfile::end(UInt32 phase)
+{
+    if (phase < kStartupPhaseCount && mBegin[phase] != 0)
+        mEnd[phase] = getUptimeNanoseconds();
+}
+
+void StartupProfile::copy(StartupProfileRecord* record) const
+{
+    UInt64 origin = mBegin[kStartupPhaseInit];
+
+    bzero(record, sizeof(*record));
+    record->uptime = origin;
+
+    for (int i = 0; i < kStartupPhaseCount; i++) {
+        if (mBegin[i] == 0 || mEnd[i] == 0)
+            continue;
+
+        record->offset[i] = mBegin[i] - origin;
+        record->duration[i] = mEnd[i] - mBegin[i];
+    }
+}
+
+void StartupProfile::publish(IOService* service) const
+{
+    StartupProfileRecord record;
+    OSDictionary* dict = OSDictionary::withCapacity(kStartupPhaseCount + 1);
+    OSNumber* osNum;
+
+    if (dict == NULL)
+        return;
+
+    copy(&record);
+
+    osNum = OSNumber::withNumber(record.uptime, 64);
+    dict->setObject("uptime-ns", osNum);
+    osNum->release();
+
+    for (int i = 0; i < kStartupPhaseCount; i++) {
+        if (record.duration[i] == 0)
+            continue;
+
+        OSDictionary* phase = OSDictionary::withCapacity(2);
+        if (phase == NULL)
+            continue;
+
+        osNum = OSNumber::withNumber(record.offset[i], 64);
+        phase->setObject("offset-ns", osNum);
+        osNum->release();
+
+        osNum = OSNumber::withNumber(record.duration[i], 64);
+        phase->setObject("duration-ns", osNum);
+        osNum->release();
+
+        dict->setObject(sPhaseNames[i], phase);
+        phase->release();
+    }
+
+    service->setProperty(kStartupProfileKey, dict);
+    dict->release();
+}
@@ -0,0 +1,71 @@
+/*
+ *  Released under "The GNU General Public License (GPL-2.0)"
+ *
+ *  This program is free software; you can redistribute it and/or modify it
+ *  under the terms of the GNU General Public License as published by the
+ *  Free Software Foundation; either version 2 of the License, or (at your
+ *  option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful, but
+ *  WITHOUT ANY WARRANTY; without even the implied warranty of MERCHANTABILITY
+ *  or FITNESS FOR A PARTICULAR PURPOSE. See the GNU General Public License
+ *  for more details.
+ *
+ *  You should have received a copy of the GNU General Public License along
+ *  with this program; if not, write to the Free Software Foundation, Inc.,
+ *  59 Temple Place, Suite 330, Boston, MA 02111-1307 USA
+ *
+ */
+
+#ifndef StartupProfile_h
+#define StartupProfile_h
+
+#include "OSTypesCompat.h"
+
+#define kStartupProfileKey "StartupProfile"
+
+// Bring-up phases, not every driver goes through all of them
+enum
+{
+    kStartupPhaseInit = 0,      // init() as a whole
+    kStartupPhasePlist,         // personality parsing in init()
+    kStartupPhaseVersion,       // DV,Version / DV,Build setup
+    kStartupPhaseAttach,
+    kStartupPhaseStart,         // start() as a whole
+    kStartupPhaseWMI,           // WMI::initialize, _WDG extraction and parsing
+    kStartupPhaseWorkLoop,
+    kStartupPhasePM,            // PMinit, registerPowerDriver, joinPMtree
+    kStartupPhaseProbe,         // initial bridge rescan
+    kStartupPhaseCount
+};
+
+// Copied out as-is through the user client, times in ns
+struct __attribute__((packed)) StartupProfileRecord
+{
+    UInt64 uptime;                              // uptime when init() was entered
+    UInt64 offset[kStartupPhaseCount];          // phase start relative to uptime
+    UInt64 duration[kStartupPhaseCount];        // 0 when the phase didn't run
+};
+
+#ifdef KERNEL
+
+#include <IOKit/IOService.h>
+
+// Per-driver timestamps of the bring-up phases
+class StartupProfile
+{
+public:
+    void begin(UInt32 phase);
+    void end(UInt32 phase);
+
+    void copy(StartupProfileRecord* record) const;
+    void publish(IOService* service) const;
+
+private:
+    UInt64 mBegin[kStartupPhaseCount] = { 0 };
+    UInt64 mEnd[kStartupPhaseCount] = { 0 };
+};
+
+#endif /* KERNEL */
+
+#endif /* StartupProfile_h */
@@ -0,0 +1,112 @@
+/*
+ *  Released under "The GNU General Public License (GPL-2.0)"
+ *
+ *  This program is free software; you can redistribute it and/or modify it
+ *  under the terms of the GNU General Public License as published by the
+ *  Free Software Foundation; either version 2 of the License, or (at your
+ *  option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful, but
+ *  WITHOUT ANY WARRANTY; without even the implied warranty of MERCHANTABILITY
+ *  or FITNESS FOR A PARTICULAR PURPOSE. See the GNU General Public License
+ *  for more details.
+ *
+ *  You should have received a copy of the GNU General Public License along
+ *  with this program; if not, write to the Free Software Foundation, Inc.,
+ *  59 Temple Place, Suite 330, Boston, MA 02111-1307 USA
+ *
+ */
+
+#include <IOKit/IOLib.h>
+#include "common.h"
+#include "UserClientDispatch.h"
+#include "Recorder.h"
+
+IOReturn dispatchExternalMethod(IOUserClient* client, OSObject* target, const DispatchMethod* methods,
+                                DispatchCounters* counters, uint32_t count, UInt16 source,
+                                uint32_t selector, IOExternalMethodArguments* arguments)
+{
+    if (selector >= count)
+        return kIOReturnBadArgument;
+
+    const DispatchMethod* method = &methods[selector];
+
+    UInt64 start = getUptimeNanoseconds();
+    IOReturn ret = client->IOUserClient::externalMethod(selector, arguments, (IOExternalMethodDispatch*)&method->dispatch,
+                                                        method->client ? client : target, NULL);
+    UInt64 elapsed = getUptimeNanoseconds() - start;
+
+    accountDispatch(methods, counters, count, source, NULL, selector, arguments->scalarInput,
+                    arguments->scalarInputCount, ret, start, elapsed);
+
+    return ret;
+}
+
+void accountDispatch(const DispatchMethod* methods, DispatchCounters* counters, uint32_t count, UInt16 source,
+                     const char* name, uint32_t selector, const uint64_t* scalarInput, uint32_t scalarInputCount,
+                     IOReturn ret, UInt64 start, UInt64 elapsed)
+{
+    if (selector >= count)
+        return;
+
+    const DispatchMethod* method = &methods[selector];
+    DispatchCounters* counter = &counters[selector];
+
+    OSIncrementAtomic(&counter->calls);
+    if (ret != kIOReturnSuccess)
+        OSIncrementAtomic(&counter->errors);
+    OSAddAtomic64(elapsed, &counter->totalTime);
+
+    UInt64 max = atomicLoad(counter->maxTime);
+    while (elapsed > max && !OSCompareAndSwap64(max, elapsed, &counter->maxTime))
+        max = atomicLoad(counter->maxTime);
+
+    if (method->record) {
+        UInt32 args[kRecorderMaxArgs] = { selector };
+        UInt32 argCount = 1;
+
+        for (UInt32 i = 0; i < scalarInputCount && argCount < kRecorderMaxArgs; i++)
+            args[argCount++] = (UInt32)scalarInput[i];
+
+        Recorder::record(kEventUserClient, source, name, args, argCount, ret, start, elapsed);
+    }
+}
+
+void publishDispatchCounters(IOService* service, const char* key, const DispatchMethod* methods,
+                             const DispatchCounters* counters, uint32_t count)
+{
+    OSDictionary* dict = OSDictionary::withCapacity(count);
+    OSNumber* osNum;
+
+    if (dict == NULL)
+        return;
+
+    for (uint32_t i = 0; i < count; i++) {
+        OSDictionary* method = OSDictionary::withCapacity(4);
+
+        if (method == NULL)
+            continue;
+
+        osNum = OSNumber::withNumber((UInt32)atomicLoad(counters[i].calls), 32);
+        method->setObject("calls", osNum);
+        osNum->release();
+
+        osNum = OSNumber::withNumber((UInt32)atomicLoad(counters[i].errors), 32);
+        method->setObject("errors", osNum);
+        osNum->release();
+
+        osNum = OSNumber::withNumber((UInt64)atomicLoad(counters[i].totalTime), 64);
+        method->setObject("total-ns", osNum);
+        osNum->release();
+
+        osNum = OSNumber::withNumber(atomicLoad(counters[i].maxTime), 64);
+        method->setObject("max-ns", osNum);
+        osNum->release();
+
+        dict->setObject(methods[i].name, method);
+        method->release();
+    }
+
+    service->setProperty(key, dict);
+    dict->release();
+}
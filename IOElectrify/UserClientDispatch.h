@@ -0,0 +1,183 @@
+/*
+ *  Released under "The GNU General Public License (GPL-2.0)"
+ *
+ *  This program is free software; you can redistribute it and/or modify it
+ *  under the terms of the GNU General Public License as published by the
+ *  Free Software Foundation; either version 2 of the License, or (at your
+ *  option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful, but
+ *  WITHOUT ANY WARRANTY; without even the implied warranty of MERCHANTABILITY
+ *  or FITNESS FOR A PARTICULAR PURPOSE. See the GNU General Public License
+ *  for more details.
+ *
+ *  You should have received a copy of the GNU General Public License along
+ *  with this program; if not, write to the Free Software Foundation, Inc.,
+ *  59 Temple Place, Suite 330, Boston, MA 02111-1307 USA
+ *
+ */
+
+#ifndef UserClientDispatch_h
+#define UserClientDispatch_h
+
+#include <IOKit/IOUserClient.h>
+#include <IOKit/IOMemoryDescriptor.h>
+
+// Shared external method dispatch for the user clients.
+//
+// Handlers are static functions with a typed signature, the dispatch entry
+// (argument counts and structure sizes) is derived from it at compile time:
+//
+//   IOReturn fn(Target* target)
+//   IOReturn fn(Target* target, const uint64_t (&in)[I], uint64_t (&out)[O])
+//   IOReturn fn(Target* target, uint64_t (&out)[O])
+//   IOReturn fn(Target* target, Output* out)                   fixed size structure output
+//   IOReturn fn(Target* target, IOExternalMethodArguments* a)  anything else, counts given explicitly
+//
+// Tables are built with kDispatchMethod / kDispatchRawMethod, indexed by selector,
+// and every call is counted per selector. The target is the user client's provider,
+// kDispatchClientMethod entries get the user client itself.
+
+struct DispatchMethod
+{
+    IOExternalMethodDispatch dispatch;
+    const char* name;
+    bool record;                // record the call with the Recorder
+    bool client;                // target is the user client rather than its provider
+};
+
+struct DispatchCounters
+{
+    volatile SInt32 calls;
+    volatile SInt32 errors;
+    volatile SInt64 totalTime;  // ns
+    volatile UInt64 maxTime;    // ns
+};
+
+template <typename F> struct DispatchTraits;
+
+template <typename T>
+struct DispatchTraits<IOReturn (*)(T*)>
+{
+    typedef T Target;
+    enum { kScalarIn = 0, kStructIn = 0, kScalarOut = 0, kStructOut = 0 };
+
+    template <IOReturn (*fn)(T*)>
+    static IOReturn call(T* target, IOExternalMethodArguments* arguments)
+    {
+        return fn(target);
+    }
+};
+
+template <typename T, uint32_t I, uint32_t O>
+struct DispatchTraits<IOReturn (*)(T*, const uint64_t (&)[I], uint64_t (&)[O])>
+{
+    typedef T Target;
+    enum { kScalarIn = I, kStructIn = 0, kScalarOut = O, kStructOut = 0 };
+
+    template <IOReturn (*fn)(T*, const uint64_t (&)[I], uint64_t (&)[O])>
+    static IOReturn call(T* target, IOExternalMethodArguments* arguments)
+    {
+        return fn(target, *reinterpret_cast<const uint64_t (*)[I]>(arguments->scalarInput),
+                  *reinterpret_cast<uint64_t (*)[O]>(arguments->scalarOutput));
+    }
+};
+
+template <typename T, uint32_t O>
+struct DispatchTraits<IOReturn (*)(T*, uint64_t (&)[O])>
+{
+    typedef T Target;
+    enum { kScalarIn = 0, kStructIn = 0, kScalarOut = O, kStructOut = 0 };
+
+    template <IOReturn (*fn)(T*, uint64_t (&)[O])>
+    static IOReturn call(T* target, IOExternalMethodArguments* arguments)
+    {
+        return fn(target, *reinterpret_cast<uint64_t (*)[O]>(arguments->scalarOutput));
+    }
+};
+
+template <typename T, typename Output>
+struct DispatchTraits<IOReturn (*)(T*, Output*)>
+{
+    typedef T Target;
+    enum { kScalarIn = 0, kStructIn = 0, kScalarOut = 0, kStructOut = sizeof(Output) };
+
+    // large outputs arrive as a memory descriptor instead of a kernel buffer
+    template <IOReturn (*fn)(T*, Output*)>
+    static IOReturn call(T* target, IOExternalMethodArguments* arguments)
+    {
+        IOMemoryDescriptor* desc = arguments->structureOutputDescriptor;
+
+        if (desc == NULL)
+            return fn(target, (Output*)arguments->structureOutput);
+
+        Output output;
+        IOReturn ret = fn(target, &output);
+
+        if (ret == kIOReturnSuccess)
+            ret = desc->prepare();
+        if (ret == kIOReturnSuccess) {
+            desc->writeBytes(0, &output, sizeof(output));
+            desc->complete();
+            arguments->structureOutputDescriptorSize = sizeof(output);
+        }
+
+        return ret;
+    }
+};
+
+template <typename T>
+struct DispatchTraits<IOReturn (*)(T*, IOExternalMethodArguments*)>
+{
+    typedef T Target;
+
+    template <IOReturn (*fn)(T*, IOExternalMethodArguments*)>
+    static IOReturn call(T* target, IOExternalMethodArguments* arguments)
+    {
+        return fn(target, arguments);
+    }
+};
+
+// IOExternalMethodAction trampoline
+template <typename F, F fn>
+static IOReturn dispatchAction(OSObject* target, void* reference, IOExternalMethodArguments* arguments)
+{
+    typedef typename DispatchTraits<F>::Target Target;
+
+    return DispatchTraits<F>::template call<fn>(static_cast<Target*>(target), arguments);
+}
+
+#define kDispatchAction(fn) \
+    &dispatchAction<decltype(&fn), &fn>
+
+#define kDispatchTypedMethod(fn, record, client) \
+    { { kDispatchAction(fn), \
+        DispatchTraits<decltype(&fn)>::kScalarIn, DispatchTraits<decltype(&fn)>::kStructIn, \
+        DispatchTraits<decltype(&fn)>::kScalarOut, DispatchTraits<decltype(&fn)>::kStructOut }, #fn, record, client }
+
+#define kDispatchMethod(fn, record) \
+    kDispatchTypedMethod(fn, record, false)
+
+#define kDispatchClientMethod(fn, record) \
+    kDispatchTypedMethod(fn, record, true)
+
+#define kDispatchRawMethod(fn, scalarIn, structIn, scalarOut, structOut, record) \
+    { { kDispatchAction(fn), scalarIn, structIn, scalarOut, structOut }, #fn, record, false }
+
+// Run the method for selector on target, counting it in counters[selector]
+IOReturn dispatchExternalMethod(IOUserClient* client, OSObject* target, const DispatchMethod* methods,
+                                DispatchCounters* counters, uint32_t count, UInt16 source,
+                                uint32_t selector, IOExternalMethodArguments* arguments);
+
+// Count and record a call to selector that ran without going through
+// externalMethod, such as a command drained from a command queue. name tags
+// the Recorder event, NULL for none.
+void accountDispatch(const DispatchMethod* methods, DispatchCounters* counters, uint32_t count, UInt16 source,
+                     const char* name, uint32_t selector, const uint64_t* scalarInput, uint32_t scalarInputCount,
+                     IOReturn ret, UInt64 start, UInt64 elapsed);
+
+// Publish calls, errors, total and worst time per selector under key
+void publishDispatchCounters(IOService* service, const char* key, const DispatchMethod* methods,
+                             const DispatchCounters* counters, uint32_t count);
+
+#endif /* UserClientDispatch_h */
@@ -19,7 +19,9 @@
  */
 
 #include "WMI.h"
-#include <uuid/uuid.h>
+#include "WMIBlock.h"
+#include "Recorder.h"
+#include "AllocStats.h"
 
 #define kWMIMethod "_WDG"
 
@@ -30,40 +32,6 @@
 #define kWMIFlags "flags"
 #define kWMIFlagsText "flags-text"
 
-/*
- * If the GUID data block is marked as expensive, we must enable and
- * explicitily disable data collection.
- */
-#define ACPI_WMI_EXPENSIVE   0x1
-#define ACPI_WMI_METHOD      0x2    /* GUID is a method */
-#define ACPI_WMI_STRING      0x4    /* GUID takes & returns a string */
-#define ACPI_WMI_EVENT       0x8    /* GUID is an event */
-
-struct __attribute__((packed)) WMI_DATA
-{
-    uuid_t guid;
-    union {
-        char object_id[2];
-        struct {
-            unsigned char notify_id;
-            unsigned char reserved;
-        };
-    };
-    UInt8 instance_count;
-    UInt8 flags;
-};
-
-#define WMI_DATA_SIZE sizeof(WMI_DATA)
-
-// Convert UUID to little endian
-void le_uuid_dec(uuid_t *in, uuid_t *out)
-{
-    *((uint32_t *)out + 0) = OSSwapInt32(*((uint32_t *)in + 0));
-    *((uint16_t *)out + 2) = OSSwapInt16(*((uint16_t *)in + 2));
-    *((uint16_t *)out + 3) = OSSwapInt16(*((uint16_t *)in + 3));
-    *((uint64_t *)out + 1) =            (*((uint64_t *)in + 1));
-}
-
 // parseWMIFlags - Parse WMI flags to a string
 OSString * parseWMIFlags(UInt8 flags)
 {
@@ -98,7 +66,7 @@ OSString * parseWMIFlags(UInt8 flags)
         strcat(output, "NONE");
     }
 
-    return (OSString::withCString(output));
+    return (AllocStatsString::withCString(kAllocSiteWMIFlags, output));
 }
 
 WMI::WMI(IOService* provider)
@@ -109,39 +77,46 @@ WMI::WMI(IOService* provider)
 bool WMI::initialize()
 {
     if (mDevice != NULL) {
-        mData = OSArray::withCapacity(0);
-            
+        mData = AllocStatsArray::withCapacity(kAllocSiteWDGEntry, 0);
+
         if (extractData()) {
             return true;
         }
 
         AlwaysLog("WMI method %s not found on object %s\n", kWMIMethod, mDevice->getName());
     }
+
+    return false;
 }
 
 WMI::~WMI()
 {
     if (mData != NULL) {
+        // the registry copy goes with us, otherwise the table outlives the driver
+        mDevice->removeProperty("WDG");
         mData->release();
     }
+
+    OSSafeReleaseNULL(mBlocks);
 }
 
 // Parse the _WDG method output for WMI data blocks
 bool WMI::extractData()
 {
-    OSObject *wdg;
+    OSObject *wdg = NULL;
     OSData *data;
 
-    if (mDevice->evaluateObject(kWMIMethod, &wdg) != kIOReturnSuccess)
+    if (evaluate(kWMIMethod, &wdg, NULL, 0) != kIOReturnSuccess || wdg == NULL)
     {
         AlwaysLog("ACPI object %s does not export _WDG data\n", mDevice->getName());
         return false;
     }
-    
+
     data = OSDynamicCast(OSData, wdg);
     
     if (data == NULL) {
         AlwaysLog("%s:_WDG did not return a data blob\n", mDevice->getName());
+        wdg->release();
         return false;
     }
 
@@ -154,51 +129,65 @@ bool WMI::extractData()
     
     mDevice->setProperty("WDG", mData);
     
-    data->release();
+    // keep a counted copy of the raw blocks for binary GUID lookups, the
+    // firmware's buffer is not ours to track
+    mBlocks = AllocStatsData::withBytes(kAllocSiteWDGBuffer, data->getBytesNoCopy(), data->getLength());
+    wdg->release();
     
     return true;
 }
 
+// Hand a newly created value over to the dictionary and drop our reference
+static void setEntry(OSDictionary* dict, const char* key, OSObject* value)
+{
+    if (value == NULL)
+        return;
+
+    dict->setObject(key, value);
+    value->release();
+}
+
 // Parse WDG datablock into an OSArray
 void WMI::parseWDGEntry(struct WMI_DATA* block)
 {
     char guid_string[37];
     char object_id_string[3];
-    OSDictionary *dict = OSDictionary::withCapacity(6);
-    
-    uuid_t hostUUID;
-    
-    le_uuid_dec(&block->guid, &hostUUID);
-    uuid_unparse_lower(hostUUID, guid_string);
+    OSDictionary *dict = AllocStatsDictionary::withCapacity(kAllocSiteWDGEntry, 6);
+
+    if (dict == NULL)
+        return;
 
-    dict->setObject(kWMIGuid, OSString::withCString(guid_string));
+    wmiGuidToString(block->guid, guid_string);
+
+    setEntry(dict, kWMIGuid, AllocStatsString::withCString(kAllocSiteWDGEntry, guid_string));
 
     if (block->flags & ACPI_WMI_EVENT)
-        dict->setObject(kWMINotifyId, OSNumber::withNumber(block->notify_id, 8));
+        setEntry(dict, kWMINotifyId, AllocStatsNumber::withNumber(kAllocSiteWDGEntry, block->notify_id, 8));
     else
     {
         snprintf(object_id_string, 3, "%c%c", block->object_id[0], block->object_id[1]);
-        dict->setObject(kWMIObjectId, OSString::withCString(object_id_string));
+        setEntry(dict, kWMIObjectId, AllocStatsString::withCString(kAllocSiteWDGEntry, object_id_string));
     }
     
-    dict->setObject(kWMIInstanceCount, OSNumber::withNumber(block->instance_count, 8));
-    dict->setObject(kWMIFlags, OSNumber::withNumber(block->flags, 8));
+    setEntry(dict, kWMIInstanceCount, AllocStatsNumber::withNumber(kAllocSiteWDGEntry, block->instance_count, 8));
+    setEntry(dict, kWMIFlags, AllocStatsNumber::withNumber(kAllocSiteWDGEntry, block->flags, 8));
     
 #ifdef DEBUG
-    dict->setObject(kWMIFlagsText, parseWMIFlags(block->flags));
+    setEntry(dict, kWMIFlagsText, parseWMIFlags(block->flags));
 #endif
     
     mData->setObject(dict);
+    dict->release();
 }
 
 OSDictionary* WMI::getMethod(const char * guid)
 {
     if (mData && mData->getCount() > 0)
     {
-        if (OSCollectionIterator* iterator = OSCollectionIterator::withCollection(mData))
+        if (OSCollectionIterator* iterator = AllocStatsIterator::withCollection(kAllocSiteWMIIterator, mData))
         {
             OSDictionary* entry;
-            
+
             while ((entry = OSDynamicCast(OSDictionary, iterator->getNextObject())))
             {
                 OSString * methodGUID = OSDynamicCast(OSString, entry->getObject(kWMIGuid));
@@ -207,10 +196,13 @@ OSDictionary* WMI::getMethod(const char * guid)
                 if (methodGUID && flags
                     && flags->unsigned32BitValue() & ACPI_WMI_METHOD
                     && strncmp(methodGUID->getCStringNoCopy(), guid, strlen(guid)) == 0) {
-                    return entry;
+                    break;
                 }
             }
             iterator->release();
+
+            // entries stay alive in mData
+            return entry;
         }
     }
     
@@ -249,11 +241,74 @@ bool WMI::executeMethod(const char * guid, OSObject ** result, OSObject * params
             strcat(methodName, methodId->getCStringNoCopy());
             
             DebugLog("Calling method %s\n", methodName);
-            mDevice->evaluateObject(methodName, result, params, paramCount);
-            
-            return true;
+            return evaluate(methodName, result, params, paramCount) == kIOReturnSuccess;
         }
     }
     
     return false;
 }
+
+const struct WMI_DATA* WMI::findMethodBlock(const uuid_t guid)
+{
+    if (mBlocks == NULL)
+        return NULL;
+
+    return wmiFindMethod(mBlocks->getBytesNoCopy(), mBlocks->getLength(), guid);
+}
+
+bool WMI::hasMethod(const uuid_t guid)
+{
+    return findMethodBlock(guid) != NULL;
+}
+
+IOReturn WMI::executeMethod(const uuid_t guid, OSObject ** result, OSObject * params[], IOItemCount paramCount)
+{
+    const struct WMI_DATA* block = findMethodBlock(guid);
+
+    if (block == NULL)
+        return kIOReturnNotFound;
+
+    char methodName[5] = { 'W', 'M', block->object_id[0], block->object_id[1], 0 };
+
+    DebugLog("Calling method %s\n", methodName);
+    return evaluate(methodName, result, params, paramCount);
+}
+
+IOReturn WMI::evaluateInteger(const char * name, UInt32 * value)
+{
+    OSObject* result = NULL;
+    IOReturn ret = evaluate(name, &result, NULL, 0);
+
+    if (ret == kIOReturnSuccess) {
+        OSNumber* osNum = OSDynamicCast(OSNumber, result);
+
+        if (osNum != NULL)
+            *value = osNum->unsigned32BitValue();
+        else
+            ret = kIOReturnBadArgument;
+    }
+
+    OSSafeReleaseNULL(result);
+
+    return ret;
+}
+
+// Evaluate an ACPI object on the WMI device and record it
+IOReturn WMI::evaluate(const char * name, OSObject ** result, OSObject * params[], IOItemCount paramCount)
+{
+    UInt32 args[kRecorderMaxArgs];
+    UInt32 argCount = 0;
+
+    for (IOItemCount i = 0; i < paramCount && argCount < kRecorderMaxArgs; i++) {
+        OSNumber* osNum = OSDynamicCast(OSNumber, params[i]);
+        args[argCount++] = osNum ? osNum->unsigned32BitValue() : 0;
+    }
+
+    UInt64 start = getUptimeNanoseconds();
+    IOReturn ret = mDevice->evaluateObject(name, result, params, paramCount);
+
+    Recorder::record(kEventACPIEvaluate, kEventSourceController, name, args, argCount, ret,
+                     start, getUptimeNanoseconds() - start);
+
+    return ret;
+}
@@ -24,11 +24,13 @@
 
 #include <IOKit/IOService.h>
 #include <IOKit/acpi/IOACPIPlatformDevice.h>
+#include <uuid/uuid.h>
 
 class WMI
 {
     IOACPIPlatformDevice* mDevice = NULL;
     OSArray* mData = NULL;
+    OSData* mBlocks = NULL;     // copy of the raw _WDG buffer
 
 public:
     // Constructor
@@ -39,6 +41,12 @@ public:
     bool initialize();
     bool hasMethod(const char * guid);
     bool executeMethod(const char * guid, OSObject ** result = NULL, OSObject * params[] = NULL, IOItemCount paramCount = NULL);
+
+    // Lookups by binary GUID in _WDG byte order, without going through strings
+    bool hasMethod(const uuid_t guid);
+    IOReturn executeMethod(const uuid_t guid, OSObject ** result = NULL, OSObject * params[] = NULL, IOItemCount paramCount = 0);
+
+    IOReturn evaluateInteger(const char * name, UInt32 * value);
     
     inline IOACPIPlatformDevice* getACPIDevice() { return mDevice; }
     
@@ -47,6 +55,8 @@ private:
     void parseWDGEntry(struct WMI_DATA * block);
     
     OSDictionary* getMethod(const char * guid);
+    const struct WMI_DATA* findMethodBlock(const uuid_t guid);
+    IOReturn evaluate(const char * name, OSObject ** result, OSObject * params[], IOItemCount paramCount);
 };
 
 
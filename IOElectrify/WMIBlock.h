@@ -0,0 +1,79 @@
+/*
+ *  Released under "The GNU General Public License (GPL-2.0)"
+ *
+ *  This program is free software; you can redistribute it and/or modify it
+ *  under the terms of the GNU General Public License as published by the
+ *  Free Software Foundation; either version 2 of the License, or (at your
+ *  option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful, but
+ *  WITHOUT ANY WARRANTY; without even the implied warranty of MERCHANTABILITY
+ *  or FITNESS FOR A PARTICULAR PURPOSE. See the GNU General Public License
+ *  for more details.
+ *
+ *  You should have received a copy of the GNU General Public License along
+ *  with this program; if not, write to the Free Software Foundation, Inc.,
+ *  59 Temple Place, Suite 330, Boston, MA 02111-1307 USA
+ *
+ */
+
+#ifndef WMIBlock_h
+#define WMIBlock_h
+
+// Binary layout of the _WDG buffer, shared by the WMI parser and the host tools
+
+#include "OSTypesCompat.h"
+
+#ifndef KERNEL
+#include <stdio.h>
+#include <string.h>
+#endif
+
+/*
+ * If the GUID data block is marked as expensive, we must enable and
+ * explicitily disable data collection.
+ */
+#define ACPI_WMI_EXPENSIVE   0x1
+#define ACPI_WMI_METHOD      0x2    /* GUID is a method */
+#define ACPI_WMI_STRING      0x4    /* GUID takes & returns a string */
+#define ACPI_WMI_EVENT       0x8    /* GUID is an event */
+
+struct __attribute__((packed)) WMI_DATA
+{
+    UInt8 guid[16];
+    union {
+        char object_id[2];
+        struct {
+            unsigned char notify_id;
+            unsigned char reserved;
+        };
+    };
+    UInt8 instance_count;
+    UInt8 flags;
+};
+
+#define WMI_DATA_SIZE sizeof(WMI_DATA)
+
+// Format a _WDG GUID, whose first three fields are little endian, as a lower case string
+static inline void wmiGuidToString(const UInt8 guid[16], char out[37])
+{
+    snprintf(out, 37, "%02x%02x%02x%02x-%02x%02x-%02x%02x-%02x%02x-%02x%02x%02x%02x%02x%02x",
+             guid[3], guid[2], guid[1], guid[0], guid[5], guid[4], guid[7], guid[6],
+             guid[8], guid[9], guid[10], guid[11], guid[12], guid[13], guid[14], guid[15]);
+}
+
+// Find a method block by GUID in a raw _WDG buffer
+static inline const struct WMI_DATA* wmiFindMethod(const void* wdg, UInt32 length, const UInt8 guid[16])
+{
+    const struct WMI_DATA* blocks = (const struct WMI_DATA*)wdg;
+    UInt32 count = length / WMI_DATA_SIZE;
+
+    for (UInt32 i = 0; i < count; i++) {
+        if ((blocks[i].flags & ACPI_WMI_METHOD) && memcmp(blocks[i].guid, guid, 16) == 0)
+            return &blocks[i];
+    }
+
+    return NULL;
+}
+
+#endif /* WMIBlock_h */
@@ -0,0 +1,265 @@
+/*
+ *  Released under "The GNU General Public License (GPL-2.0)"
+ *
+ *  This program is free software; you can redistribute it and/or modify it
+ *  under the terms of the GNU General Public License as published by the
+ *  Free Software Foundation; either version 2 of the License, or (at your
+ *  option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful, but
+ *  WITHOUT ANY WARRANTY; without even the implied warranty of MERCHANTABILITY
+ *  or FITNESS FOR A PARTICULAR PURPOSE. See the GNU General Public License
+ *  for more details.
+ *
+ *  You should have received a copy of the GNU General Public License along
+ *  with this program; if not, write to the Free Software Foundation, Inc.,
+ *  59 Temple Place, Suite 330, Boston, MA 02111-1307 USA
+ *
+ */
+
+#include <IOKit/IOLib.h>
+#include <IOKit/IOLocks.h>
+#include "common.h"
+#include "WakeTrace.h"
+
+struct WakeRecord
+{
+    UInt32 id;
+    UInt32 children;
+    UInt64 stamp[kWakeStageCount];
+};
+
+static IOLock* sLock = NULL;
+
+static UInt32 sNextId = 0;
+static WakeRecord sCurrent;     // open trace, id == 0 when none
+static WakeRecord sLast;        // most recently closed trace
+
+static UInt64 sHistory[kWakeTraceHistory];
+static UInt32 sHistoryCount = 0;
+static UInt32 sHistoryNext = 0;
+
+static const char* sStageNames[kWakeStageCount] =
+{
+    "pm-callback",
+    "acpi-done",
+    "probe-requested",
+    "first-child",
+    "last-child"
+};
+
+// Duration of a trace, measured up to the latest stage reached
+static UInt64 traceDuration(const WakeRecord* record)
+{
+    UInt64 latest = 0;
+
+    for (int i = kWakeStagePMCallback + 1; i < kWakeStageCount; i++) {
+        if (record->stamp[i] > latest)
+            latest = record->stamp[i];
+    }
+
+    return latest ? latest - record->stamp[kWakeStagePMCallback] : 0;
+}
+
+// Must be called with the lock held
+static void closeCurrent()
+{
+    if (sCurrent.id == 0)
+        return;
+
+    sHistory[sHistoryNext] = traceDuration(&sCurrent);
+    sHistoryNext = (sHistoryNext + 1) % kWakeTraceHistory;
+    if (sHistoryCount < kWakeTraceHistory)
+        sHistoryCount++;
+
+    sLast = sCurrent;
+    bzero(&sCurrent, sizeof(sCurrent));
+}
+
+// Once the settle window of the wake rescan passed no child joins the trace
+// anymore, it is complete without waiting for the next sleep. Must be called
+// with the lock held
+static void closeSettled(UInt64 now)
+{
+    UInt64 requested = sCurrent.stamp[kWakeStageProbeRequested];
+
+    if (sCurrent.id != 0 && requested != 0 && now - requested > kWakeTraceSettleMS * 1000000ULL)
+        closeCurrent();
+}
+
+bool WakeTrace::initialize()
+{
+    sLock = IOLockAlloc();
+
+    return sLock != NULL;
+}
+
+void WakeTrace::finalize()
+{
+    if (sLock != NULL) {
+        IOLockFree(sLock);
+        sLock = NULL;
+    }
+}
+
+UInt32 WakeTrace::begin()
+{
+    UInt32 id;
+
+    IOLockLock(sLock);
+    if (sCurrent.id == 0) {
+        if (++sNextId == 0)
+            sNextId = 1;
+
+        sCurrent.id = sNextId;
+        sCurrent.stamp[kWakeStagePMCallback] = getUptimeNanoseconds();
+        DebugLog("wake trace %u started\n", sCurrent.id);
+    }
+    id = sCurrent.id;
+    IOLockUnlock(sLock);
+
+    return id;
+}
+
+void WakeTrace::mark(UInt32 stage)
+{
+    if (stage >= kWakeStageCount)
+        return;
+
+    IOLockLock(sLock);
+    if (sCurrent.id != 0 && sCurrent.stamp[stage] == 0)
+        sCurrent.stamp[stage] = getUptimeNanoseconds();
+    IOLockUnlock(sLock);
+}
+
+void WakeTrace::childPublished()
+{
+    UInt64 now = getUptimeNanoseconds();
+
+    IOLockLock(sLock);
+    // only children published by the wake rescan belong to the trace
+    UInt64 requested = sCurrent.stamp[kWakeStageProbeRequested];
+    if (sCurrent.id != 0 && requested != 0 && now - requested <= kWakeTraceSettleMS * 1000000ULL) {
+        if (sCurrent.stamp[kWakeStageFirstChild] == 0)
+            sCurrent.stamp[kWakeStageFirstChild] = now;
+        sCurrent.stamp[kWakeStageLastChild] = now;
+        sCurrent.children++;
+    }
+    IOLockUnlock(sLock);
+}
+
+void WakeTrace::end()
+{
+    IOLockLock(sLock);
+    closeCurrent();
+    IOLockUnlock(sLock);
+}
+
+UInt32 WakeTrace::currentId()
+{
+    UInt32 id;
+
+    IOLockLock(sLock);
+    id = sCurrent.id;
+    IOLockUnlock(sLock);
+
+    return id;
+}
+
+static OSDictionary* copyRecord(const WakeRecord* record)
+{
+    OSDictionary* dict = OSDictionary::withCapacity(kWakeStageCount + 2);
+    OSNumber* osNum;
+
+    if (dict == NULL)
+        return NULL;
+
+    osNum = OSNumber::withNumber(record->id, 32);
+    dict->setObject("id", osNum);
+    osNum->release();
+
+    osNum = OSNumber::withNumber(record->children, 32);
+    dict->setObject("children", osNum);
+    osNum->release();
+
+    // stages are reported in nanoseconds relative to the PM callback
+    for (int i = kWakeStagePMCallback + 1; i < kWakeStageCount; i++) {
+        if (record->stamp[i] == 0)
+            continue;
+
+        osNum = OSNumber::withNumber(record->stamp[i] - record->stamp[kWakeStagePMCallback], 64);
+        dict->setObject(sStageNames[i], osNum);
+        osNum->release();
+    }
+
+    return dict;
+}
+
+// Nearest rank, pct percent of the samples are at or below it
+static UInt64 percentile(const UInt64* sorted, UInt32 count, UInt32 pct)
+{
+    return count ? sorted[(count * pct + 99) / 100 - 1] : 0;
+}
+
+void WakeTrace::publish(IOService* service)
+{
+    UInt64 sorted[kWakeTraceHistory];
+    UInt32 count;
+    OSDictionary* current;
+    OSDictionary* last;
+    UInt64 now = getUptimeNanoseconds();
+
+    IOLockLock(sLock);
+    closeSettled(now);
+    current = sCurrent.id ? copyRecord(&sCurrent) : NULL;
+    last = sLast.id ? copyRecord(&sLast) : NULL;
+    count = sHistoryCount;
+    memcpy(sorted, sHistory, count * sizeof(UInt64));
+    IOLockUnlock(sLock);
+
+    // insertion sort, the history is small
+    for (UInt32 i = 1; i < count; i++) {
+        UInt64 value = sorted[i];
+        UInt32 j = i;
+
+        while (j > 0 && sorted[j - 1] > value) {
+            sorted[j] = sorted[j - 1];
+            j--;
+        }
+        sorted[j] = value;
+    }
+
+    OSDictionary* dict = OSDictionary::withCapacity(5);
+    OSNumber* osNum;
+
+    if (dict == NULL) {
+        OSSafeReleaseNULL(current);
+        OSSafeReleaseNULL(last);
+        return;
+    }
+
+    if (current) {
+        dict->setObject("current", current);
+        current->release();
+    }
+
+    if (last) {
+        dict->setObject("last", last);
+        last->release();
+    }
+
+    osNum = OSNumber::withNumber(count, 32);
+    dict->setObject("samples", osNum);
+    osNum->release();
+
+    osNum = OSNumber::withNumber(percentile(sorted, count, 50), 64);
+    dict->setObject("p50", osNum);
+    osNum->release();
+
+    osNum = OSNumber::withNumber(percentile(sorted, count, 99), 64);
+    dict->setObject("p99", osNum);
+    osNum->release();
+
+    service->setProperty(kWakeTraceKey, dict);
+    dict->release();
+}
@@ -0,0 +1,64 @@
+/*
+ *  Released under "The GNU General Public License (GPL-2.0)"
+ *
+ *  This program is free software; you can redistribute it and/or modify it
+ *  under the terms of the GNU General Public License as published by the
+ *  Free Software Foundation; either version 2 of the License, or (at your
+ *  option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful, but
+ *  WITHOUT ANY WARRANTY; without even the implied warranty of MERCHANTABILITY
+ *  or FITNESS FOR A PARTICULAR PURPOSE. See the GNU General Public License
+ *  for more details.
+ *
+ *  You should have received a copy of the GNU General Public License along
+ *  with this program; if not, write to the Free Software Foundation, Inc.,
+ *  59 Temple Place, Suite 330, Boston, MA 02111-1307 USA
+ *
+ */
+
+#ifndef WakeTrace_h
+#define WakeTrace_h
+
+#include <IOKit/IOService.h>
+
+#define kWakeTraceKey "WakeTrace"
+
+// Number of completed wakes kept for the rolling percentiles
+#define kWakeTraceHistory 64
+
+// Children published later than this after the wake rescan was requested
+// are hotplugs, not part of the wake
+#define kWakeTraceSettleMS 10000
+
+// Stages of a wake, from the system wake callback until devices behind the bridge are usable
+enum
+{
+    kWakeStagePMCallback = 0,
+    kWakeStageACPIDone,
+    kWakeStageProbeRequested,
+    kWakeStageFirstChild,
+    kWakeStageLastChild,
+    kWakeStageCount
+};
+
+// Kext-wide wake trace shared by IOElectrify and IOElectrifyBridge.
+// The first wake callback of either driver opens a trace, later stages are
+// stamped against the same trace id, and sleep closes it.
+class WakeTrace
+{
+public:
+    // Called from module start/stop
+    static bool initialize();
+    static void finalize();
+
+    static UInt32 begin();
+    static void mark(UInt32 stage);
+    static void childPublished();
+    static void end();
+
+    static UInt32 currentId();
+    static void publish(IOService* service);
+};
+
+#endif /* WakeTrace_h */
@@ -20,11 +20,30 @@
 #ifndef common_h
 #define common_h
 
+#include <kern/clock.h>
+
+#ifndef DebugLog
 #ifdef DEBUG
 #define DebugLog(args...) do { IOLog("IOElectrify: " args); } while (0)
 #else
 #define DebugLog(args...) do { } while (0)
 #endif
+#endif
+#ifndef AlwaysLog
 #define AlwaysLog(args...) do { IOLog("IOElectrify: " args); } while (0)
+#endif
+
+// Monotonic uptime in nanoseconds, used for all timing in the driver
+static inline UInt64 getUptimeNanoseconds()
+{
+    UInt64 abstime, ns;
+    clock_get_uptime(&abstime);
+    absolutetime_to_nanoseconds(abstime, &ns);
+    return ns;
+}
+
+// Read of a counter other threads update with OSAddAtomic and friends,
+// a plain load may tear or be served from a stale register copy
+#define atomicLoad(counter) __atomic_load_n(&(counter), __ATOMIC_RELAXED)
 
 #endif /* common_h */
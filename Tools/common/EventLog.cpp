@@ -0,0 +1,128 @@
+/*
+ *  Released under "The GNU General Public License (GPL-2.0)"
+ *
+ *  This program is free software; you can redistribute it and/or modify it
+ *  under the terms of the GNU General Public License as published by the
+ *  Free Software Foundation; either version 2 of the License, or (at your
+ *  option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful, but
+ *  WITHOUT ANY WARRANTY; without even the implied warranty of MERCHANTABILITY
+ *  or FITNESS FOR A PARTICULAR PURPOSE. See the GNU General Public License
+ *  for more details.
+ *
+ *  You should have received a copy of the GNU General Public License along
+ *  with this program; if not, write to the Free Software Foundation, Inc.,
+ *  59 Temple Place, Suite 330, Boston, MA 02111-1307 USA
+ *
+ */
+
+#include <stdlib.h>
+#include <string.h>
+#include <algorithm>
+
+#include "EventLog.h"
+
+static const char* sTypeNames[] = { NULL, "pm", "acpi", "probe", "client" };
+static const char* sSourceNames[] = { "controller", "bridge" };
+
+#define kTypeNameCount (sizeof(sTypeNames) / sizeof(sTypeNames[0]))
+#define kSourceNameCount (sizeof(sSourceNames) / sizeof(sSourceNames[0]))
+
+const char* eventTypeName(UInt16 type)
+{
+    return type < kTypeNameCount && sTypeNames[type] != NULL ? sTypeNames[type] : "unknown";
+}
+
+const char* eventSourceName(UInt16 source)
+{
+    return source < kSourceNameCount ? sSourceNames[source] : "unknown";
+}
+
+static bool lookup(const char* name, const char* const* names, unsigned int count, UInt16* value)
+{
+    for (unsigned int i = 0; i < count; i++) {
+        if (names[i] != NULL && strcmp(name, names[i]) == 0) {
+            *value = (UInt16)i;
+            return true;
+        }
+    }
+
+    return false;
+}
+
+void writeEventLog(FILE* file, const RecorderEvent* events, UInt32 count)
+{
+    fprintf(file, "# timestamp duration wake type source name result args\n");
+
+    for (UInt32 i = 0; i < count; i++) {
+        const RecorderEvent* event = &events[i];
+        char name[sizeof(event->name) + 1];
+
+        memcpy(name, event->name, sizeof(event->name));
+        name[sizeof(event->name)] = 0;
+
+        fprintf(file, "%llu %llu %u %s %s %s 0x%x", (unsigned long long)event->timestamp,
+                (unsigned long long)event->duration, event->wakeId, eventTypeName(event->type),
+                eventSourceName(event->source), name[0] ? name : "-", event->result);
+        for (UInt32 j = 0; j < event->argCount && j < kRecorderMaxArgs; j++)
+            fprintf(file, " %u", event->args[j]);
+        fprintf(file, "\n");
+    }
+}
+
+bool readEventLog(FILE* file, std::vector<RecorderEvent>* events, int* line)
+{
+    char text[256];
+
+    for (*line = 1; fgets(text, sizeof(text), file) != NULL; (*line)++) {
+        RecorderEvent event;
+        UInt16 type, source;
+        char* fields[7 + kRecorderMaxArgs];
+        int count = 0;
+        char* end;
+
+        if (text[0] == '#')
+            continue;
+
+        for (char* token = strtok(text, " \t\r\n"); token != NULL && count < (int)(sizeof(fields) / sizeof(fields[0]));
+             token = strtok(NULL, " \t\r\n"))
+            fields[count++] = token;
+
+        if (count == 0)
+            continue;
+        if (count < 7)
+            return false;
+
+        memset(&event, 0, sizeof(event));
+        event.timestamp = strtoull(fields[0], &end, 10);
+        if (*end != 0)
+            return false;
+        event.duration = strtoull(fields[1], &end, 10);
+        if (*end != 0)
+            return false;
+        event.wakeId = (UInt32)strtoul(fields[2], &end, 10);
+        if (*end != 0)
+            return false;
+        if (!lookup(fields[3], sTypeNames, kTypeNameCount, &type) ||
+            !lookup(fields[4], sSourceNames, kSourceNameCount, &source))
+            return false;
+        event.type = type;
+        event.source = source;
+        if (strcmp(fields[5], "-") != 0)
+            memcpy(event.name, fields[5], std::min(strlen(fields[5]), sizeof(event.name)));
+        event.result = (UInt32)strtoul(fields[6], &end, 16);
+        if (*end != 0)
+            return false;
+
+        for (int i = 7; i < count; i++) {
+            event.args[event.argCount++] = (UInt32)strtoul(fields[i], &end, 10);
+            if (*end != 0)
+                return false;
+        }
+
+        events->push_back(event);
+    }
+
+    return true;
+}
@@ -0,0 +1,45 @@
+/*
+ *  Released under "The GNU General Public License (GPL-2.0)"
+ *
+ *  This program is free software; you can redistribute it and/or modify it
+ *  under the terms of the GNU General Public License as published by the
+ *  Free Software Foundation; either version 2 of the License, or (at your
+ *  option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful, but
+ *  WITHOUT ANY WARRANTY; without even the implied warranty of MERCHANTABILITY
+ *  or FITNESS FOR A PARTICULAR PURPOSE. See the GNU General Public License
+ *  for more details.
+ *
+ *  You should have received a copy of the GNU General Public License along
+ *  with this program; if not, write to the Free Software Foundation, Inc.,
+ *  59 Temple Place, Suite 330, Boston, MA 02111-1307 USA
+ *
+ */
+
+#ifndef EventLog_h
+#define EventLog_h
+
+// Text form of the kext's event log (see Recorder.h), written by electrifyctl
+// and read back by the replayer. One event per line:
+//
+//   <timestamp> <duration> <wake id> <type> <source> <name> <result> [args...]
+//
+// Times are ns of uptime, type is pm, acpi, probe or client, source is
+// controller or bridge, name is - when empty and result is hexadecimal.
+// Lines starting with # are comments.
+
+#include <stdio.h>
+#include <vector>
+
+#include "Recorder.h"
+
+const char* eventTypeName(UInt16 type);
+const char* eventSourceName(UInt16 source);
+
+void writeEventLog(FILE* file, const RecorderEvent* events, UInt32 count);
+
+// Appends to events, false with the number of the offending line in *line
+bool readEventLog(FILE* file, std::vector<RecorderEvent>* events, int* line);
+
+#endif /* EventLog_h */
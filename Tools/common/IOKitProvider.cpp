@@ -0,0 +1,324 @@
+/*
+ *  Released under "The GNU General Public License (GPL-2.0)"
+ *
+ *  This program is free software; you can redistribute it and/or modify it
+ *  under the terms of the GNU General Public License as published by the
+ *  Free Software Foundation; either version 2 of the License, or (at your
+ *  option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful, but
+ *  WITHOUT ANY WARRANTY; without even the implied warranty of MERCHANTABILITY
+ *  or FITNESS FOR A PARTICULAR PURPOSE. See the GNU General Public License
+ *  for more details.
+ *
+ *  You should have received a copy of the GNU General Public License along
+ *  with this program; if not, write to the Free Software Foundation, Inc.,
+ *  59 Temple Place, Suite 330, Boston, MA 02111-1307 USA
+ *
+ */
+
+#include <stddef.h>
+#include <string.h>
+
+#include "Provider.h"
+
+#ifdef __APPLE__
+
+#include <mach/mach.h>
+#include <CoreFoundation/CoreFoundation.h>
+#include <IOKit/IOKitLib.h>
+#include <IOKit/ps/IOPowerSources.h>
+#include <IOKit/ps/IOPSKeys.h>
+
+class IOKitProvider : public Provider
+{
+public:
+    IOKitProvider() : mController(IO_OBJECT_NULL), mBridge(IO_OBJECT_NULL), mBridgeDevice(IO_OBJECT_NULL)
+    {
+        memset(mQueues, 0, sizeof(mQueues));
+    }
+    virtual ~IOKitProvider();
+
+    bool open();
+
+    virtual const char* name() const { return "iokit"; }
+    virtual int forcePower(UInt32 on);
+    virtual int setPowerHook(UInt32 hook);
+    virtual int probe(UInt32 options, UInt32* result);
+    virtual int submit(UInt32 queue, const CommandEntry* commands, UInt32 count, CompletionEntry* completions);
+    virtual int copyResidency(PowerResidencyRecord* record);
+    virtual int resetResidency();
+    virtual int copyEvents(RecorderEvent* events, UInt32 maxEvents, UInt32* count);
+    virtual int countDevices();
+    virtual bool onACPower();
+
+private:
+    int levelBelowBridge(io_registry_entry_t entry);
+    CommandQueue* mapQueue(UInt32 queue);
+
+    io_connect_t mController;
+    io_connect_t mBridge;
+    io_registry_entry_t mBridgeDevice;  // PCI device the bridge driver attached to
+
+    // mapped on first submit, indexed by kQueueController / kQueueBridge
+    CommandQueue* mQueues[2];
+    std::mutex mQueueLocks[2];
+};
+
+// Only the first instance of each driver is used
+static io_connect_t openService(const char* className, io_registry_entry_t* provider)
+{
+    io_service_t service = IOServiceGetMatchingService(kIOMasterPortDefault, IOServiceMatching(className));
+    io_connect_t connect = IO_OBJECT_NULL;
+
+    if (service == IO_OBJECT_NULL)
+        return IO_OBJECT_NULL;
+
+    if (IOServiceOpen(service, mach_task_self(), 0, &connect) != KERN_SUCCESS)
+        connect = IO_OBJECT_NULL;
+
+    if (provider != NULL && IORegistryEntryGetParentEntry(service, kIOServicePlane, provider) != KERN_SUCCESS)
+        *provider = IO_OBJECT_NULL;
+
+    IOObjectRelease(service);
+
+    return connect;
+}
+
+IOKitProvider::~IOKitProvider()
+{
+    if (mQueues[kQueueController] != NULL)
+        IOConnectUnmapMemory64(mController, kCommandQueueMemoryType, mach_task_self(), (mach_vm_address_t)mQueues[kQueueController]);
+    if (mQueues[kQueueBridge] != NULL)
+        IOConnectUnmapMemory64(mBridge, kCommandQueueMemoryType, mach_task_self(), (mach_vm_address_t)mQueues[kQueueBridge]);
+    if (mController != IO_OBJECT_NULL)
+        IOServiceClose(mController);
+    if (mBridge != IO_OBJECT_NULL)
+        IOServiceClose(mBridge);
+    if (mBridgeDevice != IO_OBJECT_NULL)
+        IOObjectRelease(mBridgeDevice);
+}
+
+bool IOKitProvider::open()
+{
+    mController = openService("IOElectrify", NULL);
+    mBridge = openService("IOElectrifyBridge", &mBridgeDevice);
+
+    return mController != IO_OBJECT_NULL && mBridge != IO_OBJECT_NULL;
+}
+
+int IOKitProvider::forcePower(UInt32 on)
+{
+    uint64_t input = on;
+    uint64_t output = 0;
+    uint32_t outputCount = 1;
+
+    return IOConnectCallScalarMethod(mController, kControllerSelectorForcePower, &input, 1, &output, &outputCount);
+}
+
+int IOKitProvider::setPowerHook(UInt32 hook)
+{
+    uint64_t input = hook;
+    uint64_t output = 0;
+    uint32_t outputCount = 1;
+
+    return IOConnectCallScalarMethod(mController, kControllerSelectorPowerHook, &input, 1, &output, &outputCount);
+}
+
+int IOKitProvider::probe(UInt32 options, UInt32* result)
+{
+    uint64_t input = options;
+    uint64_t output = 0;
+    uint32_t outputCount = 1;
+    kern_return_t kr = IOConnectCallScalarMethod(mBridge, kBridgeSelectorProbe, &input, 1, &output, &outputCount);
+
+    *result = (UInt32)output;
+    return kr;
+}
+
+CommandQueue* IOKitProvider::mapQueue(UInt32 queue)
+{
+    io_connect_t connect = queue == kQueueController ? mController : mBridge;
+    mach_vm_address_t address = 0;
+    mach_vm_size_t size = 0;
+
+    if (mQueues[queue] != NULL)
+        return mQueues[queue];
+
+    if (IOConnectMapMemory64(connect, kCommandQueueMemoryType, mach_task_self(), &address, &size,
+                             kIOMapAnywhere) != KERN_SUCCESS || size < sizeof(CommandQueue))
+        return NULL;
+
+    mQueues[queue] = (CommandQueue*)address;
+    return mQueues[queue];
+}
+
+int IOKitProvider::submit(UInt32 queue, const CommandEntry* commands, UInt32 count, CompletionEntry* completions)
+{
+    if (queue > kQueueBridge)
+        return kProviderUnsupported;
+
+    std::lock_guard<std::mutex> lock(mQueueLocks[queue]);
+    io_connect_t connect = queue == kQueueController ? mController : mBridge;
+    uint32_t selector = queue == kQueueController ? kControllerSelectorDoorbell : kBridgeSelectorDoorbell;
+    CommandQueue* ring = mapQueue(queue);
+    UInt32 done = 0;
+
+    if (ring == NULL)
+        return kProviderUnsupported;
+
+    while (done < count) {
+        UInt32 tail = ring->submitTail;
+        UInt32 batch = 0;
+
+        // the completion ring is empty between calls, so a full submission ring always fits
+        while (done + batch < count && batch < kCommandQueueEntries) {
+            ring->submit[(tail + batch) & (kCommandQueueEntries - 1)] = commands[done + batch];
+            batch++;
+        }
+
+        commandQueueStore(ring->submitTail, tail + batch);
+
+        uint64_t output = 0;
+        uint32_t outputCount = 1;
+        kern_return_t kr = IOConnectCallScalarMethod(connect, selector, NULL, 0, &output, &outputCount);
+        if (kr != KERN_SUCCESS)
+            return kr;
+        if (output == 0)
+            return kProviderUnsupported;    // nothing drained, don't spin
+
+        UInt32 head = ring->completeHead;
+        UInt32 completeTail = commandQueueLoad(ring->completeTail);
+        while (head != completeTail)
+            completions[done++] = ring->complete[head++ & (kCommandQueueEntries - 1)];
+        commandQueueStore(ring->completeHead, head);
+    }
+
+    return kProviderSuccess;
+}
+
+int IOKitProvider::copyResidency(PowerResidencyRecord* record)
+{
+    size_t size = sizeof(*record);
+
+    return IOConnectCallStructMethod(mController, kControllerSelectorResidency, NULL, 0, record, &size);
+}
+
+int IOKitProvider::resetResidency()
+{
+    return IOConnectCallScalarMethod(mController, kControllerSelectorResetResidency, NULL, 0, NULL, NULL);
+}
+
+int IOKitProvider::copyEvents(RecorderEvent* events, UInt32 maxEvents, UInt32* count)
+{
+    uint64_t output = 0;
+    uint32_t outputCount = 1;
+    size_t size = maxEvents * sizeof(RecorderEvent);
+    kern_return_t kr = IOConnectCallMethod(mController, kControllerSelectorEventLog, NULL, 0, NULL, 0,
+                                           &output, &outputCount, events, &size);
+
+    *count = kr == KERN_SUCCESS ? (UInt32)output : 0;
+    return kr;
+}
+
+// Number of PCI levels between entry and the bridge's root port, 0 when entry isn't behind it
+int IOKitProvider::levelBelowBridge(io_registry_entry_t entry)
+{
+    io_registry_entry_t current = entry;
+    int level = 1;
+    bool found = false;
+
+    IOObjectRetain(current);
+    while (!found) {
+        io_registry_entry_t parent;
+
+        if (IORegistryEntryGetParentEntry(current, kIOServicePlane, &parent) != KERN_SUCCESS)
+            break;
+
+        IOObjectRelease(current);
+        current = parent;
+        found = IOObjectIsEqualTo(current, mBridgeDevice);
+        if (!found && IOObjectConformsTo(current, "IOPCIDevice"))
+            level++;
+    }
+    IOObjectRelease(current);
+
+    return found ? level : 0;
+}
+
+static UInt32 classCode(io_registry_entry_t entry)
+{
+    CFTypeRef data = IORegistryEntryCreateCFProperty(entry, CFSTR("class-code"), kCFAllocatorDefault, 0);
+    UInt32 value = 0;
+
+    if (data == NULL)
+        return 0;
+
+    if (CFGetTypeID(data) == CFDataGetTypeID() && CFDataGetLength((CFDataRef)data) >= 4) {
+        const UInt8* bytes = CFDataGetBytePtr((CFDataRef)data);
+        value = bytes[0] | (bytes[1] << 8) | (bytes[2] << 16);
+    }
+    CFRelease(data);
+
+    return value;
+}
+
+int IOKitProvider::countDevices()
+{
+    io_iterator_t iterator;
+    io_service_t service;
+    int count = 0;
+
+    if (mBridgeDevice == IO_OBJECT_NULL)
+        return 0;
+
+    if (IOServiceGetMatchingServices(kIOMasterPortDefault, IOServiceMatching("IOPCIDevice"), &iterator) != KERN_SUCCESS)
+        return 0;
+
+    while ((service = IOIteratorNext(iterator)) != IO_OBJECT_NULL) {
+        if (isAttachedDevice(levelBelowBridge(service), classCode(service)))
+            count++;
+        IOObjectRelease(service);
+    }
+    IOObjectRelease(iterator);
+
+    return count;
+}
+
+bool IOKitProvider::onACPower()
+{
+    CFTypeRef info = IOPSCopyPowerSourcesInfo();
+    bool ac = true;
+
+    if (info == NULL)
+        return ac;
+
+    CFStringRef type = IOPSGetProvidingPowerSourceType(info);
+    if (type != NULL)
+        ac = CFStringCompare(type, CFSTR(kIOPMACPowerKey), 0) == kCFCompareEqualTo;
+
+    CFRelease(info);
+
+    return ac;
+}
+
+Provider* createIOKitProvider()
+{
+    IOKitProvider* provider = new IOKitProvider();
+
+    if (!provider->open()) {
+        delete provider;
+        return NULL;
+    }
+
+    return provider;
+}
+
+#else
+
+Provider* createIOKitProvider()
+{
+    return NULL;
+}
+
+#endif
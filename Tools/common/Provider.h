@@ -0,0 +1,172 @@
+/*
+ *  Released under "The GNU General Public License (GPL-2.0)"
+ *
+ *  This program is free software; you can redistribute it and/or modify it
+ *  under the terms of the GNU General Public License as published by the
+ *  Free Software Foundation; either version 2 of the License, or (at your
+ *  option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful, but
+ *  WITHOUT ANY WARRANTY; without even the implied warranty of MERCHANTABILITY
+ *  or FITNESS FOR A PARTICULAR PURPOSE. See the GNU General Public License
+ *  for more details.
+ *
+ *  You should have received a copy of the GNU General Public License along
+ *  with this program; if not, write to the Free Software Foundation, Inc.,
+ *  59 Temple Place, Suite 330, Boston, MA 02111-1307 USA
+ *
+ */
+
+#ifndef Provider_h
+#define Provider_h
+
+// Access to the IOElectrify user clients for the host-side tools.
+// The IOKit provider talks to the kext, the stub provider stands in for it
+// on machines without one (Linux, CI) with configurable latencies.
+
+#include <mutex>
+#include <vector>
+
+#include "OSTypesCompat.h"
+#include "CommandQueue.h"
+#include "PowerResidency.h"
+#include "Recorder.h"
+
+// IOElectrifyUserClient selectors, see IOElectrify.h
+#define kControllerSelectorForcePower   0
+#define kControllerSelectorPowerHook    1
+#define kControllerSelectorEventLog     2
+#define kControllerSelectorDoorbell     4
+#define kControllerSelectorResidency    5
+#define kControllerSelectorResetResidency 6
+
+// IOElectrifyBridgeUserClient selectors, see IOElectrifyBridge.h
+#define kBridgeSelectorProbe            0
+#define kBridgeSelectorDoorbell         2
+
+// Command queue pairs, one per user client
+enum
+{
+    kQueueController = 0,
+    kQueueBridge
+};
+
+// Bridge probe options, as in IOPCIBridge.h
+#define kProbeOptionDone                0x80000000
+#define kProbeOptionEject               0x00100000
+#define kProbeOptionNeedsScan           0x00200000
+
+// Attached devices are counted the way the kext counts them. The Thunderbolt
+// controller takes the first two PCI levels below the root port, its upstream
+// and downstream ports. Behind a downstream port sits either one of its own
+// functions (NHI, xHCI), an endpoint that shows up whenever the controller is
+// powered, or the upstream port of an attached device's own switch, a bridge.
+#define kAttachedDeviceLevel            3           // levels below the root port
+#define kPCIClassBridge                 0x060400    // PCI-to-PCI bridge class code
+
+static inline bool isAttachedDevice(int level, UInt32 classCode)
+{
+    return level == kAttachedDeviceLevel && (classCode & 0xffff00) == kPCIClassBridge;
+}
+
+#define kProviderSuccess                0
+#define kProviderUnsupported            ((int)0xe00002c7)   // kIOReturnUnsupported
+
+class Provider
+{
+public:
+    virtual ~Provider() {}
+
+    virtual const char* name() const = 0;
+
+    // Turn force-power on or off, returns the status from the controller
+    virtual int forcePower(UInt32 on) = 0;
+
+    // Replace the IOElectrifyPowerHook mask
+    virtual int setPowerHook(UInt32 hook) = 0;
+
+    // Ask the bridge to eject and/or rescan, returns the status of the call
+    virtual int probe(UInt32 options, UInt32* result) = 0;
+
+    // Run a batch through the controller or bridge command queue with one
+    // doorbell per queue full, completions come back in submission order
+    virtual int submit(UInt32 queue, const CommandEntry* commands, UInt32 count, CompletionEntry* completions) = 0;
+
+    // Force-power residency and transition cost of the current session
+    virtual int copyResidency(PowerResidencyRecord* record) = 0;
+    virtual int resetResidency() = 0;
+
+    // Oldest first, at most maxEvents of the kext's event log
+    virtual int copyEvents(RecorderEvent* events, UInt32 maxEvents, UInt32* count) = 0;
+
+    // Number of Thunderbolt devices attached behind the bridge, see isAttachedDevice
+    virtual int countDevices() = 0;
+
+    virtual bool onACPower() = 0;
+};
+
+struct StubConfig
+{
+    UInt32 forcePowerUS;        // simulated force-power latency
+    UInt32 probeUS;             // simulated rescan latency
+    bool realTime;              // actually wait for the latencies, otherwise only account for them
+};
+
+class StubProvider : public Provider
+{
+public:
+    explicit StubProvider(const StubConfig& config);
+
+    virtual const char* name() const { return "stub"; }
+    virtual int forcePower(UInt32 on);
+    virtual int setPowerHook(UInt32 hook);
+    virtual int probe(UInt32 options, UInt32* result);
+    virtual int submit(UInt32 queue, const CommandEntry* commands, UInt32 count, CompletionEntry* completions);
+    virtual int copyResidency(PowerResidencyRecord* record);
+    virtual int resetResidency();
+    virtual int copyEvents(RecorderEvent* events, UInt32 maxEvents, UInt32* count);
+    virtual int countDevices();
+    virtual bool onACPower();
+
+    // Knobs for simulations, count is the number of devices plugged in
+    void setDevices(int count) { mDevices = count; }
+    void setACPower(bool ac) { mACPower = ac; }
+
+    bool forcePowered() const { return mForcePowered; }
+    UInt64 busyTime() const { return mBusyUS; }
+    UInt32 forcePowerCalls() const { return mForcePowerCalls; }
+    UInt32 probeCalls() const { return mProbeCalls; }
+
+private:
+    struct PCIDevice
+    {
+        int level;              // below the root port
+        UInt32 classCode;
+    };
+
+    void enumerate(std::vector<PCIDevice>& devices);
+    void spend(UInt32 us);
+    int forcePowerLocked(UInt32 on, UInt32 source);
+    int probeLocked(UInt32 options, UInt32* result);
+
+    // calls are serialized like the kext serializes force-power and probes
+    std::mutex mLock;
+
+    StubConfig mConfig;
+    UInt32 mPowerHook;
+    bool mForcePowered;
+    bool mACPower;
+    int mDevices;
+    UInt64 mBusyUS;
+    UInt32 mForcePowerCalls;
+    UInt32 mProbeCalls;
+
+    // residency in simulated time, the clock advances with what was spent
+    PowerResidencyRecord mResidency;
+    UInt64 mStateSince;
+};
+
+// NULL when the kext isn't loaded or IOKit isn't available on this host
+Provider* createIOKitProvider();
+
+#endif /* Provider_h */
@@ -0,0 +1,214 @@
+/*
+ *  Released under "The GNU General Public License (GPL-2.0)"
+ *
+ *  This program is free software; you can redistribute it and/or modify it
+ *  under the terms of the GNU General Public License as published by the
+ *  Free Software Foundation; either version 2 of the License, or (at your
+ *  option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful, but
+ *  WITHOUT ANY WARRANTY; without even the implied warranty of MERCHANTABILITY
+ *  or FITNESS FOR A PARTICULAR PURPOSE. See the GNU General Public License
+ *  for more details.
+ *
+ *  You should have received a copy of the GNU General Public License along
+ *  with this program; if not, write to the Free Software Foundation, Inc.,
+ *  59 Temple Place, Suite 330, Boston, MA 02111-1307 USA
+ *
+ */
+
+#include <string.h>
+#include <unistd.h>
+
+#include "Provider.h"
+
+StubProvider::StubProvider(const StubConfig& config) :
+    mConfig(config),
+    mPowerHook(0),
+    mForcePowered(false),
+    mACPower(false),
+    mDevices(0),
+    mBusyUS(0),
+    mForcePowerCalls(0),
+    mProbeCalls(0),
+    mStateSince(0)
+{
+    memset(&mResidency, 0, sizeof(mResidency));
+}
+
+void StubProvider::spend(UInt32 us)
+{
+    mBusyUS += us;
+    if (mConfig.realTime && us)
+        usleep(us);
+}
+
+int StubProvider::forcePower(UInt32 on)
+{
+    std::lock_guard<std::mutex> lock(mLock);
+
+    return forcePowerLocked(on, kResidencySourceClient);
+}
+
+int StubProvider::forcePowerLocked(UInt32 on, UInt32 source)
+{
+    int state = on ? 1 : 0;
+    UInt64 start = mBusyUS;
+
+    mForcePowerCalls++;
+
+    // the firmware returns right away when the state doesn't change
+    if (mForcePowered != (on != 0))
+        spend(mConfig.forcePowerUS);
+
+    mResidency.acpiCalls[state]++;
+    mResidency.acpiTime[state] += (mBusyUS - start) * 1000;
+    mResidency.acpiMean[state] = mResidency.acpiTime[state] / mResidency.acpiCalls[state];
+
+    if (mForcePowered != (on != 0)) {
+        mResidency.residency[mResidency.state] += (mBusyUS - mStateSince) * 1000;
+        mResidency.transitions[source][state]++;
+        mResidency.state = state;
+        mStateSince = mBusyUS;
+    }
+
+    mForcePowered = (on != 0);
+    return kProviderSuccess;
+}
+
+int StubProvider::setPowerHook(UInt32 hook)
+{
+    std::lock_guard<std::mutex> lock(mLock);
+
+    mPowerHook = hook;
+    return kProviderSuccess;
+}
+
+int StubProvider::probe(UInt32 options, UInt32* result)
+{
+    std::lock_guard<std::mutex> lock(mLock);
+
+    return probeLocked(options, result);
+}
+
+int StubProvider::probeLocked(UInt32 options, UInt32* result)
+{
+    mProbeCalls++;
+
+    if (options & kProbeOptionEject)
+        mDevices = 0;
+    if (options & kProbeOptionNeedsScan)
+        spend(mConfig.probeUS);
+
+    *result = 1;
+    return kProviderSuccess;
+}
+
+// The kext drains a batch in one go, so does the stub
+int StubProvider::submit(UInt32 queue, const CommandEntry* commands, UInt32 count, CompletionEntry* completions)
+{
+    std::lock_guard<std::mutex> lock(mLock);
+
+    for (UInt32 i = 0; i < count; i++) {
+        UInt32 opcode = commands[i].opcode;
+        UInt32 result = 0;
+        int status;
+
+        if (queue == kQueueController && opcode == kCommandForcePower) {
+            status = forcePowerLocked((UInt32)commands[i].arg, kResidencySourceClient);
+            result = status;
+        }
+        else if (queue == kQueueController && opcode == kCommandPowerHook) {
+            mPowerHook = (UInt32)commands[i].arg;
+            status = kProviderSuccess;
+            result = mPowerHook;
+        }
+        else if (queue == kQueueBridge && opcode == kCommandProbe) {
+            status = probeLocked((UInt32)commands[i].arg, &result);
+        }
+        else {
+            status = kProviderUnsupported;
+        }
+
+        completions[i].tag = commands[i].tag;
+        completions[i].status = status;
+        completions[i].result = result;
+    }
+
+    return kProviderSuccess;
+}
+
+int StubProvider::copyResidency(PowerResidencyRecord* record)
+{
+    std::lock_guard<std::mutex> lock(mLock);
+
+    *record = mResidency;
+    record->residency[record->state] += (mBusyUS - mStateSince) * 1000;
+    return kProviderSuccess;
+}
+
+int StubProvider::resetResidency()
+{
+    std::lock_guard<std::mutex> lock(mLock);
+    UInt32 state = mResidency.state;
+
+    memset(&mResidency, 0, sizeof(mResidency));
+    mResidency.sessionStart = mBusyUS * 1000;
+    mResidency.state = state;
+    mStateSince = mBusyUS;
+    return kProviderSuccess;
+}
+
+// Nothing runs the kext's policy here, so there is nothing to record
+int StubProvider::copyEvents(RecorderEvent*, UInt32, UInt32* count)
+{
+    *count = 0;
+    return kProviderUnsupported;
+}
+
+// What sits below the root port: the controller shows up as soon as it is
+// powered, by force-power or by the firmware for a plugged in device, each
+// device comes in through its own switch
+void StubProvider::enumerate(std::vector<PCIDevice>& devices)
+{
+    static const PCIDevice controller[] = {
+        { 1, kPCIClassBridge },     // upstream port
+        { 2, kPCIClassBridge },     // downstream ports
+        { 2, kPCIClassBridge },
+        { 2, kPCIClassBridge },
+        { 3, 0x088000 },            // NHI
+        { 3, 0x0c0330 }             // xHCI
+    };
+    static const PCIDevice device[] = {
+        { 3, kPCIClassBridge },     // the device's upstream port
+        { 4, kPCIClassBridge },     // its downstream port
+        { 5, 0x020000 }             // a NIC behind it
+    };
+
+    if (!mForcePowered && mDevices == 0)
+        return;
+
+    devices.insert(devices.end(), controller, controller + sizeof(controller) / sizeof(controller[0]));
+    for (int i = 0; i < mDevices; i++)
+        devices.insert(devices.end(), device, device + sizeof(device) / sizeof(device[0]));
+}
+
+int StubProvider::countDevices()
+{
+    std::lock_guard<std::mutex> lock(mLock);
+    std::vector<PCIDevice> devices;
+    int count = 0;
+
+    enumerate(devices);
+    for (size_t i = 0; i < devices.size(); i++) {
+        if (isAttachedDevice(devices[i].level, devices[i].classCode))
+            count++;
+    }
+
+    return count;
+}
+
+bool StubProvider::onACPower()
+{
+    return mACPower;
+}
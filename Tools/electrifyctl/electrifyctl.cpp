@@ -0,0 +1,444 @@
+/*
+ *  Released under "The GNU General Public License (GPL-2.0)"
+ *
+ *  This program is free software; you can redistribute it and/or modify it
+ *  under the terms of the GNU General Public License as published by the
+ *  Free Software Foundation; either version 2 of the License, or (at your
+ *  option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful, but
+ *  WITHOUT ANY WARRANTY; without even the implied warranty of MERCHANTABILITY
+ *  or FITNESS FOR A PARTICULAR PURPOSE. See the GNU General Public License
+ *  for more details.
+ *
+ *  You should have received a copy of the GNU General Public License along
+ *  with this program; if not, write to the Free Software Foundation, Inc.,
+ *  59 Temple Place, Suite 330, Boston, MA 02111-1307 USA
+ *
+ */
+
+// electrifyctl - drive the IOElectrify user clients from the command line
+//
+// usage: electrifyctl [-b iokit|stub] [-p force-power-us] [-r rescan-us] command
+//
+//   power on|off               turn force-power on or off
+//   hook <mask>                set the IOElectrifyPowerHook mask
+//   probe <options>            ask the bridge to probe, options are a number or
+//                              a comma separated list of scan, eject and done
+//   bench [-n cycles] [-t threads] [-q]
+//                              cycle force-power and rescans, print latencies,
+//                              with -q through the shared memory command queues
+//   residency [reset]          print force-power residency and transition cost
+//                              of the session, or start a new session
+//   events [-o file]           save the kext's event log for the replayer
+//
+// The stub back end stands in for the kext where it isn't available, with
+// the given simulated force-power and rescan latencies.
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <time.h>
+#include <algorithm>
+#include <thread>
+#include <vector>
+
+#include "Provider.h"
+#include "EventLog.h"
+
+#define kDefaultCycles      100
+
+static UInt64 nanoTime()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (UInt64)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+static void usage(const char* name)
+{
+    fprintf(stderr, "usage: %s [-b iokit|stub] [-p force-power-us] [-r rescan-us] command\n", name);
+    fprintf(stderr, "  power on|off\n");
+    fprintf(stderr, "  hook <mask>\n");
+    fprintf(stderr, "  probe <options>         number, or a list of scan,eject,done\n");
+    fprintf(stderr, "  bench [-n cycles] [-t threads] [-q]\n");
+    fprintf(stderr, "  residency [reset]\n");
+    fprintf(stderr, "  events [-o file]\n");
+}
+
+static bool parseProbeOptions(const char* text, UInt32* options)
+{
+    char buf[64];
+    char* end;
+
+    *options = (UInt32)strtoul(text, &end, 0);
+    if (*end == 0)
+        return true;
+
+    *options = 0;
+    snprintf(buf, sizeof(buf), "%s", text);
+
+    for (char* token = strtok(buf, ","); token != NULL; token = strtok(NULL, ",")) {
+        if (strcmp(token, "scan") == 0)
+            *options |= kProbeOptionNeedsScan;
+        else if (strcmp(token, "eject") == 0)
+            *options |= kProbeOptionEject;
+        else if (strcmp(token, "done") == 0)
+            *options |= kProbeOptionDone;
+        else
+            return false;
+    }
+
+    return true;
+}
+
+static int commandPower(Provider* provider, int argc, char* argv[])
+{
+    if (argc != 2 || (strcmp(argv[1], "on") && strcmp(argv[1], "off")))
+        return -1;
+
+    int ret = provider->forcePower(strcmp(argv[1], "on") == 0);
+    if (ret != kProviderSuccess) {
+        fprintf(stderr, "force-power %s failed: 0x%x\n", argv[1], ret);
+        return 1;
+    }
+
+    printf("force-power %s\n", argv[1]);
+    return 0;
+}
+
+static int commandHook(Provider* provider, int argc, char* argv[])
+{
+    if (argc != 2)
+        return -1;
+
+    UInt32 hook = (UInt32)strtoul(argv[1], NULL, 0);
+    int ret = provider->setPowerHook(hook);
+    if (ret != kProviderSuccess) {
+        fprintf(stderr, "setting power hook failed: 0x%x\n", ret);
+        return 1;
+    }
+
+    printf("power hook 0x%x\n", hook);
+    return 0;
+}
+
+static int commandProbe(Provider* provider, int argc, char* argv[])
+{
+    UInt32 options;
+    UInt32 result;
+
+    if (argc != 2 || !parseProbeOptions(argv[1], &options))
+        return -1;
+
+    int ret = provider->probe(options, &result);
+    if (ret != kProviderSuccess) {
+        fprintf(stderr, "probe 0x%x failed: 0x%x\n", options, ret);
+        return 1;
+    }
+
+    printf("probe 0x%x: %u\n", options, result);
+    return 0;
+}
+
+static int commandResidency(Provider* provider, int argc, char* argv[])
+{
+    PowerResidencyRecord record;
+    int ret;
+
+    if (argc > 2 || (argc == 2 && strcmp(argv[1], "reset")))
+        return -1;
+
+    if (argc == 2) {
+        ret = provider->resetResidency();
+        if (ret != kProviderSuccess) {
+            fprintf(stderr, "resetting residency failed: 0x%x\n", ret);
+            return 1;
+        }
+
+        printf("residency reset\n");
+        return 0;
+    }
+
+    ret = provider->copyResidency(&record);
+    if (ret != kProviderSuccess) {
+        fprintf(stderr, "copying residency failed: 0x%x\n", ret);
+        return 1;
+    }
+
+    UInt64 total = record.residency[0] + record.residency[1];
+
+    printf("force-power %s, session %.3f s\n", record.state ? "on" : "off", total / 1e9);
+    printf("%-7s %12s %7s %6s %6s %6s %8s %12s\n", "", "residency", "", "pm", "client", "policy", "calls",
+           "acpi mean");
+
+    for (int state = 0; state < 2; state++) {
+        printf("%-7s %10.3f s %6.1f%%", state ? "on" : "off", record.residency[state] / 1e9,
+               total ? record.residency[state] * 100.0 / total : 0.0);
+        for (int source = 0; source < kResidencySourceCount; source++)
+            printf(" %6u", record.transitions[source][state]);
+        printf(" %8u %9.1f us\n", record.acpiCalls[state], record.acpiMean[state] / 1e3);
+    }
+
+    return 0;
+}
+
+static int commandEvents(Provider* provider, int argc, char* argv[])
+{
+    const char* path = NULL;
+
+    if (argc == 3 && strcmp(argv[1], "-o") == 0)
+        path = argv[2];
+    else if (argc != 1)
+        return -1;
+
+    std::vector<RecorderEvent> events(kRecorderCapacity);
+    UInt32 count;
+    int ret = provider->copyEvents(&events[0], kRecorderCapacity, &count);
+
+    if (ret != kProviderSuccess) {
+        fprintf(stderr, "copying the event log failed: 0x%x\n", ret);
+        return 1;
+    }
+
+    FILE* file = path ? fopen(path, "w") : stdout;
+    if (file == NULL) {
+        perror(path);
+        return 1;
+    }
+
+    writeEventLog(file, &events[0], count);
+    if (path != NULL) {
+        fclose(file);
+        printf("%u events saved to %s\n", count, path);
+    }
+
+    return 0;
+}
+
+// Bench
+
+enum
+{
+    kOpPowerOff = 0,
+    kOpPowerOn,
+    kOpRescan,
+    kOpPowerCycle,
+    kOpCount
+};
+
+static const char* sOpNames[kOpCount] = { "power-off", "power-on", "rescan", "power-cycle" };
+
+struct BenchThread
+{
+    Provider* provider;
+    int cycles;
+    bool queued;
+    int errors;
+    std::vector<UInt64> samples[kOpCount];
+};
+
+static bool submitted(Provider* provider, UInt32 queue, const CommandEntry* commands, UInt32 count)
+{
+    CompletionEntry completions[2];
+
+    if (provider->submit(queue, commands, count, completions) != kProviderSuccess)
+        return false;
+
+    for (UInt32 i = 0; i < count; i++)
+        if (completions[i].status != kProviderSuccess)
+            return false;
+
+    return true;
+}
+
+// One cycle is what a sleep/wake does: power off, power on and rescan.
+// Queued, power off and on share one doorbell and the rescan takes another.
+static void benchThread(BenchThread* thread)
+{
+    for (int i = 0; i < thread->cycles && thread->queued; i++) {
+        CommandEntry power[2] = { { kCommandForcePower, 0, 0 }, { kCommandForcePower, 1, 1 } };
+        CommandEntry rescan = { kCommandProbe, 2, kProbeOptionNeedsScan | kProbeOptionDone };
+        UInt64 start;
+
+        start = nanoTime();
+        if (!submitted(thread->provider, kQueueController, power, 2))
+            thread->errors++;
+        thread->samples[kOpPowerCycle].push_back(nanoTime() - start);
+
+        start = nanoTime();
+        if (!submitted(thread->provider, kQueueBridge, &rescan, 1))
+            thread->errors++;
+        thread->samples[kOpRescan].push_back(nanoTime() - start);
+    }
+
+    for (int i = 0; i < thread->cycles && !thread->queued; i++) {
+        UInt32 result;
+        UInt64 start;
+
+        start = nanoTime();
+        if (thread->provider->forcePower(0) != kProviderSuccess)
+            thread->errors++;
+        thread->samples[kOpPowerOff].push_back(nanoTime() - start);
+
+        start = nanoTime();
+        if (thread->provider->forcePower(1) != kProviderSuccess)
+            thread->errors++;
+        thread->samples[kOpPowerOn].push_back(nanoTime() - start);
+
+        start = nanoTime();
+        if (thread->provider->probe(kProbeOptionNeedsScan | kProbeOptionDone, &result) != kProviderSuccess)
+            thread->errors++;
+        thread->samples[kOpRescan].push_back(nanoTime() - start);
+    }
+}
+
+static UInt64 percentile(const std::vector<UInt64>& sorted, int pct)
+{
+    return sorted.empty() ? 0 : sorted[((sorted.size() - 1) * pct) / 100];
+}
+
+static int commandBench(Provider* provider, int argc, char* argv[])
+{
+    int cycles = kDefaultCycles;
+    int threads = 1;
+    bool queued = false;
+    int opt;
+
+    optind = 1;
+#ifdef __APPLE__
+    optreset = 1;
+#endif
+    while ((opt = getopt(argc, argv, "n:t:q")) != -1) {
+        switch (opt) {
+            case 'n': cycles = atoi(optarg); break;
+            case 't': threads = atoi(optarg); break;
+            case 'q': queued = true; break;
+            default: return -1;
+        }
+    }
+
+    if (cycles <= 0 || threads <= 0 || optind != argc)
+        return -1;
+
+    std::vector<BenchThread> work(threads);
+    std::vector<std::thread> running;
+
+    // spread the cycles over the threads
+    for (int i = 0; i < threads; i++) {
+        work[i].provider = provider;
+        work[i].cycles = cycles / threads + (i < cycles % threads ? 1 : 0);
+        work[i].queued = queued;
+        work[i].errors = 0;
+    }
+
+    UInt64 start = nanoTime();
+    for (int i = 0; i < threads; i++)
+        running.push_back(std::thread(benchThread, &work[i]));
+    for (int i = 0; i < threads; i++)
+        running[i].join();
+    UInt64 elapsed = nanoTime() - start;
+
+    int errors = 0;
+    for (int i = 0; i < threads; i++)
+        errors += work[i].errors;
+
+    printf("%s back end%s, %d cycles on %d thread(s), %d errors\n", provider->name(), queued ? ", queued" : "",
+           cycles, threads, errors);
+    printf("%-11s %10s %10s %10s %10s  (us)\n", "", "p50", "p90", "p99", "max");
+
+    for (int op = 0; op < kOpCount; op++) {
+        std::vector<UInt64> sorted;
+
+        for (int i = 0; i < threads; i++)
+            sorted.insert(sorted.end(), work[i].samples[op].begin(), work[i].samples[op].end());
+        std::sort(sorted.begin(), sorted.end());
+
+        if (sorted.empty())
+            continue;
+
+        printf("%-11s %10.1f %10.1f %10.1f %10.1f\n", sOpNames[op],
+               percentile(sorted, 50) / 1e3, percentile(sorted, 90) / 1e3,
+               percentile(sorted, 99) / 1e3, sorted.empty() ? 0.0 : sorted.back() / 1e3);
+    }
+
+    // three commands per cycle, over two doorbells when queued
+    printf("%.1f cycles/s, %.1f commands/s, %.1f calls/s\n", cycles * 1e9 / elapsed, cycles * 3 * 1e9 / elapsed,
+           cycles * (queued ? 2 : 3) * 1e9 / elapsed);
+
+    return errors ? 1 : 0;
+}
+
+int main(int argc, char* argv[])
+{
+#ifdef __APPLE__
+    const char* backend = "iokit";
+#else
+    const char* backend = "stub";
+#endif
+    StubConfig config = { 0, 0, true };
+    int opt;
+
+    // options for the tool itself stop at the command
+    while ((opt = getopt(argc, argv, "+b:p:r:")) != -1) {
+        switch (opt) {
+            case 'b': backend = optarg; break;
+            case 'p': config.forcePowerUS = (UInt32)atoi(optarg); break;
+            case 'r': config.probeUS = (UInt32)atoi(optarg); break;
+            default:
+                usage(argv[0]);
+                return 1;
+        }
+    }
+
+    if (optind >= argc) {
+        usage(argv[0]);
+        return 1;
+    }
+
+    Provider* provider = NULL;
+
+    if (strcmp(backend, "iokit") == 0) {
+        provider = createIOKitProvider();
+        if (provider == NULL) {
+            fprintf(stderr, "%s: IOElectrify and IOElectrifyBridge not found\n", argv[0]);
+            return 1;
+        }
+    }
+    else if (strcmp(backend, "stub") == 0) {
+        provider = new StubProvider(config);
+    }
+    else {
+        usage(argv[0]);
+        return 1;
+    }
+
+    const char* command = argv[optind];
+    int commandArgc = argc - optind;
+    char** commandArgv = argv + optind;
+    int ret;
+
+    if (strcmp(command, "power") == 0)
+        ret = commandPower(provider, commandArgc, commandArgv);
+    else if (strcmp(command, "hook") == 0)
+        ret = commandHook(provider, commandArgc, commandArgv);
+    else if (strcmp(command, "probe") == 0)
+        ret = commandProbe(provider, commandArgc, commandArgv);
+    else if (strcmp(command, "bench") == 0)
+        ret = commandBench(provider, commandArgc, commandArgv);
+    else if (strcmp(command, "residency") == 0)
+        ret = commandResidency(provider, commandArgc, commandArgv);
+    else if (strcmp(command, "events") == 0)
+        ret = commandEvents(provider, commandArgc, commandArgv);
+    else
+        ret = -1;
+
+    if (ret < 0) {
+        usage(argv[0]);
+        ret = 1;
+    }
+
+    delete provider;
+    return ret;
+}
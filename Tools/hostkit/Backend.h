@@ -0,0 +1,60 @@
+/*
+ *  Released under "The GNU General Public License (GPL-2.0)"
+ *
+ *  This program is free software; you can redistribute it and/or modify it
+ *  under the terms of the GNU General Public License as published by the
+ *  Free Software Foundation; either version 2 of the License, or (at your
+ *  option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful, but
+ *  WITHOUT ANY WARRANTY; without even the implied warranty of MERCHANTABILITY
+ *  or FITNESS FOR A PARTICULAR PURPOSE. See the GNU General Public License
+ *  for more details.
+ *
+ *  You should have received a copy of the GNU General Public License along
+ *  with this program; if not, write to the Free Software Foundation, Inc.,
+ *  59 Temple Place, Suite 330, Boston, MA 02111-1307 USA
+ *
+ */
+
+#ifndef Backend_h
+#define Backend_h
+
+#include <stdint.h>
+
+// Scheduling back end of the host kit. Every lock, sleep, wakeup, delay and
+// clock read of the kext ends up here. Link exactly one implementation:
+//   ThreadBackend.cpp  real threads and the monotonic clock
+//   SimBackend.cpp     discrete-event simulation, one thread runs at a time
+//                      and the clock only moves when every thread waits
+namespace HostBackend
+{
+    struct Mutex;
+    struct Thread;
+
+    // Called once from main before anything else
+    void initialize();
+
+    Mutex* mutexAlloc();
+    void mutexFree(Mutex* mutex);
+    void lock(Mutex* mutex);
+    void unlock(Mutex* mutex);
+
+    // Drop mutex and wait for a wakeup on event or the deadline (ns of
+    // uptime, 0 waits forever). mutex is held again on return. Returns
+    // false when the deadline passed.
+    bool sleep(Mutex* mutex, const void* event, uint64_t deadline);
+    void wakeup(Mutex* mutex, const void* event, bool oneThread);
+
+    uint64_t now();
+    void delay(uint64_t ns);
+
+    Thread* spawn(void (*function)(void* argument), void* argument);
+    void join(Thread* thread);
+    void detach(Thread* thread);
+
+    // Identity of the calling thread, stable for its lifetime
+    const void* self();
+}
+
+#endif /* Backend_h */
@@ -0,0 +1,1745 @@
+/*
+ *  Released under "The GNU General Public License (GPL-2.0)"
+ *
+ *  This program is free software; you can redistribute it and/or modify it
+ *  under the terms of the GNU General Public License as published by the
+ *  Free Software Foundation; either version 2 of the License, or (at your
+ *  option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful, but
+ *  WITHOUT ANY WARRANTY; without even the implied warranty of MERCHANTABILITY
+ *  or FITNESS FOR A PARTICULAR PURPOSE. See the GNU General Public License
+ *  for more details.
+ *
+ *  You should have received a copy of the GNU General Public License along
+ *  with this program; if not, write to the Free Software Foundation, Inc.,
+ *  59 Temple Place, Suite 330, Boston, MA 02111-1307 USA
+ *
+ */
+
+#include <map>
+#include <mutex>
+#include <string>
+#include "HostKit.h"
+
+// The registry, collections and notification lists are guarded by plain
+// mutexes that are never held across a call into kext code. Whatever may
+// block or run kext code uses the back end, so it schedules the same way
+// as the kext's own locks.
+
+extern "C" kern_return_t IOElectrify_start(kmod_info_t* ki, void* data);
+extern "C" kern_return_t IOElectrify_stop(kmod_info_t* ki, void* data);
+
+kmod_info_t kmod_info = { "org.darkvoid.driver.IOElectrify", "host" };
+const int version_major = 21;
+const int version_minor = 0;
+
+static volatile SInt64 sLiveObjects = 0;
+static volatile SInt64 sCreatedObjects = 0;
+static volatile SInt64 sLiveAllocations = 0;
+static volatile SInt64 sAllocations = 0;
+static volatile bool sPrivileged = true;
+static volatile bool sLogging = false;
+
+static std::mutex sRegistryLock;
+
+// IOLib
+
+void IOLog(const char* format, ...)
+{
+    va_list args;
+
+    if (!__atomic_load_n(&sLogging, __ATOMIC_RELAXED))
+        return;
+
+    va_start(args, format);
+    vfprintf(stderr, format, args);
+    va_end(args);
+}
+
+void* IOMalloc(vm_size_t size)
+{
+    void* address = malloc(size ? size : 1);
+
+    if (address != NULL) {
+        OSAddAtomic64(1, &sLiveAllocations);
+        OSAddAtomic64(1, &sAllocations);
+    }
+    return address;
+}
+
+void IOFree(void* address, vm_size_t size)
+{
+    if (address == NULL)
+        return;
+
+    OSAddAtomic64(-1, &sLiveAllocations);
+    free(address);
+}
+
+void IOSleep(unsigned milliseconds)
+{
+    HostBackend::delay((UInt64)milliseconds * kMillisecondScale);
+}
+
+void IODelay(unsigned microseconds)
+{
+    HostBackend::delay((UInt64)microseconds * kMicrosecondScale);
+}
+
+void clock_get_uptime(UInt64* result)
+{
+    *result = HostBackend::now();
+}
+
+void absolutetime_to_nanoseconds(UInt64 abstime, UInt64* result)
+{
+    *result = abstime;
+}
+
+void nanoseconds_to_absolutetime(UInt64 nanoseconds, UInt64* result)
+{
+    *result = nanoseconds;
+}
+
+void clock_interval_to_deadline(UInt32 interval, UInt32 scaleFactor, UInt64* result)
+{
+    *result = HostBackend::now() + (UInt64)interval * scaleFactor;
+}
+
+task_t current_task()
+{
+    static char task;
+
+    return &task;
+}
+
+// Locks
+
+IOLock* IOLockAlloc()
+{
+    return (IOLock*)HostBackend::mutexAlloc();
+}
+
+void IOLockFree(IOLock* lock)
+{
+    HostBackend::mutexFree((HostBackend::Mutex*)lock);
+}
+
+void IOLockLock(IOLock* lock)
+{
+    HostBackend::lock((HostBackend::Mutex*)lock);
+}
+
+void IOLockUnlock(IOLock* lock)
+{
+    HostBackend::unlock((HostBackend::Mutex*)lock);
+}
+
+int IOLockSleep(IOLock* lock, void* event, UInt32 interType)
+{
+    HostBackend::sleep((HostBackend::Mutex*)lock, event, 0);
+    return THREAD_AWAKENED;
+}
+
+int IOLockSleepDeadline(IOLock* lock, void* event, AbsoluteTime deadline, UInt32 interType)
+{
+    return HostBackend::sleep((HostBackend::Mutex*)lock, event, deadline) ? THREAD_AWAKENED : THREAD_TIMED_OUT;
+}
+
+void IOLockWakeup(IOLock* lock, void* event, bool oneThread)
+{
+    HostBackend::wakeup((HostBackend::Mutex*)lock, event, oneThread);
+}
+
+// Thread calls, a worker per call that sleeps until entered. Freeing only
+// tells the worker to go, it deletes the call once a running callout returns.
+
+struct thread_call
+{
+    thread_call_func_t function;
+    thread_call_param_t param0;
+    thread_call_param_t param1;
+    HostBackend::Mutex* mutex;
+    UInt64 deadline;
+    bool pending;
+    bool running;
+    bool exiting;
+};
+
+static void threadCallMain(void* argument)
+{
+    thread_call_t call = (thread_call_t)argument;
+
+    HostBackend::lock(call->mutex);
+    while (!call->exiting) {
+        if (!call->pending) {
+            HostBackend::sleep(call->mutex, call, 0);
+            continue;
+        }
+
+        if (call->deadline > HostBackend::now()) {
+            HostBackend::sleep(call->mutex, call, call->deadline);
+            continue;
+        }
+
+        thread_call_param_t param1 = call->param1;
+
+        call->pending = false;
+        call->running = true;
+        HostBackend::unlock(call->mutex);
+
+        call->function(call->param0, param1);
+
+        HostBackend::lock(call->mutex);
+        call->running = false;
+        HostBackend::wakeup(call->mutex, &call->running, false);
+    }
+    HostBackend::unlock(call->mutex);
+
+    HostBackend::mutexFree(call->mutex);
+    delete call;
+}
+
+thread_call_t thread_call_allocate(thread_call_func_t func, thread_call_param_t param0)
+{
+    thread_call_t call = new thread_call;
+
+    call->function = func;
+    call->param0 = param0;
+    call->param1 = NULL;
+    call->mutex = HostBackend::mutexAlloc();
+    call->deadline = 0;
+    call->pending = false;
+    call->running = false;
+    call->exiting = false;
+
+    HostBackend::detach(HostBackend::spawn(threadCallMain, call));
+    return call;
+}
+
+bool thread_call_free(thread_call_t call)
+{
+    HostBackend::lock(call->mutex);
+    call->pending = false;
+    call->exiting = true;
+    HostBackend::wakeup(call->mutex, call, false);
+    HostBackend::unlock(call->mutex);
+
+    return true;
+}
+
+static bool enterCall(thread_call_t call, thread_call_param_t param1, UInt64 deadline)
+{
+    bool wasPending;
+
+    HostBackend::lock(call->mutex);
+    wasPending = call->pending;
+    call->pending = true;
+    call->param1 = param1;
+    call->deadline = deadline;
+    HostBackend::wakeup(call->mutex, call, false);
+    HostBackend::unlock(call->mutex);
+
+    return wasPending;
+}
+
+bool thread_call_enter(thread_call_t call)
+{
+    return enterCall(call, NULL, 0);
+}
+
+bool thread_call_enter1(thread_call_t call, thread_call_param_t param1)
+{
+    return enterCall(call, param1, 0);
+}
+
+bool thread_call_enter_delayed(thread_call_t call, UInt64 deadline)
+{
+    return enterCall(call, NULL, deadline);
+}
+
+bool thread_call_enter1_delayed(thread_call_t call, thread_call_param_t param1, UInt64 deadline)
+{
+    return enterCall(call, param1, deadline);
+}
+
+bool thread_call_cancel(thread_call_t call)
+{
+    bool wasPending;
+
+    HostBackend::lock(call->mutex);
+    wasPending = call->pending;
+    call->pending = false;
+    HostBackend::unlock(call->mutex);
+
+    return wasPending;
+}
+
+bool thread_call_cancel_wait(thread_call_t call)
+{
+    bool wasPending;
+
+    HostBackend::lock(call->mutex);
+    wasPending = call->pending;
+    call->pending = false;
+    while (call->running)
+        HostBackend::sleep(call->mutex, &call->running, 0);
+    HostBackend::unlock(call->mutex);
+
+    return wasPending;
+}
+
+// Classes
+
+typedef std::map<std::string, HostClassAllocator> ClassMap;
+
+static ClassMap& classes()
+{
+    static ClassMap map;
+
+    return map;
+}
+
+HostClassRegistration::HostClassRegistration(const char* name, HostClassAllocator allocator)
+{
+    classes()[name] = allocator;
+}
+
+OSObject* hostAllocClassWithName(const char* name)
+{
+    ClassMap::iterator it = classes().find(name);
+
+    return it != classes().end() ? it->second() : NULL;
+}
+
+// OSObject
+
+void* OSObject::operator new(size_t size)
+{
+    void* memory = calloc(1, size);
+
+    if (memory == NULL)
+        abort();
+
+    OSAddAtomic64(1, &sLiveObjects);
+    OSAddAtomic64(1, &sCreatedObjects);
+    return memory;
+}
+
+void OSObject::operator delete(void* memory, size_t size)
+{
+    OSAddAtomic64(-1, &sLiveObjects);
+    ::free(memory);
+}
+
+OSObject::OSObject() : mRetainCount(1)
+{
+}
+
+OSObject::~OSObject()
+{
+}
+
+void OSObject::free()
+{
+    delete this;
+}
+
+void OSObject::retain() const
+{
+    OSIncrementAtomic(&mRetainCount);
+}
+
+void OSObject::release() const
+{
+    if (OSDecrementAtomic(&mRetainCount) == 1)
+        const_cast<OSObject*>(this)->free();
+}
+
+int OSObject::getRetainCount() const
+{
+    return __atomic_load_n(&mRetainCount, __ATOMIC_RELAXED);
+}
+
+bool OSObject::serialize(OSSerialize* serializer) const
+{
+    return true;
+}
+
+OSDefineMetaClassAndStructors(OSSerialize, OSObject)
+OSDefineMetaClassAndStructors(OSIterator, OSObject)
+OSDefineMetaClassAndStructors(OSString, OSObject)
+OSDefineMetaClassAndStructors(OSSymbol, OSString)
+OSDefineMetaClassAndStructors(OSNumber, OSObject)
+OSDefineMetaClassAndStructors(OSBoolean, OSObject)
+OSDefineMetaClassAndStructors(OSData, OSObject)
+OSDefineMetaClassAndStructors(OSArray, OSCollection)
+OSDefineMetaClassAndStructors(OSDictionary, OSCollection)
+OSDefineMetaClassAndStructors(OSCollectionIterator, OSIterator)
+
+// abstract, no allocator
+const char* OSCollection::hostClassName() const
+{
+    return "OSCollection";
+}
+
+bool OSCollection::hostConformsTo(const char* name) const
+{
+    return strcmp(name, "OSCollection") == 0 || OSObject::hostConformsTo(name);
+}
+
+OSSerialize* OSSerialize::withCapacity(unsigned int capacity)
+{
+    return new OSSerialize;
+}
+
+OSString* OSString::withCString(const char* string)
+{
+    OSString* object = new OSString;
+
+    object->initWithCString(string);
+    return object;
+}
+
+bool OSString::initWithCString(const char* string)
+{
+    mString = strdup(string);
+    return mString != NULL;
+}
+
+void OSString::free()
+{
+    ::free(mString);
+    OSObject::free();
+}
+
+bool OSString::isEqualTo(const OSObject* object) const
+{
+    return isEqualTo(OSDynamicCast(OSString, object));
+}
+
+const OSSymbol* OSSymbol::withCString(const char* string)
+{
+    OSSymbol* object = new OSSymbol;
+
+    object->mString = strdup(string);
+    return object;
+}
+
+OSNumber* OSNumber::withNumber(unsigned long long value, unsigned int numberOfBits)
+{
+    OSNumber* object = new OSNumber;
+
+    object->init(value, numberOfBits);
+    return object;
+}
+
+bool OSNumber::init(unsigned long long value, unsigned int numberOfBits)
+{
+    mBits = numberOfBits;
+    setValue(value);
+    return true;
+}
+
+void OSNumber::setValue(unsigned long long value)
+{
+    mValue = mBits < 64 ? value & ((1ULL << mBits) - 1) : value;
+}
+
+bool OSNumber::isEqualTo(const OSObject* object) const
+{
+    const OSNumber* number = OSDynamicCast(OSNumber, object);
+
+    return number != NULL && number->mValue == mValue;
+}
+
+static OSBoolean sBooleanTrue(true);
+static OSBoolean sBooleanFalse(false);
+OSBoolean* const kOSBooleanTrue = &sBooleanTrue;
+OSBoolean* const kOSBooleanFalse = &sBooleanFalse;
+
+OSBoolean* OSBoolean::withBoolean(bool value)
+{
+    return value ? kOSBooleanTrue : kOSBooleanFalse;
+}
+
+OSData* OSData::withBytes(const void* bytes, unsigned int length)
+{
+    OSData* object = new OSData;
+
+    object->initWithBytes(bytes, length);
+    return object;
+}
+
+bool OSData::initWithBytes(const void* bytes, unsigned int length)
+{
+    return appendBytes(bytes, length);
+}
+
+OSData* OSData::withCapacity(unsigned int capacity)
+{
+    OSData* object = new OSData;
+
+    object->mBytes.reserve(capacity);
+    return object;
+}
+
+const void* OSData::getBytesNoCopy(unsigned int start, unsigned int length) const
+{
+    if (length == 0 || start >= mBytes.size() || mBytes.size() - start < length)
+        return NULL;
+
+    return &mBytes[start];
+}
+
+bool OSData::appendBytes(const void* bytes, unsigned int length)
+{
+    const UInt8* first = (const UInt8*)bytes;
+
+    mBytes.insert(mBytes.end(), first, first + length);
+    return true;
+}
+
+bool OSData::isEqualTo(const OSObject* object) const
+{
+    const OSData* data = OSDynamicCast(OSData, object);
+
+    return data != NULL && data->mBytes == mBytes;
+}
+
+OSArray* OSArray::withCapacity(unsigned int capacity)
+{
+    OSArray* object = new OSArray;
+
+    object->initWithCapacity(capacity);
+    return object;
+}
+
+bool OSArray::initWithCapacity(unsigned int capacity)
+{
+    mObjects.reserve(capacity);
+    return true;
+}
+
+void OSArray::free()
+{
+    flushCollection();
+    OSCollection::free();
+}
+
+void OSArray::flushCollection()
+{
+    std::vector<const OSObject*> objects;
+
+    objects.swap(mObjects);
+    for (size_t i = 0; i < objects.size(); i++)
+        objects[i]->release();
+}
+
+bool OSArray::setObject(const OSObject* object)
+{
+    return setObject(getCount(), object);
+}
+
+bool OSArray::setObject(unsigned int index, const OSObject* object)
+{
+    if (object == NULL || index > mObjects.size())
+        return false;
+
+    object->retain();
+    mObjects.insert(mObjects.begin() + index, object);
+    return true;
+}
+
+OSObject* OSArray::getObject(unsigned int index) const
+{
+    return index < mObjects.size() ? const_cast<OSObject*>(mObjects[index]) : NULL;
+}
+
+void OSArray::removeObject(unsigned int index)
+{
+    if (index >= mObjects.size())
+        return;
+
+    const OSObject* object = mObjects[index];
+    mObjects.erase(mObjects.begin() + index);
+    object->release();
+}
+
+bool OSArray::merge(const OSArray* other)
+{
+    for (unsigned int i = 0; i < other->getCount(); i++)
+        setObject(other->getObject(i));
+    return true;
+}
+
+unsigned int OSArray::getNextIndexOfObject(const OSObject* object, unsigned int index) const
+{
+    for (unsigned int i = index; i < mObjects.size(); i++) {
+        if (mObjects[i] == object)
+            return i;
+    }
+
+    return (unsigned int)-1;
+}
+
+OSDictionary* OSDictionary::withCapacity(unsigned int capacity)
+{
+    OSDictionary* object = new OSDictionary;
+
+    object->initWithCapacity(capacity);
+    return object;
+}
+
+bool OSDictionary::initWithCapacity(unsigned int capacity)
+{
+    mEntries.reserve(capacity);
+    return true;
+}
+
+OSDictionary* OSDictionary::withDictionary(const OSDictionary* dictionary, unsigned int capacity)
+{
+    OSDictionary* object = withCapacity(capacity > dictionary->getCount() ? capacity : dictionary->getCount());
+
+    for (size_t i = 0; i < dictionary->mEntries.size(); i++) {
+        Entry entry = dictionary->mEntries[i];
+
+        entry.key->retain();
+        entry.value->retain();
+        object->mEntries.push_back(entry);
+    }
+
+    return object;
+}
+
+void OSDictionary::free()
+{
+    flushCollection();
+    OSCollection::free();
+}
+
+void OSDictionary::flushCollection()
+{
+    std::vector<Entry> entries;
+
+    entries.swap(mEntries);
+    for (size_t i = 0; i < entries.size(); i++) {
+        entries[i].key->release();
+        entries[i].value->release();
+    }
+}
+
+OSObject* OSDictionary::hostIterate(unsigned int index) const
+{
+    return index < mEntries.size() ? const_cast<OSSymbol*>(mEntries[index].key) : NULL;
+}
+
+bool OSDictionary::setObject(const char* key, const OSObject* object)
+{
+    if (key == NULL || object == NULL)
+        return false;
+
+    object->retain();
+    for (size_t i = 0; i < mEntries.size(); i++) {
+        if (mEntries[i].key->isEqualTo(key)) {
+            const OSObject* old = mEntries[i].value;
+
+            mEntries[i].value = object;
+            old->release();
+            return true;
+        }
+    }
+
+    Entry entry = { OSSymbol::withCString(key), object };
+    mEntries.push_back(entry);
+    return true;
+}
+
+bool OSDictionary::setObject(const OSString* key, const OSObject* object)
+{
+    return key != NULL && setObject(key->getCStringNoCopy(), object);
+}
+
+OSObject* OSDictionary::getObject(const char* key) const
+{
+    for (size_t i = 0; key != NULL && i < mEntries.size(); i++) {
+        if (mEntries[i].key->isEqualTo(key))
+            return const_cast<OSObject*>(mEntries[i].value);
+    }
+
+    return NULL;
+}
+
+OSObject* OSDictionary::getObject(const OSString* key) const
+{
+    return key != NULL ? getObject(key->getCStringNoCopy()) : NULL;
+}
+
+void OSDictionary::removeObject(const char* key)
+{
+    for (size_t i = 0; i < mEntries.size(); i++) {
+        if (mEntries[i].key->isEqualTo(key)) {
+            Entry entry = mEntries[i];
+
+            mEntries.erase(mEntries.begin() + i);
+            entry.key->release();
+            entry.value->release();
+            return;
+        }
+    }
+}
+
+void OSDictionary::removeObject(const OSString* key)
+{
+    if (key != NULL)
+        removeObject(key->getCStringNoCopy());
+}
+
+OSCollectionIterator* OSCollectionIterator::withCollection(const OSCollection* collection)
+{
+    OSCollectionIterator* object;
+
+    if (collection == NULL)
+        return NULL;
+
+    object = new OSCollectionIterator;
+    object->initWithCollection(collection);
+    return object;
+}
+
+bool OSCollectionIterator::initWithCollection(const OSCollection* collection)
+{
+    if (collection == NULL)
+        return false;
+
+    collection->retain();
+    mCollection = collection;
+    return true;
+}
+
+void OSCollectionIterator::free()
+{
+    if (mCollection != NULL)
+        mCollection->release();
+    OSIterator::free();
+}
+
+OSObject* OSCollectionIterator::getNextObject()
+{
+    return mCollection->hostIterate(mIndex++);
+}
+
+// Registry
+
+const IORegistryPlane* gIOServicePlane = NULL;
+
+OSDefineMetaClassAndStructors(IORegistryEntry, OSObject)
+
+bool IORegistryEntry::init(OSDictionary* dictionary)
+{
+    mProperties = dictionary != NULL ? OSDictionary::withDictionary(dictionary) : OSDictionary::withCapacity(8);
+    mChildren = OSArray::withCapacity(2);
+    return true;
+}
+
+void IORegistryEntry::free()
+{
+    OSSafeReleaseNULL(mProperties);
+    OSSafeReleaseNULL(mChildren);
+    ::free(mName);
+    ::free(mLocation);
+    OSObject::free();
+}
+
+const char* IORegistryEntry::getName(const IORegistryPlane* plane) const
+{
+    return mName != NULL ? mName : hostClassName();
+}
+
+void IORegistryEntry::setName(const char* name, const IORegistryPlane* plane)
+{
+    ::free(mName);
+    mName = strdup(name);
+}
+
+const char* IORegistryEntry::getLocation(const IORegistryPlane* plane) const
+{
+    return mLocation;
+}
+
+void IORegistryEntry::setLocation(const char* location, const IORegistryPlane* plane)
+{
+    ::free(mLocation);
+    mLocation = strdup(location);
+}
+
+bool IORegistryEntry::setProperty(const char* key, OSObject* object)
+{
+    std::lock_guard<std::mutex> guard(sRegistryLock);
+
+    return mProperties->setObject(key, object);
+}
+
+bool IORegistryEntry::setProperty(const char* key, const char* string)
+{
+    OSString* object = OSString::withCString(string);
+    bool result = setProperty(key, object);
+
+    object->release();
+    return result;
+}
+
+bool IORegistryEntry::setProperty(const char* key, bool value)
+{
+    return setProperty(key, value ? kOSBooleanTrue : kOSBooleanFalse);
+}
+
+bool IORegistryEntry::setProperty(const char* key, unsigned long long value, unsigned int numberOfBits)
+{
+    OSNumber* object = OSNumber::withNumber(value, numberOfBits);
+    bool result = setProperty(key, object);
+
+    object->release();
+    return result;
+}
+
+bool IORegistryEntry::setProperty(const char* key, void* bytes, unsigned int length)
+{
+    OSData* object = OSData::withBytes(bytes, length);
+    bool result = setProperty(key, object);
+
+    object->release();
+    return result;
+}
+
+// unretained like IOKit's, only safe while nobody replaces the property
+OSObject* IORegistryEntry::getProperty(const char* key) const
+{
+    std::lock_guard<std::mutex> guard(sRegistryLock);
+
+    return mProperties->getObject(key);
+}
+
+OSObject* IORegistryEntry::copyProperty(const char* key) const
+{
+    std::lock_guard<std::mutex> guard(sRegistryLock);
+    OSObject* object = mProperties->getObject(key);
+
+    if (object != NULL)
+        object->retain();
+    return object;
+}
+
+void IORegistryEntry::removeProperty(const char* key)
+{
+    std::lock_guard<std::mutex> guard(sRegistryLock);
+
+    mProperties->removeObject(key);
+}
+
+IOReturn IORegistryEntry::setProperties(OSObject* properties)
+{
+    return kIOReturnUnsupported;
+}
+
+bool IORegistryEntry::serializeProperties(OSSerialize* serializer) const
+{
+    return true;
+}
+
+OSDictionary* IORegistryEntry::dictionaryWithProperties() const
+{
+    std::lock_guard<std::mutex> guard(sRegistryLock);
+
+    return OSDictionary::withDictionary(mProperties);
+}
+
+IORegistryEntry* IORegistryEntry::getParentEntry(const IORegistryPlane* plane) const
+{
+    std::lock_guard<std::mutex> guard(sRegistryLock);
+
+    return mParent;
+}
+
+// a snapshot, children attached or detached meanwhile don't disturb it
+OSIterator* IORegistryEntry::getChildIterator(const IORegistryPlane* plane) const
+{
+    OSArray* children = OSArray::withCapacity(4);
+    OSIterator* iterator;
+
+    {
+        std::lock_guard<std::mutex> guard(sRegistryLock);
+        children->merge(mChildren);
+    }
+
+    iterator = OSCollectionIterator::withCollection(children);
+    children->release();
+    return iterator;
+}
+
+bool IORegistryEntry::attachToParent(IORegistryEntry* parent)
+{
+    std::lock_guard<std::mutex> guard(sRegistryLock);
+
+    if (mParent != NULL || parent == NULL)
+        return false;
+
+    parent->retain();
+    mParent = parent;
+    parent->mChildren->setObject(this);
+    return true;
+}
+
+// the last references may go here, they are dropped outside the lock
+void IORegistryEntry::detachFromParent(IORegistryEntry* parent)
+{
+    {
+        std::lock_guard<std::mutex> guard(sRegistryLock);
+        unsigned int index;
+
+        if (mParent != parent || parent == NULL)
+            return;
+
+        mParent = NULL;
+        retain();
+        index = parent->mChildren->getNextIndexOfObject(this, 0);
+        if (index != (unsigned int)-1)
+            parent->mChildren->removeObject(index);
+    }
+
+    release();
+    parent->release();
+}
+
+// Notifications
+
+class HostNotifier : public IONotifier
+{
+    OSDeclareDefaultStructors(HostNotifier)
+public:
+    virtual void free() override;
+    virtual void remove() override;
+
+    bool matches(const OSSymbol* type, IOService* service) const;
+    void deliver(IOService* service);
+
+    const OSSymbol* mType;
+    OSString* mClassName;
+    IOServiceMatchingNotificationHandler mHandler;
+    void* mTarget;
+    void* mRef;
+    HostBackend::Mutex* mMutex;
+    UInt32 mInFlight;
+    bool mRemoved;
+};
+
+OSDefineMetaClassAndStructors(IONotifier, OSObject)
+OSDefineMetaClassAndStructors(HostNotifier, IONotifier)
+
+const OSSymbol* gIOPublishNotification = OSSymbol::withCString("IOServicePublish");
+const OSSymbol* gIOTerminatedNotification = OSSymbol::withCString("IOServiceTerminate");
+
+static std::vector<HostNotifier*> sNotifiers;
+static std::vector<IOService*> sPublished;
+
+void IONotifier::remove()
+{
+    release();
+}
+
+void HostNotifier::free()
+{
+    OSSafeReleaseNULL(mClassName);
+    HostBackend::mutexFree(mMutex);
+    IONotifier::free();
+}
+
+// waits for handlers already running on other threads
+void HostNotifier::remove()
+{
+    {
+        std::lock_guard<std::mutex> guard(sRegistryLock);
+
+        for (size_t i = 0; i < sNotifiers.size(); i++) {
+            if (sNotifiers[i] == this) {
+                sNotifiers.erase(sNotifiers.begin() + i);
+                break;
+            }
+        }
+    }
+
+    HostBackend::lock(mMutex);
+    mRemoved = true;
+    while (mInFlight > 0)
+        HostBackend::sleep(mMutex, &mInFlight, 0);
+    HostBackend::unlock(mMutex);
+
+    release();
+}
+
+bool HostNotifier::matches(const OSSymbol* type, IOService* service) const
+{
+    return mType == type && (mClassName == NULL || service->hostConformsTo(mClassName->getCStringNoCopy()));
+}
+
+void HostNotifier::deliver(IOService* service)
+{
+    HostBackend::lock(mMutex);
+    if (mRemoved) {
+        HostBackend::unlock(mMutex);
+        return;
+    }
+    mInFlight++;
+    HostBackend::unlock(mMutex);
+
+    mHandler(mTarget, mRef, service, this);
+
+    HostBackend::lock(mMutex);
+    if (--mInFlight == 0)
+        HostBackend::wakeup(mMutex, &mInFlight, false);
+    HostBackend::unlock(mMutex);
+}
+
+static void deliverNotifications(const OSSymbol* type, IOService* service)
+{
+    std::vector<HostNotifier*> notifiers;
+
+    {
+        std::lock_guard<std::mutex> guard(sRegistryLock);
+
+        for (size_t i = 0; i < sNotifiers.size(); i++) {
+            if (sNotifiers[i]->matches(type, service)) {
+                sNotifiers[i]->retain();
+                notifiers.push_back(sNotifiers[i]);
+            }
+        }
+    }
+
+    for (size_t i = 0; i < notifiers.size(); i++) {
+        notifiers[i]->deliver(service);
+        notifiers[i]->release();
+    }
+}
+
+// Services
+
+OSDefineMetaClassAndStructors(IOService, IORegistryEntry)
+
+static HostBackend::Mutex* sPMLock = HostBackend::mutexAlloc();
+
+bool IOService::init(OSDictionary* dictionary)
+{
+    return IORegistryEntry::init(dictionary);
+}
+
+void IOService::free()
+{
+    IORegistryEntry::free();
+}
+
+bool IOService::attach(IOService* provider)
+{
+    return attachToParent(provider);
+}
+
+void IOService::detach(IOService* provider)
+{
+    detachFromParent(provider);
+}
+
+IOService* IOService::getProvider() const
+{
+    return OSDynamicCast(IOService, getParentEntry(gIOServicePlane));
+}
+
+bool IOService::isInactive() const
+{
+    return __atomic_load_n(&mInactive, __ATOMIC_ACQUIRE);
+}
+
+void IOService::registerService(IOOptionBits options)
+{
+    {
+        std::lock_guard<std::mutex> guard(sRegistryLock);
+
+        retain();
+        sPublished.push_back(this);
+    }
+
+    deliverNotifications(gIOPublishNotification, this);
+}
+
+// Synchronous, clients go first, then the terminated notifications, stop and detach
+bool IOService::terminate(IOOptionBits options)
+{
+    if (__atomic_exchange_n(&mInactive, true, __ATOMIC_ACQ_REL))
+        return false;
+
+    retain();
+
+    OSIterator* children = getChildIterator(gIOServicePlane);
+    if (children != NULL) {
+        while (OSObject* child = children->getNextObject()) {
+            if (IOService* service = OSDynamicCast(IOService, child))
+                service->terminate(options);
+        }
+        children->release();
+    }
+
+    deliverNotifications(gIOTerminatedNotification, this);
+
+    bool published = false;
+    {
+        std::lock_guard<std::mutex> guard(sRegistryLock);
+
+        for (size_t i = 0; i < sPublished.size(); i++) {
+            if (sPublished[i] == this) {
+                sPublished.erase(sPublished.begin() + i);
+                published = true;
+                break;
+            }
+        }
+    }
+    if (published)
+        release();
+
+    IOService* provider = getProvider();
+    if (mStarted) {
+        mStarted = false;
+        stop(provider);
+    }
+    if (provider != NULL)
+        detach(provider);
+
+    release();
+    return true;
+}
+
+IOReturn IOService::message(UInt32 type, IOService* provider, void* argument)
+{
+    return kIOReturnUnsupported;
+}
+
+IOReturn IOService::registerPowerDriver(IOService* driver, IOPMPowerState* states, unsigned long count)
+{
+    mPowerStateCount = count;
+    return kIOReturnSuccess;
+}
+
+IOReturn IOService::acknowledgeSetPowerState()
+{
+    HostBackend::lock(sPMLock);
+    mAckPending = false;
+    HostBackend::wakeup(sPMLock, &mAckPending, false);
+    HostBackend::unlock(sPMLock);
+
+    return kIOReturnSuccess;
+}
+
+IOReturn IOService::hostPowerChange(unsigned long powerState, UInt64* elapsedNS)
+{
+    UInt64 start = HostBackend::now();
+    IOReturn ret;
+    bool timedOut;
+
+    HostBackend::lock(sPMLock);
+    mAckPending = true;
+    HostBackend::unlock(sPMLock);
+
+    // the return value is the longest the driver needs to acknowledge, in us
+    ret = setPowerState(powerState, this);
+
+    HostBackend::lock(sPMLock);
+    if (ret == IOPMAckImplied)
+        mAckPending = false;
+    while (mAckPending) {
+        if (!HostBackend::sleep(sPMLock, &mAckPending, start + (UInt64)ret * kMicrosecondScale))
+            break;
+    }
+    timedOut = mAckPending;
+    mAckPending = false;
+    HostBackend::unlock(sPMLock);
+
+    if (elapsedNS != NULL)
+        *elapsedNS = HostBackend::now() - start;
+
+    return timedOut ? kIOReturnTimeout : kIOReturnSuccess;
+}
+
+bool IOService::hostStart(IOService* provider)
+{
+    if (!attach(provider))
+        return false;
+
+    if (!start(provider)) {
+        detach(provider);
+        return false;
+    }
+
+    mStarted = true;
+    return true;
+}
+
+OSDictionary* IOService::serviceMatching(const char* className, OSDictionary* table)
+{
+    OSDictionary* matching = table != NULL ? table : OSDictionary::withCapacity(1);
+    OSString* name = OSString::withCString(className);
+
+    matching->setObject("IOProviderClass", name);
+    name->release();
+    return matching;
+}
+
+IONotifier* IOService::addMatchingNotification(const OSSymbol* type, OSDictionary* matching,
+                                               IOServiceMatchingNotificationHandler handler, void* target,
+                                               void* ref, SInt32 priority)
+{
+    HostNotifier* notifier = new HostNotifier;
+    std::vector<IOService*> existing;
+
+    notifier->mType = type;
+    notifier->mClassName = OSDynamicCast(OSString, matching->getObject("IOProviderClass"));
+    if (notifier->mClassName != NULL)
+        notifier->mClassName->retain();
+    notifier->mHandler = handler;
+    notifier->mTarget = target;
+    notifier->mRef = ref;
+    notifier->mMutex = HostBackend::mutexAlloc();
+
+    {
+        std::lock_guard<std::mutex> guard(sRegistryLock);
+
+        sNotifiers.push_back(notifier);
+        if (type == gIOPublishNotification) {
+            for (size_t i = 0; i < sPublished.size(); i++) {
+                if (notifier->matches(type, sPublished[i])) {
+                    sPublished[i]->retain();
+                    existing.push_back(sPublished[i]);
+                }
+            }
+        }
+    }
+
+    // services already published are delivered right away
+    for (size_t i = 0; i < existing.size(); i++) {
+        notifier->deliver(existing[i]);
+        existing[i]->release();
+    }
+
+    return notifier;
+}
+
+// User clients
+
+OSDefineMetaClassAndStructors(IOUserClient, IOService)
+
+bool IOUserClient::initWithTask(task_t owningTask, void* securityID, UInt32 type, OSDictionary* properties)
+{
+    return init(properties);
+}
+
+IOReturn IOUserClient::externalMethod(uint32_t selector, IOExternalMethodArguments* arguments,
+                                      IOExternalMethodDispatch* dispatch, OSObject* target, void* reference)
+{
+    if (dispatch == NULL)
+        return kIOReturnUnsupported;
+
+    if (dispatch->checkScalarInputCount != kIOUCVariableStructureSize &&
+        dispatch->checkScalarInputCount != arguments->scalarInputCount)
+        return kIOReturnBadArgument;
+    if (dispatch->checkStructureInputSize != kIOUCVariableStructureSize &&
+        dispatch->checkStructureInputSize != arguments->structureInputSize)
+        return kIOReturnBadArgument;
+    if (dispatch->checkScalarOutputCount != kIOUCVariableStructureSize &&
+        dispatch->checkScalarOutputCount != arguments->scalarOutputCount)
+        return kIOReturnBadArgument;
+    if (dispatch->checkStructureOutputSize != kIOUCVariableStructureSize &&
+        dispatch->checkStructureOutputSize != arguments->structureOutputSize)
+        return kIOReturnBadArgument;
+
+    return dispatch->function(target != NULL ? target : this, reference, arguments);
+}
+
+IOReturn IOUserClient::clientHasPrivilege(void* securityToken, const char* privilegeName)
+{
+    return __atomic_load_n(&sPrivileged, __ATOMIC_RELAXED) ? kIOReturnSuccess : kIOReturnNotPrivileged;
+}
+
+// Memory descriptors
+
+OSDefineMetaClassAndStructors(IOMemoryDescriptor, OSObject)
+OSDefineMetaClassAndStructors(IOBufferMemoryDescriptor, IOMemoryDescriptor)
+
+IOMemoryDescriptor* IOMemoryDescriptor::hostWithAddress(void* address, IOByteCount length)
+{
+    IOMemoryDescriptor* descriptor = new IOMemoryDescriptor;
+
+    descriptor->mBytes = address;
+    descriptor->mLength = length;
+    return descriptor;
+}
+
+IOByteCount IOMemoryDescriptor::readBytes(IOByteCount offset, void* bytes, IOByteCount length)
+{
+    if (offset >= mLength)
+        return 0;
+    if (length > mLength - offset)
+        length = mLength - offset;
+
+    memcpy(bytes, (const UInt8*)mBytes + offset, length);
+    return length;
+}
+
+IOByteCount IOMemoryDescriptor::writeBytes(IOByteCount offset, const void* bytes, IOByteCount length)
+{
+    if (offset >= mLength)
+        return 0;
+    if (length > mLength - offset)
+        length = mLength - offset;
+
+    memcpy((UInt8*)mBytes + offset, bytes, length);
+    return length;
+}
+
+IOBufferMemoryDescriptor* IOBufferMemoryDescriptor::withOptions(IOOptionBits options, vm_size_t capacity,
+                                                                vm_offset_t alignment)
+{
+    IOBufferMemoryDescriptor* descriptor = new IOBufferMemoryDescriptor;
+
+    descriptor->mBytes = calloc(1, capacity ? capacity : 1);
+    descriptor->mLength = capacity;
+    return descriptor;
+}
+
+void IOBufferMemoryDescriptor::free()
+{
+    ::free(mBytes);
+    IOMemoryDescriptor::free();
+}
+
+// Work loops
+
+OSDefineMetaClassAndStructors(IOEventSource, OSObject)
+OSDefineMetaClassAndStructors(IOWorkLoop, OSObject)
+OSDefineMetaClassAndStructors(IOCommandGate, IOEventSource)
+OSDefineMetaClassAndStructors(IOTimerEventSource, IOEventSource)
+
+IOWorkLoop* IOWorkLoop::workLoop()
+{
+    IOWorkLoop* workLoop = new IOWorkLoop;
+
+    workLoop->mLock = IOLockAlloc();
+    workLoop->mSources = OSArray::withCapacity(2);
+    return workLoop;
+}
+
+void IOWorkLoop::free()
+{
+    for (unsigned int i = 0; i < mSources->getCount(); i++)
+        ((IOEventSource*)mSources->getObject(i))->hostSetWorkLoop(NULL);
+    mSources->release();
+    IOLockFree(mLock);
+    OSObject::free();
+}
+
+IOReturn IOWorkLoop::addEventSource(IOEventSource* source)
+{
+    closeGate();
+    mSources->setObject(source);
+    source->hostSetWorkLoop(this);
+    openGate();
+
+    return kIOReturnSuccess;
+}
+
+IOReturn IOWorkLoop::removeEventSource(IOEventSource* source)
+{
+    unsigned int index;
+
+    closeGate();
+    index = mSources->getNextIndexOfObject(source, 0);
+    if (index != (unsigned int)-1) {
+        source->hostSetWorkLoop(NULL);
+        mSources->removeObject(index);
+    }
+    openGate();
+
+    return index != (unsigned int)-1 ? kIOReturnSuccess : kIOReturnNotFound;
+}
+
+bool IOWorkLoop::inGate() const
+{
+    return __atomic_load_n(&mOwner, __ATOMIC_ACQUIRE) == HostBackend::self();
+}
+
+void IOWorkLoop::closeGate()
+{
+    if (inGate()) {
+        mDepth++;
+        return;
+    }
+
+    IOLockLock(mLock);
+    __atomic_store_n(&mOwner, HostBackend::self(), __ATOMIC_RELEASE);
+    mDepth = 1;
+}
+
+void IOWorkLoop::openGate()
+{
+    if (--mDepth > 0)
+        return;
+
+    __atomic_store_n(&mOwner, (const void*)NULL, __ATOMIC_RELEASE);
+    IOLockUnlock(mLock);
+}
+
+int IOWorkLoop::hostSleepGate(void* event, AbsoluteTime deadline)
+{
+    UInt32 depth = mDepth;
+    bool awakened;
+
+    mDepth = 0;
+    __atomic_store_n(&mOwner, (const void*)NULL, __ATOMIC_RELEASE);
+
+    awakened = HostBackend::sleep((HostBackend::Mutex*)mLock, event, deadline);
+
+    __atomic_store_n(&mOwner, HostBackend::self(), __ATOMIC_RELEASE);
+    mDepth = depth;
+
+    return awakened ? THREAD_AWAKENED : THREAD_TIMED_OUT;
+}
+
+void IOWorkLoop::hostWakeupGate(void* event, bool oneThread)
+{
+    IOLockWakeup(mLock, event, oneThread);
+}
+
+IOCommandGate* IOCommandGate::commandGate(OSObject* owner, Action action)
+{
+    IOCommandGate* gate = new IOCommandGate;
+
+    gate->mOwner = owner;
+    return gate;
+}
+
+IOReturn IOCommandGate::runAction(Action action, void* arg0, void* arg1, void* arg2, void* arg3)
+{
+    IOWorkLoop* workLoop = getWorkLoop();
+    IOReturn ret;
+
+    if (workLoop == NULL)
+        return kIOReturnNotReady;
+
+    workLoop->closeGate();
+    ret = action(mOwner, arg0, arg1, arg2, arg3);
+    workLoop->openGate();
+
+    return ret;
+}
+
+IOReturn IOCommandGate::commandSleep(void* event, UInt32 interruptible)
+{
+    return getWorkLoop()->hostSleepGate(event, 0);
+}
+
+IOReturn IOCommandGate::commandSleep(void* event, AbsoluteTime deadline, UInt32 interruptible)
+{
+    return getWorkLoop()->hostSleepGate(event, deadline);
+}
+
+void IOCommandGate::commandWakeup(void* event, bool oneThread)
+{
+    IOWorkLoop* workLoop = getWorkLoop();
+
+    if (workLoop != NULL)
+        workLoop->hostWakeupGate(event, oneThread);
+}
+
+IOTimerEventSource* IOTimerEventSource::timerEventSource(OSObject* owner, Action action)
+{
+    IOTimerEventSource* timer = new IOTimerEventSource;
+
+    timer->mOwner = owner;
+    timer->mAction = action;
+    timer->mLock = IOLockAlloc();
+    timer->mCall = thread_call_allocate(&IOTimerEventSource::timeout, timer);
+    return timer;
+}
+
+void IOTimerEventSource::free()
+{
+    cancelTimeout();
+    thread_call_free(mCall);
+    IOLockFree(mLock);
+    IOEventSource::free();
+}
+
+IOReturn IOTimerEventSource::arm(UInt64 ns)
+{
+    UInt32 generation;
+
+    IOLockLock(mLock);
+    generation = ++mGeneration;
+    mArmed = true;
+    IOLockUnlock(mLock);
+
+    thread_call_enter1_delayed(mCall, (thread_call_param_t)(uintptr_t)generation, HostBackend::now() + ns);
+    return kIOReturnSuccess;
+}
+
+IOReturn IOTimerEventSource::setTimeoutMS(UInt32 ms)
+{
+    return arm((UInt64)ms * kMillisecondScale);
+}
+
+IOReturn IOTimerEventSource::setTimeoutUS(UInt32 us)
+{
+    return arm((UInt64)us * kMicrosecondScale);
+}
+
+void IOTimerEventSource::cancelTimeout()
+{
+    IOLockLock(mLock);
+    mGeneration++;
+    mArmed = false;
+    IOLockUnlock(mLock);
+
+    thread_call_cancel(mCall);
+}
+
+// Fires in the gate, unless cancelled or re-armed since this callout was entered
+void IOTimerEventSource::timeout(thread_call_param_t param0, thread_call_param_t param1)
+{
+    IOTimerEventSource* self = (IOTimerEventSource*)param0;
+    UInt32 generation = (UInt32)(uintptr_t)param1;
+    IOWorkLoop* workLoop;
+    bool fire;
+
+    IOLockLock(self->mLock);
+    if (!self->mArmed || self->mGeneration != generation) {
+        IOLockUnlock(self->mLock);
+        return;
+    }
+    self->retain();
+    IOLockUnlock(self->mLock);
+
+    workLoop = self->getWorkLoop();
+    if (workLoop != NULL) {
+        workLoop->closeGate();
+
+        IOLockLock(self->mLock);
+        fire = self->mArmed && self->mGeneration == generation;
+        if (fire)
+            self->mArmed = false;
+        IOLockUnlock(self->mLock);
+
+        if (fire && self->mAction != NULL)
+            self->mAction(self->mOwner, self);
+        workLoop->openGate();
+    }
+
+    self->release();
+}
+
+// Reporting
+
+OSDefineMetaClassAndStructors(IOReporter, OSObject)
+OSDefineMetaClassAndStructors(IOStateReporter, IOReporter)
+OSDefineMetaClassAndStructors(IOSimpleReporter, IOReporter)
+OSDefineMetaClassAndStructors(IOReportLegend, OSObject)
+
+IOStateReporter* IOStateReporter::with(IOService* service, UInt16 categories, int nstates, UInt32 unit)
+{
+    return new IOStateReporter;
+}
+
+IOSimpleReporter* IOSimpleReporter::with(IOService* service, UInt16 categories, UInt64 unit)
+{
+    return new IOSimpleReporter;
+}
+
+// Platform
+
+OSDefineMetaClassAndStructors(IOACPIPlatformDevice, IOService)
+OSDefineMetaClassAndStructors(IOPCIDevice, IOService)
+OSDefineMetaClassAndStructors(IOPCIBridge, IOService)
+OSDefineMetaClassAndStructors(IOPCI2PCIBridge, IOPCIBridge)
+
+void IOPCIDevice::hostSetConfig(UInt16 vendor, UInt16 device, UInt32 classCode, UInt8 headerType)
+{
+    bzero(mConfig, sizeof(mConfig));
+    mConfig[kIOPCIConfigVendorID] = (UInt8)vendor;
+    mConfig[kIOPCIConfigVendorID + 1] = (UInt8)(vendor >> 8);
+    mConfig[kIOPCIConfigDeviceID] = (UInt8)device;
+    mConfig[kIOPCIConfigDeviceID + 1] = (UInt8)(device >> 8);
+    mConfig[kIOPCIConfigClassCode] = (UInt8)classCode;
+    mConfig[kIOPCIConfigClassCode + 1] = (UInt8)(classCode >> 8);
+    mConfig[kIOPCIConfigClassCode + 2] = (UInt8)(classCode >> 16);
+    mConfig[kIOPCIConfigHeaderType] = headerType;
+}
+
+// Harness
+
+namespace HostKit
+{
+
+bool loadModule()
+{
+    return IOElectrify_start(&kmod_info, NULL) == KERN_SUCCESS;
+}
+
+void unloadModule()
+{
+    IOElectrify_stop(&kmod_info, NULL);
+}
+
+IOService* startDriver(OSDictionary* personality, IOService* provider)
+{
+    OSString* className = OSDynamicCast(OSString, personality->getObject("IOClass"));
+    IOService* driver;
+
+    if (className == NULL)
+        return NULL;
+
+    driver = OSDynamicCast(IOService, hostAllocClassWithName(className->getCStringNoCopy()));
+    if (driver == NULL)
+        return NULL;
+
+    if (!driver->init(personality) || !driver->hostStart(provider)) {
+        driver->release();
+        return NULL;
+    }
+
+    return driver;
+}
+
+void publish(IOService* service, IOService* provider)
+{
+    if (provider != NULL)
+        service->attach(provider);
+    service->registerService();
+}
+
+IOUserClient* openUserClient(IOService* provider, UInt32 type)
+{
+    OSObject* property = provider->copyProperty("IOUserClientClass");
+    OSString* className = OSDynamicCast(OSString, property);
+    IOUserClient* client = NULL;
+
+    if (className != NULL)
+        client = OSDynamicCast(IOUserClient, hostAllocClassWithName(className->getCStringNoCopy()));
+    OSSafeReleaseNULL(property);
+
+    if (client == NULL)
+        return NULL;
+
+    if (!client->initWithTask(current_task(), NULL, type, NULL) || !client->hostStart(provider)) {
+        client->release();
+        return NULL;
+    }
+
+    return client;
+}
+
+void closeUserClient(IOUserClient* client)
+{
+    client->clientClose();
+    client->release();
+}
+
+IOReturn callMethod(IOUserClient* client, UInt32 selector, const UInt64* scalarInput, UInt32 scalarInputCount,
+                    const void* structInput, UInt32 structInputSize, UInt64* scalarOutput,
+                    UInt32* scalarOutputCount, void* structOutput, UInt32* structOutputSize)
+{
+    IOExternalMethodArguments arguments;
+    IOReturn ret;
+
+    bzero(&arguments, sizeof(arguments));
+    arguments.version = 1;
+    arguments.selector = selector;
+    arguments.scalarInput = scalarInput;
+    arguments.scalarInputCount = scalarInputCount;
+    arguments.structureInput = structInput;
+    arguments.structureInputSize = structInputSize;
+    arguments.scalarOutput = scalarOutput;
+    arguments.scalarOutputCount = scalarOutputCount != NULL ? *scalarOutputCount : 0;
+    arguments.structureOutput = structOutput;
+    arguments.structureOutputSize = structOutputSize != NULL ? *structOutputSize : 0;
+
+    ret = client->externalMethod(selector, &arguments);
+
+    if (scalarOutputCount != NULL)
+        *scalarOutputCount = arguments.scalarOutputCount;
+    if (structOutputSize != NULL)
+        *structOutputSize = arguments.structureOutputSize;
+
+    return ret;
+}
+
+OSDictionary* copyProperties(IORegistryEntry* entry)
+{
+    OSSerialize* serializer = OSSerialize::withCapacity(0);
+
+    entry->serializeProperties(serializer);
+    serializer->release();
+    return entry->dictionaryWithProperties();
+}
+
+bool getNumber(OSDictionary* properties, const char* path, UInt64* value)
+{
+    std::string rest(path);
+    OSObject* object = properties;
+
+    for (;;) {
+        OSDictionary* dict = OSDynamicCast(OSDictionary, object);
+        size_t slash = rest.find('/');
+
+        if (dict == NULL)
+            return false;
+
+        object = dict->getObject(rest.substr(0, slash).c_str());
+        if (slash == std::string::npos)
+            break;
+        rest = rest.substr(slash + 1);
+    }
+
+    OSNumber* number = OSDynamicCast(OSNumber, object);
+    if (number == NULL)
+        return false;
+
+    *value = number->unsigned64BitValue();
+    return true;
+}
+
+void setPrivileged(bool privileged)
+{
+    __atomic_store_n(&sPrivileged, privileged, __ATOMIC_RELAXED);
+}
+
+void setLogging(bool logging)
+{
+    __atomic_store_n(&sLogging, logging, __ATOMIC_RELAXED);
+}
+
+SInt64 liveObjects()
+{
+    return __atomic_load_n(&sLiveObjects, __ATOMIC_ACQUIRE);
+}
+
+UInt64 createdObjects()
+{
+    return __atomic_load_n(&sCreatedObjects, __ATOMIC_ACQUIRE);
+}
+
+SInt64 liveAllocations()
+{
+    return __atomic_load_n(&sLiveAllocations, __ATOMIC_ACQUIRE);
+}
+
+UInt64 allocations()
+{
+    return __atomic_load_n(&sAllocations, __ATOMIC_ACQUIRE);
+}
+
+}
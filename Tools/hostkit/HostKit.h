@@ -0,0 +1,71 @@
+/*
+ *  Released under "The GNU General Public License (GPL-2.0)"
+ *
+ *  This program is free software; you can redistribute it and/or modify it
+ *  under the terms of the GNU General Public License as published by the
+ *  Free Software Foundation; either version 2 of the License, or (at your
+ *  option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful, but
+ *  WITHOUT ANY WARRANTY; without even the implied warranty of MERCHANTABILITY
+ *  or FITNESS FOR A PARTICULAR PURPOSE. See the GNU General Public License
+ *  for more details.
+ *
+ *  You should have received a copy of the GNU General Public License along
+ *  with this program; if not, write to the Free Software Foundation, Inc.,
+ *  59 Temple Place, Suite 330, Boston, MA 02111-1307 USA
+ *
+ */
+
+#ifndef HostKit_h
+#define HostKit_h
+
+#include "HostKitKernel.h"
+#include "Backend.h"
+
+// Harness side of the host kit, what kextload, the IOKit matching and a
+// user space client would do to the kext
+namespace HostKit
+{
+    // Back end first, then the module start routine
+    bool loadModule();
+    void unloadModule();
+
+    // IOKitPersonalities entry of an Info.plist, NULL when missing
+    OSDictionary* copyPersonality(const char* plistPath, const char* name);
+
+    // Create the personality's IOClass and start it on provider, NULL when
+    // it didn't start. The caller owns the returned reference.
+    IOService* startDriver(OSDictionary* personality, IOService* provider);
+
+    // Publish a device the way its bus driver would, delivering publish
+    // notifications. provider may be NULL for a root.
+    void publish(IOService* service, IOService* provider);
+
+    // IOServiceOpen and IOServiceClose on the provider's IOUserClientClass
+    IOUserClient* openUserClient(IOService* provider, UInt32 type = 0);
+    void closeUserClient(IOUserClient* client);
+
+    // IOConnectCallMethod, counts are in and out like the user space call
+    IOReturn callMethod(IOUserClient* client, UInt32 selector, const UInt64* scalarInput, UInt32 scalarInputCount,
+                        const void* structInput, UInt32 structInputSize, UInt64* scalarOutput,
+                        UInt32* scalarOutputCount, void* structOutput, UInt32* structOutputSize);
+
+    // IORegistryEntryCreateCFProperties, serializeProperties runs first
+    OSDictionary* copyProperties(IORegistryEntry* entry);
+
+    // Copy of a 64 bit number in a property dictionary, nested keys
+    // separated by '/', false when missing
+    bool getNumber(OSDictionary* properties, const char* path, UInt64* value);
+
+    void setPrivileged(bool privileged);
+    void setLogging(bool logging);
+
+    // OSObjects and IOMalloc blocks alive and created so far
+    SInt64 liveObjects();
+    UInt64 createdObjects();
+    SInt64 liveAllocations();
+    UInt64 allocations();
+}
+
+#endif /* HostKit_h */
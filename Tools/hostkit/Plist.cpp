@@ -0,0 +1,168 @@
+/*
+ *  Released under "The GNU General Public License (GPL-2.0)"
+ *
+ *  This program is free software; you can redistribute it and/or modify it
+ *  under the terms of the GNU General Public License as published by the
+ *  Free Software Foundation; either version 2 of the License, or (at your
+ *  option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful, but
+ *  WITHOUT ANY WARRANTY; without even the implied warranty of MERCHANTABILITY
+ *  or FITNESS FOR A PARTICULAR PURPOSE. See the GNU General Public License
+ *  for more details.
+ *
+ *  You should have received a copy of the GNU General Public License along
+ *  with this program; if not, write to the Free Software Foundation, Inc.,
+ *  59 Temple Place, Suite 330, Boston, MA 02111-1307 USA
+ *
+ */
+
+#include <string>
+#include "HostKit.h"
+
+// Just enough of the XML property list format for IOKitPersonalities:
+// dict, array, key, string, integer, true and false
+
+struct PlistReader
+{
+    std::string text;
+    size_t pos;
+
+    bool nextTag(std::string* tag)
+    {
+        for (;;) {
+            size_t open = text.find('<', pos);
+
+            if (open == std::string::npos)
+                return false;
+
+            size_t close = text.find('>', open);
+            if (close == std::string::npos)
+                return false;
+
+            pos = close + 1;
+            *tag = text.substr(open + 1, close - open - 1);
+            if (!tag->empty() && ((*tag)[0] == '?' || (*tag)[0] == '!'))
+                continue;
+            return true;
+        }
+    }
+
+    // text up to the closing tag, entities decoded
+    std::string content(const std::string& name)
+    {
+        std::string end = "</" + name + ">";
+        size_t close = text.find(end, pos);
+        std::string raw = text.substr(pos, close - pos);
+        std::string value;
+
+        pos = close == std::string::npos ? text.size() : close + end.size();
+
+        for (size_t i = 0; i < raw.size(); i++) {
+            if (raw[i] != '&') {
+                value += raw[i];
+                continue;
+            }
+
+            size_t semi = raw.find(';', i);
+            std::string entity = raw.substr(i + 1, semi - i - 1);
+
+            if (entity == "amp")
+                value += '&';
+            else if (entity == "lt")
+                value += '<';
+            else if (entity == "gt")
+                value += '>';
+            else if (entity == "quot")
+                value += '"';
+            else if (entity == "apos")
+                value += '\'';
+            i = semi;
+        }
+
+        return value;
+    }
+
+    // the value starting at tag, NULL at a closing tag or on errors
+    OSObject* parseValue(const std::string& tag)
+    {
+        if (tag == "dict") {
+            OSDictionary* dict = OSDictionary::withCapacity(8);
+            std::string next;
+
+            while (nextTag(&next) && next == "key") {
+                std::string key = content("key");
+                OSObject* value;
+
+                if (!nextTag(&next) || (value = parseValue(next)) == NULL)
+                    break;
+                dict->setObject(key.c_str(), value);
+                value->release();
+            }
+            return dict;
+        }
+
+        if (tag == "array") {
+            OSArray* array = OSArray::withCapacity(4);
+            std::string next;
+            OSObject* value;
+
+            while (nextTag(&next) && (value = parseValue(next)) != NULL) {
+                array->setObject(value);
+                value->release();
+            }
+            return array;
+        }
+
+        if (tag == "dict/" || tag == "array/")
+            return tag == "dict/" ? (OSObject*)OSDictionary::withCapacity(1) : (OSObject*)OSArray::withCapacity(1);
+        if (tag == "string")
+            return OSString::withCString(content("string").c_str());
+        if (tag == "integer")
+            return OSNumber::withNumber(strtoull(content("integer").c_str(), NULL, 0), 32);
+        if (tag == "true/")
+            return kOSBooleanTrue;
+        if (tag == "false/")
+            return kOSBooleanFalse;
+
+        return NULL;
+    }
+};
+
+namespace HostKit
+{
+
+OSDictionary* copyPersonality(const char* plistPath, const char* name)
+{
+    FILE* file = fopen(plistPath, "r");
+    PlistReader reader;
+    char buffer[4096];
+    size_t length;
+    std::string tag;
+
+    if (file == NULL)
+        return NULL;
+
+    while ((length = fread(buffer, 1, sizeof(buffer), file)) > 0)
+        reader.text.append(buffer, length);
+    fclose(file);
+
+    reader.pos = 0;
+    while (reader.nextTag(&tag) && tag != "dict")
+        ;
+
+    OSDictionary* root = OSDynamicCast(OSDictionary, reader.parseValue(tag));
+    if (root == NULL)
+        return NULL;
+
+    OSDictionary* personalities = OSDynamicCast(OSDictionary, root->getObject("IOKitPersonalities"));
+    OSDictionary* personality = personalities ? OSDynamicCast(OSDictionary, personalities->getObject(name)) : NULL;
+
+    if (personality != NULL)
+        personality->retain();
+    root->release();
+
+    return personality;
+}
+
+}
@@ -0,0 +1,342 @@
+/*
+ *  Released under "The GNU General Public License (GPL-2.0)"
+ *
+ *  This program is free software; you can redistribute it and/or modify it
+ *  under the terms of the GNU General Public License as published by the
+ *  Free Software Foundation; either version 2 of the License, or (at your
+ *  option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful, but
+ *  WITHOUT ANY WARRANTY; without even the implied warranty of MERCHANTABILITY
+ *  or FITNESS FOR A PARTICULAR PURPOSE. See the GNU General Public License
+ *  for more details.
+ *
+ *  You should have received a copy of the GNU General Public License along
+ *  with this program; if not, write to the Free Software Foundation, Inc.,
+ *  59 Temple Place, Suite 330, Boston, MA 02111-1307 USA
+ *
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <condition_variable>
+#include <deque>
+#include <list>
+#include <map>
+#include <mutex>
+#include <thread>
+#include "Backend.h"
+
+// Discrete-event simulation. Every simulated thread is a real thread, but
+// only the one holding the baton runs, until it blocks on a mutex, an event
+// or a delay. The next ready thread gets the baton in FIFO order, and when
+// none is ready the clock jumps to the earliest deadline. Code runs in zero
+// time, only sleeps and delays advance the clock, so a run is deterministic
+// and takes as long as the computation, not the simulated time.
+
+// uptime starts at 1 s, the kext uses 0 as "not stamped"
+#define kUptimeBase 1000000000ULL
+
+namespace HostBackend
+{
+
+typedef std::pair<uint64_t, uint64_t> TimerKey;     // deadline, sequence
+
+struct Thread
+{
+    std::condition_variable cond;
+    bool running;
+    bool finished;
+    bool detached;
+
+    const void* event;              // waited for, NULL when not sleeping on one
+    bool timedOut;
+    bool hasTimer;
+    std::map<TimerKey, Thread*>::iterator timer;
+
+    void (*function)(void* argument);
+    void* argument;
+};
+
+struct Mutex
+{
+    Thread* owner;
+    std::deque<Thread*> waiters;
+};
+
+static std::mutex sSched;
+static uint64_t sNow = kUptimeBase;
+static uint64_t sTimerSeq = 0;
+static std::deque<Thread*> sReady;
+static std::map<TimerKey, Thread*> sTimers;
+static std::list<Thread*> sSleepers;
+static thread_local Thread* sSelf = NULL;
+
+static Thread* newThread()
+{
+    Thread* thread = new Thread;
+
+    thread->running = false;
+    thread->finished = false;
+    thread->detached = false;
+    thread->event = NULL;
+    thread->timedOut = false;
+    thread->hasTimer = false;
+    thread->function = NULL;
+    thread->argument = NULL;
+    return thread;
+}
+
+static void addTimer(Thread* thread, uint64_t deadline)
+{
+    if (deadline < sNow)
+        deadline = sNow;
+    thread->timer = sTimers.insert(std::make_pair(TimerKey(deadline, sTimerSeq++), thread)).first;
+    thread->hasTimer = true;
+}
+
+static void makeReady(Thread* thread)
+{
+    if (thread->hasTimer) {
+        sTimers.erase(thread->timer);
+        thread->hasTimer = false;
+    }
+    sReady.push_back(thread);
+}
+
+static Thread* pickNext()
+{
+    if (!sReady.empty()) {
+        Thread* next = sReady.front();
+        sReady.pop_front();
+        return next;
+    }
+
+    if (sTimers.empty()) {
+        fprintf(stderr, "simulation deadlock at %llu ns, every thread waits for an event\n",
+                (unsigned long long)sNow);
+        abort();
+    }
+
+    std::map<TimerKey, Thread*>::iterator first = sTimers.begin();
+    Thread* next = first->second;
+
+    if (first->first.first > sNow)
+        sNow = first->first.first;
+    sTimers.erase(first);
+    next->hasTimer = false;
+
+    if (next->event != NULL) {
+        sSleepers.remove(next);
+        next->event = NULL;
+        next->timedOut = true;
+    }
+
+    return next;
+}
+
+// Hand the baton on and wait until the caller is made ready and picked again
+static void block(std::unique_lock<std::mutex>& guard)
+{
+    Thread* self = sSelf;
+    Thread* next;
+
+    self->running = false;
+    next = pickNext();
+    if (next == self) {
+        self->running = true;
+        return;
+    }
+
+    next->running = true;
+    next->cond.notify_one();
+    self->cond.wait(guard, [&] { return self->running; });
+}
+
+static void acquireLocked(Mutex* mutex, std::unique_lock<std::mutex>& guard)
+{
+    if (mutex->owner == NULL) {
+        mutex->owner = sSelf;
+        return;
+    }
+
+    // unlock hands the mutex over before making us ready
+    mutex->waiters.push_back(sSelf);
+    block(guard);
+}
+
+static void releaseLocked(Mutex* mutex)
+{
+    if (mutex->waiters.empty()) {
+        mutex->owner = NULL;
+        return;
+    }
+
+    Thread* next = mutex->waiters.front();
+    mutex->waiters.pop_front();
+    mutex->owner = next;
+    makeReady(next);
+}
+
+static void waitEventLocked(const void* event, std::unique_lock<std::mutex>& guard)
+{
+    sSelf->event = event;
+    sSelf->timedOut = false;
+    sSleepers.push_back(sSelf);
+    block(guard);
+}
+
+static void wakeupLocked(const void* event, bool oneThread)
+{
+    for (std::list<Thread*>::iterator it = sSleepers.begin(); it != sSleepers.end();) {
+        Thread* thread = *it;
+
+        if (thread->event != event) {
+            ++it;
+            continue;
+        }
+
+        it = sSleepers.erase(it);
+        thread->event = NULL;
+        makeReady(thread);
+        if (oneThread)
+            break;
+    }
+}
+
+void initialize()
+{
+    std::lock_guard<std::mutex> guard(sSched);
+
+    sSelf = newThread();
+    sSelf->running = true;
+}
+
+Mutex* mutexAlloc()
+{
+    Mutex* mutex = new Mutex;
+
+    mutex->owner = NULL;
+    return mutex;
+}
+
+void mutexFree(Mutex* mutex)
+{
+    delete mutex;
+}
+
+void lock(Mutex* mutex)
+{
+    std::unique_lock<std::mutex> guard(sSched);
+
+    acquireLocked(mutex, guard);
+}
+
+void unlock(Mutex* mutex)
+{
+    std::lock_guard<std::mutex> guard(sSched);
+
+    releaseLocked(mutex);
+}
+
+bool sleep(Mutex* mutex, const void* event, uint64_t deadline)
+{
+    std::unique_lock<std::mutex> guard(sSched);
+
+    if (deadline != 0)
+        addTimer(sSelf, deadline);
+    releaseLocked(mutex);
+    waitEventLocked(event, guard);
+
+    bool awakened = !sSelf->timedOut;
+    acquireLocked(mutex, guard);
+    return awakened;
+}
+
+void wakeup(Mutex* mutex, const void* event, bool oneThread)
+{
+    std::lock_guard<std::mutex> guard(sSched);
+
+    wakeupLocked(event, oneThread);
+}
+
+uint64_t now()
+{
+    std::lock_guard<std::mutex> guard(sSched);
+
+    return sNow;
+}
+
+void delay(uint64_t ns)
+{
+    std::unique_lock<std::mutex> guard(sSched);
+
+    addTimer(sSelf, sNow + ns);
+    block(guard);
+}
+
+static void threadMain(Thread* thread)
+{
+    {
+        std::unique_lock<std::mutex> guard(sSched);
+
+        sSelf = thread;
+        thread->cond.wait(guard, [&] { return thread->running; });
+    }
+
+    thread->function(thread->argument);
+
+    std::unique_lock<std::mutex> guard(sSched);
+    Thread* next;
+
+    thread->finished = true;
+    thread->running = false;
+    wakeupLocked(thread, false);
+
+    next = pickNext();
+    next->running = true;
+    next->cond.notify_one();
+
+    if (thread->detached)
+        delete thread;
+}
+
+// the new thread runs once the caller blocks
+Thread* spawn(void (*function)(void* argument), void* argument)
+{
+    Thread* thread = newThread();
+
+    thread->function = function;
+    thread->argument = argument;
+    std::thread(threadMain, thread).detach();
+
+    std::lock_guard<std::mutex> guard(sSched);
+    sReady.push_back(thread);
+    return thread;
+}
+
+void join(Thread* thread)
+{
+    std::unique_lock<std::mutex> guard(sSched);
+
+    while (!thread->finished)
+        waitEventLocked(thread, guard);
+    delete thread;
+}
+
+void detach(Thread* thread)
+{
+    std::lock_guard<std::mutex> guard(sSched);
+
+    if (thread->finished)
+        delete thread;
+    else
+        thread->detached = true;
+}
+
+const void* self()
+{
+    return sSelf;
+}
+
+}
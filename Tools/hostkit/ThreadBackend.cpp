@@ -0,0 +1,173 @@
+/*
+ *  Released under "The GNU General Public License (GPL-2.0)"
+ *
+ *  This program is free software; you can redistribute it and/or modify it
+ *  under the terms of the GNU General Public License as published by the
+ *  Free Software Foundation; either version 2 of the License, or (at your
+ *  option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful, but
+ *  WITHOUT ANY WARRANTY; without even the implied warranty of MERCHANTABILITY
+ *  or FITNESS FOR A PARTICULAR PURPOSE. See the GNU General Public License
+ *  for more details.
+ *
+ *  You should have received a copy of the GNU General Public License along
+ *  with this program; if not, write to the Free Software Foundation, Inc.,
+ *  59 Temple Place, Suite 330, Boston, MA 02111-1307 USA
+ *
+ */
+
+#include <chrono>
+#include <condition_variable>
+#include <list>
+#include <mutex>
+#include <thread>
+#include "Backend.h"
+
+// Real threads, what the kext would see on a machine short of the kernel's
+// preemption and priorities. Waits on events go through one global list,
+// like xnu's wait queues keyed by event.
+
+namespace HostBackend
+{
+
+struct Mutex
+{
+    std::mutex mutex;
+};
+
+struct Thread
+{
+    std::thread thread;
+};
+
+struct Waiter
+{
+    const void* event;
+    std::condition_variable cond;
+    bool signaled;
+};
+
+static std::mutex sWaitLock;
+static std::list<Waiter*> sWaiters;
+
+// uptime starts at 1 s, the kext uses 0 as "not stamped"
+#define kUptimeBase 1000000000ULL
+
+static std::chrono::steady_clock::time_point sEpoch = std::chrono::steady_clock::now();
+
+void initialize()
+{
+}
+
+Mutex* mutexAlloc()
+{
+    return new Mutex;
+}
+
+void mutexFree(Mutex* mutex)
+{
+    delete mutex;
+}
+
+void lock(Mutex* mutex)
+{
+    mutex->mutex.lock();
+}
+
+void unlock(Mutex* mutex)
+{
+    mutex->mutex.unlock();
+}
+
+// the waiter is queued before mutex is dropped, a wakeup issued under
+// mutex can't slip in between
+bool sleep(Mutex* mutex, const void* event, uint64_t deadline)
+{
+    Waiter waiter;
+    std::unique_lock<std::mutex> guard(sWaitLock);
+
+    waiter.event = event;
+    waiter.signaled = false;
+    sWaiters.push_back(&waiter);
+    mutex->mutex.unlock();
+
+    if (deadline == 0) {
+        waiter.cond.wait(guard, [&] { return waiter.signaled; });
+    }
+    else {
+        uint64_t offset = deadline > kUptimeBase ? deadline - kUptimeBase : 0;
+        std::chrono::steady_clock::time_point until = sEpoch + std::chrono::nanoseconds(offset);
+
+        waiter.cond.wait_until(guard, until, [&] { return waiter.signaled; });
+    }
+
+    if (!waiter.signaled)
+        sWaiters.remove(&waiter);
+    bool signaled = waiter.signaled;
+    guard.unlock();
+
+    mutex->mutex.lock();
+    return signaled;
+}
+
+void wakeup(Mutex* mutex, const void* event, bool oneThread)
+{
+    std::lock_guard<std::mutex> guard(sWaitLock);
+
+    for (std::list<Waiter*>::iterator it = sWaiters.begin(); it != sWaiters.end();) {
+        Waiter* waiter = *it;
+
+        if (waiter->event != event) {
+            ++it;
+            continue;
+        }
+
+        it = sWaiters.erase(it);
+        waiter->signaled = true;
+        waiter->cond.notify_one();
+        if (oneThread)
+            break;
+    }
+}
+
+uint64_t now()
+{
+    std::chrono::nanoseconds elapsed = std::chrono::steady_clock::now() - sEpoch;
+
+    return kUptimeBase + (uint64_t)elapsed.count();
+}
+
+void delay(uint64_t ns)
+{
+    std::this_thread::sleep_for(std::chrono::nanoseconds(ns));
+}
+
+Thread* spawn(void (*function)(void* argument), void* argument)
+{
+    Thread* thread = new Thread;
+
+    thread->thread = std::thread(function, argument);
+    return thread;
+}
+
+void join(Thread* thread)
+{
+    thread->thread.join();
+    delete thread;
+}
+
+void detach(Thread* thread)
+{
+    thread->thread.detach();
+    delete thread;
+}
+
+const void* self()
+{
+    static thread_local char marker;
+
+    return &marker;
+}
+
+}
@@ -0,0 +1,878 @@
+/*
+ *  Released under "The GNU General Public License (GPL-2.0)"
+ *
+ *  This program is free software; you can redistribute it and/or modify it
+ *  under the terms of the GNU General Public License as published by the
+ *  Free Software Foundation; either version 2 of the License, or (at your
+ *  option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful, but
+ *  WITHOUT ANY WARRANTY; without even the implied warranty of MERCHANTABILITY
+ *  or FITNESS FOR A PARTICULAR PURPOSE. See the GNU General Public License
+ *  for more details.
+ *
+ *  You should have received a copy of the GNU General Public License along
+ *  with this program; if not, write to the Free Software Foundation, Inc.,
+ *  59 Temple Place, Suite 330, Boston, MA 02111-1307 USA
+ *
+ */
+
+#ifndef HostKitKernel_h
+#define HostKitKernel_h
+
+// Host build of the kernel interfaces the kext uses, enough to run the real
+// driver sources in a user space process. Objects are reference counted like
+// libkern's, the registry, PM, user clients and work loops behave like IOKit's
+// as far as the driver can tell. Locks, sleeps and the clock go through a
+// scheduling back end, real threads or a discrete-event simulation.
+//
+// Every IOKit, libkern, kern and mach header the kext includes resolves to
+// this one through the shims next to it.
+
+#include <stdint.h>
+#include <stddef.h>
+#include <stdarg.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <assert.h>
+#include <vector>
+
+// Types
+
+typedef uint8_t  UInt8;
+typedef uint16_t UInt16;
+typedef uint32_t UInt32;
+typedef uint64_t UInt64;
+typedef int8_t   SInt8;
+typedef int16_t  SInt16;
+typedef int32_t  SInt32;
+typedef int64_t  SInt64;
+
+typedef int kern_return_t;
+typedef kern_return_t IOReturn;
+typedef UInt32 IOOptionBits;
+typedef UInt32 IOItemCount;
+typedef UInt32 IODirection;
+typedef UInt64 IOByteCount;
+typedef UInt64 AbsoluteTime;            // ns of uptime
+typedef UInt32 IOPMPowerFlags;
+typedef uintptr_t vm_size_t;
+typedef uintptr_t vm_offset_t;
+typedef void* task_t;
+typedef UInt32 mach_port_t;
+typedef UInt64 io_user_reference_t;
+typedef unsigned char uuid_t[16];
+
+#define KERN_SUCCESS                0
+#define KERN_FAILURE                5
+
+#define kIOReturnSuccess            KERN_SUCCESS
+#define iokit_common_err(return)    ((IOReturn)(0xe0000000 | (return)))
+#define kIOReturnError              iokit_common_err(0x2bc)
+#define kIOReturnNoMemory           iokit_common_err(0x2bd)
+#define kIOReturnNotPrivileged      iokit_common_err(0x2c1)
+#define kIOReturnBadArgument        iokit_common_err(0x2c2)
+#define kIOReturnUnsupported        iokit_common_err(0x2c7)
+#define kIOReturnBusy               iokit_common_err(0x2d5)
+#define kIOReturnTimeout            iokit_common_err(0x2d6)
+#define kIOReturnNotReady           iokit_common_err(0x2d8)
+#define kIOReturnNotFound           iokit_common_err(0x2f0)
+
+#define THREAD_UNINT                0
+#define THREAD_INTERRUPTIBLE        1
+#define THREAD_ABORTSAFE            2
+#define THREAD_AWAKENED             0
+#define THREAD_TIMED_OUT            1
+
+#define PAGE_SIZE                   4096
+
+#define kNanosecondScale            1
+#define kMicrosecondScale           1000
+#define kMillisecondScale           (1000 * 1000)
+#define kSecondScale                (1000 * 1000 * 1000)
+
+// IOLib
+
+#define strlcpy hostStrlcpy
+static inline size_t hostStrlcpy(char* dst, const char* src, size_t size)
+{
+    size_t length = strlen(src);
+
+    if (size > 0) {
+        size_t copy = length < size - 1 ? length : size - 1;
+        memcpy(dst, src, copy);
+        dst[copy] = 0;
+    }
+
+    return length;
+}
+
+void IOLog(const char* format, ...) __attribute__((format(printf, 1, 2)));
+void* IOMalloc(vm_size_t size);
+void IOFree(void* address, vm_size_t size);
+void IOSleep(unsigned milliseconds);
+void IODelay(unsigned microseconds);
+
+void clock_get_uptime(UInt64* result);
+void absolutetime_to_nanoseconds(UInt64 abstime, UInt64* result);
+void nanoseconds_to_absolutetime(UInt64 nanoseconds, UInt64* result);
+void clock_interval_to_deadline(UInt32 interval, UInt32 scaleFactor, UInt64* result);
+
+task_t current_task();
+
+// Atomics, libkern returns the value before the operation
+
+static inline SInt32 OSAddAtomic(SInt32 amount, volatile SInt32* address)
+{
+    return __atomic_fetch_add(address, amount, __ATOMIC_SEQ_CST);
+}
+
+static inline SInt64 OSAddAtomic64(SInt64 amount, volatile SInt64* address)
+{
+    return __atomic_fetch_add(address, amount, __ATOMIC_SEQ_CST);
+}
+
+static inline SInt32 OSIncrementAtomic(volatile SInt32* address)
+{
+    return OSAddAtomic(1, address);
+}
+
+static inline SInt32 OSDecrementAtomic(volatile SInt32* address)
+{
+    return OSAddAtomic(-1, address);
+}
+
+static inline bool OSCompareAndSwap64(UInt64 oldValue, UInt64 newValue, volatile UInt64* address)
+{
+    return __atomic_compare_exchange_n(address, &oldValue, newValue, false, __ATOMIC_SEQ_CST, __ATOMIC_SEQ_CST);
+}
+
+static inline bool OSCompareAndSwapPtr(void* oldValue, void* newValue, void* volatile* address)
+{
+    return __atomic_compare_exchange_n(address, &oldValue, newValue, false, __ATOMIC_SEQ_CST, __ATOMIC_SEQ_CST);
+}
+
+static inline void OSMemoryBarrier()
+{
+    __atomic_thread_fence(__ATOMIC_SEQ_CST);
+}
+
+// Locks, on the scheduling back end
+
+typedef struct HostLock IOLock;
+
+IOLock* IOLockAlloc();
+void IOLockFree(IOLock* lock);
+void IOLockLock(IOLock* lock);
+void IOLockUnlock(IOLock* lock);
+int IOLockSleep(IOLock* lock, void* event, UInt32 interType);
+int IOLockSleepDeadline(IOLock* lock, void* event, AbsoluteTime deadline, UInt32 interType);
+void IOLockWakeup(IOLock* lock, void* event, bool oneThread);
+
+// Thread calls, each runs on its own thread
+
+typedef void* thread_call_param_t;
+typedef struct thread_call* thread_call_t;
+typedef void (*thread_call_func_t)(thread_call_param_t param0, thread_call_param_t param1);
+
+thread_call_t thread_call_allocate(thread_call_func_t func, thread_call_param_t param0);
+bool thread_call_free(thread_call_t call);
+bool thread_call_enter(thread_call_t call);
+bool thread_call_enter1(thread_call_t call, thread_call_param_t param1);
+bool thread_call_enter_delayed(thread_call_t call, UInt64 deadline);
+bool thread_call_enter1_delayed(thread_call_t call, thread_call_param_t param1, UInt64 deadline);
+bool thread_call_cancel(thread_call_t call);
+bool thread_call_cancel_wait(thread_call_t call);
+
+// Module
+
+struct kmod_info_t
+{
+    char name[64];
+    char version[64];
+};
+
+extern const int version_major;
+extern const int version_minor;
+
+// libkern
+
+class OSObject;
+class OSSerialize;
+
+typedef OSObject* (*HostClassAllocator)();
+
+// OSMetaClass stand-in, the class name checks behind service matching and
+// the allocation by name behind personalities and IOUserClientClass
+struct HostClassRegistration
+{
+    HostClassRegistration(const char* name, HostClassAllocator allocator);
+};
+
+OSObject* hostAllocClassWithName(const char* name);
+
+#define OSDeclareDefaultStructors(className) \
+public: \
+    virtual const char* hostClassName() const override; \
+    virtual bool hostConformsTo(const char* name) const override; \
+private:
+
+#define OSDefineMetaClassAndStructors(className, superclassName) \
+    const char* className::hostClassName() const { return #className; } \
+    bool className::hostConformsTo(const char* name) const \
+    { \
+        return strcmp(name, #className) == 0 || superclassName::hostConformsTo(name); \
+    } \
+    static OSObject* hostAlloc##className() { return new className; } \
+    static HostClassRegistration hostRegistration##className(#className, &hostAlloc##className);
+
+template <class T>
+static inline T* hostDynamicCast(const OSObject* object)
+{
+    return object ? dynamic_cast<T*>(const_cast<OSObject*>(object)) : NULL;
+}
+
+#define OSDynamicCast(type, inst) hostDynamicCast<type>(inst)
+#define OSSafeReleaseNULL(inst) do { if (inst) { (inst)->release(); } (inst) = NULL; } while (0)
+
+// Itanium C++ ABI member function pointer, a function address or a vtable
+// offset. The low bit of ptr marks virtual ones, of adj on ARM.
+template <class T, class F>
+static inline void* hostMemberFunctionCast(const T* self, F function)
+{
+    struct { uintptr_t ptr; ptrdiff_t adj; } pmf;
+
+    static_assert(sizeof(F) == sizeof(pmf), "unexpected member function pointer layout");
+    memcpy(&pmf, &function, sizeof(pmf));
+
+#if defined(__arm__) || defined(__aarch64__)
+    bool isVirtual = pmf.adj & 1;
+    ptrdiff_t offset = pmf.ptr;
+    ptrdiff_t adjust = pmf.adj >> 1;
+#else
+    bool isVirtual = pmf.ptr & 1;
+    ptrdiff_t offset = pmf.ptr - 1;
+    ptrdiff_t adjust = pmf.adj;
+#endif
+
+    if (!isVirtual)
+        return (void*)pmf.ptr;
+
+    const char* vtable = *(const char* const*)((const char*)self + adjust);
+    return *(void* const*)(vtable + offset);
+}
+
+#define OSMemberFunctionCast(cptrtype, self, func) ((cptrtype)hostMemberFunctionCast(self, func))
+
+class OSObject
+{
+public:
+    // zero filled like kernel allocations, drivers rely on it
+    static void* operator new(size_t size);
+    static void operator delete(void* memory, size_t size);
+
+    OSObject();
+    virtual ~OSObject();
+
+    virtual bool init() { return true; }
+    virtual void free();
+
+    virtual void retain() const;
+    virtual void release() const;
+    int getRetainCount() const;
+
+    virtual bool isEqualTo(const OSObject* object) const { return this == object; }
+    virtual bool serialize(OSSerialize* serializer) const;
+
+    virtual const char* hostClassName() const { return "OSObject"; }
+    virtual bool hostConformsTo(const char* name) const { return strcmp(name, "OSObject") == 0; }
+
+private:
+    mutable volatile SInt32 mRetainCount;
+};
+
+class OSSerialize : public OSObject
+{
+    OSDeclareDefaultStructors(OSSerialize)
+public:
+    static OSSerialize* withCapacity(unsigned int capacity);
+};
+
+class OSIterator : public OSObject
+{
+    OSDeclareDefaultStructors(OSIterator)
+public:
+    virtual void reset() {}
+    virtual OSObject* getNextObject() { return NULL; }
+};
+
+class OSCollection : public OSObject
+{
+    OSDeclareDefaultStructors(OSCollection)
+public:
+    virtual unsigned int getCount() const = 0;
+    virtual void flushCollection() = 0;
+    virtual OSObject* hostIterate(unsigned int index) const = 0;
+};
+
+class OSString : public OSObject
+{
+    OSDeclareDefaultStructors(OSString)
+public:
+    static OSString* withCString(const char* string);
+    virtual bool initWithCString(const char* string);
+    virtual void free() override;
+
+    const char* getCStringNoCopy() const { return mString; }
+    unsigned int getLength() const { return (unsigned int)strlen(mString); }
+    bool isEqualTo(const char* string) const { return strcmp(mString, string) == 0; }
+    bool isEqualTo(const OSString* string) const { return string != NULL && isEqualTo(string->mString); }
+    virtual bool isEqualTo(const OSObject* object) const override;
+
+protected:
+    char* mString;
+};
+
+class OSSymbol : public OSString
+{
+    OSDeclareDefaultStructors(OSSymbol)
+public:
+    static const OSSymbol* withCString(const char* string);
+};
+
+class OSNumber : public OSObject
+{
+    OSDeclareDefaultStructors(OSNumber)
+public:
+    static OSNumber* withNumber(unsigned long long value, unsigned int numberOfBits);
+    virtual bool init(unsigned long long value, unsigned int numberOfBits);
+
+    UInt8 unsigned8BitValue() const { return (UInt8)mValue; }
+    UInt16 unsigned16BitValue() const { return (UInt16)mValue; }
+    UInt32 unsigned32BitValue() const { return (UInt32)mValue; }
+    UInt64 unsigned64BitValue() const { return mValue; }
+    unsigned int numberOfBits() const { return mBits; }
+    void setValue(unsigned long long value);
+    virtual bool isEqualTo(const OSObject* object) const override;
+
+private:
+    UInt64 mValue;
+    unsigned int mBits;
+};
+
+class OSBoolean : public OSObject
+{
+    OSDeclareDefaultStructors(OSBoolean)
+public:
+    explicit OSBoolean(bool value = false) : mValue(value) {}
+    static OSBoolean* withBoolean(bool value);
+
+    bool getValue() const { return mValue; }
+    bool isTrue() const { return mValue; }
+    bool isFalse() const { return !mValue; }
+
+    // the two instances live forever
+    virtual void retain() const override {}
+    virtual void release() const override {}
+
+private:
+    bool mValue;
+};
+
+extern OSBoolean* const kOSBooleanTrue;
+extern OSBoolean* const kOSBooleanFalse;
+
+class OSData : public OSObject
+{
+    OSDeclareDefaultStructors(OSData)
+public:
+    static OSData* withBytes(const void* bytes, unsigned int length);
+    static OSData* withCapacity(unsigned int capacity);
+    virtual bool initWithBytes(const void* bytes, unsigned int length);
+
+    const void* getBytesNoCopy() const { return mBytes.empty() ? NULL : &mBytes[0]; }
+    const void* getBytesNoCopy(unsigned int start, unsigned int length) const;
+    unsigned int getLength() const { return (unsigned int)mBytes.size(); }
+    bool appendBytes(const void* bytes, unsigned int length);
+    virtual bool isEqualTo(const OSObject* object) const override;
+
+private:
+    std::vector<UInt8> mBytes;
+};
+
+class OSArray : public OSCollection
+{
+    OSDeclareDefaultStructors(OSArray)
+public:
+    static OSArray* withCapacity(unsigned int capacity);
+    virtual bool initWithCapacity(unsigned int capacity);
+    virtual void free() override;
+
+    virtual unsigned int getCount() const override { return (unsigned int)mObjects.size(); }
+    virtual void flushCollection() override;
+    virtual OSObject* hostIterate(unsigned int index) const override { return getObject(index); }
+
+    bool setObject(const OSObject* object);
+    bool setObject(unsigned int index, const OSObject* object);
+    OSObject* getObject(unsigned int index) const;
+    void removeObject(unsigned int index);
+    bool merge(const OSArray* other);
+    unsigned int getNextIndexOfObject(const OSObject* object, unsigned int index) const;
+
+private:
+    std::vector<const OSObject*> mObjects;
+};
+
+class OSDictionary : public OSCollection
+{
+    OSDeclareDefaultStructors(OSDictionary)
+public:
+    static OSDictionary* withCapacity(unsigned int capacity);
+    static OSDictionary* withDictionary(const OSDictionary* dictionary, unsigned int capacity = 0);
+    virtual bool initWithCapacity(unsigned int capacity);
+    virtual void free() override;
+
+    virtual unsigned int getCount() const override { return (unsigned int)mEntries.size(); }
+    virtual void flushCollection() override;
+    // iterating a dictionary yields its keys
+    virtual OSObject* hostIterate(unsigned int index) const override;
+
+    bool setObject(const char* key, const OSObject* object);
+    bool setObject(const OSString* key, const OSObject* object);
+    OSObject* getObject(const char* key) const;
+    OSObject* getObject(const OSString* key) const;
+    void removeObject(const char* key);
+    void removeObject(const OSString* key);
+
+private:
+    struct Entry
+    {
+        const OSSymbol* key;
+        const OSObject* value;
+    };
+
+    std::vector<Entry> mEntries;
+};
+
+class OSCollectionIterator : public OSIterator
+{
+    OSDeclareDefaultStructors(OSCollectionIterator)
+public:
+    static OSCollectionIterator* withCollection(const OSCollection* collection);
+    virtual bool initWithCollection(const OSCollection* collection);
+    virtual void free() override;
+
+    virtual void reset() override { mIndex = 0; }
+    virtual OSObject* getNextObject() override;
+
+private:
+    const OSCollection* mCollection;
+    unsigned int mIndex;
+};
+
+// Registry
+
+struct IORegistryPlane;
+extern const IORegistryPlane* gIOServicePlane;
+
+class IORegistryEntry : public OSObject
+{
+    OSDeclareDefaultStructors(IORegistryEntry)
+public:
+    virtual bool init(OSDictionary* dictionary = NULL);
+    virtual void free() override;
+
+    virtual const char* getName(const IORegistryPlane* plane = NULL) const;
+    virtual void setName(const char* name, const IORegistryPlane* plane = NULL);
+    virtual const char* getLocation(const IORegistryPlane* plane = NULL) const;
+    virtual void setLocation(const char* location, const IORegistryPlane* plane = NULL);
+
+    virtual bool setProperty(const char* key, OSObject* object);
+    bool setProperty(const char* key, const char* string);
+    bool setProperty(const char* key, bool value);
+    bool setProperty(const char* key, unsigned long long value, unsigned int numberOfBits);
+    bool setProperty(const char* key, void* bytes, unsigned int length);
+    virtual OSObject* getProperty(const char* key) const;
+    virtual OSObject* copyProperty(const char* key) const;
+    virtual void removeProperty(const char* key);
+    virtual IOReturn setProperties(OSObject* properties);
+    virtual bool serializeProperties(OSSerialize* serializer) const;
+    OSDictionary* dictionaryWithProperties() const;
+
+    IORegistryEntry* getParentEntry(const IORegistryPlane* plane) const;
+    OSIterator* getChildIterator(const IORegistryPlane* plane) const;
+
+protected:
+    bool attachToParent(IORegistryEntry* parent);
+    void detachFromParent(IORegistryEntry* parent);
+
+private:
+    OSDictionary* mProperties;
+    char* mName;
+    char* mLocation;
+    IORegistryEntry* mParent;       // retained
+    OSArray* mChildren;
+};
+
+// Services
+
+class IOService;
+class IOUserClient;
+class IONotifier;
+class IOWorkLoop;
+
+extern const OSSymbol* gIOPublishNotification;
+extern const OSSymbol* gIOTerminatedNotification;
+
+typedef bool (*IOServiceMatchingNotificationHandler)(void* target, void* refCon, IOService* newService,
+                                                     IONotifier* notifier);
+
+class IONotifier : public OSObject
+{
+    OSDeclareDefaultStructors(IONotifier)
+public:
+    // no notifications are delivered once remove returns
+    virtual void remove();
+};
+
+#define kIOPMDeviceUsable           0x00008000
+#define kIOPMDoze                   0x00000400
+#define IOPMPowerOn                 0x00000002
+#define IOPMAckImplied              0
+
+struct IOPMPowerState
+{
+    unsigned long version;
+    IOPMPowerFlags capabilityFlags;
+    IOPMPowerFlags outputPowerCharacter;
+    IOPMPowerFlags inputPowerRequirement;
+    unsigned long staticPower;
+    unsigned long stateOrder;
+    unsigned long powerToAttain;
+    unsigned long timeToAttain;
+    unsigned long settleUpTime;
+    unsigned long timeToLower;
+    unsigned long settleDownTime;
+    unsigned long powerDomainBudget;
+};
+
+// IOReporting, accepted and ignored
+#define kIOReportCategoryPower      0x0001
+#define kIOReportUnitNone           0
+#define kIOReportUnit_ns            1
+#define IOREPORT_MAKEID(A, B, C, D, E, F, G, H) \
+    (((UInt64)(A) << 56) | ((UInt64)(B) << 48) | ((UInt64)(C) << 40) | ((UInt64)(D) << 32) | \
+     ((UInt64)(E) << 24) | ((UInt64)(F) << 16) | ((UInt64)(G) << 8) | (UInt64)(H))
+
+typedef struct IOReportChannelList IOReportChannelList;
+typedef UInt32 IOReportConfigureAction;
+typedef UInt32 IOReportUpdateAction;
+
+class IOService : public IORegistryEntry
+{
+    OSDeclareDefaultStructors(IOService)
+public:
+    virtual bool init(OSDictionary* dictionary = NULL) override;
+    virtual void free() override;
+
+    virtual IOService* probe(IOService* provider, SInt32* score) { return this; }
+    virtual bool start(IOService* provider) { return true; }
+    virtual void stop(IOService* provider) {}
+    virtual bool attach(IOService* provider);
+    virtual void detach(IOService* provider);
+    virtual IOService* getProvider() const;
+    virtual bool terminate(IOOptionBits options = 0);
+    bool isInactive() const;
+    virtual void registerService(IOOptionBits options = 0);
+
+    virtual IOReturn message(UInt32 type, IOService* provider, void* argument = 0);
+
+    void PMinit() {}
+    void PMstop() {}
+    IOReturn registerPowerDriver(IOService* driver, IOPMPowerState* states, unsigned long count);
+    IOReturn joinPMtree(IOService* driver) { return kIOReturnSuccess; }
+    virtual IOReturn setPowerState(unsigned long powerState, IOService* device) { return IOPMAckImplied; }
+    IOReturn acknowledgeSetPowerState();
+
+    virtual IOReturn configureReport(IOReportChannelList* channels, IOReportConfigureAction action, void* result,
+                                     void* destination) { return kIOReturnSuccess; }
+    virtual IOReturn updateReport(IOReportChannelList* channels, IOReportUpdateAction action, void* result,
+                                  void* destination) { return kIOReturnSuccess; }
+
+    static OSDictionary* serviceMatching(const char* className, OSDictionary* table = NULL);
+    static IONotifier* addMatchingNotification(const OSSymbol* type, OSDictionary* matching,
+                                               IOServiceMatchingNotificationHandler handler, void* target,
+                                               void* ref = NULL, SInt32 priority = 0);
+
+    // Harness side: start on provider the way matching would, and take a PM
+    // transition through to the acknowledgement or the timeout the driver
+    // asked for, returning kIOReturnTimeout for the latter
+    bool hostStart(IOService* provider);
+    IOReturn hostPowerChange(unsigned long powerState, UInt64* elapsedNS);
+
+private:
+    volatile bool mInactive;
+    bool mStarted;
+    bool mAckPending;
+    unsigned long mPowerStateCount;
+};
+
+class IOUserClient;
+
+struct IOExternalMethodArguments
+{
+    uint32_t version;
+    uint32_t selector;
+    mach_port_t asyncWakePort;
+    io_user_reference_t* asyncReference;
+    uint32_t asyncReferenceCount;
+    const uint64_t* scalarInput;
+    uint32_t scalarInputCount;
+    const void* structureInput;
+    uint32_t structureInputSize;
+    class IOMemoryDescriptor* structureInputDescriptor;
+    uint64_t* scalarOutput;
+    uint32_t scalarOutputCount;
+    void* structureOutput;
+    uint32_t structureOutputSize;
+    class IOMemoryDescriptor* structureOutputDescriptor;
+    uint32_t structureOutputDescriptorSize;
+};
+
+typedef IOReturn (*IOExternalMethodAction)(OSObject* target, void* reference, IOExternalMethodArguments* arguments);
+
+struct IOExternalMethodDispatch
+{
+    IOExternalMethodAction function;
+    uint32_t checkScalarInputCount;
+    uint32_t checkStructureInputSize;
+    uint32_t checkScalarOutputCount;
+    uint32_t checkStructureOutputSize;
+};
+
+enum { kIOUCVariableStructureSize = 0xffffffff };
+
+#define kIOClientPrivilegeAdministrator "root"
+
+class IOUserClient : public IOService
+{
+    OSDeclareDefaultStructors(IOUserClient)
+public:
+    virtual bool initWithTask(task_t owningTask, void* securityID, UInt32 type, OSDictionary* properties);
+    virtual IOReturn clientClose() { return kIOReturnUnsupported; }
+    virtual IOReturn clientMemoryForType(UInt32 type, IOOptionBits* options, class IOMemoryDescriptor** memory)
+    {
+        return kIOReturnUnsupported;
+    }
+    virtual IOReturn externalMethod(uint32_t selector, IOExternalMethodArguments* arguments,
+                                    IOExternalMethodDispatch* dispatch = 0, OSObject* target = 0, void* reference = 0);
+
+    static IOReturn clientHasPrivilege(void* securityToken, const char* privilegeName);
+};
+
+// Memory descriptors
+
+#define kIODirectionInOut           3
+#define kIOMemoryKernelUserShared   0x00000200
+
+class IOMemoryDescriptor : public OSObject
+{
+    OSDeclareDefaultStructors(IOMemoryDescriptor)
+public:
+    virtual IOReturn prepare(IODirection direction = 0) { return kIOReturnSuccess; }
+    virtual IOReturn complete(IODirection direction = 0) { return kIOReturnSuccess; }
+    IOByteCount readBytes(IOByteCount offset, void* bytes, IOByteCount length);
+    IOByteCount writeBytes(IOByteCount offset, const void* bytes, IOByteCount length);
+    IOByteCount getLength() const { return mLength; }
+
+    // Harness side, a descriptor over a caller's buffer
+    static IOMemoryDescriptor* hostWithAddress(void* address, IOByteCount length);
+
+protected:
+    void* mBytes;
+    IOByteCount mLength;
+};
+
+class IOBufferMemoryDescriptor : public IOMemoryDescriptor
+{
+    OSDeclareDefaultStructors(IOBufferMemoryDescriptor)
+public:
+    static IOBufferMemoryDescriptor* withOptions(IOOptionBits options, vm_size_t capacity, vm_offset_t alignment = 1);
+    virtual void free() override;
+
+    void* getBytesNoCopy() { return mBytes; }
+};
+
+// Work loops
+
+class IOEventSource : public OSObject
+{
+    OSDeclareDefaultStructors(IOEventSource)
+public:
+    IOWorkLoop* getWorkLoop() const { return __atomic_load_n(&mWorkLoop, __ATOMIC_ACQUIRE); }
+    void hostSetWorkLoop(IOWorkLoop* workLoop) { __atomic_store_n(&mWorkLoop, workLoop, __ATOMIC_RELEASE); }
+
+protected:
+    OSObject* mOwner;
+    IOWorkLoop* mWorkLoop;
+};
+
+// The gate is a recursive lock owned by one thread at a time
+class IOWorkLoop : public OSObject
+{
+    OSDeclareDefaultStructors(IOWorkLoop)
+public:
+    static IOWorkLoop* workLoop();
+    virtual void free() override;
+
+    IOReturn addEventSource(IOEventSource* source);
+    IOReturn removeEventSource(IOEventSource* source);
+    bool inGate() const;
+    void closeGate();
+    void openGate();
+
+    // drop the gate entirely while sleeping on event, the depth comes back with it
+    int hostSleepGate(void* event, AbsoluteTime deadline);
+    void hostWakeupGate(void* event, bool oneThread);
+
+private:
+    IOLock* mLock;
+    const void* mOwner;
+    UInt32 mDepth;
+    OSArray* mSources;
+};
+
+class IOCommandGate : public IOEventSource
+{
+    OSDeclareDefaultStructors(IOCommandGate)
+public:
+    typedef IOReturn (*Action)(OSObject* owner, void* arg0, void* arg1, void* arg2, void* arg3);
+
+    static IOCommandGate* commandGate(OSObject* owner, Action action = NULL);
+
+    IOReturn runAction(Action action, void* arg0 = 0, void* arg1 = 0, void* arg2 = 0, void* arg3 = 0);
+    IOReturn commandSleep(void* event, UInt32 interruptible = THREAD_ABORTSAFE);
+    IOReturn commandSleep(void* event, AbsoluteTime deadline, UInt32 interruptible);
+    void commandWakeup(void* event, bool oneThread = false);
+};
+
+class IOTimerEventSource : public IOEventSource
+{
+    OSDeclareDefaultStructors(IOTimerEventSource)
+public:
+    typedef void (*Action)(OSObject* owner, IOTimerEventSource* sender);
+
+    static IOTimerEventSource* timerEventSource(OSObject* owner, Action action = NULL);
+    virtual void free() override;
+
+    IOReturn setTimeoutMS(UInt32 ms);
+    IOReturn setTimeoutUS(UInt32 us);
+    void cancelTimeout();
+
+private:
+    static void timeout(thread_call_param_t param0, thread_call_param_t param1);
+    IOReturn arm(UInt64 ns);
+
+    Action mAction;
+    thread_call_t mCall;
+    IOLock* mLock;
+    UInt32 mGeneration;         // bumped by every set and cancel, a stale callout does nothing
+    bool mArmed;
+};
+
+// Reporting
+
+class IOReporter : public OSObject
+{
+    OSDeclareDefaultStructors(IOReporter)
+public:
+    IOReturn addChannel(UInt64 channel, const char* name = NULL) { return kIOReturnSuccess; }
+    IOReturn configureReport(IOReportChannelList* channels, IOReportConfigureAction action, void* result,
+                             void* destination) { return kIOReturnSuccess; }
+    IOReturn updateReport(IOReportChannelList* channels, IOReportUpdateAction action, void* result,
+                          void* destination) { return kIOReturnSuccess; }
+};
+
+class IOStateReporter : public IOReporter
+{
+    OSDeclareDefaultStructors(IOStateReporter)
+public:
+    static IOStateReporter* with(IOService* service, UInt16 categories, int nstates, UInt32 unit = 0);
+    IOReturn setStateID(UInt64 channel, int index, UInt64 stateID) { return kIOReturnSuccess; }
+    IOReturn setChannelState(UInt64 channel, UInt64 stateID) { return kIOReturnSuccess; }
+};
+
+class IOSimpleReporter : public IOReporter
+{
+    OSDeclareDefaultStructors(IOSimpleReporter)
+public:
+    static IOSimpleReporter* with(IOService* service, UInt16 categories, UInt64 unit);
+    IOReturn incrementValue(UInt64 channel, SInt64 increment) { return kIOReturnSuccess; }
+};
+
+class IOReportLegend : public OSObject
+{
+    OSDeclareDefaultStructors(IOReportLegend)
+public:
+    static IOReturn addReporterLegend(IOService* service, IOReporter* reporter, const char* groupName,
+                                      const char* subGroupName) { return kIOReturnSuccess; }
+};
+
+// Messages
+
+#define iokit_vendor_specific_msg(message)  ((UInt32)(0xe0000000 | (0x2 << 14) | (message)))
+#define kIOACPIMessageDeviceNotification    ((UInt32)(0xe0000000 | (0x1 << 14) | 0x10))
+
+// ACPI, the harness subclasses the platform device to answer evaluations
+
+class IOACPIPlatformDevice : public IOService
+{
+    OSDeclareDefaultStructors(IOACPIPlatformDevice)
+public:
+    virtual IOReturn evaluateObject(const char* objectName, OSObject** result = NULL, OSObject* params[] = NULL,
+                                    IOItemCount paramCount = 0, IOOptionBits options = 0)
+    {
+        return kIOReturnNotFound;
+    }
+};
+
+// PCI, config space is an array the harness fills, probes go to a subclass
+
+#define kIOPCIConfigVendorID        0x00
+#define kIOPCIConfigDeviceID        0x02
+#define kIOPCIConfigClassCode       0x09
+#define kIOPCIConfigHeaderType      0x0e
+
+#define kIOPCIProbeOptionDone       0x80000000
+#define kIOPCIProbeOptionEject      0x00100000
+#define kIOPCIProbeOptionNeedsScan  0x00200000
+
+class IOPCIDevice : public IOService
+{
+    OSDeclareDefaultStructors(IOPCIDevice)
+public:
+    UInt8 configRead8(UInt8 offset) { return mConfig[offset]; }
+    UInt16 configRead16(UInt8 offset) { return (UInt16)(mConfig[offset] | mConfig[(UInt8)(offset + 1)] << 8); }
+    UInt32 configRead32(UInt8 offset) { return configRead16(offset) | (UInt32)configRead16((UInt8)(offset + 2)) << 16; }
+
+    void hostSetConfig(UInt16 vendor, UInt16 device, UInt32 classCode, UInt8 headerType);
+
+private:
+    UInt8 mConfig[256];
+};
+
+class IOPCIBridge : public IOService
+{
+    OSDeclareDefaultStructors(IOPCIBridge)
+public:
+    virtual UInt32 requestProbe(IOOptionBits options) { return 0; }
+};
+
+class IOPCI2PCIBridge : public IOPCIBridge
+{
+    OSDeclareDefaultStructors(IOPCI2PCIBridge)
+};
+
+#endif /* HostKitKernel_h */
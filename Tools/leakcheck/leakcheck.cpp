@@ -0,0 +1,376 @@
+/*
+ *  Released under "The GNU General Public License (GPL-2.0)"
+ *
+ *  This program is free software; you can redistribute it and/or modify it
+ *  under the terms of the GNU General Public License as published by the
+ *  Free Software Foundation; either version 2 of the License, or (at your
+ *  option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful, but
+ *  WITHOUT ANY WARRANTY; without even the implied warranty of MERCHANTABILITY
+ *  or FITNESS FOR A PARTICULAR PURPOSE. See the GNU General Public License
+ *  for more details.
+ *
+ *  You should have received a copy of the GNU General Public License along
+ *  with this program; if not, write to the Free Software Foundation, Inc.,
+ *  59 Temple Place, Suite 330, Boston, MA 02111-1307 USA
+ *
+ */
+
+// leakcheck - fail when an operation on the kext leaves objects behind
+//
+// usage: leakcheck [-n runs] [-v]
+//
+//   -n runs        times each operation is repeated after the warm-up (20)
+//   -v             print the kext's log
+//
+// The kext sources are built against the host kit (see Tools/hostkit), which
+// counts every OSObject and IOMalloc block. Each operation runs twice to let
+// published properties and lazily created state settle (a wake trace only
+// has a "last" entry from the second wake on), then -n more times, and every
+// OSObject, IOMalloc block and AllocStats live count must be back where it
+// was. The simulation back end runs thread calls to completion before the
+// counts are taken, PM is acknowledged before the thread call drops its
+// reference. Stopping the drivers has to bring AllocStats back to zero.
+//
+// Exits with 1 on any non-zero net allocation, "make check" runs it.
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "HostKit.h"
+#include "AllocStats.h"
+#include "Profiles.h"
+#include "WMI.h"
+#include "WMIBlock.h"
+
+#define kPowerStateSleep        0
+#define kPowerStateNormal       2
+
+// IOElectrifyUserClient and IOElectrifyBridgeUserClient selectors, see Provider.h
+#define kSelectorForcePower     0
+#define kSelectorPowerHook      1
+#define kSelectorProbe          0
+
+// IOElectrifyPowerHook bits, see IOElectrify.h
+#define kPowerHookSleep         0x1
+#define kPowerHookWake          0x2
+
+static const ForcePowerProfile* sProfile = &kForcePowerProfiles[0];
+
+static const char* sSiteNames[kAllocSiteCount] =
+{
+    "force-power-args",
+    "wdg-buffer",
+    "wdg-entry",
+    "wmi-flags",
+    "wmi-iterator"
+};
+
+// Firmware and bus stand-ins, answering at once
+
+class CheckACPIDevice : public IOACPIPlatformDevice
+{
+    OSDeclareDefaultStructors(CheckACPIDevice)
+public:
+    virtual IOReturn evaluateObject(const char* objectName, OSObject** result, OSObject* params[],
+                                    IOItemCount paramCount, IOOptionBits options) override;
+};
+
+OSDefineMetaClassAndStructors(CheckACPIDevice, IOACPIPlatformDevice)
+
+IOReturn CheckACPIDevice::evaluateObject(const char* objectName, OSObject** result, OSObject* params[],
+                                         IOItemCount paramCount, IOOptionBits options)
+{
+    if (result == NULL)
+        return kIOReturnSuccess;
+
+    if (strcmp(objectName, "_WDG") == 0) {
+        WMI_DATA blocks[2];
+
+        // the force-power method and an event, both kinds of entry
+        memset(blocks, 0, sizeof(blocks));
+        memcpy(blocks[0].guid, sProfile->guid, sizeof(blocks[0].guid));
+        memcpy(blocks[0].object_id, "TF", sizeof(blocks[0].object_id));
+        blocks[0].instance_count = 1;
+        blocks[0].flags = ACPI_WMI_METHOD;
+        blocks[1].notify_id = 0xd0;
+        blocks[1].instance_count = 1;
+        blocks[1].flags = ACPI_WMI_EVENT;
+
+        *result = OSData::withBytes(blocks, sizeof(blocks));
+        return kIOReturnSuccess;
+    }
+
+    *result = OSNumber::withNumber(1ULL, 32);
+    return kIOReturnSuccess;
+}
+
+class CheckRootPort : public IOPCI2PCIBridge
+{
+    OSDeclareDefaultStructors(CheckRootPort)
+public:
+    virtual UInt32 requestProbe(IOOptionBits options) override { return 0; }
+};
+
+OSDefineMetaClassAndStructors(CheckRootPort, IOPCI2PCIBridge)
+
+// Operations
+
+struct Fixture
+{
+    IOService* controller;
+    IOService* bridge;
+    IOUserClient* controllerClient;
+    IOUserClient* bridgeClient;
+    CheckACPIDevice* wmiDevice;         // for the WMI operations, apart from the controller's
+    WMI* wmi;
+};
+
+static Fixture sFixture;
+
+static void callScalar(IOUserClient* client, UInt32 selector, UInt64 input)
+{
+    UInt64 output = 0;
+    UInt32 outputCount = 1;
+
+    HostKit::callMethod(client, selector, &input, 1, NULL, 0, &output, &outputCount, NULL, NULL);
+}
+
+static void forcePower()
+{
+    callScalar(sFixture.controllerClient, kSelectorForcePower, 0);
+    callScalar(sFixture.controllerClient, kSelectorForcePower, 1);
+}
+
+static void powerHook()
+{
+    callScalar(sFixture.controllerClient, kSelectorPowerHook, kPowerHookSleep | kPowerHookWake);
+}
+
+static void probe()
+{
+    callScalar(sFixture.bridgeClient, kSelectorProbe, kIOPCIProbeOptionNeedsScan | kIOPCIProbeOptionDone);
+}
+
+static void sleepWake()
+{
+    sFixture.controller->hostPowerChange(kPowerStateSleep, NULL);
+    sFixture.bridge->hostPowerChange(kPowerStateSleep, NULL);
+    sFixture.controller->hostPowerChange(kPowerStateNormal, NULL);
+    sFixture.bridge->hostPowerChange(kPowerStateNormal, NULL);
+}
+
+// ioreg, which publishes the user client counters
+static void readProperties()
+{
+    HostKit::copyProperties(sFixture.controller)->release();
+    HostKit::copyProperties(sFixture.bridge)->release();
+}
+
+static void openClose()
+{
+    HostKit::closeUserClient(HostKit::openUserClient(sFixture.controller));
+    HostKit::closeUserClient(HostKit::openUserClient(sFixture.bridge));
+}
+
+static void wmiParse()
+{
+    WMI* wmi = new WMI(sFixture.wmiDevice);
+
+    wmi->initialize();
+    delete wmi;
+}
+
+// the string lookup walks mData with an iterator
+static void wmiLookup()
+{
+    char guid[37];
+
+    wmiGuidToString(sProfile->guid, guid);
+    sFixture.wmi->hasMethod(guid);
+}
+
+struct Operation
+{
+    const char* name;
+    void (*run)();
+};
+
+static const Operation sOperations[] =
+{
+    { "force-power", forcePower },
+    { "power-hook", powerHook },
+    { "probe", probe },
+    { "sleep-wake", sleepWake },
+    { "properties", readProperties },
+    { "open-close", openClose },
+    { "wmi-parse", wmiParse },
+    { "wmi-lookup", wmiLookup }
+};
+
+#define kOperationCount (sizeof(sOperations) / sizeof(sOperations[0]))
+
+struct Snapshot
+{
+    SInt64 objects;
+    SInt64 allocations;
+    SInt32 sites[kAllocSiteCount];
+};
+
+static void snapshot(Snapshot* snap)
+{
+    // every ready thread runs before the clock moves
+    HostBackend::delay(kMillisecondScale);
+
+    snap->objects = HostKit::liveObjects();
+    snap->allocations = HostKit::liveAllocations();
+    for (int i = 0; i < kAllocSiteCount; i++)
+        snap->sites[i] = AllocStats::live(i);
+}
+
+// prints the operation's net allocation, false when it isn't zero
+static bool check(const char* name, const Snapshot& before, const Snapshot& after, int runs)
+{
+    bool clean = after.objects == before.objects && after.allocations == before.allocations;
+
+    for (int i = 0; i < kAllocSiteCount; i++)
+        clean = clean && after.sites[i] == before.sites[i];
+
+    printf("%-12s %5d %8lld %9lld  %s", name, runs, (long long)(after.objects - before.objects),
+           (long long)(after.allocations - before.allocations), clean ? "ok" : "LEAK");
+    for (int i = 0; i < kAllocSiteCount; i++) {
+        if (after.sites[i] != before.sites[i])
+            printf(" %s %+d", sSiteNames[i], after.sites[i] - before.sites[i]);
+    }
+    printf("\n");
+
+    return clean;
+}
+
+int main(int argc, char* argv[])
+{
+    int runs = 20;
+    bool verbose = false;
+    int opt;
+
+    while ((opt = getopt(argc, argv, "n:v")) != -1) {
+        switch (opt)
+        {
+            case 'n':
+                runs = atoi(optarg);
+                if (runs < 1)
+                    runs = 1;
+                break;
+            case 'v':
+                verbose = true;
+                break;
+            default:
+                fprintf(stderr, "usage: %s [-n runs] [-v]\n", argv[0]);
+                return 2;
+        }
+    }
+
+    HostBackend::initialize();
+    HostKit::setLogging(verbose);
+    HostKit::setPrivileged(true);
+
+    OSDictionary* controllerPersonality = HostKit::copyPersonality(KEXT_INFO_PLIST, "IOElectrify");
+    OSDictionary* bridgePersonality = HostKit::copyPersonality(KEXT_INFO_PLIST, "IOElectrifyBridge");
+
+    if (controllerPersonality == NULL || bridgePersonality == NULL) {
+        fprintf(stderr, "%s: no IOElectrify personalities in %s\n", argv[0], KEXT_INFO_PLIST);
+        return 1;
+    }
+
+    OSNumber* osNum = OSNumber::withNumber(kPowerHookSleep | kPowerHookWake, 32);
+    controllerPersonality->setObject("IOElectrifyPowerHook", osNum);
+    osNum->release();
+    bridgePersonality->setObject("IOElectrifyBridgePowerHook", kOSBooleanTrue);
+
+    if (!HostKit::loadModule()) {
+        fprintf(stderr, "%s: module start failed\n", argv[0]);
+        return 1;
+    }
+
+    CheckACPIDevice* acpi = new CheckACPIDevice;
+    IOPCIDevice* rootPortDevice = new IOPCIDevice;
+    CheckRootPort* rootPort = new CheckRootPort;
+    bool clean = true;
+
+    acpi->init(NULL);
+    acpi->setName("WMI1");
+    rootPortDevice->init(NULL);
+    rootPortDevice->setName("RP01");
+    rootPortDevice->hostSetConfig(0x8086, 0x7615, 0x060400, 0x01);
+    rootPort->init(NULL);
+    rootPort->attach(rootPortDevice);
+
+    sFixture.controller = HostKit::startDriver(controllerPersonality, acpi);
+    sFixture.bridge = HostKit::startDriver(bridgePersonality, rootPort);
+    controllerPersonality->release();
+    bridgePersonality->release();
+
+    if (sFixture.controller == NULL || sFixture.bridge == NULL) {
+        fprintf(stderr, "%s: %s did not start\n", argv[0],
+                sFixture.controller == NULL ? "IOElectrify" : "IOElectrifyBridge");
+        return 1;
+    }
+
+    sFixture.controllerClient = HostKit::openUserClient(sFixture.controller);
+    sFixture.bridgeClient = HostKit::openUserClient(sFixture.bridge);
+    sFixture.wmiDevice = new CheckACPIDevice;
+    sFixture.wmiDevice->init(NULL);
+    sFixture.wmiDevice->setName("WMI2");
+    sFixture.wmi = new WMI(sFixture.wmiDevice);
+
+    if (sFixture.controllerClient == NULL || sFixture.bridgeClient == NULL || !sFixture.wmi->initialize()) {
+        fprintf(stderr, "%s: setting up the fixture failed\n", argv[0]);
+        return 1;
+    }
+
+    printf("%-12s %5s %8s %9s  %s\n", "operation", "runs", "objects", "IOMalloc", "net");
+
+    for (unsigned int i = 0; i < kOperationCount; i++) {
+        Snapshot before, after;
+
+        sOperations[i].run();
+        sOperations[i].run();
+
+        snapshot(&before);
+        for (int run = 0; run < runs; run++)
+            sOperations[i].run();
+        snapshot(&after);
+
+        clean = check(sOperations[i].name, before, after, runs) && clean;
+    }
+
+    // the whole driver lifetime, AllocStats has to be back to nothing
+    Snapshot stopped;
+
+    delete sFixture.wmi;
+    sFixture.wmiDevice->release();
+    HostKit::closeUserClient(sFixture.controllerClient);
+    HostKit::closeUserClient(sFixture.bridgeClient);
+    rootPortDevice->terminate();
+    acpi->terminate();
+    sFixture.controller->release();
+    sFixture.bridge->release();
+
+    snapshot(&stopped);
+    for (int i = 0; i < kAllocSiteCount; i++) {
+        if (stopped.sites[i] != 0) {
+            printf("%s: %d objects still live after the drivers stopped\n", sSiteNames[i], stopped.sites[i]);
+            clean = false;
+        }
+    }
+
+    rootPort->release();
+    rootPortDevice->release();
+    acpi->release();
+    HostKit::unloadModule();
+
+    return clean ? 0 : 1;
+}
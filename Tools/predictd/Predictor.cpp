@@ -0,0 +1,147 @@
+/*
+ *  Released under "The GNU General Public License (GPL-2.0)"
+ *
+ *  This program is free software; you can redistribute it and/or modify it
+ *  under the terms of the GNU General Public License as published by the
+ *  Free Software Foundation; either version 2 of the License, or (at your
+ *  option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful, but
+ *  WITHOUT ANY WARRANTY; without even the implied warranty of MERCHANTABILITY
+ *  or FITNESS FOR A PARTICULAR PURPOSE. See the GNU General Public License
+ *  for more details.
+ *
+ *  You should have received a copy of the GNU General Public License along
+ *  with this program; if not, write to the Free Software Foundation, Inc.,
+ *  59 Temple Place, Suite 330, Boston, MA 02111-1307 USA
+ *
+ */
+
+#include <stdio.h>
+#include <unistd.h>
+#include <algorithm>
+#include <string>
+
+#include "Predictor.h"
+
+#define kSecondsPerDay  (24 * 60 * 60)
+#define kRetainSeconds  ((kPredictDays + 1) * kSecondsPerDay)
+
+static bool isWeekend(time_t when)
+{
+    struct tm local;
+
+    localtime_r(&when, &local);
+    return local.tm_wday == 0 || local.tm_wday == 6;
+}
+
+void Predictor::record(time_t when, bool ac)
+{
+    Connect connect = { when, ac };
+
+    if (mStart == 0 || when < mStart)
+        mStart = when;
+
+    // connections arrive in order, keep the vector sorted anyway
+    std::vector<Connect>::iterator it = mHistory.end();
+    while (it != mHistory.begin() && (it - 1)->when > when)
+        --it;
+    mHistory.insert(it, connect);
+
+    time_t oldest = mHistory.back().when - kRetainSeconds;
+    it = mHistory.begin();
+    while (it != mHistory.end() && it->when < oldest)
+        ++it;
+    mHistory.erase(mHistory.begin(), it);
+}
+
+double Predictor::score(time_t now, bool ac) const
+{
+    bool weekend = isWeekend(now);
+    double hits = 0;
+    int days = 0;
+
+    for (int d = 1; d <= kPredictDays; d++) {
+        time_t day = now - (time_t)d * kSecondsPerDay;
+        time_t from = day - kPredictSlackMinutes * 60;
+        time_t to = day + (kPredictLeadMinutes + kPredictSlackMinutes) * 60;
+
+        if (mStart == 0 || from < mStart)
+            break;
+        if (isWeekend(day) != weekend)
+            continue;
+
+        days++;
+
+        Connect key = { from, false };
+        std::vector<Connect>::const_iterator it = std::lower_bound(mHistory.begin(), mHistory.end(), key,
+            [](const Connect& a, const Connect& b) { return a.when < b.when; });
+
+        double best = 0;
+        for (; it != mHistory.end() && it->when <= to; ++it) {
+            double weight = it->ac == ac ? 1.0 : 0.5;
+
+            if (weight > best)
+                best = weight;
+        }
+        hits += best;
+    }
+
+    if (days < kPredictMinDays)
+        return 0;
+
+    return hits / days;
+}
+
+bool Predictor::load(const char* path, time_t now)
+{
+    FILE* file = fopen(path, "r");
+    char line[64];
+
+    if (file == NULL)
+        return false;
+
+    while (fgets(line, sizeof(line), file) != NULL) {
+        long long when;
+        int ac;
+
+        if (sscanf(line, "start %lld", &when) == 1) {
+            mStart = (time_t)when;
+        }
+        else if (sscanf(line, "%lld %d", &when, &ac) == 2) {
+            // older entries no longer take part in any score
+            if ((time_t)when >= now - kRetainSeconds)
+                record((time_t)when, ac != 0);
+        }
+    }
+
+    fclose(file);
+
+    return true;
+}
+
+bool Predictor::save(const char* path) const
+{
+    std::string temporary = std::string(path) + ".tmp";
+    FILE* file = fopen(temporary.c_str(), "w");
+    bool written;
+
+    if (file == NULL)
+        return false;
+
+    fprintf(file, "start %lld\n", (long long)mStart);
+    for (size_t i = 0; i < mHistory.size(); i++)
+        fprintf(file, "%lld %d\n", (long long)mHistory[i].when, mHistory[i].ac ? 1 : 0);
+
+    written = !ferror(file);
+    if (fclose(file) != 0)
+        written = false;
+
+    // replace the old history in one step so a crash never leaves half of it
+    if (!written || rename(temporary.c_str(), path) != 0) {
+        unlink(temporary.c_str());
+        return false;
+    }
+
+    return true;
+}
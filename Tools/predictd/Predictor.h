@@ -0,0 +1,66 @@
+/*
+ *  Released under "The GNU General Public License (GPL-2.0)"
+ *
+ *  This program is free software; you can redistribute it and/or modify it
+ *  under the terms of the GNU General Public License as published by the
+ *  Free Software Foundation; either version 2 of the License, or (at your
+ *  option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful, but
+ *  WITHOUT ANY WARRANTY; without even the implied warranty of MERCHANTABILITY
+ *  or FITNESS FOR A PARTICULAR PURPOSE. See the GNU General Public License
+ *  for more details.
+ *
+ *  You should have received a copy of the GNU General Public License along
+ *  with this program; if not, write to the Free Software Foundation, Inc.,
+ *  59 Temple Place, Suite 330, Boston, MA 02111-1307 USA
+ *
+ */
+
+#ifndef Predictor_h
+#define Predictor_h
+
+#include <time.h>
+#include <vector>
+
+#define kPredictLeadMinutes     10      // how far ahead a connection is predicted
+#define kPredictSlackMinutes    15      // tolerance on the time of day of past connections
+#define kPredictDays            14      // past days taken into account
+#define kPredictMinDays         3       // past days of the same kind needed before predicting
+
+// Connection history, scored by time of day, weekday/weekend and power source
+class Predictor
+{
+public:
+    Predictor() : mStart(0) {}
+
+    // Connections before this time are unknown rather than absent
+    void setStart(time_t start) { mStart = start; }
+    time_t start() const { return mStart; }
+
+    // Connections that no longer take part in any score are dropped
+    void record(time_t when, bool ac);
+
+    // Share of comparable past days with a connection within the lead time of now,
+    // a connection made on another power source counts half
+    double score(time_t now, bool ac) const;
+
+    size_t size() const { return mHistory.size(); }
+
+    // History file: a "start <time>" line followed by "<time> <ac>" per connection,
+    // saving rewrites it with the retained history so it stays bounded
+    bool load(const char* path, time_t now);
+    bool save(const char* path) const;
+
+private:
+    struct Connect
+    {
+        time_t when;
+        bool ac;
+    };
+
+    std::vector<Connect> mHistory;  // ordered by time
+    time_t mStart;
+};
+
+#endif /* Predictor_h */
@@ -0,0 +1,400 @@
+/*
+ *  Released under "The GNU General Public License (GPL-2.0)"
+ *
+ *  This program is free software; you can redistribute it and/or modify it
+ *  under the terms of the GNU General Public License as published by the
+ *  Free Software Foundation; either version 2 of the License, or (at your
+ *  option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful, but
+ *  WITHOUT ANY WARRANTY; without even the implied warranty of MERCHANTABILITY
+ *  or FITNESS FOR A PARTICULAR PURPOSE. See the GNU General Public License
+ *  for more details.
+ *
+ *  You should have received a copy of the GNU General Public License along
+ *  with this program; if not, write to the Free Software Foundation, Inc.,
+ *  59 Temple Place, Suite 330, Boston, MA 02111-1307 USA
+ *
+ */
+
+// predictd - learn when a dock or device usually gets connected behind the
+// Thunderbolt bridge and power it up ahead of time, so the connection doesn't
+// pay for force-power and the bridge rescan.
+//
+// usage: predictd [-f history] [-t threshold] [-i interval]
+//        predictd -s [-d days] [-S seed] [-t threshold] [-p force-power-ms] [-r rescan-ms]
+//
+// Pre-powering only pays off when the kext doesn't keep force-power on by
+// itself, i.e. with IOElectrifyIdleTimeout or the presence-aware wake bit set.
+// The kext's idle timer turns force-power back off after a wrong prediction.
+
+#include <stdarg.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <time.h>
+#include <algorithm>
+#include <vector>
+
+#include "Provider.h"
+#include "Predictor.h"
+
+#define kDefaultHistoryPath     "/var/db/IOElectrify.predictd"
+#define kDefaultThreshold       0.5
+#define kDefaultInterval        30      // seconds between polls
+
+// How long a pre-power is kept after the prediction ends before it counts as wrong
+#define kArmedSeconds           ((kPredictLeadMinutes + kPredictSlackMinutes) * 60)
+
+static bool sVerbose = true;
+
+static void logLine(time_t now, const char* format, ...)
+{
+    char stamp[32];
+    struct tm local;
+    va_list args;
+
+    if (!sVerbose)
+        return;
+
+    localtime_r(&now, &local);
+    strftime(stamp, sizeof(stamp), "%Y-%m-%d %H:%M", &local);
+    printf("%s ", stamp);
+
+    va_start(args, format);
+    vprintf(format, args);
+    va_end(args);
+
+    printf("\n");
+    fflush(stdout);
+}
+
+class Daemon
+{
+public:
+    Daemon(Provider& provider, Predictor& predictor, double threshold, const char* historyPath) :
+        mProvider(provider), mPredictor(predictor), mThreshold(threshold), mHistoryPath(historyPath),
+        mConnected(false), mLastAC(false), mArmedUntil(0),
+        mConnects(0), mHits(0), mPrepowers(0), mExpired(0) {}
+
+    void tick(time_t now);
+
+    bool armed() const { return mArmedUntil != 0; }
+
+    UInt32 connects() const { return mConnects; }
+    UInt32 hits() const { return mHits; }
+    UInt32 prepowers() const { return mPrepowers; }
+    UInt32 expired() const { return mExpired; }
+
+private:
+    void prepower(time_t now, double score);
+
+    Provider& mProvider;
+    Predictor& mPredictor;
+    double mThreshold;
+    const char* mHistoryPath;
+
+    bool mConnected;
+    bool mLastAC;               // power source before the current poll
+    time_t mArmedUntil;
+
+    UInt32 mConnects;
+    UInt32 mHits;
+    UInt32 mPrepowers;
+    UInt32 mExpired;
+};
+
+void Daemon::tick(time_t now)
+{
+    bool connected = mProvider.countDevices() > 0;
+    bool ac = mProvider.onACPower();
+
+    if (connected && !mConnected) {
+        mConnects++;
+        if (armed()) {
+            mHits++;
+            logLine(now, "connect, pre-powered");
+        }
+        else {
+            logLine(now, "connect");
+        }
+        mArmedUntil = 0;
+
+        // the power source before the connection is the useful context, a dock switches it to AC
+        mPredictor.record(now, mLastAC);
+        if (mHistoryPath != NULL && !mPredictor.save(mHistoryPath))
+            logLine(now, "can't write %s", mHistoryPath);
+    }
+    mConnected = connected;
+    mLastAC = ac;
+
+    if (mConnected)
+        return;
+
+    double score = mPredictor.score(now, ac);
+
+    if (score >= mThreshold) {
+        // stay armed for as long as a connection is expected
+        if (armed())
+            mArmedUntil = now + kArmedSeconds;
+        else
+            prepower(now, score);
+    }
+    else if (armed() && now >= mArmedUntil) {
+        mExpired++;
+        mArmedUntil = 0;
+        logLine(now, "no connection after pre-power");
+    }
+}
+
+void Daemon::prepower(time_t now, double score)
+{
+    UInt32 result;
+    int ret;
+
+    mPrepowers++;
+    mArmedUntil = now + kArmedSeconds;
+    logLine(now, "pre-power, score %.2f", score);
+
+    ret = mProvider.forcePower(1);
+    if (ret != kProviderSuccess) {
+        logLine(now, "force-power failed (0x%x)", ret);
+        return;
+    }
+
+    ret = mProvider.probe(kProbeOptionNeedsScan | kProbeOptionDone, &result);
+    if (ret != kProviderSuccess)
+        logLine(now, "rescan failed (0x%x)", ret);
+}
+
+// Simulation
+
+struct Session
+{
+    time_t connect;
+    time_t disconnect;
+};
+
+struct Random
+{
+    UInt64 state;
+
+    UInt32 next()
+    {
+        state ^= state << 13;
+        state ^= state >> 7;
+        state ^= state << 17;
+        return (UInt32)(state >> 32);
+    }
+
+    // uniform in [lo, hi]
+    int range(int lo, int hi) { return lo + (int)(next() % (UInt32)(hi - lo + 1)); }
+    bool chance(int percent) { return (int)(next() % 100) < percent; }
+};
+
+// A user docking on weekday mornings, sometimes in the evening, now and then
+// on weekends and occasionally at a random time
+static void buildSessions(std::vector<Session>& sessions, std::vector<bool>& charger, time_t origin, int days, Random& random)
+{
+    for (int day = 0; day < days; day++) {
+        time_t midnight = origin + (time_t)day * 24 * 60 * 60;
+        bool weekend = (day % 7) >= 5;
+        Session session;
+
+        charger.push_back(random.chance(30));
+
+        if (!weekend && random.chance(85)) {
+            session.connect = midnight + (9 * 60 + random.range(-15, 15)) * 60;
+            session.disconnect = midnight + (17 * 60 + 30 + random.range(-30, 30)) * 60;
+            sessions.push_back(session);
+
+            if (random.chance(40)) {
+                session.connect = midnight + (20 * 60 + random.range(-10, 10)) * 60;
+                session.disconnect = session.connect + 2 * 60 * 60;
+                sessions.push_back(session);
+            }
+        }
+        else if (weekend && random.chance(25)) {
+            session.connect = midnight + random.range(10 * 60, 18 * 60) * 60;
+            session.disconnect = session.connect + 3 * 60 * 60;
+            sessions.push_back(session);
+        }
+
+        if (random.chance(10)) {
+            time_t connect = midnight + random.range(0, 23 * 60) * 60;
+
+            // don't overlap the regular sessions
+            bool overlaps = false;
+            for (size_t i = 0; i < sessions.size(); i++) {
+                if (connect < sessions[i].disconnect + 60 * 60 && connect + 2 * 60 * 60 > sessions[i].connect)
+                    overlaps = true;
+            }
+
+            if (!overlaps) {
+                session.connect = connect;
+                session.disconnect = connect + 60 * 60;
+                sessions.push_back(session);
+            }
+        }
+    }
+
+    std::sort(sessions.begin(), sessions.end(),
+              [](const Session& a, const Session& b) { return a.connect < b.connect; });
+}
+
+static int simulate(int days, UInt64 seed, double threshold, UInt32 forcePowerMS, UInt32 probeMS, bool verbose)
+{
+    // 2024-01-01 was a Monday, keep the weekday arithmetic in UTC
+    const time_t origin = 1704067200;
+    StubConfig config = { forcePowerMS * 1000, probeMS * 1000, false };
+    StubProvider stub(config);
+    Predictor predictor;
+    Daemon daemon(stub, predictor, threshold, NULL);
+    std::vector<Session> sessions;
+    std::vector<bool> charger;
+    Random random = { seed ? seed : 1 };
+    UInt64 savedUS = 0;
+    UInt64 poweredMinutes = 0;
+    size_t next = 0;
+    UInt32 learnedConnects = 0;
+    UInt32 learnedHits = 0;
+    bool connected = false;
+
+    setenv("TZ", "UTC", 1);
+    tzset();
+    sVerbose = verbose;
+
+    buildSessions(sessions, charger, origin, days, random);
+    predictor.setStart(origin);
+
+    for (time_t now = origin; now < origin + (time_t)days * 24 * 60 * 60; now += 60) {
+        int day = (int)((now - origin) / (24 * 60 * 60));
+
+        if (day == kPredictDays && now == origin + (time_t)day * 24 * 60 * 60) {
+            learnedConnects = daemon.connects();
+            learnedHits = daemon.hits();
+        }
+
+        if (!connected && next < sessions.size() && now >= sessions[next].connect) {
+            connected = true;
+            stub.setDevices(1);
+
+            // the connection costs force-power and the rescan, unless it was done ahead of time
+            if (stub.forcePowered()) {
+                savedUS += (UInt64)forcePowerMS * 1000 + (UInt64)probeMS * 1000;
+            }
+            else {
+                UInt32 result;
+
+                stub.forcePower(1);
+                stub.probe(kProbeOptionNeedsScan | kProbeOptionDone, &result);
+            }
+        }
+        else if (connected && now >= sessions[next].disconnect) {
+            connected = false;
+            next++;
+            stub.setDevices(0);
+        }
+
+        stub.setACPower(connected || charger[day]);
+        daemon.tick(now);
+
+        // stand-in for the kext's idle gating once nothing uses force-power
+        if (!connected && !daemon.armed() && stub.forcePowered())
+            stub.forcePower(0);
+        if (stub.forcePowered() && !connected)
+            poweredMinutes++;
+    }
+
+    UInt32 connects = daemon.connects();
+    UInt32 hits = daemon.hits();
+    UInt32 prepowers = daemon.prepowers();
+    UInt64 coldUS = (UInt64)(forcePowerMS + probeMS) * 1000;
+
+    printf("simulated %d days, %u connections, first %d days are learning\n", days, connects, kPredictDays);
+    printf("pre-powered %u of them (hit rate %.1f%%), %u missed\n",
+           hits, connects ? 100.0 * hits / connects : 0.0, connects - hits);
+    if (days > kPredictDays) {
+        learnedConnects = connects - learnedConnects;
+        learnedHits = hits - learnedHits;
+        printf("after learning: %u of %u (hit rate %.1f%%)\n",
+               learnedHits, learnedConnects, learnedConnects ? 100.0 * learnedHits / learnedConnects : 0.0);
+    }
+    printf("%u pre-powers, %u without a connection (precision %.1f%%)\n",
+           prepowers, daemon.expired(), prepowers ? 100.0 * hits / prepowers : 0.0);
+    printf("latency saved %.2f s total, %.3f s per connection (cold connection %.3f s)\n",
+           savedUS / 1e6, connects ? savedUS / 1e6 / connects : 0.0, coldUS / 1e6);
+    printf("force-power on without a device for %llu min, %u force-power calls, %u rescans\n",
+           (unsigned long long)poweredMinutes, stub.forcePowerCalls(), stub.probeCalls());
+
+    return 0;
+}
+
+static void usage(const char* name)
+{
+    fprintf(stderr, "usage: %s [-f history] [-t threshold] [-i interval]\n", name);
+    fprintf(stderr, "       %s -s [-d days] [-S seed] [-t threshold] [-p force-power-ms] [-r rescan-ms] [-v]\n", name);
+}
+
+int main(int argc, char* argv[])
+{
+    const char* historyPath = kDefaultHistoryPath;
+    double threshold = kDefaultThreshold;
+    int interval = kDefaultInterval;
+    bool simulation = false;
+    bool verbose = false;
+    int days = 28;
+    UInt64 seed = 1;
+    UInt32 forcePowerMS = 500;
+    UInt32 probeMS = 1000;
+    int opt;
+
+    while ((opt = getopt(argc, argv, "f:t:i:sd:S:p:r:v")) != -1) {
+        switch (opt) {
+            case 'f': historyPath = optarg; break;
+            case 't': threshold = atof(optarg); break;
+            case 'i': interval = atoi(optarg); break;
+            case 's': simulation = true; break;
+            case 'd': days = atoi(optarg); break;
+            case 'S': seed = strtoull(optarg, NULL, 0); break;
+            case 'p': forcePowerMS = (UInt32)atoi(optarg); break;
+            case 'r': probeMS = (UInt32)atoi(optarg); break;
+            case 'v': verbose = true; break;
+            default:
+                usage(argv[0]);
+                return 1;
+        }
+    }
+
+    if (threshold <= 0 || threshold > 1 || interval <= 0 || days <= 0) {
+        usage(argv[0]);
+        return 1;
+    }
+
+    if (simulation)
+        return simulate(days, seed, threshold, forcePowerMS, probeMS, verbose);
+
+    Provider* provider = createIOKitProvider();
+    if (provider == NULL) {
+        fprintf(stderr, "%s: IOElectrify and IOElectrifyBridge not found\n", argv[0]);
+        return 1;
+    }
+
+    Predictor predictor;
+    time_t now = time(NULL);
+
+    if (!predictor.load(historyPath, now))
+        predictor.setStart(now);
+
+    Daemon daemon(*provider, predictor, threshold, historyPath);
+
+    logLine(now, "started, history in %s", historyPath);
+    for (;;) {
+        daemon.tick(time(NULL));
+        sleep(interval);
+    }
+
+    delete provider;
+    return 0;
+}
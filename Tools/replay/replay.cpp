@@ -0,0 +1,874 @@
+/*
+ *  Released under "The GNU General Public License (GPL-2.0)"
+ *
+ *  This program is free software; you can redistribute it and/or modify it
+ *  under the terms of the GNU General Public License as published by the
+ *  Free Software Foundation; either version 2 of the License, or (at your
+ *  option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful, but
+ *  WITHOUT ANY WARRANTY; without even the implied warranty of MERCHANTABILITY
+ *  or FITNESS FOR A PARTICULAR PURPOSE. See the GNU General Public License
+ *  for more details.
+ *
+ *  You should have received a copy of the GNU General Public License along
+ *  with this program; if not, write to the Free Software Foundation, Inc.,
+ *  59 Temple Place, Suite 330, Boston, MA 02111-1307 USA
+ *
+ */
+
+// replay - run a recorded event log through the kext in simulated time
+//
+// usage: replay [-d devices] [-H power-hook] [-o file] [-v] log
+//
+//   -d devices     Thunderbolt devices attached behind the controller (1)
+//   -H mask        IOElectrifyPowerHook of the controller (3, sleep and wake),
+//                  the bridge power hook is always on
+//   -o file        save the event log of the replayed run
+//   -v             print the kext's log
+//
+// The log comes from "electrifyctl events". The kext sources are built
+// against the host kit (see Tools/hostkit) on its discrete-event back end,
+// so the real PM callbacks, policy and user clients run, and only the
+// firmware and the PCI bus are simulated: every ACPI evaluation and bridge
+// probe takes as long as it took in the log and returns what it returned
+// there. PM transitions and user client calls arrive at their recorded
+// offsets, a transition no earlier than the driver acknowledged the last one.
+//
+// Prints each wake's stages next to the recorded ones, then how long PM
+// waited for acknowledgements and how long the user client calls took.
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <algorithm>
+#include <deque>
+#include <map>
+#include <string>
+#include <vector>
+
+#include "HostKit.h"
+#include "EventLog.h"
+#include "Profiles.h"
+#include "WakeTrace.h"
+#include "WMIBlock.h"
+
+#define kPowerStateSleep        0
+
+// IOElectrifyUserClient and IOElectrifyBridgeUserClient selectors, see Provider.h
+#define kSelectorForcePower     0
+#define kSelectorPowerHook      1
+#define kSelectorResetResidency 6
+#define kSelectorProbe          0
+
+// Force-power method of the simulated _WDG, WM followed by the object id.
+// Taken from the log when it has one.
+static char sMethod[5] = "WMTF";
+
+static const ForcePowerProfile* sProfile = &kForcePowerProfiles[0];
+
+static UInt64 percentile(std::vector<UInt64> values, int pct)
+{
+    if (values.empty())
+        return 0;
+
+    std::sort(values.begin(), values.end());
+    return values[(values.size() - 1) * pct / 100];
+}
+
+// Firmware
+
+// Sleeps and wakes so far. A phase opens with the first sleep callback of
+// either driver after a wake, or the first wake callback after a sleep.
+class PhaseTracker
+{
+public:
+    void note(UInt32 powerState)
+    {
+        int awake = powerState != kPowerStateSleep;
+
+        if (awake != mAwake) {
+            mAwake = awake;
+            mPhase++;
+        }
+    }
+
+    UInt32 phase() const { return mPhase; }
+
+private:
+    UInt32 mPhase = 0;
+    int mAwake = -1;
+};
+
+// What the firmware did in the log, per ACPI method and argument list or
+// per probe kind. A call gets the recorded call of its kind from the same
+// phase that is closest to it in time, so a change that adds or drops calls
+// doesn't shift the later ones. Calls beyond the recorded ones take the
+// median of their kind and succeed.
+struct Timing
+{
+    UInt64 duration;
+    UInt32 result;
+};
+
+class FirmwareScript
+{
+public:
+    void add(const std::string& key, UInt32 phase, UInt64 offset, const Timing& timing)
+    {
+        Entry entry = { phase, offset, timing, false };
+
+        mEntries[key].push_back(entry);
+    }
+
+    Timing next(const std::string& key, UInt32 phase, UInt64 offset)
+    {
+        std::vector<Entry>& entries = mEntries[key];
+        Entry* closest = NULL;
+        UInt64 distance = 0;
+
+        for (size_t i = 0; i < entries.size(); i++) {
+            UInt64 d = entries[i].offset > offset ? entries[i].offset - offset : offset - entries[i].offset;
+
+            if (!entries[i].used && entries[i].phase == phase && (closest == NULL || d < distance)) {
+                closest = &entries[i];
+                distance = d;
+            }
+        }
+
+        if (closest != NULL) {
+            closest->used = true;
+            return closest->timing;
+        }
+
+        std::vector<UInt64> durations;
+        Timing timing = { 0, kIOReturnSuccess };
+
+        for (size_t i = 0; i < entries.size(); i++)
+            durations.push_back(entries[i].timing.duration);
+        timing.duration = percentile(durations, 50);
+        mExtra++;
+
+        return timing;
+    }
+
+    // calls the log had no timing for
+    UInt32 extra() const { return mExtra; }
+
+private:
+    struct Entry
+    {
+        UInt32 phase;
+        UInt64 offset;          // ns since the start of the log
+        Timing timing;
+        bool used;
+    };
+
+    std::map<std::string, std::vector<Entry> > mEntries;
+    UInt32 mExtra = 0;
+};
+
+static FirmwareScript sScript;
+static PhaseTracker sPhase;
+static UInt64 sLogStart = 0;
+static UInt64 sSimStart = 0;
+static bool sReplaying = false;     // set up runs in zero time
+static bool sPowered = true;        // force-power, the machine is awake and powered at start
+
+static std::string acpiKey(const char* name, const UInt32* args, UInt32 argCount)
+{
+    std::string key(name);
+    char buf[16];
+
+    for (UInt32 i = 0; i < argCount; i++) {
+        snprintf(buf, sizeof(buf), " %u", args[i]);
+        key += buf;
+    }
+
+    return key;
+}
+
+static const char* probeKey(UInt32 options)
+{
+    return (options & kIOPCIProbeOptionEject) ? "eject" : "scan";
+}
+
+// Recorded timing of the next call, nothing while setting up
+static Timing firmwareTiming(const std::string& key)
+{
+    Timing timing = { 0, kIOReturnSuccess };
+
+    if (sReplaying)
+        timing = sScript.next(key, sPhase.phase(), HostBackend::now() - sSimStart);
+
+    return timing;
+}
+
+static void spend(UInt64 ns)
+{
+    if (ns > 0)
+        HostBackend::delay(ns);
+}
+
+// The WMI device of the controller, exports the force-power method in _WDG
+class SimACPIDevice : public IOACPIPlatformDevice
+{
+    OSDeclareDefaultStructors(SimACPIDevice)
+public:
+    virtual IOReturn evaluateObject(const char* objectName, OSObject** result, OSObject* params[],
+                                    IOItemCount paramCount, IOOptionBits options) override;
+};
+
+OSDefineMetaClassAndStructors(SimACPIDevice, IOACPIPlatformDevice)
+
+IOReturn SimACPIDevice::evaluateObject(const char* objectName, OSObject** result, OSObject* params[],
+                                       IOItemCount paramCount, IOOptionBits options)
+{
+    if (strcmp(objectName, "_WDG") == 0) {
+        WMI_DATA block;
+
+        memset(&block, 0, sizeof(block));
+        memcpy(block.guid, sProfile->guid, sizeof(block.guid));
+        memcpy(block.object_id, sMethod + 2, sizeof(block.object_id));
+        block.instance_count = 1;
+        block.flags = ACPI_WMI_METHOD;
+
+        if (result != NULL)
+            *result = OSData::withBytes(&block, sizeof(block));
+        return kIOReturnSuccess;
+    }
+
+    UInt32 args[kRecorderMaxArgs];
+    UInt32 argCount = 0;
+
+    for (IOItemCount i = 0; i < paramCount && argCount < kRecorderMaxArgs; i++) {
+        OSNumber* osNum = OSDynamicCast(OSNumber, params[i]);
+        args[argCount++] = osNum ? osNum->unsigned32BitValue() : 0;
+    }
+
+    Timing timing = firmwareTiming(acpiKey(objectName, args, argCount));
+
+    spend(timing.duration);
+    if (timing.result != kIOReturnSuccess)
+        return timing.result;
+
+    if (strcmp(objectName, sMethod) == 0 && argCount > sProfile->powerArg)
+        sPowered = args[sProfile->powerArg] != 0;
+    if (result != NULL)
+        *result = OSNumber::withNumber(sPowered, 32);
+
+    return kIOReturnSuccess;
+}
+
+// PCI
+
+#define kPCIClassBridge         0x060400
+#define kPCIClassSystem         0x088000
+#define kPCIHeaderTypeBridge    0x01
+
+static IOPCIDevice* newPCIDevice(const char* name, UInt32 classCode, UInt8 headerType)
+{
+    IOPCIDevice* device = new IOPCIDevice;
+
+    device->init(NULL);
+    device->setName(name);
+    device->hostSetConfig(0x8086, 0x15d3, classCode, headerType);
+    return device;
+}
+
+// The root port in front of the controller. A scan finds the controller
+// while it is force-powered: its upstream port, a downstream port per
+// attached device plus one for the NHI, and behind those the NHI and the
+// upstream ports of the devices' own switches. The devices are published
+// one by one over the recorded duration of the scan.
+class SimRootPort : public IOPCI2PCIBridge
+{
+    OSDeclareDefaultStructors(SimRootPort)
+public:
+    virtual UInt32 requestProbe(IOOptionBits options) override;
+    virtual void free() override;
+
+    int mDevices;
+    IOPCIDevice* mUpstream;
+};
+
+OSDefineMetaClassAndStructors(SimRootPort, IOPCI2PCIBridge)
+
+void SimRootPort::free()
+{
+    OSSafeReleaseNULL(mUpstream);
+    IOPCI2PCIBridge::free();
+}
+
+UInt32 SimRootPort::requestProbe(IOOptionBits options)
+{
+    Timing timing = firmwareTiming(probeKey(options));
+
+    if (options & kIOPCIProbeOptionEject) {
+        if (mUpstream != NULL) {
+            mUpstream->terminate();
+            mUpstream->release();
+            mUpstream = NULL;
+        }
+        spend(timing.duration);
+        return timing.result;
+    }
+
+    if (!sPowered || mUpstream != NULL) {
+        spend(timing.duration);
+        return timing.result;
+    }
+
+    std::vector<IOPCIDevice*> devices;
+    std::vector<IOService*> parents;
+
+    mUpstream = newPCIDevice("UPSB", kPCIClassBridge, kPCIHeaderTypeBridge);
+    devices.push_back(mUpstream);
+    parents.push_back(this);
+
+    for (int i = 0; i <= mDevices; i++) {
+        char name[16];
+        IOPCIDevice* port;
+
+        snprintf(name, sizeof(name), "DSB%d", i);
+        port = newPCIDevice(name, kPCIClassBridge, kPCIHeaderTypeBridge);
+        devices.push_back(port);
+        parents.push_back(mUpstream);
+
+        if (i == 0) {
+            devices.push_back(newPCIDevice("NHI0", kPCIClassSystem, 0));
+        }
+        else {
+            snprintf(name, sizeof(name), "UPS%d", i);
+            devices.push_back(newPCIDevice(name, kPCIClassBridge, kPCIHeaderTypeBridge));
+        }
+        parents.push_back(port);
+    }
+
+    // the last one shows up when the scan returns
+    for (size_t i = 0; i < devices.size(); i++) {
+        spend(timing.duration * (i + 1) / devices.size() - timing.duration * i / devices.size());
+        HostKit::publish(devices[i], parents[i]);
+        if (devices[i] != mUpstream)
+            devices[i]->release();
+    }
+
+    return timing.result;
+}
+
+// Wakes
+
+static const char* sStageNames[kWakeStageCount] =
+{
+    "pm-callback",
+    "acpi-done",
+    "probe-requested",
+    "first-child",
+    "last-child"
+};
+
+// A wake in the log, ns after its first wake callback, 0 when missing
+struct RecordedWake
+{
+    UInt64 acpiDone;            // end of the force-power on
+    UInt64 probeStart;      // start of the rescan's requestProbe
+    UInt64 probeDone;           // end of the rescan
+};
+
+// A wake of the replay, as the kext's wake trace saw it
+struct ReplayedWake
+{
+    UInt64 id;
+    UInt64 children;
+    UInt64 stage[kWakeStageCount];
+    bool stamped[kWakeStageCount];
+};
+
+static bool isForcePowerOn(const RecorderEvent& event)
+{
+    return event.type == kEventACPIEvaluate && strncmp(event.name, "WM", 2) == 0 &&
+        event.argCount > sProfile->powerArg && event.args[sProfile->powerArg] != 0 && event.result == kIOReturnSuccess;
+}
+
+// A wake opens with the first wake callback of either driver and closes
+// with the first sleep callback, like the kext's wake trace
+static std::vector<RecordedWake> findRecordedWakes(const std::vector<RecorderEvent>& events)
+{
+    std::vector<RecordedWake> wakes;
+    UInt64 start = 0;
+    bool open = false;
+
+    for (size_t i = 0; i < events.size(); i++) {
+        const RecorderEvent& event = events[i];
+        RecordedWake* wake = open ? &wakes.back() : NULL;
+
+        if (event.type == kEventPMCallback && event.argCount > 0) {
+            if (event.args[0] == kPowerStateSleep) {
+                open = false;
+            }
+            else if (!open) {
+                RecordedWake added = { 0, 0, 0 };
+
+                wakes.push_back(added);
+                start = event.timestamp;
+                open = true;
+            }
+        }
+        else if (wake != NULL && isForcePowerOn(event) && wake->acpiDone == 0) {
+            wake->acpiDone = event.timestamp + event.duration - start;
+        }
+        else if (wake != NULL && event.type == kEventProbe && event.argCount > 0 &&
+                 !(event.args[0] & kIOPCIProbeOptionEject) && wake->probeStart == 0) {
+            wake->probeStart = event.timestamp - start;
+            wake->probeDone = event.timestamp + event.duration - start;
+        }
+    }
+
+    return wakes;
+}
+
+static IOService* sController = NULL;
+static std::vector<ReplayedWake> sWakes;
+
+// Keep the open wake of the trace, once per trace id
+static void snapshotWake()
+{
+    WakeTrace::publish(sController);
+
+    OSObject* property = sController->copyProperty(kWakeTraceKey);
+    OSDictionary* dict = OSDynamicCast(OSDictionary, property);
+    ReplayedWake wake;
+
+    // a trace that settled before the sleep is already the last one
+    const char* record = "current";
+
+    memset(&wake, 0, sizeof(wake));
+    if (dict != NULL && !HostKit::getNumber(dict, "current/id", &wake.id)) {
+        record = "last";
+        HostKit::getNumber(dict, "last/id", &wake.id);
+    }
+    if (wake.id != 0 && (sWakes.empty() || sWakes.back().id != wake.id)) {
+        HostKit::getNumber(dict, (std::string(record) + "/children").c_str(), &wake.children);
+        for (int i = 0; i < kWakeStageCount; i++) {
+            std::string path = std::string(record) + "/" + sStageNames[i];
+            wake.stamped[i] = HostKit::getNumber(dict, path.c_str(), &wake.stage[i]);
+        }
+        sWakes.push_back(wake);
+    }
+
+    OSSafeReleaseNULL(property);
+}
+
+// Injection
+
+static void waitFor(const RecorderEvent* event)
+{
+    UInt64 at = sSimStart + (event->timestamp - sLogStart);
+    UInt64 now = HostBackend::now();
+
+    if (at > now)
+        HostBackend::delay(at - now);
+}
+
+// PM changes a driver's power state one transition at a time
+struct PMInjector
+{
+    const char* name;
+    IOService* driver;
+    std::vector<const RecorderEvent*> events;
+    std::vector<UInt64> acks[2];        // sleep, wake
+    UInt32 timeouts;
+};
+
+static void pmThread(void* argument)
+{
+    PMInjector* injector = (PMInjector*)argument;
+
+    for (size_t i = 0; i < injector->events.size(); i++) {
+        const RecorderEvent* event = injector->events[i];
+        UInt32 state = event->args[0];
+        UInt64 elapsed;
+
+        waitFor(event);
+        if (state == kPowerStateSleep)
+            snapshotWake();
+        sPhase.note(state);
+
+        if (injector->driver->hostPowerChange(state, &elapsed) == kIOReturnTimeout)
+            injector->timeouts++;
+        injector->acks[state == kPowerStateSleep ? 0 : 1].push_back(elapsed);
+    }
+}
+
+// User client calls that change state, the others only read it and are skipped
+struct ReplayMethod
+{
+    UInt16 source;
+    UInt32 selector;
+    const char* name;
+    UInt32 scalarOutputCount;
+};
+
+static const ReplayMethod sMethods[] =
+{
+    { kEventSourceController, kSelectorForcePower, "force-power", 1 },
+    { kEventSourceController, kSelectorPowerHook, "power-hook", 1 },
+    { kEventSourceController, kSelectorResetResidency, "reset-residency", 0 },
+    { kEventSourceBridge, kSelectorProbe, "probe", 1 }
+};
+
+#define kReplayMethodCount (sizeof(sMethods) / sizeof(sMethods[0]))
+
+struct ClientCall
+{
+    const RecorderEvent* event;
+    const ReplayMethod* method;
+    IOUserClient* client;
+    IOReturn result;
+    UInt64 latency;
+};
+
+static const ReplayMethod* findMethod(const RecorderEvent& event)
+{
+    for (unsigned int i = 0; i < kReplayMethodCount; i++) {
+        if (sMethods[i].source == event.source && event.argCount > 0 && sMethods[i].selector == event.args[0])
+            return &sMethods[i];
+    }
+
+    return NULL;
+}
+
+// Calls drained from a command queue are made directly, the queue only
+// batches them
+static void clientThread(void* argument)
+{
+    ClientCall* call = (ClientCall*)argument;
+    UInt64 input[kRecorderMaxArgs];
+    UInt64 output[1] = { 0 };
+    UInt32 inputCount = call->event->argCount - 1;
+    UInt32 outputCount = call->method->scalarOutputCount;
+
+    for (UInt32 i = 0; i < inputCount; i++)
+        input[i] = call->event->args[i + 1];
+
+    waitFor(call->event);
+
+    UInt64 start = HostBackend::now();
+    call->result = HostKit::callMethod(call->client, call->method->selector, input, inputCount, NULL, 0,
+                                       output, &outputCount, NULL, NULL);
+    call->latency = HostBackend::now() - start;
+}
+
+// Report
+
+static void printMS(UInt64 ns, bool valid)
+{
+    if (valid)
+        printf(" %10.1f", ns / 1e6);
+    else
+        printf(" %10s", "-");
+}
+
+static void printWakes(const std::vector<RecordedWake>& recorded)
+{
+    size_t count = std::max(recorded.size(), sWakes.size());
+
+    printf("\nwake stages, ms after the first wake callback\n");
+    printf("%-5s %32s    %54s\n", "", "---------- recorded ----------",
+           "------------------------ replayed ---------------------");
+    printf("%-5s %10s %10s %10s    %10s %10s %10s %10s %10s\n", "wake", "acpi", "probe", "probe-done",
+           "acpi", "probe-req", "first", "last", "children");
+
+    for (size_t i = 0; i < count; i++) {
+        printf("%-5u", (unsigned int)i + 1);
+
+        if (i < recorded.size()) {
+            const RecordedWake& wake = recorded[i];
+
+            printMS(wake.acpiDone, wake.acpiDone != 0);
+            printMS(wake.probeStart, wake.probeStart != 0);
+            printMS(wake.probeDone, wake.probeDone != 0);
+        }
+        else {
+            printf(" %10s %10s %10s", "-", "-", "-");
+        }
+        printf("   ");
+
+        if (i < sWakes.size()) {
+            const ReplayedWake& wake = sWakes[i];
+
+            for (int stage = kWakeStageACPIDone; stage < kWakeStageCount; stage++)
+                printMS(wake.stage[stage], wake.stamped[stage]);
+            printf(" %10llu\n", (unsigned long long)wake.children);
+        }
+        else {
+            printf(" %10s %10s %10s %10s %10s\n", "-", "-", "-", "-", "-");
+        }
+    }
+
+    OSObject* property = sController->copyProperty(kWakeTraceKey);
+    OSDictionary* dict = OSDynamicCast(OSDictionary, property);
+    UInt64 samples = 0, p50 = 0, p99 = 0;
+
+    if (dict != NULL && HostKit::getNumber(dict, "samples", &samples) && samples > 0 &&
+        HostKit::getNumber(dict, "p50", &p50) && HostKit::getNumber(dict, "p99", &p99))
+        printf("wake total over %llu completed wakes: p50 %.1f ms, p99 %.1f ms\n", (unsigned long long)samples,
+               p50 / 1e6, p99 / 1e6);
+    OSSafeReleaseNULL(property);
+}
+
+static void printAcks(PMInjector* injectors, int count)
+{
+    printf("\n%-18s %6s %10s %10s %9s\n", "pm acknowledgement", "count", "p50 ms", "max ms", "timeouts");
+
+    for (int i = 0; i < count; i++) {
+        for (int kind = 0; kind < 2; kind++) {
+            const std::vector<UInt64>& acks = injectors[i].acks[kind];
+            char label[32];
+
+            if (acks.empty())
+                continue;
+
+            snprintf(label, sizeof(label), "%s %s", injectors[i].name, kind ? "wake" : "sleep");
+            printf("%-18s %6zu %10.1f %10.1f %9u\n", label, acks.size(), percentile(acks, 50) / 1e6,
+                   percentile(acks, 100) / 1e6, kind ? 0 : injectors[i].timeouts);
+        }
+    }
+}
+
+static void printCalls(const std::vector<ClientCall>& calls, UInt32 skipped)
+{
+    printf("\n%-18s %6s %6s %10s %10s\n", "client call", "count", "errors", "p50 ms", "max ms");
+
+    for (unsigned int m = 0; m < kReplayMethodCount; m++) {
+        std::vector<UInt64> latencies;
+        UInt32 errors = 0;
+
+        for (size_t i = 0; i < calls.size(); i++) {
+            if (calls[i].method != &sMethods[m])
+                continue;
+            latencies.push_back(calls[i].latency);
+            if (calls[i].result != kIOReturnSuccess)
+                errors++;
+        }
+
+        if (!latencies.empty())
+            printf("%-18s %6zu %6u %10.3f %10.3f\n", sMethods[m].name, latencies.size(), errors,
+                   percentile(latencies, 50) / 1e6, percentile(latencies, 100) / 1e6);
+    }
+
+    if (skipped > 0)
+        printf("%u read-only calls skipped\n", skipped);
+}
+
+static void usage(const char* name)
+{
+    fprintf(stderr, "usage: %s [-d devices] [-H power-hook] [-o file] [-v] log\n", name);
+}
+
+int main(int argc, char* argv[])
+{
+    int devices = 1;
+    UInt32 powerHook = 0x3;
+    const char* output = NULL;
+    bool verbose = false;
+    int opt;
+
+    while ((opt = getopt(argc, argv, "d:H:o:v")) != -1) {
+        switch (opt) {
+            case 'd': devices = atoi(optarg); break;
+            case 'H': powerHook = (UInt32)strtoul(optarg, NULL, 0); break;
+            case 'o': output = optarg; break;
+            case 'v': verbose = true; break;
+            default:
+                usage(argv[0]);
+                return 1;
+        }
+    }
+
+    if (optind + 1 != argc || devices < 0) {
+        usage(argv[0]);
+        return 1;
+    }
+
+    FILE* file = fopen(argv[optind], "r");
+    std::vector<RecorderEvent> events;
+    int line;
+
+    if (file == NULL) {
+        perror(argv[optind]);
+        return 1;
+    }
+    if (!readEventLog(file, &events, &line)) {
+        fprintf(stderr, "%s:%d: malformed event\n", argv[optind], line);
+        fclose(file);
+        return 1;
+    }
+    fclose(file);
+
+    if (events.empty()) {
+        fprintf(stderr, "%s: no events\n", argv[optind]);
+        return 1;
+    }
+
+    // the kext records an ACPI call when it returns, stamped with its start
+    std::stable_sort(events.begin(), events.end(), [](const RecorderEvent& a, const RecorderEvent& b) {
+        return a.timestamp < b.timestamp;
+    });
+
+    PhaseTracker phases;
+
+    for (size_t i = 0; i < events.size(); i++) {
+        const RecorderEvent& event = events[i];
+        Timing timing = { event.duration, event.result };
+        UInt64 offset = event.timestamp - events.front().timestamp;
+        UInt32 args[kRecorderMaxArgs];
+        char name[sizeof(event.name) + 1];
+
+        memcpy(args, event.args, sizeof(args));
+        memcpy(name, event.name, sizeof(event.name));
+        name[sizeof(event.name)] = 0;
+
+        if (event.type == kEventPMCallback && event.argCount > 0) {
+            phases.note(event.args[0]);
+        }
+        else if (event.type == kEventACPIEvaluate) {
+            if (strncmp(name, "WM", 2) == 0 && strlen(name) == 4)
+                memcpy(sMethod, name, sizeof(sMethod));
+            sScript.add(acpiKey(name, args, event.argCount), phases.phase(), offset, timing);
+        }
+        else if (event.type == kEventProbe && event.argCount > 0) {
+            sScript.add(probeKey(event.args[0]), phases.phase(), offset, timing);
+        }
+    }
+
+    HostBackend::initialize();
+    HostKit::setLogging(verbose);
+
+    OSDictionary* controllerPersonality = HostKit::copyPersonality(KEXT_INFO_PLIST, "IOElectrify");
+    OSDictionary* bridgePersonality = HostKit::copyPersonality(KEXT_INFO_PLIST, "IOElectrifyBridge");
+
+    if (controllerPersonality == NULL || bridgePersonality == NULL) {
+        fprintf(stderr, "%s: no IOElectrify personalities in %s\n", argv[0], KEXT_INFO_PLIST);
+        return 1;
+    }
+
+    OSNumber* osNum = OSNumber::withNumber(powerHook, 32);
+    controllerPersonality->setObject("IOElectrifyPowerHook", osNum);
+    osNum->release();
+    bridgePersonality->setObject("IOElectrifyBridgePowerHook", kOSBooleanTrue);
+
+    if (!HostKit::loadModule()) {
+        fprintf(stderr, "%s: module start failed\n", argv[0]);
+        return 1;
+    }
+
+    SimACPIDevice* acpi = new SimACPIDevice;
+    IOPCIDevice* rootPortDevice = newPCIDevice("RP01", kPCIClassBridge, kPCIHeaderTypeBridge);
+    SimRootPort* rootPort = new SimRootPort;
+
+    acpi->init(NULL);
+    acpi->setName("WMI1");
+    rootPortDevice->hostSetConfig(0x8086, 0x7615, kPCIClassBridge, kPCIHeaderTypeBridge);
+    rootPort->init(NULL);
+    rootPort->mDevices = devices;
+    rootPort->attach(rootPortDevice);
+
+    sController = HostKit::startDriver(controllerPersonality, acpi);
+    IOService* bridge = HostKit::startDriver(bridgePersonality, rootPort);
+    controllerPersonality->release();
+    bridgePersonality->release();
+
+    if (sController == NULL || bridge == NULL) {
+        fprintf(stderr, "%s: %s did not start\n", argv[0], sController == NULL ? "IOElectrify" : "IOElectrifyBridge");
+        return 1;
+    }
+
+    IOUserClient* clients[2] = { HostKit::openUserClient(sController), HostKit::openUserClient(bridge) };
+    PMInjector injectors[2] = { { "controller", sController, {}, {}, 0 }, { "bridge", bridge, {}, {}, 0 } };
+    std::vector<ClientCall> calls;
+    UInt32 skipped = 0;
+
+    if (clients[kEventSourceController] == NULL || clients[kEventSourceBridge] == NULL) {
+        fprintf(stderr, "%s: opening the user clients failed\n", argv[0]);
+        return 1;
+    }
+
+    for (size_t i = 0; i < events.size(); i++) {
+        const RecorderEvent& event = events[i];
+
+        if (event.source > kEventSourceBridge)
+            continue;
+
+        if (event.type == kEventPMCallback && event.argCount > 0) {
+            injectors[event.source].events.push_back(&event);
+        }
+        else if (event.type == kEventUserClient) {
+            ClientCall call = { &event, findMethod(event), clients[event.source], kIOReturnSuccess, 0 };
+
+            if (call.method != NULL)
+                calls.push_back(call);
+            else
+                skipped++;
+        }
+    }
+
+    // everything is in place, from here the firmware takes its recorded time
+    std::vector<HostBackend::Thread*> threads;
+
+    sLogStart = events.front().timestamp;
+    sSimStart = HostBackend::now();
+    sReplaying = true;
+
+    for (int i = 0; i < 2; i++)
+        threads.push_back(HostBackend::spawn(pmThread, &injectors[i]));
+    for (size_t i = 0; i < calls.size(); i++)
+        threads.push_back(HostBackend::spawn(clientThread, &calls[i]));
+    for (size_t i = 0; i < threads.size(); i++)
+        HostBackend::join(threads[i]);
+
+    UInt64 simulated = HostBackend::now() - sSimStart;
+    sReplaying = false;
+    snapshotWake();
+
+    // the log ends awake, give the last wake its settle window so the kext
+    // counts it as completed like the others
+    HostBackend::delay(kWakeTraceSettleMS * 1000000ULL);
+    WakeTrace::publish(sController);
+
+    printf("replayed %zu events, %zu pm transitions, %zu client calls in %.3f s of simulated time\n", events.size(),
+           injectors[0].events.size() + injectors[1].events.size(), calls.size(), simulated / 1e9);
+    if (sScript.extra() > 0)
+        printf("%u firmware calls had no recorded timing and took the median\n", sScript.extra());
+
+    printWakes(findRecordedWakes(events));
+    printAcks(injectors, 2);
+    printCalls(calls, skipped);
+
+    if (output != NULL) {
+        std::vector<RecorderEvent> replayed(kRecorderCapacity);
+        UInt32 count = Recorder::copyEvents(&replayed[0], kRecorderCapacity);
+
+        file = fopen(output, "w");
+        if (file == NULL) {
+            perror(output);
+            return 1;
+        }
+        writeEventLog(file, &replayed[0], count);
+        fclose(file);
+    }
+
+    HostKit::closeUserClient(clients[kEventSourceController]);
+    HostKit::closeUserClient(clients[kEventSourceBridge]);
+    rootPortDevice->terminate();
+    acpi->terminate();
+    sController->release();
+    bridge->release();
+    rootPort->release();
+    rootPortDevice->release();
+    acpi->release();
+    HostKit::unloadModule();
+
+    return 0;
+}
@@ -0,0 +1,591 @@
+/*
+ *  Released under "The GNU General Public License (GPL-2.0)"
+ *
+ *  This program is free software; you can redistribute it and/or modify it
+ *  under the terms of the GNU General Public License as published by the
+ *  Free Software Foundation; either version 2 of the License, or (at your
+ *  option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful, but
+ *  WITHOUT ANY WARRANTY; without even the implied warranty of MERCHANTABILITY
+ *  or FITNESS FOR A PARTICULAR PURPOSE. See the GNU General Public License
+ *  for more details.
+ *
+ *  You should have received a copy of the GNU General Public License along
+ *  with this program; if not, write to the Free Software Foundation, Inc.,
+ *  59 Temple Place, Suite 330, Boston, MA 02111-1307 USA
+ *
+ */
+
+// ucstress - hammer the user clients from many threads while PM transitions run
+//
+// usage: ucstress [-c clients] [-t threads] [-n calls] [-p pm-interval-us]
+//                 [-a acpi-us] [-r probe-us] [-s seed] [-v]
+//
+//   -c clients     user clients opened on each driver (4)
+//   -t threads     calling threads, thread i starts on client i mod clients
+//                  and moves on to the next one after every call (8)
+//   -n calls       calls per thread (2000)
+//   -p us          pause between PM transitions, 0 disables them (500)
+//   -a us          time every ACPI evaluation takes (20)
+//   -r us          time every bridge probe takes (100)
+//   -s seed        seed of the call mix (1)
+//   -v             print the kext's log
+//
+// The kext sources are built against the host kit (see Tools/hostkit) on
+// its thread back end, so the calls go through the real externalMethod
+// dispatch, command gates and locks, and only the firmware and the PCI bus
+// are stand-ins. Each call is a force-power on or off, a power hook change,
+// a bridge probe or a turn on a client's shared command queue, picked at
+// random. A queue turn submits a few commands, rings the doorbell or reaps
+// the completions, any mix of the three, so the driver drains commands other
+// threads wrote and only the head and tail order them. A thread per driver walks it through sleep, dark wake and
+// full wake in the meantime.
+//
+// Prints the calls per second and the latency percentiles per selector,
+// then how long PM waited for acknowledgements. The tool is built with
+// ThreadSanitizer, which reports any data race on stderr and makes the
+// tool exit with 66 when it found one.
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <algorithm>
+#include <atomic>
+#include <mutex>
+#include <vector>
+
+#include "HostKit.h"
+#include "CommandQueue.h"
+#include "Profiles.h"
+#include "WMIBlock.h"
+
+#define kPowerStateSleep        0
+#define kPowerStateDoze         1
+#define kPowerStateNormal       2
+
+// IOElectrifyUserClient and IOElectrifyBridgeUserClient selectors, see Provider.h
+#define kSelectorForcePower     0
+#define kSelectorPowerHook      1
+#define kSelectorProbe          0
+#define kSelectorDoorbell       4
+#define kSelectorBridgeDoorbell 2
+
+// every IOElectrifyPowerHook bit, see IOElectrify.h
+#define kPowerHookMask          0xf
+
+static const ForcePowerProfile* sProfile = &kForcePowerProfiles[0];
+
+static UInt32 sACPIDelay = 20;
+static UInt32 sProbeDelay = 100;
+
+static UInt64 percentile(std::vector<UInt64> values, int pct)
+{
+    if (values.empty())
+        return 0;
+
+    size_t index = (values.size() - 1) * pct / 1000;
+
+    std::nth_element(values.begin(), values.begin() + index, values.end());
+    return values[index];
+}
+
+// Firmware and bus stand-ins
+
+class StressACPIDevice : public IOACPIPlatformDevice
+{
+    OSDeclareDefaultStructors(StressACPIDevice)
+public:
+    virtual IOReturn evaluateObject(const char* objectName, OSObject** result, OSObject* params[],
+                                    IOItemCount paramCount, IOOptionBits options) override;
+
+    std::atomic<UInt32> mPowered;
+};
+
+OSDefineMetaClassAndStructors(StressACPIDevice, IOACPIPlatformDevice)
+
+IOReturn StressACPIDevice::evaluateObject(const char* objectName, OSObject** result, OSObject* params[],
+                                          IOItemCount paramCount, IOOptionBits options)
+{
+    if (strcmp(objectName, "_WDG") == 0) {
+        WMI_DATA block;
+
+        memset(&block, 0, sizeof(block));
+        memcpy(block.guid, sProfile->guid, sizeof(block.guid));
+        memcpy(block.object_id, "TF", sizeof(block.object_id));
+        block.instance_count = 1;
+        block.flags = ACPI_WMI_METHOD;
+
+        if (result != NULL)
+            *result = OSData::withBytes(&block, sizeof(block));
+        return kIOReturnSuccess;
+    }
+
+    IODelay(sACPIDelay);
+
+    if (strcmp(objectName, "WMTF") == 0 && paramCount > sProfile->powerArg) {
+        OSNumber* osNum = OSDynamicCast(OSNumber, params[sProfile->powerArg]);
+        mPowered = osNum != NULL && osNum->unsigned32BitValue() != 0;
+    }
+    if (result != NULL)
+        *result = OSNumber::withNumber(mPowered, 32);
+
+    return kIOReturnSuccess;
+}
+
+// The root port in front of the controller, a probe only takes its time
+class StressRootPort : public IOPCI2PCIBridge
+{
+    OSDeclareDefaultStructors(StressRootPort)
+public:
+    virtual UInt32 requestProbe(IOOptionBits options) override;
+};
+
+OSDefineMetaClassAndStructors(StressRootPort, IOPCI2PCIBridge)
+
+UInt32 StressRootPort::requestProbe(IOOptionBits options)
+{
+    IODelay(sProbeDelay);
+    return 0;
+}
+
+// PM
+
+static std::atomic<bool> sStopping(false);
+
+struct PMInjector
+{
+    const char* name;
+    IOService* driver;
+    UInt32 interval;
+    std::vector<UInt64> acks[2];        // sleep, wake
+    UInt32 timeouts;
+};
+
+// sleep, then a dark or a full wake, until the callers are done
+static void pmThread(void* argument)
+{
+    PMInjector* injector = (PMInjector*)argument;
+    UInt32 cycle = 0;
+
+    while (!sStopping) {
+        UInt32 states[2] = { kPowerStateSleep, (cycle++ % 3) == 2 ? (UInt32)kPowerStateDoze : (UInt32)kPowerStateNormal };
+
+        for (int i = 0; i < 2; i++) {
+            UInt64 elapsed;
+
+            IODelay(injector->interval);
+            if (injector->driver->hostPowerChange(states[i], &elapsed) == kIOReturnTimeout)
+                injector->timeouts++;
+            injector->acks[states[i] == kPowerStateSleep ? 0 : 1].push_back(elapsed);
+        }
+    }
+
+    // leave it awake
+    if (injector->driver->hostPowerChange(kPowerStateNormal, NULL) == kIOReturnTimeout)
+        injector->timeouts++;
+}
+
+// Callers
+
+enum
+{
+    kMethodForcePower = 0,
+    kMethodPowerHook,
+    kMethodProbe,
+    kMethodQueue,
+    kMethodBridgeQueue,
+    kMethodCount
+};
+
+struct StressMethod
+{
+    const char* name;
+    UInt32 selector;
+    bool bridge;
+};
+
+static const StressMethod sMethods[kMethodCount] =
+{
+    { "force-power", kSelectorForcePower, false },
+    { "power-hook", kSelectorPowerHook, false },
+    { "probe", kSelectorProbe, true },
+    { "queue", kSelectorDoorbell, false },
+    { "bridge-queue", kSelectorBridgeDoorbell, true }
+};
+
+#define kQueueBatch 4
+
+// Userspace side of a client's command queue. Submitting and reaping are
+// serialized among the callers like in a real client, the doorbell is not.
+struct StressRing
+{
+    IOMemoryDescriptor* memory;
+    CommandQueue* queue;
+    std::mutex submitLock;
+    std::mutex completeLock;
+    UInt32 nextTag;             // submitLock
+    UInt32 expectedTag;         // completeLock
+};
+
+static bool mapRing(IOUserClient* client, StressRing* ring)
+{
+    IOOptionBits options;
+
+    ring->memory = NULL;
+    ring->queue = NULL;
+    ring->nextTag = 0;
+    ring->expectedTag = 0;
+
+    if (client->clientMemoryForType(kCommandQueueMemoryType, &options, &ring->memory) != kIOReturnSuccess)
+        return false;
+
+    IOBufferMemoryDescriptor* buffer = OSDynamicCast(IOBufferMemoryDescriptor, ring->memory);
+    if (buffer != NULL)
+        ring->queue = (CommandQueue*)buffer->getBytesNoCopy();
+    return ring->queue != NULL;
+}
+
+// Submits what fits of a batch, rings the doorbell and reaps, each step
+// depending on pick. An error when the doorbell failed or a completion came
+// back out of submission order.
+static IOReturn queueTurn(IOUserClient* client, StressRing* ring, UInt32 selector, bool bridge, UInt32 pick)
+{
+    CommandQueue* queue = ring->queue;
+    IOReturn ret = kIOReturnSuccess;
+
+    if (pick & 0x10) {
+        std::lock_guard<std::mutex> lock(ring->submitLock);
+        UInt32 tail = queue->submitTail;
+        UInt32 count = kCommandQueueEntries - (tail - commandQueueLoad(queue->submitHead));
+
+        count = std::min<UInt32>(count, kQueueBatch);
+        for (UInt32 i = 0; i < count; i++) {
+            CommandEntry* entry = &queue->submit[(tail + i) & (kCommandQueueEntries - 1)];
+            UInt32 bits = pick >> (8 + 4 * i);
+
+            if (bridge) {
+                entry->opcode = kCommandProbe;
+                entry->arg = kIOPCIProbeOptionNeedsScan | kIOPCIProbeOptionDone;
+            }
+            else if (bits & 1) {
+                entry->opcode = kCommandPowerHook;
+                entry->arg = (bits >> 1) & kPowerHookMask;
+            }
+            else {
+                entry->opcode = kCommandForcePower;
+                entry->arg = (bits >> 1) & 1;
+            }
+            entry->tag = ring->nextTag++;
+        }
+        commandQueueStore(queue->submitTail, tail + count);
+    }
+
+    if (pick & 0x40) {
+        UInt64 input = 0;
+        UInt64 output = 0;
+        UInt32 outputCount = 1;
+
+        if (HostKit::callMethod(client, selector, &input, 0, NULL, 0, &output, &outputCount, NULL, NULL) != kIOReturnSuccess)
+            ret = kIOReturnError;
+    }
+
+    if (pick & 0x20) {
+        std::lock_guard<std::mutex> lock(ring->completeLock);
+        UInt32 head = queue->completeHead;
+        UInt32 tail = commandQueueLoad(queue->completeTail);
+
+        for (; head != tail; head++) {
+            if (queue->complete[head & (kCommandQueueEntries - 1)].tag != ring->expectedTag++)
+                ret = kIOReturnError;
+        }
+        commandQueueStore(queue->completeHead, head);
+    }
+
+    return ret;
+}
+
+struct Caller
+{
+    UInt32 index;
+    UInt32 calls;
+    UInt32 seed;
+    std::vector<IOUserClient*>* clients[2];     // controller, bridge
+    std::vector<StressRing>* rings[2];
+    std::vector<UInt64> latency[kMethodCount];
+    UInt32 errors[kMethodCount];
+};
+
+static UInt32 nextRandom(UInt32* state)
+{
+    UInt32 x = *state;
+
+    x ^= x << 13;
+    x ^= x >> 17;
+    x ^= x << 5;
+    *state = x;
+    return x;
+}
+
+static void callerThread(void* argument)
+{
+    Caller* caller = (Caller*)argument;
+    UInt32 state = caller->seed * 2654435761U + caller->index + 1;
+    size_t clientCount = caller->clients[0]->size();
+
+    for (UInt32 i = 0; i < caller->calls; i++) {
+        UInt32 pick = nextRandom(&state);
+        UInt32 method = pick % kMethodCount;
+        bool bridge = sMethods[method].bridge;
+        size_t clientIndex = (caller->index + i) % clientCount;
+        IOUserClient* client = (*caller->clients[bridge])[clientIndex];
+        UInt64 input = 0;
+        UInt64 output = 0;
+        UInt32 outputCount = 1;
+
+        if (method == kMethodQueue || method == kMethodBridgeQueue) {
+            UInt64 start = HostBackend::now();
+            IOReturn ret = queueTurn(client, &(*caller->rings[bridge])[clientIndex], sMethods[method].selector,
+                                     bridge, pick);
+            caller->latency[method].push_back(HostBackend::now() - start);
+            if (ret != kIOReturnSuccess)
+                caller->errors[method]++;
+            continue;
+        }
+
+        switch (method) {
+            case kMethodForcePower:
+                input = (pick >> 8) & 1;
+                break;
+            case kMethodPowerHook:
+                input = (pick >> 8) & kPowerHookMask;
+                break;
+            case kMethodProbe:
+                input = kIOPCIProbeOptionNeedsScan | kIOPCIProbeOptionDone;
+                break;
+        }
+
+        UInt64 start = HostBackend::now();
+        IOReturn ret = HostKit::callMethod(client, sMethods[method].selector, &input, 1, NULL, 0,
+                                           &output, &outputCount, NULL, NULL);
+        caller->latency[method].push_back(HostBackend::now() - start);
+        if (ret != kIOReturnSuccess)
+            caller->errors[method]++;
+    }
+}
+
+// Report
+
+static void printCalls(std::vector<Caller>& callers, UInt64 elapsed)
+{
+    UInt64 total = 0;
+
+    printf("\n%-12s %8s %8s %10s %10s %10s %10s\n", "call", "count", "errors", "p50 us", "p99 us", "p99.9 us",
+           "max us");
+
+    for (int method = 0; method < kMethodCount; method++) {
+        std::vector<UInt64> latency;
+        UInt32 errors = 0;
+
+        for (size_t i = 0; i < callers.size(); i++) {
+            latency.insert(latency.end(), callers[i].latency[method].begin(), callers[i].latency[method].end());
+            errors += callers[i].errors[method];
+        }
+        total += latency.size();
+
+        printf("%-12s %8zu %8u %10.1f %10.1f %10.1f %10.1f\n", sMethods[method].name, latency.size(), errors,
+               percentile(latency, 500) / 1e3, percentile(latency, 990) / 1e3, percentile(latency, 999) / 1e3,
+               latency.empty() ? 0.0 : *std::max_element(latency.begin(), latency.end()) / 1e3);
+    }
+
+    printf("%llu calls in %.3f s, %.0f calls/s\n", (unsigned long long)total, elapsed / 1e9,
+           elapsed ? total / (elapsed / 1e9) : 0.0);
+}
+
+static void printAcks(PMInjector* injectors, int count)
+{
+    printf("\n%-18s %6s %10s %10s %9s\n", "pm acknowledgement", "count", "p50 ms", "max ms", "timeouts");
+
+    for (int i = 0; i < count; i++) {
+        for (int kind = 0; kind < 2; kind++) {
+            const std::vector<UInt64>& acks = injectors[i].acks[kind];
+            char label[32];
+
+            snprintf(label, sizeof(label), "%s %s", injectors[i].name, kind == 0 ? "sleep" : "wake");
+            printf("%-18s %6zu %10.3f %10.3f %9u\n", label, acks.size(), percentile(acks, 500) / 1e6,
+                   acks.empty() ? 0.0 : *std::max_element(acks.begin(), acks.end()) / 1e6,
+                   kind == 0 ? injectors[i].timeouts : 0);
+        }
+    }
+}
+
+int main(int argc, char* argv[])
+{
+    int clientCount = 4;
+    int threadCount = 8;
+    int calls = 2000;
+    int pmInterval = 500;
+    int seed = 1;
+    bool verbose = false;
+    int opt;
+
+    while ((opt = getopt(argc, argv, "c:t:n:p:a:r:s:v")) != -1) {
+        switch (opt)
+        {
+            case 'c':
+                clientCount = std::max(atoi(optarg), 1);
+                break;
+            case 't':
+                threadCount = std::max(atoi(optarg), 1);
+                break;
+            case 'n':
+                calls = std::max(atoi(optarg), 1);
+                break;
+            case 'p':
+                pmInterval = std::max(atoi(optarg), 0);
+                break;
+            case 'a':
+                sACPIDelay = (UInt32)std::max(atoi(optarg), 0);
+                break;
+            case 'r':
+                sProbeDelay = (UInt32)std::max(atoi(optarg), 0);
+                break;
+            case 's':
+                seed = atoi(optarg);
+                break;
+            case 'v':
+                verbose = true;
+                break;
+            default:
+                fprintf(stderr, "usage: %s [-c clients] [-t threads] [-n calls] [-p pm-interval-us] [-a acpi-us] "
+                        "[-r probe-us] [-s seed] [-v]\n", argv[0]);
+                return 2;
+        }
+    }
+
+    HostBackend::initialize();
+    HostKit::setLogging(verbose);
+
+    OSDictionary* controllerPersonality = HostKit::copyPersonality(KEXT_INFO_PLIST, "IOElectrify");
+    OSDictionary* bridgePersonality = HostKit::copyPersonality(KEXT_INFO_PLIST, "IOElectrifyBridge");
+
+    if (controllerPersonality == NULL || bridgePersonality == NULL) {
+        fprintf(stderr, "%s: no IOElectrify personalities in %s\n", argv[0], KEXT_INFO_PLIST);
+        return 1;
+    }
+
+    // every hook on, the PM callbacks do their full work
+    OSNumber* osNum = OSNumber::withNumber(kPowerHookMask, 32);
+    controllerPersonality->setObject("IOElectrifyPowerHook", osNum);
+    osNum->release();
+    bridgePersonality->setObject("IOElectrifyBridgePowerHook", kOSBooleanTrue);
+
+    if (!HostKit::loadModule()) {
+        fprintf(stderr, "%s: module start failed\n", argv[0]);
+        return 1;
+    }
+
+    StressACPIDevice* acpi = new StressACPIDevice;
+    IOPCIDevice* rootPortDevice = new IOPCIDevice;
+    StressRootPort* rootPort = new StressRootPort;
+
+    acpi->init(NULL);
+    acpi->setName("WMI1");
+    acpi->mPowered = 1;
+    rootPortDevice->init(NULL);
+    rootPortDevice->setName("RP01");
+    rootPortDevice->hostSetConfig(0x8086, 0x7615, 0x060400, 0x01);
+    rootPort->init(NULL);
+    rootPort->attach(rootPortDevice);
+
+    IOService* controller = HostKit::startDriver(controllerPersonality, acpi);
+    IOService* bridge = HostKit::startDriver(bridgePersonality, rootPort);
+    controllerPersonality->release();
+    bridgePersonality->release();
+
+    if (controller == NULL || bridge == NULL) {
+        fprintf(stderr, "%s: %s did not start\n", argv[0], controller == NULL ? "IOElectrify" : "IOElectrifyBridge");
+        return 1;
+    }
+
+    std::vector<IOUserClient*> clients[2];
+    std::vector<StressRing> rings[2] = { std::vector<StressRing>(clientCount), std::vector<StressRing>(clientCount) };
+
+    HostKit::setPrivileged(true);
+    for (int i = 0; i < clientCount; i++) {
+        IOUserClient* controllerClient = HostKit::openUserClient(controller);
+        IOUserClient* bridgeClient = HostKit::openUserClient(bridge);
+
+        if (controllerClient == NULL || bridgeClient == NULL) {
+            fprintf(stderr, "%s: opening the user clients failed\n", argv[0]);
+            return 1;
+        }
+        clients[0].push_back(controllerClient);
+        clients[1].push_back(bridgeClient);
+
+        if (!mapRing(controllerClient, &rings[0][i]) || !mapRing(bridgeClient, &rings[1][i])) {
+            fprintf(stderr, "%s: mapping the command queues failed\n", argv[0]);
+            return 1;
+        }
+    }
+
+    PMInjector injectors[2] = { { "controller", controller, (UInt32)pmInterval, {}, 0 },
+                                { "bridge", bridge, (UInt32)pmInterval, {}, 0 } };
+    std::vector<Caller> callers(threadCount);
+    std::vector<HostBackend::Thread*> pmThreads;
+    std::vector<HostBackend::Thread*> threads;
+
+    for (int i = 0; i < threadCount; i++) {
+        Caller& caller = callers[i];
+
+        caller.index = i;
+        caller.calls = calls;
+        caller.seed = seed;
+        caller.clients[0] = &clients[0];
+        caller.clients[1] = &clients[1];
+        caller.rings[0] = &rings[0];
+        caller.rings[1] = &rings[1];
+        memset(caller.errors, 0, sizeof(caller.errors));
+    }
+
+    UInt64 start = HostBackend::now();
+
+    if (pmInterval > 0) {
+        for (int i = 0; i < 2; i++)
+            pmThreads.push_back(HostBackend::spawn(pmThread, &injectors[i]));
+    }
+    for (int i = 0; i < threadCount; i++)
+        threads.push_back(HostBackend::spawn(callerThread, &callers[i]));
+    for (size_t i = 0; i < threads.size(); i++)
+        HostBackend::join(threads[i]);
+
+    UInt64 elapsed = HostBackend::now() - start;
+
+    sStopping = true;
+    for (size_t i = 0; i < pmThreads.size(); i++)
+        HostBackend::join(pmThreads[i]);
+
+    printf("%d threads on %d clients per driver, %d calls each%s\n", threadCount, clientCount, calls,
+           pmInterval > 0 ? ", PM transitions running" : "");
+    printCalls(callers, elapsed);
+    if (pmInterval > 0)
+        printAcks(injectors, 2);
+
+    for (int i = 0; i < clientCount; i++) {
+        rings[0][i].memory->release();
+        rings[1][i].memory->release();
+        HostKit::closeUserClient(clients[0][i]);
+        HostKit::closeUserClient(clients[1][i]);
+    }
+    rootPortDevice->terminate();
+    acpi->terminate();
+    controller->release();
+    bridge->release();
+    rootPort->release();
+    rootPortDevice->release();
+    acpi->release();
+    HostKit::unloadModule();
+
+    return 0;
+}
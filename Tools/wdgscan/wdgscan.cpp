@@ -0,0 +1,489 @@
+/*
+ *  Released under "The GNU General Public License (GPL-2.0)"
+ *
+ *  This program is free software; you can redistribute it and/or modify it
+ *  under the terms of the GNU General Public License as published by the
+ *  Free Software Foundation; either version 2 of the License, or (at your
+ *  option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful, but
+ *  WITHOUT ANY WARRANTY; without even the implied warranty of MERCHANTABILITY
+ *  or FITNESS FOR A PARTICULAR PURPOSE. See the GNU General Public License
+ *  for more details.
+ *
+ *  You should have received a copy of the GNU General Public License along
+ *  with this program; if not, write to the Free Software Foundation, Inc.,
+ *  59 Temple Place, Suite 330, Boston, MA 02111-1307 USA
+ *
+ */
+
+// wdgscan - find PNP0C14 devices and their _WDG buffers in raw DSDT/SSDT dumps
+// and hand each buffer to the kext's own WMI::initialize through the host kit,
+// reporting the parse time, the objects and IOMalloc blocks it created and
+// the force-power method the kext would call.
+//
+// usage: wdgscan [-n iterations] [-v] table.aml [table.aml ...]
+//
+// Exits with 1 when a table can't be read, doesn't resolve to a known
+// force-power method, or the parser leaks.
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <time.h>
+#include <vector>
+
+#include "HostKit.h"
+#include "WMI.h"
+#include "WMIBlock.h"
+#include "Profiles.h"
+
+#define kACPITableHeaderSize 36
+
+// AML opcodes we care about
+#define AML_NAME_OP         0x08
+#define AML_BUFFER_OP       0x11
+#define AML_BYTE_PREFIX     0x0A
+#define AML_WORD_PREFIX     0x0B
+#define AML_DWORD_PREFIX    0x0C
+#define AML_STRING_PREFIX   0x0D
+#define AML_EXT_OP_PREFIX   0x5B
+#define AML_DEVICE_OP       0x82
+
+// EISAID("PNP0C14") as stored in AML
+static const UInt8 kPNP0C14EisaId[4] = { 0x41, 0xd0, 0x0c, 0x14 };
+
+static UInt64 nanoTime()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (UInt64)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+struct WDGBuffer
+{
+    size_t offset;              // offset of the buffer data in the table
+    size_t length;
+    char device[5];             // enclosing device, empty if none found
+    bool pnp0c14;
+};
+
+struct DeviceRange
+{
+    size_t start;
+    size_t end;
+    char name[5];
+};
+
+// Decode an AML PkgLength, returns the number of bytes it occupies or 0 on error
+static size_t parsePkgLength(const UInt8* aml, size_t size, size_t offset, size_t* length)
+{
+    if (offset >= size)
+        return 0;
+
+    UInt8 lead = aml[offset];
+    size_t count = lead >> 6;
+
+    if (offset + count >= size)
+        return 0;
+
+    if (count == 0) {
+        *length = lead & 0x3f;
+        return 1;
+    }
+
+    *length = lead & 0x0f;
+    for (size_t i = 0; i < count; i++)
+        *length |= (size_t)aml[offset + 1 + i] << (4 + 8 * i);
+
+    return count + 1;
+}
+
+// Decode a BufferSize term, returns the number of bytes it occupies or 0 on error
+static size_t parseInteger(const UInt8* aml, size_t size, size_t offset, UInt32* value)
+{
+    if (offset >= size)
+        return 0;
+
+    switch (aml[offset])
+    {
+        case 0x00:
+            *value = 0;
+            return 1;
+        case 0x01:
+            *value = 1;
+            return 1;
+        case AML_BYTE_PREFIX:
+            if (offset + 1 >= size)
+                return 0;
+            *value = aml[offset + 1];
+            return 2;
+        case AML_WORD_PREFIX:
+            if (offset + 2 >= size)
+                return 0;
+            *value = aml[offset + 1] | (aml[offset + 2] << 8);
+            return 3;
+        case AML_DWORD_PREFIX:
+            if (offset + 4 >= size)
+                return 0;
+            *value = aml[offset + 1] | (aml[offset + 2] << 8) | (aml[offset + 3] << 16) | ((UInt32)aml[offset + 4] << 24);
+            return 5;
+    }
+
+    return 0;
+}
+
+static bool hasPNP0C14Hid(const UInt8* aml, size_t start, size_t end)
+{
+    for (size_t i = start; i + 4 < end; i++) {
+        if (memcmp(aml + i, "_HID", 4) != 0)
+            continue;
+
+        if (aml[i + 4] == AML_DWORD_PREFIX && i + 9 <= end && memcmp(aml + i + 5, kPNP0C14EisaId, 4) == 0)
+            return true;
+
+        if (aml[i + 4] == AML_STRING_PREFIX && i + 13 <= end && memcmp(aml + i + 5, "PNP0C14", 8) == 0)
+            return true;
+    }
+
+    return false;
+}
+
+static void scanDevices(const UInt8* aml, size_t size, std::vector<DeviceRange>& devices)
+{
+    for (size_t i = kACPITableHeaderSize; i + 2 < size; i++) {
+        if (aml[i] != AML_EXT_OP_PREFIX || aml[i + 1] != AML_DEVICE_OP)
+            continue;
+
+        size_t length;
+        size_t used = parsePkgLength(aml, size, i + 2, &length);
+
+        if (used == 0 || i + 2 + length > size || length < used + 4)
+            continue;
+
+        DeviceRange device;
+        device.start = i + 2;
+        device.end = i + 2 + length;
+        memcpy(device.name, aml + i + 2 + used, 4);
+        device.name[4] = 0;
+        devices.push_back(device);
+    }
+}
+
+static void scanWDG(const UInt8* aml, size_t size, const std::vector<DeviceRange>& devices, std::vector<WDGBuffer>& buffers)
+{
+    for (size_t i = kACPITableHeaderSize + 1; i + 5 < size; i++) {
+        if (memcmp(aml + i, "_WDG", 4) != 0 || aml[i + 4] != AML_BUFFER_OP)
+            continue;
+
+        // NameOp, possibly followed by root / parent prefixes
+        size_t op = i - 1;
+        while (op > kACPITableHeaderSize && (aml[op] == '\\' || aml[op] == '^'))
+            op--;
+        if (aml[op] != AML_NAME_OP)
+            continue;
+
+        size_t length;
+        size_t used = parsePkgLength(aml, size, i + 5, &length);
+        if (used == 0 || i + 5 + length > size)
+            continue;
+
+        UInt32 bufferSize;
+        size_t sizeUsed = parseInteger(aml, size, i + 5 + used, &bufferSize);
+        if (sizeUsed == 0)
+            continue;
+
+        WDGBuffer buffer;
+        buffer.offset = i + 5 + used + sizeUsed;
+        buffer.length = (i + 5 + length) - buffer.offset;
+        if (bufferSize < buffer.length)
+            buffer.length = bufferSize;
+        buffer.device[0] = 0;
+        buffer.pnp0c14 = false;
+
+        // innermost device containing the buffer
+        const DeviceRange* best = NULL;
+        for (size_t d = 0; d < devices.size(); d++) {
+            if (devices[d].start < i && i < devices[d].end && (best == NULL || devices[d].start > best->start))
+                best = &devices[d];
+        }
+
+        if (best != NULL) {
+            memcpy(buffer.device, best->name, sizeof(buffer.device));
+            buffer.pnp0c14 = hasPNP0C14Hid(aml, best->start, best->end);
+        }
+
+        buffers.push_back(buffer);
+    }
+}
+
+static bool readTable(const char* path, std::vector<UInt8>& table)
+{
+    FILE* file = fopen(path, "rb");
+
+    if (file == NULL) {
+        perror(path);
+        return false;
+    }
+
+    fseek(file, 0, SEEK_END);
+    long size = ftell(file);
+    fseek(file, 0, SEEK_SET);
+
+    if (size < kACPITableHeaderSize) {
+        fprintf(stderr, "%s: too small for an ACPI table\n", path);
+        fclose(file);
+        return false;
+    }
+
+    table.resize(size);
+    bool ok = fread(table.data(), 1, size, file) == (size_t)size;
+    fclose(file);
+
+    if (!ok) {
+        fprintf(stderr, "%s: read error\n", path);
+        return false;
+    }
+
+    if (memcmp(table.data(), "DSDT", 4) != 0 && memcmp(table.data(), "SSDT", 4) != 0)
+        fprintf(stderr, "%s: warning, signature is not DSDT/SSDT\n", path);
+
+    return true;
+}
+
+static void printBlocks(const UInt8* aml, const WDGBuffer& buffer)
+{
+    const struct WMI_DATA* blocks = (const struct WMI_DATA*)(aml + buffer.offset);
+    size_t count = buffer.length / WMI_DATA_SIZE;
+
+    for (size_t i = 0; i < count; i++) {
+        char guid[37];
+
+        wmiGuidToString(blocks[i].guid, guid);
+        if (blocks[i].flags & ACPI_WMI_EVENT)
+            printf("      %s  notify 0x%02x  instances %u  flags 0x%x\n",
+                   guid, blocks[i].notify_id, blocks[i].instance_count, blocks[i].flags);
+        else
+            printf("      %s  object %c%c  instances %u  flags 0x%x\n",
+                   guid, blocks[i].object_id[0], blocks[i].object_id[1], blocks[i].instance_count, blocks[i].flags);
+    }
+}
+
+// The WMI device a buffer sits in. _WDG returns the buffer, any other
+// evaluation only notes the method name and succeeds.
+class ScanDevice : public IOACPIPlatformDevice
+{
+    OSDeclareDefaultStructors(ScanDevice)
+public:
+    const UInt8* mWDG;
+    UInt32 mLength;
+    UInt32 mCreated;            // objects handed out, not the parser's
+    char mEvaluated[5];
+
+    virtual IOReturn evaluateObject(const char* objectName, OSObject** result, OSObject* params[],
+                                    IOItemCount paramCount, IOOptionBits options) override;
+};
+
+OSDefineMetaClassAndStructors(ScanDevice, IOACPIPlatformDevice)
+
+IOReturn ScanDevice::evaluateObject(const char* objectName, OSObject** result, OSObject* params[],
+                                    IOItemCount paramCount, IOOptionBits options)
+{
+    if (strcmp(objectName, "_WDG") == 0) {
+        if (result != NULL) {
+            *result = OSData::withBytes(mWDG, mLength);
+            mCreated++;
+        }
+        return kIOReturnSuccess;
+    }
+
+    strlcpy(mEvaluated, objectName, sizeof(mEvaluated));
+    return kIOReturnSuccess;
+}
+
+struct ParseResult
+{
+    bool parsed;
+    const ForcePowerProfile* profile;   // first one the kext would pick, NULL if none
+    char method[5];
+    UInt64 elapsed;                     // per parse, ns
+    UInt64 objects;                     // per parse
+    UInt64 allocations;                 // IOMalloc blocks per parse
+    SInt64 leakedObjects;               // still alive once WMI and device are gone
+    SInt64 leakedAllocations;
+};
+
+// Run one buffer through WMI::initialize iterations times, on a fresh
+// device each time like a driver restart, then resolve the force-power
+// method the way IOElectrify::start does
+static void parseBuffer(const UInt8* wdg, size_t length, const char* name, int iterations, ParseResult* result)
+{
+    memset(result, 0, sizeof(*result));
+
+    for (int i = 0; i < iterations; i++) {
+        SInt64 liveObjects = HostKit::liveObjects();
+        SInt64 liveAllocations = HostKit::liveAllocations();
+        ScanDevice* device = new ScanDevice;
+
+        device->init(NULL);
+        device->setName(name[0] ? name : "WMI");
+        device->mWDG = wdg;
+        device->mLength = (UInt32)length;
+        device->mCreated = 0;
+        device->mEvaluated[0] = 0;
+
+        UInt64 objects = HostKit::createdObjects();
+        UInt64 allocations = HostKit::allocations();
+        UInt64 start = nanoTime();
+        WMI* wmi = new WMI(device);
+
+        result->parsed = wmi->initialize();
+        result->elapsed += nanoTime() - start;
+        result->objects += HostKit::createdObjects() - objects - device->mCreated;
+        result->allocations += HostKit::allocations() - allocations;
+
+        if (i == iterations - 1) {
+            for (unsigned int p = 0; p < kForcePowerProfileCount && result->parsed; p++) {
+                if (!wmi->hasMethod(kForcePowerProfiles[p].guid))
+                    continue;
+
+                // the name comes from the kext's lookup, not from the raw blocks
+                wmi->executeMethod(kForcePowerProfiles[p].guid);
+                result->profile = &kForcePowerProfiles[p];
+                memcpy(result->method, device->mEvaluated, sizeof(result->method));
+                break;
+            }
+        }
+
+        delete wmi;
+        device->release();
+
+        result->leakedObjects += HostKit::liveObjects() - liveObjects;
+        result->leakedAllocations += HostKit::liveAllocations() - liveAllocations;
+    }
+
+    result->elapsed /= iterations;
+    result->objects /= iterations;
+    result->allocations /= iterations;
+}
+
+int main(int argc, char* argv[])
+{
+    int iterations = 1;
+    bool verbose = false;
+    int opt;
+
+    while ((opt = getopt(argc, argv, "n:v")) != -1) {
+        switch (opt)
+        {
+            case 'n':
+                iterations = atoi(optarg);
+                if (iterations < 1)
+                    iterations = 1;
+                break;
+            case 'v':
+                verbose = true;
+                break;
+            default:
+                fprintf(stderr, "usage: %s [-n iterations] [-v] table.aml [table.aml ...]\n", argv[0]);
+                return 2;
+        }
+    }
+
+    if (optind >= argc) {
+        fprintf(stderr, "usage: %s [-n iterations] [-v] table.aml [table.aml ...]\n", argv[0]);
+        return 2;
+    }
+
+    HostBackend::initialize();
+    HostKit::setLogging(verbose);
+
+    // WMI evaluations are recorded, the recorder lives from module start
+    if (!HostKit::loadModule()) {
+        fprintf(stderr, "%s: module start failed\n", argv[0]);
+        return 1;
+    }
+
+    size_t totalBytes = 0;
+    UInt64 totalTime = 0;
+    int failures = 0;
+
+    for (int f = optind; f < argc; f++) {
+        std::vector<UInt8> table;
+
+        if (!readTable(argv[f], table)) {
+            failures++;
+            continue;
+        }
+
+        std::vector<DeviceRange> devices;
+        std::vector<WDGBuffer> buffers;
+        UInt64 elapsed = 0;
+
+        for (int i = 0; i < iterations; i++) {
+            devices.clear();
+            buffers.clear();
+
+            UInt64 start = nanoTime();
+            scanDevices(table.data(), table.size(), devices);
+            scanWDG(table.data(), table.size(), devices, buffers);
+            elapsed += nanoTime() - start;
+        }
+
+        totalBytes += table.size() * iterations;
+        totalTime += elapsed;
+
+        printf("%s: %zu bytes, %zu devices, %zu _WDG buffers, %.1f us/scan\n",
+               argv[f], table.size(), devices.size(), buffers.size(), elapsed / 1000.0 / iterations);
+
+        bool resolved = false;
+        bool leaked = false;
+
+        for (size_t b = 0; b < buffers.size(); b++) {
+            ParseResult result;
+
+            printf("  _WDG at 0x%zx in %s%s, %zu bytes, %zu blocks%s\n",
+                   buffers[b].offset, buffers[b].device[0] ? buffers[b].device : "(no device)",
+                   buffers[b].pnp0c14 ? " (PNP0C14)" : "", buffers[b].length, buffers[b].length / WMI_DATA_SIZE,
+                   buffers[b].length % WMI_DATA_SIZE ? ", trailing bytes" : "");
+            printBlocks(table.data(), buffers[b]);
+
+            parseBuffer(table.data() + buffers[b].offset, buffers[b].length, buffers[b].device, iterations, &result);
+            if (!result.parsed) {
+                printf("    WMI::initialize failed\n");
+                continue;
+            }
+
+            printf("    WMI::initialize %.1f us, %llu objects, %llu IOMalloc blocks per parse\n",
+                   result.elapsed / 1000.0, (unsigned long long)result.objects,
+                   (unsigned long long)result.allocations);
+
+            if (result.profile != NULL) {
+                char guid[37];
+
+                wmiGuidToString(result.profile->guid, guid);
+                printf("    %s (%s) -> %s\n", result.profile->name, guid, result.method);
+                resolved = true;
+            }
+
+            if (result.leakedObjects != 0 || result.leakedAllocations != 0) {
+                printf("    leaked %lld objects and %lld IOMalloc blocks over %d parses\n",
+                       (long long)result.leakedObjects, (long long)result.leakedAllocations, iterations);
+                leaked = true;
+            }
+        }
+
+        if (!resolved)
+            printf("  no known force-power method\n");
+        if (!resolved || leaked)
+            failures++;
+    }
+
+    HostKit::unloadModule();
+
+    if (totalTime > 0)
+        printf("total: %zu bytes in %.3f ms, %.1f MB/s\n", totalBytes, totalTime / 1e6, totalBytes / (totalTime / 1e9) / 1e6);
+
+    return failures ? 1 : 0;
+}